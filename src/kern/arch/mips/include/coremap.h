@@ -51,6 +51,10 @@ void mmu_setas(struct addrspace *as);
 void mmu_unmap(struct addrspace *as, vaddr_t va);
 void mmu_map(struct addrspace *as, vaddr_t va, paddr_t pa, int writable);
 
+/* kernel (kseg2) mappings, for vmalloc */
+void mmu_kmap(vaddr_t va, paddr_t pa);
+void mmu_kflush(void);
+
 /* physical page allocation */
 paddr_t coremap_allocuser(struct lpage *lp);
 void coremap_free(paddr_t page, bool iskern);
@@ -60,6 +64,11 @@ void coremap_pin(paddr_t paddr);
 int coremap_pageispinned(paddr_t paddr);
 void coremap_unpin(paddr_t paddr);
 
+/* wiring down user pages (mlock, I/O) */
+int coremap_wire(paddr_t paddr);
+void coremap_unwire(paddr_t paddr);
+int coremap_pageiswired(paddr_t paddr);
+
 /* special ops on physical pages */
 void coremap_zero_page(paddr_t paddr);
 void coremap_copy_page(paddr_t oldpaddr, paddr_t newpaddr);
@@ -43,6 +43,7 @@ typedef unsigned spinlock_data_t;
 void spinlock_data_set(volatile spinlock_data_t *sd, unsigned val);
 spinlock_data_t spinlock_data_get(volatile spinlock_data_t *sd);
 spinlock_data_t spinlock_data_testandset(volatile spinlock_data_t *sd);
+spinlock_data_t spinlock_data_fetchinc(volatile spinlock_data_t *sd);
 
 ////////////////////////////////////////////////////////////
 
@@ -93,5 +94,34 @@ spinlock_data_testandset(volatile spinlock_data_t *sd)
 	return x;
 }
 
+SPINLOCK_INLINE
+spinlock_data_t
+spinlock_data_fetchinc(volatile spinlock_data_t *sd)
+{
+	spinlock_data_t x;
+	spinlock_data_t y;
+
+	/*
+	 * Atomic increment using LL/SC, handing back the old value.
+	 *
+	 * Load the existing value into X and store X+1 from Y. After
+	 * the SC, Y contains 1 if the store succeeded, 0 if it failed;
+	 * unlike test-and-set, we can't give up, so just retry.
+	 */
+
+	do {
+		__asm volatile(
+			".set push;"		/* save assembler mode */
+			".set mips32;"		/* allow MIPS32 instructions */
+			".set volatile;"	/* avoid unwanted optimization */
+			"ll %0, 0(%2);"		/*   x = *sd */
+			"addiu %1, %0, 1;"	/*   y = x + 1 */
+			"sc %1, 0(%2);"		/*   *sd = y; y = success? */
+			".set pop"		/* restore assembler mode */
+			: "=&r" (x), "=&r" (y) : "r" (sd) : "memory");
+	} while (y == 0);
+	return x;
+}
+
 
 #endif /* _MIPS_SPINLOCK_H_ */
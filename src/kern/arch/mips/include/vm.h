@@ -68,6 +68,16 @@
 #define PADDR_TO_KVADDR(paddr) ((paddr)+MIPS_KSEG0)
 #define KVADDR_TO_PADDR(vaddr) ((vaddr)-MIPS_KSEG0)
 
+/*
+ * The vmalloc window: the bottom 4M of kseg2, where vmalloc maps
+ * scattered physical pages to make virtually contiguous kernel
+ * buffers. Translations come from the kernel page table in
+ * vm/vmalloc.c and are loaded into the TLB on demand.
+ */
+#define VMALLOC_START  MIPS_KSEG2
+#define VMALLOC_PAGES  1024
+#define VMALLOC_END    (VMALLOC_START + VMALLOC_PAGES*PAGE_SIZE)
+
 /*
  * The top of user space. (Actually, the address immediately above the
  * last valid user address.)
@@ -120,6 +130,8 @@ struct cpu_vm_machdep {
 	uint32_t cvm_nexttlb;
 	/* for OPT_SEQTLB, next TLB entry to use (after TLB full) */
 	uint32_t cvm_tlbseqslot;
+	/* kernel flush generation as of our last full TLB flush */
+	volatile uint32_t cvm_kflushgen;
 };
 
 void cpu_vm_machdep_init(struct cpu_vm_machdep *cvm);
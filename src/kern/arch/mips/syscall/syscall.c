@@ -37,6 +37,7 @@
 #include <syscall.h>
 #include <kern/wait.h> /* New include of wait macros for _exit */
 #include <copyinout.h> /* A3 SETUP - new include for lseek */
+#include "opt-dumbvm.h"
 /*
  * System call dispatcher.
  *
@@ -117,6 +118,11 @@ syscall(struct trapframe *tf)
 				     (userptr_t)tf->tf_a1);
 		    break;
 
+	    case SYS_nanosleep:
+		    err = sys_nanosleep((userptr_t)tf->tf_a0,
+					(userptr_t)tf->tf_a1);
+		    break;
+
             /* ASST2: These implementations of read and write only work for
              * console I/O (stdin, stdout and stderr file descriptors)
              */
@@ -142,6 +148,18 @@ syscall(struct trapframe *tf)
 		    err = sys_fork(tf, &retval);
 		    break;
 
+	    case SYS_vfork:
+		    err = sys_vfork(tf, &retval);
+		    break;
+
+	    case SYS_getpriority:
+		    err = sys_getpriority(tf->tf_a0, tf->tf_a1, &retval);
+		    break;
+
+	    case SYS_setpriority:
+		    err = sys_setpriority(tf->tf_a0, tf->tf_a1, tf->tf_a2);
+		    break;
+
             /* ASST2 - You need to fill in the code for each of these cases */
             case SYS_getpid:
             case SYS_waitpid:
@@ -194,6 +212,26 @@ syscall(struct trapframe *tf)
 		break;
 	    
 	    /* END A3 SETUP */
+
+#if !OPT_DUMBVM
+	    /* VM calls */
+
+	    case SYS_sbrk:
+		err = sys_sbrk(tf->tf_a0, &retval);
+		break;
+	    case SYS_madvise:
+		err = sys_madvise((userptr_t)tf->tf_a0, tf->tf_a1, tf->tf_a2);
+		break;
+	    case SYS_mlock:
+		err = sys_mlock((userptr_t)tf->tf_a0, tf->tf_a1);
+		break;
+	    case SYS_munlock:
+		err = sys_munlock((userptr_t)tf->tf_a0, tf->tf_a1);
+		break;
+	    case SYS_munlockall:
+		err = sys_munlockall();
+		break;
+#endif
  
 	    default:
 		kprintf("Unknown syscall %d\n", callno);
@@ -46,6 +46,9 @@
 #include <machine/tlb.h>
 #include <vfs.h>
 #include <vnode.h>
+#include <clock.h>
+#include <spl.h>
+#include <platform/maxcpus.h>
 
 #include "opt-randpage.h"
 #include "opt-randtlb.h"
@@ -71,6 +74,14 @@
  */
 #define CM_MIN_SLACK		8
 
+/*
+ * The compaction thread wakes up every COMPACT_INTERVAL seconds and,
+ * if there is no run of COMPACT_TARGET free pages but enough free
+ * memory overall to make one, migrates user pages out of the way.
+ */
+#define COMPACT_INTERVAL	1
+#define COMPACT_TARGET		8
+
 
 /*
  * Coremap entry structure.
@@ -88,8 +99,11 @@ struct coremap_entry {
 		cm_allocated:1;	/* true if page in use (user or kernel) */
 	volatile 
 	unsigned cm_pinned:1;	/* true if page is busy */
+	unsigned cm_wired:8;	/* wire count (mlock, I/O); never evicted */
 };
 
+#define CM_MAX_WIRED		255	/* largest count cm_wired can hold */
+
 #define COREMAP_TO_PADDR(i)	(((paddr_t)PAGE_SIZE)*((i)+base_coremap_page))
 #define PADDR_TO_COREMAP(page)	(((page)/PAGE_SIZE) - base_coremap_page)
 
@@ -101,24 +115,73 @@ struct coremap_entry {
 static struct spinlock coremap_spinlock = SPINLOCK_INITIALIZER;
 
 /*
- * Use one wchan for all page-pin waiting. There shouldn't be that
- * much of it or very many threads at once. Also use one wchan for all
- * TLB shootdown waiting. This is less justifiable - it maybe ought to
- * be per-CPU.
+ * Use one wchan for all TLB shootdown waiting. This is not very
+ * justifiable - it maybe ought to be per-CPU. Page-pin waiting uses
+ * the hashed sleep queues instead, keyed by coremap entry, so that
+ * unpinning a page only wakes the threads waiting for that page.
  */
-static struct wchan *coremap_pinchan;
 static struct wchan *coremap_shootchan;
 
 static uint32_t num_coremap_entries;
 static uint32_t num_coremap_kernel;	/* pages allocated to the kernel */
 static uint32_t num_coremap_user;	/* pages allocated to user progs */
 static uint32_t num_coremap_free;	/* pages not allocated at all */
+static uint32_t num_coremap_wired;	/* user pages wired down */
 static uint32_t base_coremap_page;
 static struct coremap_entry *coremap;
 
 static volatile uint32_t ct_shootdowns_sent;
 static volatile uint32_t ct_shootdowns_done;
 static volatile uint32_t ct_shootdown_interrupts;
+static volatile uint32_t ct_compactions;
+static volatile uint32_t ct_migrations;
+static volatile uint32_t ct_kflushes;
+
+/*
+ * Kernel (kseg2) TLB flush tracking. kflush_gen counts flushes asked
+ * for by mmu_kflush; each CPU records in cvm_kflushgen the value it
+ * saw the last time it cleared its whole TLB. kflush_cpus lets us
+ * find every CPU's record. All protected by coremap_spinlock.
+ */
+static uint32_t kflush_gen;
+static struct cpu_vm_machdep *kflush_cpus[MAXCPUS];
+static unsigned kflush_ncpus;
+
+////////////////////////////////////////////////////////////
+//
+// Pin waiting
+
+/*
+ * coremap_pinwait: wait for pinned page IX to unpin.
+ *
+ * Synchronization: called and returns with coremap_spinlock held, but
+ * releases it while asleep.
+ */
+static
+void
+coremap_pinwait(unsigned ix)
+{
+	sleepq_lock(SLEEPQ_WAIT, &coremap[ix]);
+	spinlock_release(&coremap_spinlock);
+	sleepq_sleep(SLEEPQ_WAIT, &coremap[ix], "vmpin");
+	spinlock_acquire(&coremap_spinlock);
+}
+
+/*
+ * coremap_pinwake: wake anyone waiting for page IX to unpin.
+ *
+ * Synchronization: caller holds coremap_spinlock.
+ */
+static
+void
+coremap_pinwake(unsigned ix)
+{
+	KASSERT(spinlock_do_i_hold(&coremap_spinlock));
+
+	sleepq_lock(SLEEPQ_WAIT, &coremap[ix]);
+	sleepq_wakeall(SLEEPQ_WAIT, &coremap[ix]);
+	sleepq_unlock(SLEEPQ_WAIT, &coremap[ix]);
+}
 
 ////////////////////////////////////////////////////////////
 //
@@ -130,6 +193,12 @@ cpu_vm_machdep_init(struct cpu_vm_machdep *cvm)
 	cvm->cvm_lastas = NULL;
 	cvm->cvm_nexttlb = 0;
 	cvm->cvm_tlbseqslot = 0;
+
+	spinlock_acquire(&coremap_spinlock);
+	cvm->cvm_kflushgen = kflush_gen;
+	KASSERT(kflush_ncpus < MAXCPUS);
+	kflush_cpus[kflush_ncpus++] = cvm;
+	spinlock_release(&coremap_spinlock);
 }
 
 void
@@ -146,16 +215,22 @@ cpu_vm_machdep_cleanup(struct cpu_vm_machdep *cvm)
 void
 vm_printmdstats(void)
 {
-	uint32_t ss, sd, si;
+	uint32_t ss, sd, si, cc, cm, kf;
 
 	spinlock_acquire(&coremap_spinlock);
 	ss = ct_shootdowns_sent;
 	sd = ct_shootdowns_done;
 	si = ct_shootdown_interrupts;
+	cc = ct_compactions;
+	cm = ct_migrations;
+	kf = ct_kflushes;
 	spinlock_release(&coremap_spinlock);
 
 	kprintf("vm: shootdowns: %lu sent, %lu done (%lu interrupts)\n",
 		(unsigned long) ss, (unsigned long) sd, (unsigned long) si);
+	kprintf("vm: compaction: %lu passes, %lu pages migrated\n",
+		(unsigned long) cc, (unsigned long) cm);
+	kprintf("vm: %lu kernel TLB flushes\n", (unsigned long) kf);
 }
 
 ////////////////////////////////////////////////////////////
@@ -201,7 +276,8 @@ tlb_invalidate(int tlbix)
 	KASSERT(spinlock_do_i_hold(&coremap_spinlock));
 
 	tlb_read(&ehi, &elo, tlbix);
-	if (elo & TLBLO_VALID) {
+	/* kseg2 (vmalloc) mappings aren't tracked in the coremap */
+	if ((elo & TLBLO_VALID) && (ehi & TLBHI_VPAGE) < MIPS_KSEG0) {
 		pa = elo & TLBLO_PPAGE;
 		cmix = PADDR_TO_COREMAP(pa);
 		KASSERT(cmix < num_coremap_entries);
@@ -233,6 +309,7 @@ tlb_clear(void)
 		tlb_invalidate(i);
 	}
 	curcpu->c_vm.cvm_nexttlb = 0;
+	curcpu->c_vm.cvm_kflushgen = kflush_gen;
 }
 
 /*
@@ -344,7 +421,7 @@ mipstlb_getslot(void)
 //
 
 /*
- * To evict a page, it must be non-kernel and non-pinned.
+ * To evict a page, it must be non-kernel, non-pinned, and not wired.
  *
  * page_replace() takes no arguments and returns an index into the
  * coremap (for the selected victim page).
@@ -356,14 +433,24 @@ mipstlb_getslot(void)
  * Random page replacement.
  *
  * Repeatedly generates a random index into the coremap until the 
- * selected page is not pinned and does not belong to the kernel.
+ * selected page is not pinned or wired and does not belong to the
+ * kernel.
  */
 static
 uint32_t 
 page_replace(void)
 {
-    // Complete this function.
-	return 0;
+	uint32_t where;
+
+	KASSERT(spinlock_do_i_hold(&coremap_spinlock));
+	KASSERT(num_coremap_kernel + num_coremap_wired < num_coremap_entries);
+
+	do {
+		where = random() % num_coremap_entries;
+	} while (coremap[where].cm_kernel || coremap[where].cm_pinned ||
+		 coremap[where].cm_wired);
+
+	return where;
 }
 
 #else /* not OPT_RANDPAGE */
@@ -372,15 +459,27 @@ page_replace(void)
  * Sequential page replacement.
  *
  * Selects pages to be evicted from the coremap sequentially. Skips
- * pages that are pinned or that belong to the kernel.
+ * pages that are pinned or wired or that belong to the kernel.
  */
 
 static
 uint32_t
 page_replace(void)
 {
-	// Complete this function.
-	return 0;
+	static uint32_t nextvictim;
+	uint32_t where;
+
+	KASSERT(spinlock_do_i_hold(&coremap_spinlock));
+	KASSERT(num_coremap_kernel + num_coremap_wired < num_coremap_entries);
+
+	while (1) {
+		where = nextvictim;
+		nextvictim = (nextvictim + 1) % num_coremap_entries;
+		if (!coremap[where].cm_kernel && !coremap[where].cm_pinned &&
+		    !coremap[where].cm_wired) {
+			return where;
+		}
+	}
 }
 
 #endif /* OPT_RANDPAGE */
@@ -474,15 +573,15 @@ coremap_bootstrap(void)
 		coremap[i].cm_notlast = 0;
 		coremap[i].cm_allocated = 0;
 		coremap[i].cm_pinned = 0;
+		coremap[i].cm_wired = 0;
 		coremap[i].cm_tlbix = -1;
 		coremap[i].cm_cpunum = 0;
 		coremap[i].cm_lpage = NULL;
 	}
 
-	coremap_pinchan = wchan_create("vmpin");
 	coremap_shootchan = wchan_create("tlbshoot");
-	if (coremap_pinchan == NULL || coremap_shootchan == NULL) {
-		panic("Failed allocating coremap wchans\n");
+	if (coremap_shootchan == NULL) {
+		panic("Failed allocating coremap wchan\n");
 	}
 }	
 
@@ -506,28 +605,49 @@ piggish_kernel(int proposed_kernel_pages)
 	return 0;
 }
 
+/*
+ * coremap_try_shrink: ask the registered shrinkers (see vm/shrinker.c)
+ * to give back NPAGES pages. Returns nonzero if anything came back.
+ *
+ * Synchronization: assumes we hold coremap_spinlock, and drops it
+ * around the callbacks, which may block and will end up in
+ * coremap_free. Only does anything in thread context, in which case
+ * the caller holds global_paging_lock; that keeps shrink passes from
+ * running concurrently.
+ */
 static
-void
-do_evict(int where)
+int
+coremap_try_shrink(unsigned npages)
 {
-	struct lpage *lp;
+	unsigned freed;
 
 	KASSERT(spinlock_do_i_hold(&coremap_spinlock));
-	KASSERT(curthread != NULL && !curthread->t_in_interrupt);
+
+	if (curthread == NULL || curthread->t_in_interrupt) {
+		return 0;
+	}
 	KASSERT(lock_do_i_hold(global_paging_lock));
 
-	KASSERT(coremap[where].cm_pinned==0);
-	KASSERT(coremap[where].cm_allocated);
-	KASSERT(coremap[where].cm_kernel==0);
+	spinlock_release(&coremap_spinlock);
+	freed = shrinker_run(npages);
+	spinlock_acquire(&coremap_spinlock);
 
-	lp = coremap[where].cm_lpage;
-	KASSERT(lp != NULL);
+	return freed > 0;
+}
 
-	/*
-	 * Pin it now, so it doesn't get e.g. paged out by someone
-	 * else while we're waiting for TLB shootdown.
-	 */
-	coremap[where].cm_pinned = 1;
+/*
+ * do_shootdown: remove any TLB mapping of a (pinned) user page,
+ * shooting it down on another CPU if necessary.
+ *
+ * Synchronization: assumes we hold coremap_spinlock. May release it
+ * while waiting for the shootdown to complete.
+ */
+static
+void
+do_shootdown(int where)
+{
+	KASSERT(spinlock_do_i_hold(&coremap_spinlock));
+	KASSERT(coremap[where].cm_pinned);
 
 	if (coremap[where].cm_tlbix >= 0) {
 		if (coremap[where].cm_cpunum != curcpu->c_number) {
@@ -542,7 +662,6 @@ do_evict(int where)
 			}
 			KASSERT(coremap[where].cm_tlbix == -1);
 			KASSERT(coremap[where].cm_cpunum == 0);
-			KASSERT(coremap[where].cm_lpage == lp);
 		}
 		else {
 			tlb_invalidate(coremap[where].cm_tlbix);
@@ -552,6 +671,34 @@ do_evict(int where)
 		DEBUG(DB_TLB, "... pa 0x%05lx --> tlb --\n", 
 		      (unsigned long) COREMAP_TO_PADDR(where));
 	}
+}
+
+static
+void
+do_evict(int where)
+{
+	struct lpage *lp;
+
+	KASSERT(spinlock_do_i_hold(&coremap_spinlock));
+	KASSERT(curthread != NULL && !curthread->t_in_interrupt);
+	KASSERT(lock_do_i_hold(global_paging_lock));
+
+	KASSERT(coremap[where].cm_pinned==0);
+	KASSERT(coremap[where].cm_allocated);
+	KASSERT(coremap[where].cm_kernel==0);
+	KASSERT(coremap[where].cm_wired==0);
+
+	lp = coremap[where].cm_lpage;
+	KASSERT(lp != NULL);
+
+	/*
+	 * Pin it now, so it doesn't get e.g. paged out by someone
+	 * else while we're waiting for TLB shootdown.
+	 */
+	coremap[where].cm_pinned = 1;
+
+	do_shootdown(where);
+	KASSERT(coremap[where].cm_lpage == lp);
 
 	/* properly we ought to lock the lpage to test this */
 	KASSERT(COREMAP_TO_PADDR(where) == (lp->lp_paddr & PAGE_FRAME));
@@ -577,7 +724,7 @@ do_evict(int where)
 	KASSERT(num_coremap_kernel+num_coremap_user+num_coremap_free
 	       == num_coremap_entries);
 
-	wchan_wakeall(coremap_pinchan);
+	coremap_pinwake(where);
 }
 
 static
@@ -593,6 +740,7 @@ do_page_replace(void)
 
 	KASSERT(coremap[where].cm_pinned==0);
 	KASSERT(coremap[where].cm_kernel==0);
+	KASSERT(coremap[where].cm_wired==0);
 
 	if (coremap[where].cm_allocated) {
 		KASSERT(coremap[where].cm_lpage != NULL);
@@ -617,6 +765,7 @@ mark_pages_allocated(int start, int npages, int dopin, int iskern)
 		KASSERT(coremap[i].cm_lpage==NULL);
 		KASSERT(coremap[i].cm_tlbix<0);
 		KASSERT(coremap[i].cm_cpunum == 0);
+		KASSERT(coremap[i].cm_wired == 0);
 
 		if (dopin) {
 			coremap[i].cm_pinned = 1;
@@ -641,6 +790,276 @@ mark_pages_allocated(int start, int npages, int dopin, int iskern)
 	       == num_coremap_entries);
 }
 
+/*
+ * coremap_find_free_page: return the index of a free page, or -1.
+ *
+ * For single-page allocations, start at the top end of memory. We
+ * will do multi-page allocations at the bottom end in the hope of
+ * reducing long-term fragmentation. But it probably won't help
+ * much if the system gets busy.
+ *
+ * Synchronization: assumes we hold coremap_spinlock. Does not block.
+ */
+static
+int
+coremap_find_free_page(void)
+{
+	int i;
+
+	KASSERT(spinlock_do_i_hold(&coremap_spinlock));
+
+	if (num_coremap_free == 0) {
+		return -1;
+	}
+
+	for (i = num_coremap_entries-1; i>=0; i--) {
+		if (coremap[i].cm_pinned || coremap[i].cm_allocated) {
+			continue;
+		}
+		KASSERT(coremap[i].cm_kernel==0);
+		KASSERT(coremap[i].cm_lpage==NULL);
+		return i;
+	}
+	return -1;
+}
+
+/*
+ * coremap_find_block: find the best place for a block of NPAGES
+ * contiguous pages. "Badness" counts how many user pages would need
+ * to be evicted (or migrated) to free the block; we return the base
+ * index of the block where it's smallest and the badness in
+ * BADNESSRET, or -1 if no block without kernel, pinned, or wired
+ * pages exists.
+ *
+ * Synchronization: assumes we hold coremap_spinlock. Does not block.
+ */
+static
+int
+coremap_find_block(unsigned npages, unsigned *badnessret)
+{
+	int base, bestbase;
+	unsigned badness, bestbadness;
+	unsigned i;
+
+	KASSERT(spinlock_do_i_hold(&coremap_spinlock));
+
+	bestbase = -1;
+	bestbadness = npages*2;
+	base = -1;
+	badness = 0;
+	for (i=0; i<num_coremap_entries; i++) {
+		if (coremap[i].cm_pinned || coremap[i].cm_kernel ||
+		    coremap[i].cm_wired) {
+			base = -1;
+			badness = 0;
+			continue;
+		}
+
+		if (coremap[i].cm_allocated) {
+			KASSERT(coremap[i].cm_lpage != NULL);
+			/*
+			 * We should do badness += 2 if page
+			 * needs cleaning, but we don't know
+			 * that here for now. Also, we shouldn't
+			 * prefer clean pages when there isn't a
+			 * pageout thread, as we'll end up always
+			 * replacing code and never data, which
+			 * doesn't work well. FUTURE.
+			 */
+			badness++;
+		}
+
+		if (base < 0) {
+			base = i;
+		}
+		else if (i - base >= npages-1) {
+			if (badness < bestbadness) {
+				bestbase = base;
+				bestbadness = badness;
+			}
+
+			/* Keep trying (offset upwards by one) */
+			if (coremap[base].cm_allocated) {
+				badness--;
+			}
+			base++;
+		}
+	}
+
+	*badnessret = bestbadness;
+	return bestbase;
+}
+
+/*
+ * do_migrate: move the user page at index FROM to the free page at
+ * index TO, copying the contents and updating the owning lpage. Any
+ * TLB mapping of the old page is shot down first; the next access
+ * faults and maps the new page.
+ *
+ * Synchronization: like do_evict. Both pages are held pinned while
+ * the coremap spinlock is released for the copy, so the lpage can't
+ * be evicted, destroyed, or faulted on (lpage_lock_and_pin waits for
+ * the pin and then notices the address change) until we're done.
+ */
+static
+void
+do_migrate(int from, int to)
+{
+	struct lpage *lp;
+	paddr_t frompa, topa;
+
+	KASSERT(spinlock_do_i_hold(&coremap_spinlock));
+	KASSERT(curthread != NULL && !curthread->t_in_interrupt);
+	KASSERT(lock_do_i_hold(global_paging_lock));
+
+	KASSERT(coremap[from].cm_pinned==0);
+	KASSERT(coremap[from].cm_allocated);
+	KASSERT(coremap[from].cm_kernel==0);
+	KASSERT(coremap[from].cm_wired==0);
+
+	lp = coremap[from].cm_lpage;
+	KASSERT(lp != NULL);
+
+	frompa = COREMAP_TO_PADDR(from);
+	topa = COREMAP_TO_PADDR(to);
+
+	coremap[from].cm_pinned = 1;
+	mark_pages_allocated(to, 1 /* npages */, 1 /* dopin */, 0 /* kern */);
+	coremap[to].cm_lpage = lp;
+
+	/* nobody may write through the old mapping while we copy */
+	do_shootdown(from);
+	KASSERT(coremap[from].cm_lpage == lp);
+
+	spinlock_release(&coremap_spinlock);
+
+	lpage_lock(lp);
+	KASSERT((lp->lp_paddr & PAGE_FRAME) == frompa);
+	coremap_copy_page(frompa, topa);
+	lp->lp_paddr = topa | (lp->lp_paddr & LPF_MASK);
+	lpage_unlock(lp);
+
+	spinlock_acquire(&coremap_spinlock);
+
+	/* because the pages are pinned these shouldn't have changed */
+	KASSERT(coremap[from].cm_allocated == 1);
+	KASSERT(coremap[from].cm_lpage == lp);
+	KASSERT(coremap[from].cm_pinned == 1);
+	KASSERT(coremap[from].cm_tlbix == -1);
+	KASSERT(coremap[to].cm_lpage == lp);
+	KASSERT(coremap[to].cm_pinned == 1);
+
+	coremap[from].cm_allocated = 0;
+	coremap[from].cm_lpage = NULL;
+	coremap[from].cm_pinned = 0;
+	coremap[to].cm_pinned = 0;
+
+	num_coremap_user--;
+	num_coremap_free++;
+	KASSERT(num_coremap_kernel+num_coremap_user+num_coremap_free
+	       == num_coremap_entries);
+
+	ct_migrations++;
+	DEBUG(DB_VM, "coremap: migrated pa 0x%x -> 0x%x\n", frompa, topa);
+
+	coremap_pinwake(from);
+	coremap_pinwake(to);
+}
+
+/*
+ * coremap_compact: try to empty the block of NPAGES pages at BASE by
+ * migrating the user pages in it to free pages elsewhere. Free pages
+ * are taken from the top end of memory, where single-page allocations
+ * go anyway. Returns the number of pages moved; the block may still
+ * be partly occupied if we ran out of free pages or if something got
+ * pinned or allocated to the kernel behind our back.
+ *
+ * Synchronization: like do_evict.
+ */
+static
+unsigned
+coremap_compact(unsigned base, unsigned npages)
+{
+	unsigned i, moved;
+	int to;
+
+	KASSERT(spinlock_do_i_hold(&coremap_spinlock));
+	KASSERT(lock_do_i_hold(global_paging_lock));
+	KASSERT(base + npages <= num_coremap_entries);
+
+	ct_compactions++;
+	moved = 0;
+	to = num_coremap_entries - 1;
+	for (i=base; i<base+npages; i++) {
+		if (coremap[i].cm_pinned || coremap[i].cm_kernel ||
+		    coremap[i].cm_wired) {
+			/* something changed while we were copying */
+			break;
+		}
+		if (!coremap[i].cm_allocated) {
+			continue;
+		}
+		while (to >= 0 && (((unsigned)to >= base &&
+				    (unsigned)to < base+npages) ||
+				   coremap[to].cm_pinned ||
+				   coremap[to].cm_allocated)) {
+			to--;
+		}
+		if (to < 0) {
+			break;
+		}
+		do_migrate(i, to);
+		moved++;
+	}
+	return moved;
+}
+
+/*
+ * coremap_compactd: background compaction thread. Tries to keep a
+ * block of COMPACT_TARGET free pages available so that multipage
+ * kernel allocations don't have to stop and page.
+ */
+static
+void
+coremap_compactd(void *data1, unsigned long data2)
+{
+	int base;
+	unsigned badness;
+
+	(void)data1;
+	(void)data2;
+
+	while (1) {
+		clocksleep(COMPACT_INTERVAL);
+
+		lock_acquire(global_paging_lock);
+		spinlock_acquire(&coremap_spinlock);
+		base = coremap_find_block(COMPACT_TARGET, &badness);
+		if (base >= 0 && badness > 0 &&
+		    num_coremap_free >= 2*COMPACT_TARGET) {
+			coremap_compact(base, COMPACT_TARGET);
+		}
+		spinlock_release(&coremap_spinlock);
+		lock_release(global_paging_lock);
+	}
+}
+
+/*
+ * compact_bootstrap: start the compaction thread. Needs to run late
+ * enough in boot that thread_fork works.
+ */
+void
+compact_bootstrap(void)
+{
+	int result;
+
+	result = thread_fork("compactd", coremap_compactd, NULL, 0, NULL);
+	if (result) {
+		panic("coremap: thread_fork for compactd failed: %s\n",
+		      strerror(result));
+	}
+}
+
 /*
  * coremap_alloc_one_page
  *
@@ -652,7 +1071,7 @@ static
 paddr_t
 coremap_alloc_one_page(struct lpage *lp, int dopin)
 {
-	int candidate, i, iskern;
+	int candidate, iskern;
 
 	iskern = (lp == NULL);
 
@@ -668,8 +1087,12 @@ coremap_alloc_one_page(struct lpage *lp, int dopin)
 	spinlock_acquire(&coremap_spinlock);
 
 	/*
-	 * Don't allow the kernel to eat everything.
+	 * Don't allow the kernel to eat everything. But before giving
+	 * up, see if kernel caches can give some memory back.
 	 */
+	if (iskern && piggish_kernel(1)) {
+		coremap_try_shrink(1);
+	}
 	if (iskern && piggish_kernel(1)) {
 		coremap_print_short();
 		spinlock_release(&coremap_spinlock);
@@ -680,27 +1103,14 @@ coremap_alloc_one_page(struct lpage *lp, int dopin)
 		return INVALID_PADDR;
 	}
 
+	candidate = coremap_find_free_page();
+
 	/*
-	 * For single-page allocations, start at the top end of memory. We
-	 * will do multi-page allocations at the bottom end in the hope of
-	 * reducing long-term fragmentation. But it probably won't help
-	 * much if the system gets busy.
+	 * Before evicting a user page (which may cost a swap write),
+	 * see if the kernel has memory lying around it can give back.
 	 */
-
-	candidate = -1;
-
-	if (num_coremap_free > 0) {
-		/* There's a free page. Find it. */
-
-		for (i = num_coremap_entries-1; i>=0; i--) {
-			if (coremap[i].cm_pinned || coremap[i].cm_allocated) {
-				continue;
-			}
-			KASSERT(coremap[i].cm_kernel==0);
-			KASSERT(coremap[i].cm_lpage==NULL);
-			candidate = i;
-			break;
-		}
+	if (candidate < 0 && coremap_try_shrink(1)) {
+		candidate = coremap_find_free_page();
 	}
 
 	if (candidate < 0 && curthread != NULL && !curthread->t_in_interrupt) {
@@ -734,9 +1144,9 @@ static
 paddr_t
 coremap_alloc_multipages(unsigned npages)
 {
-	int base, bestbase;
-	int badness, bestbadness;
-	int evicted;
+	int bestbase;
+	unsigned bestbadness;
+	int evicted, shrunk, compacted;
 	unsigned i;
 
 	KASSERT(npages>1);
@@ -753,6 +1163,9 @@ coremap_alloc_multipages(unsigned npages)
 
 	spinlock_acquire(&coremap_spinlock);
 
+	if (piggish_kernel(npages)) {
+		coremap_try_shrink(npages);
+	}
 	if (piggish_kernel(npages)) {
 		coremap_print_short();
 		spinlock_release(&coremap_spinlock);
@@ -765,51 +1178,26 @@ coremap_alloc_multipages(unsigned npages)
 	}
 
 	/*
-	 * Look for the best block of this length.
-	 * "badness" counts how many evictions we need to do.
-	 * Find the block where it's smallest.
+	 * Look for the best block of this length, that is, the one
+	 * with the fewest user pages in it.
 	 */
 
+	shrunk = 0;
+	compacted = 0;
 	do {
-		bestbase = -1;
-		bestbadness = npages*2;
-		base = -1;
-		badness = 0;
-		for (i=0; i<num_coremap_entries; i++) {
-			if (coremap[i].cm_pinned || coremap[i].cm_kernel) {
-				base = -1;
-				badness = 0;
-				continue;
-			}
-			
-			if (coremap[i].cm_allocated) {
-				KASSERT(coremap[i].cm_lpage != NULL);
-				/*
-				 * We should do badness += 2 if page
-				 * needs cleaning, but we don't know
-				 * that here for now. Also, we shouldn't
-				 * prefer clean pages when there isn't a
-				 * pageout thread, as we'll end up always
-				 * replacing code and never data, which
-				 * doesn't work well. FUTURE.
-				 */
-				badness++;
-			}
-			
-			if (base < 0) {
-				base = i;
-			}
-			else if (i - base >= npages-1) {
-				if (badness < bestbadness) {
-					bestbase = base;
-					bestbadness = badness;
-				}
+		bestbase = coremap_find_block(npages, &bestbadness);
 
-				/* Keep trying (offset upwards by one) */
-				if (coremap[base].cm_allocated) {
-					badness--;
-				}
-				base++;
+		/*
+		 * If we'd have to evict, or there's no usable block at
+		 * all, first ask the shrinkers for memory (once) and
+		 * look again; freed kernel pages may open up a better
+		 * block.
+		 */
+		if ((bestbase < 0 || bestbadness > 0) && !shrunk) {
+			shrunk = 1;
+			if (coremap_try_shrink(npages)) {
+				evicted = 1;
+				continue;
 			}
 		}
 
@@ -822,6 +1210,20 @@ coremap_alloc_multipages(unsigned npages)
 			return INVALID_PADDR;
 		}
 
+		/*
+		 * Before evicting, try to move the user pages in the
+		 * way somewhere else (once). This costs a page copy per
+		 * page instead of a swap write.
+		 */
+		if (bestbadness > 0 && !compacted &&
+		    curthread != NULL && !curthread->t_in_interrupt) {
+			compacted = 1;
+			if (coremap_compact(bestbase, npages) > 0) {
+				evicted = 1;
+				continue;
+			}
+		}
+
 		/*
 		 * If any pages need evicting, evict them and try the
 		 * whole schmear again. Because we are holding
@@ -834,7 +1236,8 @@ coremap_alloc_multipages(unsigned npages)
 
 		evicted = 0;
 		for (i=bestbase; i<bestbase+npages; i++) {
-			if (coremap[i].cm_pinned || coremap[i].cm_kernel) {
+			if (coremap[i].cm_pinned || coremap[i].cm_kernel ||
+			    coremap[i].cm_wired) {
 				/* Whoops... retry */
 				KASSERT(evicted==1);
 				break;
@@ -945,6 +1348,12 @@ coremap_free(paddr_t page, bool iskern)
 		}
 		num_coremap_free++;
 
+		/* freeing the page drops any wiring */
+		if (coremap[i].cm_wired) {
+			coremap[i].cm_wired = 0;
+			num_coremap_wired--;
+		}
+
 		coremap[i].cm_lpage = NULL;
 
 		if (!coremap[i].cm_notlast) {
@@ -1010,9 +1419,10 @@ coremap_print_short(void)
 
 	KASSERT(spinlock_do_i_hold(&coremap_spinlock));
 		
-	kprintf("Coremap: %u entries, %uk/%uu/%uf\n",
+	kprintf("Coremap: %u entries, %uk/%uu/%uf (%u wired)\n",
 		num_coremap_entries,
-		num_coremap_kernel, num_coremap_user, num_coremap_free);
+		num_coremap_kernel, num_coremap_user, num_coremap_free,
+		num_coremap_wired);
 
 	for (i=0; i<num_coremap_entries; i++) {
 		if (atbol) {
@@ -1028,6 +1438,9 @@ coremap_print_short(void)
 		else if (coremap[i].cm_allocated && coremap[i].cm_pinned) {
 			kprintf("&");
 		}
+		else if (coremap[i].cm_allocated && coremap[i].cm_wired) {
+			kprintf("W");
+		}
 		else if (coremap[i].cm_allocated) {
 			kprintf("*");
 		}
@@ -1045,19 +1458,6 @@ coremap_print_short(void)
 }
 #undef NCOLS
 
-/*
- * coremap_pinwait: wait for a pinned page to unpin.
- */
-static
-void
-coremap_pinwait(void)
-{
-	wchan_lock(coremap_pinchan);
-	spinlock_release(&coremap_spinlock);
-	wchan_sleep(coremap_pinchan);
-	spinlock_acquire(&coremap_spinlock);
-}
-
 /*
  * coremap_pin: mark page pinned for manipulation of contents.
  *
@@ -1073,7 +1473,7 @@ coremap_pin(paddr_t paddr)
 
 	spinlock_acquire(&coremap_spinlock);
 	while (coremap[ix].cm_pinned) {
-		coremap_pinwait();
+		coremap_pinwait(ix);
 	}
 	coremap[ix].cm_pinned = 1;
 	spinlock_release(&coremap_spinlock);
@@ -1118,10 +1518,90 @@ coremap_unpin(paddr_t paddr)
 	spinlock_acquire(&coremap_spinlock);
 	KASSERT(coremap[ix].cm_pinned);
 	coremap[ix].cm_pinned = 0;
-	wchan_wakeall(coremap_pinchan);
+	coremap_pinwake(ix);
 	spinlock_release(&coremap_spinlock);
 }
 
+/*
+ * coremap_wire: wire down a user page so it is never evicted or
+ * migrated. Wirings nest; each needs a matching coremap_unwire. The
+ * page should be pinned (so it can't be evicted before we get it
+ * wired) and the caller should own the lpage.
+ *
+ * Returns EAGAIN if wiring the page would leave too little memory to
+ * page in, that is, if the kernel and wired pages together would be
+ * piggish in the sense of piggish_kernel.
+ *
+ * Synchronization: takes coremap_spinlock. Does not block.
+ */
+int
+coremap_wire(paddr_t paddr)
+{
+	unsigned ix;
+
+	ix = PADDR_TO_COREMAP(paddr);
+	KASSERT(ix<num_coremap_entries);
+
+	spinlock_acquire(&coremap_spinlock);
+	KASSERT(coremap[ix].cm_pinned);
+	KASSERT(coremap[ix].cm_allocated);
+	KASSERT(coremap[ix].cm_kernel == 0);
+
+	if (coremap[ix].cm_wired == CM_MAX_WIRED) {
+		spinlock_release(&coremap_spinlock);
+		return EAGAIN;
+	}
+	if (coremap[ix].cm_wired == 0) {
+		if (piggish_kernel(num_coremap_wired + 1)) {
+			spinlock_release(&coremap_spinlock);
+			return EAGAIN;
+		}
+		num_coremap_wired++;
+	}
+	coremap[ix].cm_wired++;
+	spinlock_release(&coremap_spinlock);
+	return 0;
+}
+
+/*
+ * coremap_unwire: drop one wiring of a page wired with coremap_wire.
+ *
+ * Synchronization: takes coremap_spinlock. Does not block.
+ */
+void
+coremap_unwire(paddr_t paddr)
+{
+	unsigned ix;
+
+	ix = PADDR_TO_COREMAP(paddr);
+	KASSERT(ix<num_coremap_entries);
+
+	spinlock_acquire(&coremap_spinlock);
+	KASSERT(coremap[ix].cm_allocated);
+	KASSERT(coremap[ix].cm_wired > 0);
+	coremap[ix].cm_wired--;
+	if (coremap[ix].cm_wired == 0) {
+		num_coremap_wired--;
+	}
+	spinlock_release(&coremap_spinlock);
+}
+
+/*
+ * coremap_pageiswired: checks if page is wired.
+ *
+ * Synchronization: like coremap_pageispinned, fast and loose.
+ */
+int
+coremap_pageiswired(paddr_t paddr)
+{
+	unsigned ix;
+
+	ix = PADDR_TO_COREMAP(paddr);
+	KASSERT(ix<num_coremap_entries);
+
+	return coremap[ix].cm_wired != 0;
+}
+
 /*
  * coremap_zero_page: zero out a memory page. Page should be pinned.
  *
@@ -1250,7 +1730,81 @@ mmu_map(struct addrspace *as, vaddr_t va, paddr_t pa, int writable)
 
 	/* Unpin the page. */
 	coremap[cmix].cm_pinned = 0;
-	wchan_wakeall(coremap_pinchan);
+	coremap_pinwake(cmix);
 
 	spinlock_release(&coremap_spinlock);
 }
+
+/*
+ * mmu_kmap: Enter a kernel (kseg2) translation into the MMU. These
+ * are always writable and aren't recorded in the coremap; stale ones
+ * are dealt with by mmu_kflush before the address is reused.
+ *
+ * Because this runs on kseg2 faults, nothing may touch vmalloc'd
+ * memory while holding coremap_spinlock.
+ *
+ * Synchronization: Takes coremap_spinlock. Does not block.
+ */
+void
+mmu_kmap(vaddr_t va, paddr_t pa)
+{
+	int tlbix;
+	uint32_t ehi, elo;
+
+	KASSERT(va >= MIPS_KSEG2);
+	KASSERT(pa/PAGE_SIZE >= base_coremap_page);
+	KASSERT(pa/PAGE_SIZE - base_coremap_page < num_coremap_entries);
+
+	spinlock_acquire(&coremap_spinlock);
+
+	tlbix = tlb_probe(va, 0);
+	if (tlbix < 0) {
+		tlbix = mipstlb_getslot();
+		KASSERT(tlbix>=0 && tlbix<NUM_TLB);
+	}
+
+	ehi = va & TLBHI_VPAGE;
+	elo = (pa & TLBLO_PPAGE) | TLBLO_DIRTY | TLBLO_VALID;
+	tlb_write(ehi, elo, tlbix);
+
+	spinlock_release(&coremap_spinlock);
+}
+
+/*
+ * mmu_kflush: Remove all kernel (kseg2) translations from every
+ * CPU's TLB, and wait until that's done. There's no cheap way to
+ * pick out just the kernel entries, so each CPU flushes everything.
+ *
+ * Synchronization: takes coremap_spinlock. Blocks waiting for the
+ * other CPUs.
+ */
+void
+mmu_kflush(void)
+{
+	uint32_t gen;
+	unsigned i;
+	int spl;
+
+	KASSERT(curthread != NULL && !curthread->t_in_interrupt);
+
+	/* Stay on this CPU until the others have been told. */
+	spl = splhigh();
+
+	spinlock_acquire(&coremap_spinlock);
+	gen = ++kflush_gen;
+	ct_kflushes++;
+	tlb_clear();
+	spinlock_release(&coremap_spinlock);
+
+	ipi_tlbshootdown_all();
+
+	splx(spl);
+
+	spinlock_acquire(&coremap_spinlock);
+	for (i=0; i<kflush_ncpus; i++) {
+		while (kflush_cpus[i]->cvm_kflushgen < gen) {
+			tlb_shootwait();
+		}
+	}
+	spinlock_release(&coremap_spinlock);
+}
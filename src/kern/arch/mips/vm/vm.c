@@ -75,11 +75,13 @@ vm_bootstrap(void)
 	coremap_bootstrap();
 
 	global_paging_lock = lock_create("global_paging_lock");
+
+	vmalloc_bootstrap();
 }
 
 /*
  * vm_fault: TLB fault handler. Hands off to the current thread's
- * address space.
+ * address space, or for kseg2 addresses to vmalloc.
  *
  * Synchronization: none.
  */
@@ -89,6 +91,9 @@ vm_fault(int faulttype, vaddr_t faultaddress)
 	struct addrspace *as;
 
 	faultaddress &= PAGE_FRAME;
+	if (faultaddress >= MIPS_KSEG2) {
+		return vmalloc_fault(faultaddress);
+	}
 	KASSERT(faultaddress < MIPS_KSEG0);
 
 	as = curthread->t_addrspace;
@@ -50,6 +50,11 @@
  */
 #define CPU_FREQUENCY 25000000 /* 25 MHz */
 
+/* Wiring of LAMEbus interrupts to bits in the cause register */
+#define LAMEBUS_IRQ_BIT  0x00000400	/* all system bus slots */
+#define LAMEBUS_IPI_BIT  0x00000800	/* inter-processor interrupt */
+#define MIPS_TIMER_BIT   0x00008000	/* on-chip timer */
+
 /*
  * Access to the on-chip timer.
  *
@@ -73,6 +78,56 @@ mips_timer_set(uint32_t count)
 		:: "r" (count));
 }
 
+/*
+ * Read and write c0_count ($9). System/161 resets it to zero when it
+ * reaches c0_compare.
+ */
+static
+uint32_t
+mips_timer_getcount(void)
+{
+	uint32_t count;
+
+	__asm volatile(
+		".set push;"		/* save assembler mode */
+		".set mips32;"		/* allow MIPS32 registers */
+		"mfc0 %0, $9;"		/* do it */
+		".set pop"		/* restore assembler mode */
+		: "=r" (count));
+	return count;
+}
+
+static
+void
+mips_timer_setcount(uint32_t count)
+{
+	__asm volatile(
+		".set push;"		/* save assembler mode */
+		".set mips32;"		/* allow MIPS32 registers */
+		"mtc0 %0, $9;"		/* do it */
+		".set pop"		/* restore assembler mode */
+		:: "r" (count));
+}
+
+/*
+ * Check c0_cause ($13) for a timer interrupt that's been asserted but
+ * not taken yet.
+ */
+static
+bool
+mips_timer_pending(void)
+{
+	uint32_t cause;
+
+	__asm volatile(
+		".set push;"		/* save assembler mode */
+		".set mips32;"		/* allow MIPS32 registers */
+		"mfc0 %0, $13;"		/* do it */
+		".set pop"		/* restore assembler mode */
+		: "=r" (cause));
+	return (cause & MIPS_TIMER_BIT) != 0;
+}
+
 /*
  * LAMEbus data for the system. (We have only one LAMEbus per system.)
  * This does not need to be locked, because it's constant once
@@ -116,6 +171,49 @@ mainbus_bootstrap(void)
 	mips_timer_set(CPU_FREQUENCY / HZ);
 }
 
+/*
+ * Tickless idle: stretch the current cpu's timer period. The count
+ * keeps running from the last hardclock, so the interrupt comes TICKS
+ * periods after that. mainbus_interrupt sets the period back.
+ *
+ * Writing c0_compare clears a pending interrupt, so if the next tick
+ * has already come due, leave the timer alone and let it be taken.
+ */
+bool
+mainbus_timer_stretch(unsigned ticks)
+{
+	KASSERT(ticks > 0 && ticks <= 0xffffffff / (CPU_FREQUENCY / HZ));
+	if (mips_timer_pending()) {
+		return false;
+	}
+	mips_timer_set(ticks * (CPU_FREQUENCY / HZ));
+	return true;
+}
+
+/*
+ * Woken early: go back to one period, keeping the phase so the next
+ * hardclock lands where it would have anyway.
+ *
+ * If the stretched interrupt has come due since the wakeup, writing
+ * c0_compare would clear it and lose those ticks. Leave the timer
+ * alone then; the interrupt is taken as soon as interrupts are back
+ * on, and hardclock catches up the whole stretch.
+ */
+bool
+mainbus_timer_restore(unsigned *ticksret)
+{
+	uint32_t count;
+
+	if (mips_timer_pending()) {
+		return false;
+	}
+	count = mips_timer_getcount();
+	mips_timer_setcount(count % (CPU_FREQUENCY / HZ));
+	mips_timer_set(CPU_FREQUENCY / HZ);
+	*ticksret = count / (CPU_FREQUENCY / HZ);
+	return true;
+}
+
 /*
  * Start all secondary CPUs.
  */
@@ -246,11 +344,6 @@ mainbus_send_ipi(struct cpu *target)
  * Interrupt dispatcher.
  */
 
-/* Wiring of LAMEbus interrupts to bits in the cause register */
-#define LAMEBUS_IRQ_BIT  0x00000400	/* all system bus slots */
-#define LAMEBUS_IPI_BIT  0x00000800	/* inter-processor interrupt */
-#define MIPS_TIMER_BIT   0x00008000	/* on-chip timer */
-
 void
 mainbus_interrupt(struct trapframe *tf)
 {
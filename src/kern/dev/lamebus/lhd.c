@@ -36,10 +36,13 @@
 #include <lib.h>
 #include <uio.h>
 #include <synch.h>
+#include <current.h>
+#include <addrspace.h>
 #include <platform/bus.h>
 #include <vfs.h>
 #include <lamebus/lhd.h>
 #include "autoconf.h"
+#include "opt-dumbvm.h"
 
 /* Registers (offsets within slot) */
 #define LHD_REG_NSECT   0   /* Number of sectors */
@@ -193,6 +196,26 @@ lhd_reset(struct lhd_softc *lh)
 }
 #endif
 
+/*
+ * Move one sector between the on-card buffer and the caller's buffer.
+ * If the caller's buffer is user memory that lhd_io pinned, copy
+ * straight to/from the physical pages rather than through the user
+ * mapping.
+ */
+static
+int
+lhd_xfer(struct lhd_softc *lh, struct uio *uio, bool pinned)
+{
+#if !OPT_DUMBVM
+	if (pinned) {
+		return as_pinned_uiomove(lh->lh_buf, LHD_SECTSIZE, uio);
+	}
+#else
+	(void)pinned;
+#endif
+	return uiomove(lh->lh_buf, LHD_SECTSIZE, uio);
+}
+
 /*
  * I/O function (for both reads and writes)
  */
@@ -208,7 +231,12 @@ lhd_io(struct device *d, struct uio *uio)
 	uint32_t lenoff = uio->uio_resid % LHD_SECTSIZE;
 	uint32_t i;
 	uint32_t statval = LHD_WORKING;
-	int result;
+	bool pinned = false;
+	int result = 0;
+#if !OPT_DUMBVM
+	vaddr_t pinbase = 0;
+	size_t pinlen = 0;
+#endif
 
 	/* Don't allow I/O that isn't sector-aligned. */
 	if (sectoff != 0 || lenoff != 0) {
@@ -225,6 +253,23 @@ lhd_io(struct device *d, struct uio *uio)
 		statval |= LHD_ISWRITE;
 	}
 
+#if !OPT_DUMBVM
+	/*
+	 * Wire down a user buffer before starting, so the transfers
+	 * can't fault. Otherwise we could end up paging (possibly to
+	 * this very disk) while holding lh_clear.
+	 */
+	if (uio->uio_segflg != UIO_SYSSPACE && uio->uio_iovcnt == 1) {
+		pinbase = (vaddr_t)uio->uio_iov->iov_ubase;
+		pinlen = uio->uio_iov->iov_len;
+		result = as_pin_range(uio->uio_space, pinbase, pinlen);
+		if (result) {
+			return result;
+		}
+		pinned = true;
+	}
+#endif
+
 	/* Loop over all the sectors we were asked to do. */
 	for (i=0; i<len; i++) {
 
@@ -236,10 +281,10 @@ lhd_io(struct device *d, struct uio *uio)
 		 * on-card buffer.
 		 */
 		if (uio->uio_rw == UIO_WRITE) {
-			result = uiomove(lh->lh_buf, LHD_SECTSIZE, uio);
+			result = lhd_xfer(lh, uio, pinned);
 			if (result) {
 				V(lh->lh_clear);
-				return result;
+				break;
 			}
 		}
 
@@ -260,19 +305,25 @@ lhd_io(struct device *d, struct uio *uio)
 		 * transfer the data out of the on-card buffer.
 		 */
 		if (result==0 && uio->uio_rw==UIO_READ) {
-			result = uiomove(lh->lh_buf, LHD_SECTSIZE, uio);
+			result = lhd_xfer(lh, uio, pinned);
 		}
 
 		/* Tell another thread it's cleared to go ahead. */
 		V(lh->lh_clear);
 
-		/* If we failed, return the error. */
+		/* If we failed, stop. */
 		if (result) {
-			return result;
+			break;
 		}
 	}
 
-	return 0;
+#if !OPT_DUMBVM
+	if (pinned) {
+		as_unpin_range(uio->uio_space, pinbase, pinlen);
+	}
+#endif
+
+	return result;
 }
 
 /*
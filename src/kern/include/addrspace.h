@@ -51,6 +51,11 @@ DECLARRAY_BYTYPE(vm_object_array, struct vm_object);
  * In the solution set VM, the address space contains an array of
  * vm_objects. Normally there will be one each for text, data/bss,
  * stack, and heap. More can be added if needed.
+ *
+ * as_rwlock protects the set of vm_objects, their sizes, and the heap
+ * fields. Lookups (page faults, mostly) take it for reading; defining
+ * or resizing regions, filling in a vm_object's pages, discarding them,
+ * and changing as_nlocked take it for writing.
  */
 
 struct addrspace {
@@ -65,9 +70,16 @@ struct addrspace {
 #else
         /* Add additional address space objects here as necessary. */
         struct vm_object_array *as_objects;
+        struct rwlock *as_rwlock;	/* protects the region list */
+        unsigned as_nlocked;	/* pages locked with mlock */
+        struct vm_object *as_heap;	/* heap (sbrk) object, or NULL */
+        vaddr_t as_heapend;		/* current break */
 #endif
 };
 
+/* Most pages one process may lock into memory with mlock. */
+#define AS_MAXLOCKED	64
+
 /*
  * Functions in addrspace.c:
  *
@@ -129,6 +141,39 @@ int               as_define_stack(struct addrspace *as, vaddr_t *initstackptr);
  */
 int as_fault(struct addrspace *as, int faulttype, vaddr_t va);
 
+#if !OPT_DUMBVM
+/*
+ * Locking pages into memory, in addrspace.c:
+ *
+ *    as_mlock/as_munlock/as_munlockall - the mlock family of system
+ *                calls. Locked pages are wired in the coremap and are
+ *                never evicted or migrated.
+ *
+ *    as_pin_range/as_unpin_range - wire down a user buffer for the
+ *                duration of an I/O, so it can be accessed with
+ *                as_pinned_uiomove without faulting.
+ */
+struct uio;
+int as_mlock(struct addrspace *as, vaddr_t va, size_t len);
+int as_munlock(struct addrspace *as, vaddr_t va, size_t len);
+void as_munlockall(struct addrspace *as);
+int as_pin_range(struct addrspace *as, vaddr_t va, size_t len);
+void as_unpin_range(struct addrspace *as, vaddr_t va, size_t len);
+int as_pinned_uiomove(void *ptr, size_t n, struct uio *uio);
+
+/*
+ * The heap, in addrspace.c:
+ *
+ *    as_sbrk - move the break by AMOUNT bytes, handing back the old
+ *                break. Shrinking frees the pages cut off at once.
+ *
+ *    as_madvise - the madvise system call. MADV_DONTNEED returns the
+ *                pages to zero-fill and frees their memory.
+ */
+int as_sbrk(struct addrspace *as, int amount, vaddr_t *oldbreak);
+int as_madvise(struct addrspace *as, vaddr_t va, size_t len, int advice);
+#endif
+
 /*
  * Functions in loadelf.c
  *    load_elf - load an ELF user program executable into the current
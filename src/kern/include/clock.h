@@ -35,8 +35,9 @@
 /*
  * Time-related definitions.
  *
- * hardclock() is called on every CPU HZ times a second, possibly only
- * when the CPU is not idle, for scheduling.
+ * hardclock() is called on every CPU HZ times a second, for scheduling.
+ * An idle CPU stops taking them until it has something to do, and then
+ * makes up for the ones it missed.
  *
  * timerclock() is called on one CPU once a second to allow simple
  * timed operations. (This is a fairly simpleminded interface.)
@@ -56,11 +57,15 @@
 #define HZ  100
 #endif
 
-void hardclock_bootstrap(void);
-
 void hardclock(void);
 void timerclock(void);
 
+/*
+ * Idle the current cpu without taking hardclocks it doesn't need.
+ * Called from the idle loop in place of cpu_idle(), at splhigh.
+ */
+void hardclock_idle(void);
+
 void gettime(time_t *seconds, uint32_t *nanoseconds);
 
 void getinterval(time_t secs1, uint32_t nsecs,
@@ -34,6 +34,16 @@
 #include <spinlock.h>
 #include <threadlist.h>
 #include <machine/vm.h>  /* for TLBSHOOTDOWN_MAX */
+#include <timer.h>
+
+/*
+ * Number of scheduler priority levels, each with its own run queue.
+ * Level 0 is the highest priority. See the scheduler in thread.c.
+ */
+#define SCHED_NLEVELS 4
+
+/* Number of buckets in the per-cpu run queue length histogram. */
+#define SCHED_RQHIST 8
 
 
 /*
@@ -59,15 +69,31 @@ struct cpu {
 	 */
 	struct thread *c_curthread;	/* Current thread on cpu */
 	struct threadlist c_zombies;	/* List of exited threads */
+	struct threadlist c_threadcache; /* Spare threads for thread_fork */
+	unsigned c_threadcache_hits;	/* Forks that got a spare thread */
+	unsigned c_threadcache_misses;	/* Forks that had to allocate */
 	unsigned c_hardclocks;		/* Counter of hardclock() calls */
+	unsigned c_lastboost;		/* c_hardclocks at last priority boost */
+	unsigned c_tickless;		/* Ticks the idle timer is stretched to */
+	unsigned c_skippedclocks;	/* Hardclocks made up for, not taken */
+	struct timerwheel c_timers;	/* Timeouts armed on this cpu */
 	struct cpu_vm_machdep c_vm;	/* Machine-dependent VM bits */
 
 	/*
 	 * Accessed by other cpus.
 	 * Protected by the runqueue lock.
+	 *
+	 * There is one run queue per scheduler priority level (see
+	 * thread.c); c_runcount is the total over all of them.
+	 * c_minvruntime never goes backwards; it is at most the
+	 * t_vruntime of anything runnable here.
 	 */
 	bool c_isidle;			/* True if this cpu is idle */
-	struct threadlist c_runqueue;	/* Run queue for this cpu */
+	struct threadlist c_runqueue[SCHED_NLEVELS]; /* Run queues */
+	unsigned c_runcount;		/* Threads on all run queues */
+	uint64_t c_minvruntime;		/* Fair-share clock for this cpu */
+	unsigned c_nmigrate;		/* Threads moved here from elsewhere */
+	unsigned c_rqhist[SCHED_RQHIST]; /* Run queue length, per hardclock */
 	struct spinlock c_runqueue_lock;
 
 	/*
@@ -153,6 +179,8 @@ void cpu_halt(void);
  * ipi_send sends an IPI to one CPU.
  * ipi_broadcast sends an IPI to all CPUs except the current one.
  * ipi_tlbshootdown is like ipi_send but carries TLB shootdown data.
+ * ipi_tlbshootdown_all asks all CPUs except the current one to flush
+ * their entire TLB.
  *
  * interprocessor_interrupt is called on the target CPU when an IPI is
  * received.
@@ -167,6 +195,7 @@ void cpu_halt(void);
 void ipi_send(struct cpu *target, int code);
 void ipi_broadcast(int code);
 void ipi_tlbshootdown(unsigned targetcpu, const struct tlbshootdown *mapping);
+void ipi_tlbshootdown_all(void);
 
 void interprocessor_interrupt(void);
 
@@ -28,6 +28,9 @@ struct vnode;
  
  
 /* these all have an implicit arg of the curthread's filetable */
+struct fdescript *fdescript_alloc(void);
+void fdescript_free(struct fdescript *file);
+
 int filetable_init(struct filetable *ft);
 void filetable_destroy(struct filetable *ft);
 int filetable_inject(struct fdescript *file, int fd);
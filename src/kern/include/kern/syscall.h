@@ -59,11 +59,11 @@
 #define SYS_mmap         8
 #define SYS_munmap       9
 #define SYS_mprotect     10
-//#define SYS_madvise    11
+#define SYS_madvise      11
 //#define SYS_mincore    12
-//#define SYS_mlock      13
-//#define SYS_munlock    14
-//#define SYS_munlockall 15
+#define SYS_mlock        13
+#define SYS_munlock      14
+#define SYS_munlockall   15
 //#define SYS_minherit   16
 //                              (security/credentials)
 #define SYS_umask        17
@@ -91,8 +91,8 @@
 //#define SYS_getrlimit  36
 //#define SYS_setrlimit  37
 //                              (process priority control)
-//#define SYS_getpriority 38
-//#define SYS_setpriority 39
+#define SYS_getpriority 38
+#define SYS_setpriority 39
 //                              (process groups, sessions, and job control)
 //#define SYS_getpgid    40
 //#define SYS_setpgid    41
@@ -0,0 +1,114 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef _KMEM_CACHE_H_
+#define _KMEM_CACHE_H_
+
+/*
+ * Object caches ("slabs") for fixed-size kernel objects.
+ *
+ * kmalloc rounds every request up to one of a handful of power-of-two
+ * block sizes. For objects that are allocated and freed all the time
+ * it's better to have a cache that packs objects of exactly the right
+ * size onto whole pages from the coremap.
+ *
+ * A cache may have a constructor, which is called once on each object
+ * when the page it lives on is set up, not on every allocation. Objects
+ * must be handed back to kmem_cache_free in constructed state, and
+ * come back out of kmem_cache_alloc that way. Caches without a
+ * constructor get freed objects scribbled with 0xdeadbeef like kfree.
+ *
+ * Objects are limited to a quarter of a page or so; use kmalloc for
+ * anything bigger.
+ *
+ * The structure is public so caches can be static; don't look inside
+ * it except through these functions.
+ */
+
+#include <spinlock.h>
+
+struct kmem_slab;	/* private to vm/kmem_cache.c */
+
+struct kmem_cache {
+	const char *kc_name;
+	size_t kc_size;			/* object size as requested */
+	size_t kc_align;		/* object alignment */
+	void (*kc_ctor)(void *obj);	/* constructor, or NULL */
+
+	struct spinlock kc_lock;	/* protects everything below */
+	bool kc_ready;			/* layout computed, on cache list */
+	size_t kc_stride;		/* object size rounded to alignment */
+	unsigned kc_perslab;		/* objects per page */
+	unsigned kc_objoffset;		/* offset of first object in page */
+	struct kmem_slab *kc_partial;	/* pages with some free objects */
+	struct kmem_slab *kc_full;	/* pages with no free objects */
+	struct kmem_slab *kc_empty;	/* pages with no objects in use */
+	struct kmem_cache *kc_next;	/* on list of all caches */
+
+	/* statistics */
+	unsigned kc_nslabs;		/* pages in use */
+	unsigned kc_inuse;		/* objects allocated */
+	unsigned kc_allocs;		/* total calls to kmem_cache_alloc */
+	unsigned kc_ctors;		/* total constructor calls */
+	unsigned kc_reaped;		/* empty pages given back */
+};
+
+/*
+ * Initializer for static caches. Caches made this way can be used
+ * straight away (once the VM system is up).
+ */
+#define KMEM_CACHE_INITIALIZER(name, size, align, ctor) \
+	{ (name), (size), (align), (ctor), SPINLOCK_INITIALIZER, \
+	  false, 0, 0, 0, NULL, NULL, NULL, NULL, 0, 0, 0, 0, 0 }
+
+/*
+ * Cache functions.
+ *
+ * kmem_cache_create	Allocate and initialize a cache. ALIGN of 0 means
+ *			the default (pointer) alignment. NAME should be
+ *			a string constant.
+ * kmem_cache_destroy	Destroy a cache. All objects must have been freed.
+ * kmem_cache_alloc	Get an object. Returns NULL if out of memory.
+ * kmem_cache_free	Give an object back.
+ *
+ * kmem_cache_bootstrap	Hook the caches up to the VM system's memory
+ *			pressure callbacks.
+ * kmem_cache_printstats Print per-cache statistics (from kheap_printstats).
+ */
+struct kmem_cache *kmem_cache_create(const char *name, size_t size,
+				     size_t align, void (*ctor)(void *obj));
+void kmem_cache_destroy(struct kmem_cache *kc);
+void *kmem_cache_alloc(struct kmem_cache *kc);
+void kmem_cache_free(struct kmem_cache *kc, void *obj);
+
+void kmem_cache_bootstrap(void);
+void kmem_cache_printstats(void);
+
+
+#endif /* _KMEM_CACHE_H_ */
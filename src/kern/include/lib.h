@@ -144,6 +144,12 @@ uint32_t random(void);
 void *kmalloc(size_t size);
 void kfree(void *ptr);
 void kheap_printstats(void);
+void kmalloc_bootstrap(void);
+
+/* Only with options kmallocprof; see vm/kmalloc.c. */
+void kheap_printsites(void);
+void kheap_setmark(void);
+void kheap_dumpsincemark(void);
 
 /*
  * C string functions. 
@@ -0,0 +1,88 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef _LOCKSTAT_H_
+#define _LOCKSTAT_H_
+
+/*
+ * Lock contention profiling ("options lockstat").
+ *
+ * spinlock_acquire, lock_acquire, P and cv_wait report every acquire
+ * here along with how long it had to wait; spinlocks and locks also
+ * report how long they were held. Counts are kept per lock name (per
+ * acquiring call site for spinlocks, which have no names), in a table
+ * per cpu so cpus don't fight over the counters, and lockstat_printtop
+ * adds them up.
+ *
+ * Times come from gettime(), so nothing is recorded until
+ * lockstat_bootstrap is called once the clock is attached.
+ */
+
+#include "opt-lockstat.h"
+
+#if OPT_LOCKSTAT
+
+/* Kinds of lock */
+#define LOCKSTAT_SPIN	0	/* spinlock */
+#define LOCKSTAT_LOCK	1	/* sleep lock */
+#define LOCKSTAT_SEM	2	/* semaphore (P only; no hold time) */
+#define LOCKSTAT_CV	3	/* condition variable (time in cv_wait) */
+
+struct cpu;
+
+/* Set up the table for a cpu; called from cpu_create. */
+void lockstat_cpu_init(struct cpu *c);
+
+/* Start recording. */
+void lockstat_bootstrap(void);
+
+/*
+ * Hooks for the lock code.
+ *
+ * lockstat_now returns the time to pass as WAITSTART for an acquire
+ * that is about to wait, or 0 if not recording. lockstat_acquired
+ * records an acquire of a lock of type KIND called NAME (WAITSTART 0
+ * meaning it didn't wait) and returns the time to pass to
+ * lockstat_released when it's let go. If NAME is NULL the lock is
+ * known by CALLER instead, which must then be the same on release:
+ * spinlocks pass the code address that acquired them, and the sleep
+ * objects pass their own address in case they were given no name.
+ */
+uint64_t lockstat_now(void);
+uint64_t lockstat_acquired(unsigned kind, const char *name,
+			   const void *caller, uint64_t waitstart);
+void lockstat_released(unsigned kind, const char *name,
+		       const void *caller, uint64_t acqtime);
+
+/* Print the N most contended locks, then start counting afresh. */
+void lockstat_printtop(unsigned n);
+
+#endif /* OPT_LOCKSTAT */
+
+#endif /* _LOCKSTAT_H_ */
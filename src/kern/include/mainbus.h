@@ -55,6 +55,21 @@ size_t mainbus_ramsize(void);
 /* Switch on an inter-processor interrupt. (Low-level.) */
 void mainbus_send_ipi(struct cpu *target);
 
+/*
+ * Tickless idle support for the current cpu's hardclock timer.
+ * mainbus_timer_stretch makes the next timer interrupt come TICKS
+ * hardclock periods after the last one, instead of one, and returns
+ * true; if the next one is already pending, it returns false and
+ * changes nothing. Once it comes, the timer goes back to normal by
+ * itself. If the cpu is woken up by something else first, mainbus_timer_restore puts it back, stores how
+ * many whole periods have gone by since the last hardclock in TICKSRET,
+ * and returns true. If the stretched interrupt is already pending, it
+ * returns false and changes nothing; hardclock then does the catching
+ * up. Interrupts must be off.
+ */
+bool mainbus_timer_stretch(unsigned ticks);
+bool mainbus_timer_restore(unsigned *ticksret);
+
 /*
  * The various ways to shut down the system. (These are very low-level
  * and should generally not be called directly - md_poweroff, for
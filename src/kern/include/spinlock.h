@@ -36,6 +36,8 @@
  */
 
 #include <cdefs.h>
+#include "opt-spinstats.h"
+#include "opt-lockstat.h"
 
 /* Inlining support - for making sure an out-of-line copy gets built */
 #ifndef SPINLOCK_INLINE
@@ -50,19 +52,43 @@
  *
  * Note that spinlocks are held by CPUs, not by threads.
  *
+ * These are ticket locks: each CPU that wants the lock takes the next
+ * number from splk_next, then waits for splk_serving to come round to
+ * it. So CPUs get the lock in the order they asked for it, and while
+ * waiting they only read splk_serving, which changes once per holder,
+ * instead of all hammering the lock word with atomic operations.
+ *
+ * With "options spinstats", each lock also keeps track of how often
+ * it had to be waited for and the longest wait, counted in polls of
+ * splk_serving. With "options lockstat", it also remembers when and
+ * where it was acquired, so lockstat can time the hold (see
+ * <lockstat.h>).
+ *
  * This structure is made public so spinlocks do not have to be
  * malloc'd; however, code that uses spinlocks should not look inside
  * the structure directly but always use the spinlock API functions.
  */
 struct spinlock {
-	volatile spinlock_data_t splk_lock; /* Memory word where we spin. */
+	volatile spinlock_data_t splk_next;    /* Next ticket to hand out. */
+	volatile spinlock_data_t splk_serving; /* Ticket that has the lock. */
 	struct cpu *splk_holder;	    /* CPU holding this lock. */
+#if OPT_SPINSTATS
+	unsigned splk_ncontended;	    /* Acquires that had to wait. */
+	unsigned splk_maxspin;		    /* Longest wait, in polls. */
+#endif
+#if OPT_LOCKSTAT
+	uint64_t splk_acqtime;		    /* When acquired, for lockstat. */
+	const void *splk_acqsite;	    /* Where acquired, for lockstat. */
+#endif
 };
 
 /*
  * Initializer for cases where a spinlock needs to be static or global.
+ * The optional counters are left out so they start at zero.
  */
-#define SPINLOCK_INITIALIZER	{ SPINLOCK_DATA_INITIALIZER, NULL }
+#define SPINLOCK_INITIALIZER	{ .splk_next = SPINLOCK_DATA_INITIALIZER, \
+				  .splk_serving = SPINLOCK_DATA_INITIALIZER, \
+				  .splk_holder = NULL }
 
 /*
  * Spinlock functions.
@@ -74,6 +100,9 @@ struct spinlock {
  * release	Release the lock. May re-enable interrupts.
  *
  * do_i_hold	Check if the current CPU holds the lock.
+ *
+ * getstats	With "options spinstats", copy out the wait counters.
+ * resetstats	With "options spinstats", zero the wait counters.
  */
 
 void spinlock_init(struct spinlock *lk);
@@ -84,5 +113,53 @@ void spinlock_release(struct spinlock *lk);
 
 bool spinlock_do_i_hold(struct spinlock *lk);
 
+#if OPT_SPINSTATS
+void spinlock_getstats(struct spinlock *lk,
+		       unsigned *ncontended, unsigned *maxspin);
+void spinlock_resetstats(struct spinlock *lk);
+#endif
+
+
+/*
+ * Read-mostly spinlock.
+ *
+ * Any number of CPUs may hold it for reading at once, or one for
+ * writing. A waiting writer holds off new readers. Like a spinlock,
+ * holding it either way disables interrupts, and it may not be held
+ * across anything that might sleep. Read holds don't nest: a second
+ * read acquire on the same CPU deadlocks if a writer has come along.
+ *
+ * The counts are protected by rwsplk_lock, which is only held long
+ * enough to update them; the read side itself runs in parallel.
+ */
+struct rwspinlock {
+	struct spinlock rwsplk_lock;		/* Protects the counts */
+	volatile unsigned rwsplk_readers;	/* CPUs reading */
+	volatile unsigned rwsplk_wwaiting;	/* CPUs waiting to write */
+	volatile bool rwsplk_writing;		/* True if held to write */
+};
+
+#define RWSPINLOCK_INITIALIZER	{ SPINLOCK_INITIALIZER, 0, 0, false }
+
+/*
+ * Read-mostly spinlock functions.
+ *
+ * init			Initialize the contents of the lock.
+ * cleanup		Opposite of init. Lock must be unheld.
+ *
+ * acquire_read		Get the lock shared. Also disables interrupts.
+ * release_read		Drop a shared hold. May re-enable interrupts.
+ * acquire_write	Get the lock exclusively. Also disables interrupts.
+ * release_write	Drop an exclusive hold. May re-enable interrupts.
+ */
+
+void rwspinlock_init(struct rwspinlock *lk);
+void rwspinlock_cleanup(struct rwspinlock *lk);
+
+void rwspinlock_acquire_read(struct rwspinlock *lk);
+void rwspinlock_release_read(struct rwspinlock *lk);
+void rwspinlock_acquire_write(struct rwspinlock *lk);
+void rwspinlock_release_write(struct rwspinlock *lk);
+
 
 #endif /* _SPINLOCK_H_ */
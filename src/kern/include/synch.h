@@ -36,17 +36,19 @@
 
 
 #include <spinlock.h>
+#include "opt-lockstat.h"
 
 /*
  * Dijkstra-style semaphore.
  *
- * The name field is for easier debugging. A copy of the name is made
- * internally.
+ * The name field is for easier debugging. It is not copied, so it
+ * should be a string constant.
+ *
+ * Threads wait in the hashed sleep queues (see <wchan.h>), keyed by
+ * the semaphore's address, whose lock also protects the count.
  */
 struct semaphore {
-        char *sem_name;
-	struct wchan *sem_wchan;
-	struct spinlock sem_lock;
+        const char *sem_name;
         volatile int sem_count;
 };
 
@@ -69,14 +71,23 @@ void V(struct semaphore *);
  * When the lock is created, no thread should be holding it. Likewise,
  * when the lock is destroyed, no thread should be holding it.
  *
- * The name field is for easier debugging. A copy of the name is
- * (should be) made internally.
+ * The name field is for easier debugging. It is not copied, so it
+ * should be a string constant.
+ *
+ * The lock is adaptive: a thread that finds it held spins as long as
+ * the holder is running on another cpu, and sleeps only if it isn't.
+ * The counters say how often each happened. Like the semaphore, it
+ * waits in the hashed sleep queues, whose lock protects the fields.
  */
 struct lock {
-        char *lk_name;
-	struct wchan *lk_wchan;
-	struct spinlock lk_lock;
+        const char *lk_name;
 	struct thread *volatile lk_holder;
+	unsigned lk_nacquire;		/* Total acquires */
+	unsigned lk_nspin;		/* Acquires that had to spin */
+	unsigned lk_nsleep;		/* Acquires that had to sleep */
+#if OPT_LOCKSTAT
+	uint64_t lk_acqtime;		/* When acquired, for lockstat */
+#endif
 };
 
 struct lock *lock_create(const char *name);
@@ -97,6 +108,9 @@ void lock_release(struct lock *);
 bool lock_do_i_hold(struct lock *);
 void lock_destroy(struct lock *);
 
+/* Print the lock's spin/sleep counters. */
+void lock_printstats(struct lock *);
+
 
 /*
  * Condition variable.
@@ -108,13 +122,13 @@ void lock_destroy(struct lock *);
  * These CVs are expected to support Mesa semantics, that is, no
  * guarantees are made about scheduling.
  *
- * The name field is for easier debugging. A copy of the name is
- * (should be) made internally.
+ * The name field is for easier debugging. It is not copied, so it
+ * should be a string constant. Waiting threads are kept in the hashed
+ * sleep queues, so there's nothing else in the structure.
  */
 
 struct cv {
-        char *cv_name;
-	struct wchan *cv_wchan;
+        const char *cv_name;
 };
 
 struct cv *cv_create(const char *name);
@@ -138,4 +152,47 @@ void cv_signal(struct cv *cv, struct lock *lock);
 void cv_broadcast(struct cv *cv, struct lock *lock);
 
 
+/*
+ * Reader-writer lock.
+ *
+ * Any number of threads may hold the lock for reading at once, or one
+ * thread for writing. Writers get preference: once one is waiting, new
+ * readers wait too, so a steady stream of readers can't starve it out.
+ * Like the plain lock, it sleeps while waiting, and may be held across
+ * blocking operations. It is not recursive; a reader that tries to
+ * read-lock again can deadlock against a waiting writer.
+ *
+ * For read-mostly data that is only held briefly and never across a
+ * sleep, see the spinning variant in <spinlock.h>.
+ *
+ * The name field is for easier debugging. It is not copied, so it
+ * should be a string constant.
+ */
+struct rwlock {
+	const char *rw_name;
+	struct spinlock rw_lock;	/* Protects the fields below */
+	unsigned rw_readers;		/* Number of readers holding it */
+	unsigned rw_wwaiting;		/* Number of writers waiting */
+	struct thread *rw_writer;	/* Writer holding it, or NULL */
+};
+
+struct rwlock *rwlock_create(const char *name);
+void rwlock_destroy(struct rwlock *);
+
+/*
+ * Operations:
+ *    rwlock_acquire_read   - Get the lock shared with other readers.
+ *    rwlock_release_read   - Give up a shared hold.
+ *    rwlock_acquire_write  - Get the lock exclusively.
+ *    rwlock_release_write  - Give up an exclusive hold.
+ *    rwlock_do_i_hold      - True if the current thread holds the lock
+ *                            for writing. (Readers aren't tracked.)
+ */
+void rwlock_acquire_read(struct rwlock *);
+void rwlock_release_read(struct rwlock *);
+void rwlock_acquire_write(struct rwlock *);
+void rwlock_release_write(struct rwlock *);
+bool rwlock_do_i_hold(struct rwlock *);
+
+
 #endif /* _SYNCH_H_ */
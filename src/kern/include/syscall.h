@@ -61,9 +61,13 @@ void enter_new_process(int argc, userptr_t argv, vaddr_t stackptr,
 
 int sys_reboot(int code);
 int sys___time(userptr_t user_seconds, userptr_t user_nanoseconds);
+int sys_nanosleep(userptr_t user_req, userptr_t user_rem);
 
 /* ASST2 setup */
 int sys_fork(struct trapframe *tf, pid_t *retval);
+int sys_vfork(struct trapframe *tf, pid_t *retval);
+int sys_getpriority(int which, pid_t who, int *retval);
+int sys_setpriority(int which, pid_t who, int prio);
 int sys_read(int fd, userptr_t buf, size_t size, int *retval);
 int sys_write(int fd, userptr_t buf, size_t size, int *retval);
 
@@ -87,4 +91,11 @@ int sys_fstat(int fd, userptr_t statptr);
 
 /* END A3 SETUP */
 
+/* VM system calls, in vm_syscalls.c (not with dumbvm) */
+int sys_sbrk(int amount, int *retval);
+int sys_madvise(userptr_t addr, size_t len, int advice);
+int sys_mlock(userptr_t addr, size_t len);
+int sys_munlock(userptr_t addr, size_t len);
+int sys_munlockall(void);
+
 #endif /* _SYSCALL_H_ */
@@ -55,9 +55,13 @@ int queuetest(int, char **);
 int threadtest(int, char **);
 int threadtest2(int, char **);
 int threadtest3(int, char **);
+int schedlattest(int, char **);
 int semtest(int, char **);
 int locktest(int, char **);
 int cvtest(int, char **);
+int rwtest(int, char **);
+int spinbench(int, char **);
+int workqueuetest(int, char **);
 
 /* filesystem tests */
 int fstest(int, char **);
@@ -71,8 +75,10 @@ int inlinetest(int, char **);
 /* other tests */
 int malloctest(int, char **);
 int mallocstress(int, char **);
+int mallocbench(int, char **);
 int coremaptest(int, char **);
 int coremapstress(int, char **);
+int vmalloctest(int, char **);
 int nettest(int, char **);
 
 /* Routine for running a user-level program. */
@@ -41,6 +41,7 @@
 
 struct addrspace;
 struct cpu;
+struct semaphore;
 struct vnode;
 
 /* BEGIN A3 SETUP */
@@ -84,10 +85,34 @@ struct thread {
 	 */
 	struct thread_machdep t_machdep; /* Any machine-dependent goo */
 	struct threadlistnode t_listnode; /* Link for run/sleep/zombie lists */
+	const void *t_sleepkey;		/* Key, if on a hashed sleep queue */
 	void *t_stack;			/* Kernel-level stack */
 	struct switchframe *t_context;	/* Saved register context (on stack) */
 	struct cpu *t_cpu;		/* CPU thread runs on */
 
+	/*
+	 * Scheduler fields. t_priority is the thread's current
+	 * level (0 is highest, up to SCHED_NLEVELS-1); t_ticks is how
+	 * many hardclocks it has used of its quantum at that level.
+	 *
+	 * Within a level, threads are ordered by t_vruntime, the CPU
+	 * time they have used scaled down by their weight, which comes
+	 * from the nice value t_nice (PRIO_MIN to PRIO_MAX).
+	 * t_vruntime is measured on its own cpu's clock (see
+	 * c_minvruntime), so values on different cpus can't be
+	 * compared. It is only made relative to c_minvruntime while
+	 * the thread is moved between cpus (thread_steal,
+	 * thread_placecpu, thread_migrate), then rebased on the new one.
+	 */
+	unsigned t_priority;		/* Scheduler priority level */
+	unsigned t_ticks;		/* Hardclocks used this quantum */
+	int t_nice;			/* Nice value; lower gets more CPU */
+	uint64_t t_vruntime;		/* Weighted CPU time used */
+	unsigned t_cputicks;		/* Total hardclocks spent running */
+	unsigned t_migrated;		/* t_cpu's c_hardclocks when moved */
+	unsigned t_lastrun;		/* t_cpu's c_hardclocks when last run */
+	bool t_bound;			/* Never moved off t_cpu */
+
 	/*
 	 * Interrupt state fields.
 	 *
@@ -114,6 +139,7 @@ struct thread {
 
 	/* VM */
 	struct addrspace *t_addrspace;	/* virtual address space */
+	struct semaphore *t_vforksem;	/* vfork parent waits on this */
 
 	/* VFS */
 	struct vnode *t_cwd;		/* current working directory */
@@ -148,6 +174,32 @@ int thread_fork(const char *name,
                 void *data1, unsigned long data2, 
                 pid_t *ret);
 
+/*
+ * vfork variant of thread_fork: the new thread borrows the current
+ * thread's address space rather than copying it, and does V(vforksem)
+ * once it calls thread_vfork_release. For now only thread_exit does;
+ * execv, once there is one, should too. The parent must not use the
+ * address space until then.
+ */
+int thread_vfork(const char *name,
+                 void (*func)(void *, unsigned long),
+                 void *data1, unsigned long data2,
+                 struct semaphore *vforksem,
+                 pid_t *ret);
+bool thread_vfork_release(void);
+
+/*
+ * Variant of thread_fork for per-cpu kernel service threads: the new
+ * thread runs on cpu number CPUNUM and the scheduler never moves it.
+ */
+int thread_fork_bound(const char *name, unsigned cpunum,
+                      void (*func)(void *, unsigned long),
+                      void *data1, unsigned long data2,
+                      pid_t *ret);
+
+/* Number of cpus. All exist once mainbus_bootstrap has run. */
+unsigned thread_numcpus(void);
+
 /*
  * Cause the current thread to exit.
  * Interrupts need not be disabled.
@@ -164,16 +216,39 @@ void thread_exit(int status);
  */
 void thread_yield(void);
 
+/*
+ * Sleep for at least NSECS nanoseconds. The resolution is one
+ * hardclock; zero returns at once. Not interruptible.
+ */
+void thread_sleep_ns(uint64_t nsecs);
+
 /*
  * Reshuffle the run queue. Called from the timer interrupt.
  */
 void schedule(void);
 
 /*
- * Potentially migrate ready threads to other CPUs. Called from the
- * timer interrupt.
+ * Charge the current thread for a clock tick and preempt it if its
+ * quantum is used up or a higher-priority thread is waiting. Called
+ * from the timer interrupt.
+ */
+void thread_tick(void);
+
+/*
+ * Get or set the current thread's nice value. Out-of-range values
+ * are clamped to PRIO_MIN..PRIO_MAX.
+ */
+int thread_getnice(void);
+void thread_setnice(int nice);
+
+/*
+ * Potentially pull ready threads over from a busier CPU. Called from
+ * the timer interrupt. (Idle CPUs also do this on their own.)
  */
 void thread_consider_migration(void);
 
+/* Print per-cpu scheduler statistics. */
+void thread_printstats(void);
+
 
 #endif /* _THREAD_H_ */
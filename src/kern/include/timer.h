@@ -0,0 +1,98 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef _TIMER_H_
+#define _TIMER_H_
+
+/*
+ * Timeouts: call a function after some number of hardclocks.
+ *
+ * Each cpu has a hierarchical timer wheel, advanced by hardclock().
+ * A timeout goes on the wheel of the cpu that arms it, and its
+ * function is called from that cpu's hardclock, in interrupt context,
+ * once the requested number of ticks has gone by. So it may not sleep,
+ * but it may wake threads up or re-arm its own timeout.
+ *
+ * The wheel has TW_LEVELS levels of TW_SLOTS slots. Level 0 holds
+ * timeouts due within TW_SLOTS ticks, one slot per tick; each level
+ * above covers TW_SLOTS times as much time as the one below, and its
+ * slots are cascaded down a level as their time comes near. Arming and
+ * cancelling are O(1), and each tick only looks at the timeouts that
+ * are actually due (plus the occasional cascade).
+ */
+
+#include <spinlock.h>
+
+#define TW_BITS		6
+#define TW_SLOTS	(1 << TW_BITS)
+#define TW_MASK		(TW_SLOTS - 1)
+#define TW_LEVELS	4
+
+struct timerwheel;
+
+struct timeout {
+	struct timeout *to_next;	/* Link in wheel slot */
+	struct timeout **to_prevp;	/* Previous link pointing to us */
+	struct timerwheel *to_wheel;	/* Wheel we're on, or NULL */
+	uint64_t to_expire;		/* Tick at which to fire */
+	void (*to_func)(void *);	/* Function to call */
+	void *to_data;			/* Argument for to_func */
+};
+
+struct timerwheel {
+	struct spinlock tw_lock;
+	uint64_t tw_now;		/* Next tick to process */
+	unsigned tw_count;		/* Number of pending timeouts */
+	struct timeout *tw_slots[TW_LEVELS][TW_SLOTS];
+};
+
+/* Set up a timeout to call FUNC(DATA). */
+void timeout_init(struct timeout *to, void (*func)(void *), void *data);
+
+/*
+ * Arm TO to fire after at least TICKS hardclocks, on the current
+ * cpu. It must not already be pending.
+ */
+void timeout_add(struct timeout *to, unsigned ticks);
+
+/*
+ * Disarm TO. Returns true if it was pending and now won't fire; false
+ * if it wasn't pending, which includes the case where it has just
+ * fired (its function may still be running on another cpu).
+ */
+bool timeout_cancel(struct timeout *to);
+
+/* Per-cpu wheel setup, and the tick called from hardclock(). */
+void timerwheel_init(struct timerwheel *tw);
+void timerwheel_tick(void);
+
+/* Hardclocks until the next one the wheel needs, capped at MAX. */
+unsigned timerwheel_nextevent(unsigned max);
+
+#endif /* _TIMER_H_ */
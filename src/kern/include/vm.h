@@ -55,6 +55,9 @@ void vm_bootstrap(void);
 /* Initialization for swapfile */
 void swap_bootstrap(void);
 
+/* Start the background coremap compaction thread. */
+void compact_bootstrap(void);
+
 /* Shutdown function for swapfile; closes swap vnode. */
 void swap_shutdown(void);
 
@@ -68,9 +71,39 @@ int vm_fault(int faulttype, vaddr_t faultaddress);
 vaddr_t alloc_kpages(int npages);
 void free_kpages(vaddr_t addr);
 
+/*
+ * Allocate/free virtually contiguous kernel memory built from
+ * scattered physical pages (see vm/vmalloc.c). For big buffers that
+ * don't need to be physically contiguous. Not for stacks, or for
+ * anything touched with the vmalloc or coremap spinlocks held. Not
+ * available with dumbvm.
+ */
+void *vmalloc(size_t sz);
+void vfree(void *ptr);
+
 /* TLB shootdown handling called from interprocessor_interrupt */
 void vm_tlbshootdown_all(void);
 
+/*
+ * Shrinkers: callbacks the coremap invokes under memory pressure to
+ * get kernel subsystems to give memory back. See vm/shrinker.c.
+ *
+ * The callback gets its data pointer and the number of pages wanted,
+ * and returns the number of pages it released. It may block but must
+ * not allocate memory. Lower priority numbers are asked first.
+ */
+#define SHRINKER_PRI_CACHE	10	/* idle caches; cheap to drop */
+#define SHRINKER_PRI_RECLAIM	20	/* dead objects awaiting cleanup */
+#define SHRINKER_PRI_COSTLY	30	/* needs I/O or other heavy work */
+
+int shrinker_register(const char *name, unsigned priority,
+		      unsigned (*func)(void *data, unsigned npages),
+		      void *data);
+void shrinker_unregister(unsigned (*func)(void *data, unsigned npages),
+			 void *data);
+unsigned shrinker_run(unsigned npages);
+void shrinker_printstats(void);
+
 /* BEGIN A3 SETUP */
 
 /* This is needed to switch between dumbvm and real vm with config.
@@ -75,6 +75,8 @@ struct addrspace;
  *
  *     LPF_DIRTY    is set if the page has been modified.
  *     LPF_PINNED   is set if the page is in transit to/from disk.
+ *     LPF_LOCKED   is set if the page was locked into RAM with mlock;
+ *                  the physical page is then wired in the coremap.
  *
  * A vm_object contains an array of lpages, each of which corresponds
  * to a virtual page in the address space of a process.
@@ -91,9 +93,11 @@ struct lpage {
 
 /* lpage flags */
 #define LPF_DIRTY		0x1
-#define LPF_MASK		0x1	// mask for the above
+#define LPF_LOCKED		0x2
+#define LPF_MASK		0x3	// mask for the above
 
 #define LP_ISDIRTY(lp)		((lp)->lp_paddr & LPF_DIRTY)
+#define LP_ISLOCKED(lp)		((lp)->lp_paddr & LPF_LOCKED)
 
 #define LP_SET(am, bit)		((lp)->lp_paddr |= (bit))
 #define LP_CLEAR(am, bit)	((lp)->lp_paddr &= ~(paddr_t)(bit))
@@ -103,6 +107,7 @@ struct lpage {
  *
  *    lpage_create - create a blank, non-materialized lpage structure.
  *    lpage_destroy - destroy an lpage
+ *    lpage_discard - destroy an lpage, keeping its swap reserved
  *    lpage_lock/unlock - for exclusive access to an lpage
  *    lpage_lock_and_pin - also pin physical page (see lpage.c for details)
  *
@@ -110,9 +115,12 @@ struct lpage {
  *    lpage_zerofill - materialize an lpage and zero-fill it
  *    lpage_fault - handle a fault on an lpage
  *    lpage_evict - evict an lpage
+ *    lpage_wire - page in an lpage and wire it in the coremap
+ *    lpage_unwire - undo lpage_wire
  */
 struct lpage     *lpage_create(void);
 void              lpage_destroy(struct lpage *lp);
+void              lpage_discard(struct lpage *lp);
 void              lpage_lock(struct lpage *lp);
 void              lpage_unlock(struct lpage *lp);
 void              lpage_lock_and_pin(struct lpage *lp);
@@ -122,6 +130,8 @@ int               lpage_zerofill(struct lpage **lpret);
 int               lpage_fault(struct lpage *lp, struct addrspace *,
 			                  int faulttype, vaddr_t va);
 void              lpage_evict(struct lpage *victim);
+int               lpage_wire(struct lpage *lp);
+void              lpage_unwire(struct lpage *lp);
 
 ////////////////////////////////////////////////////////////
 //
@@ -152,6 +162,7 @@ struct vm_object {
  *                    number of struct lpage's set for zero-fill.
  * vm_object_copy:    clone a vm_object, as at fork time.
  * vm_object_setsize: adjust the size of a vm_object (either up or down).
+ * vm_object_discard: return a range of pages to zero-fill.
  * vm_object_destroy: frees all the mapping entries and swap space.
  *
  */
@@ -162,6 +173,9 @@ int			        vm_object_copy(struct vm_object *vmo,
 int                 vm_object_setsize(struct addrspace *as,
 					                  struct vm_object *vmo,
 					                  unsigned newnpages);
+void                vm_object_discard(struct addrspace *as,
+					                  struct vm_object *vmo,
+					                  unsigned first, unsigned npages);
 void 			 vm_object_destroy(struct addrspace *as, 
 					               struct vm_object *vmo);
 
@@ -183,6 +197,8 @@ void 			 vm_object_destroy(struct addrspace *as,
  *
  * swap_free:        unmarks a swap page.
  *
+ * swap_free_reserved: unmarks a swap page but leaves it reserved.
+ *
  * swap_reserve:     reserve some swap pages for future allocation.
  *
  * swap_unreserve:   release some previously-reserved swap pages.
@@ -196,6 +212,7 @@ void 			 vm_object_destroy(struct addrspace *as,
 
 off_t	 	swap_alloc(void);
 void 		swap_free(off_t diskpage);
+void		swap_free_reserved(off_t diskpage);
 
 int		swap_reserve(unsigned long npages);
 void		swap_unreserve(unsigned long npages);
@@ -221,6 +238,11 @@ extern struct lock *global_paging_lock;
 // other bits
 //
 
+/* vmalloc setup, kseg2 fault handling, and counters (vmalloc.c) */
+void vmalloc_bootstrap(void);
+int vmalloc_fault(vaddr_t va);
+void vmalloc_printstats(void);
+
 /* Print machine-dependent VM counters */
 void vm_printmdstats(void);
 
@@ -82,4 +82,43 @@ void wchan_wakeone(struct wchan *wc);
 void wchan_wakeall(struct wchan *wc);
 
 
+/*
+ * Hashed sleep queues.
+ *
+ * Rather than having a wait channel of its own, an object can have
+ * threads wait on its address (the "key"). Keys are hashed into a
+ * fixed table of queues shared by the whole system, so waiting costs
+ * the object no memory at all. Each queue's lock can also serve as the
+ * interlock protecting the state of objects that hash to it, so those
+ * don't need a spinlock of their own either (see synch.c).
+ *
+ * There are two tables. Sleep locks use SLEEPQ_LOCK and everything
+ * else uses SLEEPQ_WAIT, because cv_wait has to release a lock while
+ * holding its CV's queue. A SLEEPQ_LOCK queue may be locked while
+ * holding a SLEEPQ_WAIT queue, but not the other way round, and never
+ * two queues from the same table.
+ *
+ * sleepq_lock		Lock the queue KEY hashes to.
+ * sleepq_unlock	Unlock it.
+ * sleepq_sleep		Sleep on KEY, showing NAME (a string constant) as
+ *			the wait channel. The queue must be locked, and
+ *			will have been *unlocked* upon return.
+ * sleepq_wakeone	Wake one thread sleeping on KEY. The queue must
+ *			be locked, and stays locked.
+ * sleepq_wakeall	Wake all threads sleeping on KEY. Likewise.
+ * sleepq_isempty	True if nobody's sleeping on KEY. The queue must
+ *			not be locked. For diagnostic purposes only.
+ */
+
+#define SLEEPQ_WAIT	0
+#define SLEEPQ_LOCK	1
+
+void sleepq_lock(unsigned table, const void *key);
+void sleepq_unlock(unsigned table, const void *key);
+void sleepq_sleep(unsigned table, const void *key, const char *name);
+void sleepq_wakeone(unsigned table, const void *key);
+void sleepq_wakeall(unsigned table, const void *key);
+bool sleepq_isempty(unsigned table, const void *key);
+
+
 #endif /* _WCHAN_H_ */
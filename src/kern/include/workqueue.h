@@ -0,0 +1,112 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef _WORKQUEUE_H_
+#define _WORKQUEUE_H_
+
+/*
+ * Workqueues: run functions later, on kernel worker threads.
+ *
+ * A workqueue has a list of pending work and a few worker threads on
+ * every cpu. Work goes on the list of the cpu that queues it and is
+ * run there, by a worker that never migrates, so queueing is cheap
+ * and the work tends to find its data still in the cache. Workers may
+ * sleep; if one does, the next one on that cpu carries on.
+ *
+ * A struct work is provided by the caller, usually embedded in the
+ * object the work is about, and is set up once with work_init. It can
+ * be queued again as soon as it has started running (it then runs
+ * again later), and on a different workqueue once it's idle.
+ *
+ * Functions:
+ *
+ * work_init		Set up W to call FUNC(DATA).
+ *
+ * workqueue_create	Make a workqueue with NWORKERS workers per cpu
+ *			(at most WQ_MAXWORKERS). Call only once all cpus
+ *			are running. Returns NULL if out of memory.
+ * workqueue_destroy	Run what's still pending, stop the workers, and
+ *			free the workqueue. Nothing may be queued on it
+ *			or be waiting to be.
+ *
+ * workqueue_add	Queue W to run soon. Returns false, and does
+ *			nothing, if it's already pending (queued or
+ *			delayed). May be called from interrupt handlers.
+ * workqueue_add_delayed Likewise, but run it after at least TICKS
+ *			hardclocks. The delay is counted on this cpu and
+ *			the work runs here too.
+ * workqueue_cancel	Stop W from running if it's still pending.
+ *			Returns true if it was. If it's running right
+ *			now it keeps going; this doesn't wait for it.
+ * workqueue_flush	Wait until nothing's queued or running on WQ.
+ *			Delayed work that hasn't come due isn't waited
+ *			for.
+ *
+ * workqueue_printstats	Print each workqueue's backlog and latency.
+ *
+ * system_wq is a workqueue with one worker per cpu for general use;
+ * it's made by workqueue_bootstrap.
+ */
+
+#include <timer.h>
+
+#define WQ_MAXWORKERS	4	/* Most workers per cpu */
+
+struct workqueue;	/* Opaque */
+struct wq_cpu;		/* Private to workqueue.c */
+
+struct work {
+	struct work *w_next;		/* Link on a cpu's pending list */
+	void (*w_func)(void *);		/* Function to call */
+	void *w_data;			/* Argument for w_func */
+	struct workqueue *w_wq;		/* Queue last added to */
+	struct timeout w_timeout;	/* For workqueue_add_delayed */
+	uint64_t w_queuedat;		/* When put on the list, in ns */
+	bool w_pending;			/* Will run (queued or delayed) */
+	bool w_delayed;			/* Waiting for w_timeout */
+	bool w_onlist;			/* On some cpu's pending list */
+};
+
+void work_init(struct work *w, void (*func)(void *), void *data);
+
+struct workqueue *workqueue_create(const char *name, unsigned nworkers);
+void workqueue_destroy(struct workqueue *wq);
+
+bool workqueue_add(struct workqueue *wq, struct work *w);
+bool workqueue_add_delayed(struct workqueue *wq, struct work *w,
+			   unsigned ticks);
+bool workqueue_cancel(struct work *w);
+void workqueue_flush(struct workqueue *wq);
+
+void workqueue_printstats(void);
+
+void workqueue_bootstrap(void);
+extern struct workqueue *system_wq;
+
+#endif /* _WORKQUEUE_H_ */
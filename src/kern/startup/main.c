@@ -42,12 +42,15 @@
 #include <current.h>
 #include <synch.h>
 #include <vm.h>
+#include <kmem_cache.h>
 #include <mainbus.h>
 #include <vfs.h>
 #include <device.h>
 #include <syscall.h>
 #include <test.h>
 #include <version.h>
+#include <lockstat.h>
+#include <workqueue.h>
 #include <pid.h> /* to bootstrap process ID system - New for ASST2 */
 #include "autoconf.h"  // for pseudoconfig
 
@@ -108,8 +111,9 @@ boot(void)
 	/* Early initialization. */
 	ram_bootstrap();
         vm_bootstrap();
+	kmalloc_bootstrap();
+	kmem_cache_bootstrap();
 	thread_bootstrap();
-	hardclock_bootstrap();
 	vfs_bootstrap();
 
 	/* Probe and initialize devices. Interrupts should come on. */
@@ -130,14 +134,21 @@ boot(void)
         /* END A3 SETUP */
 
 	kprintf_bootstrap();
+#if OPT_LOCKSTAT
+	lockstat_bootstrap(); /* needs the clock, so after the devices */
+#endif
 
 	/* New for ASST2 - Initialize process ID managment. This should
 	 * come before additional cpus are brought online.
 	 */
 	pid_bootstrap(); 
+#if !OPT_DUMBVM
+	compact_bootstrap(); /* needs thread_fork, hence pids */
+#endif
 	dumb_consoleIO_bootstrap(); /* And initialize for user console IO */
 
 	thread_start_cpus();
+	workqueue_bootstrap(); /* per-cpu workers, so after the cpus */
 
 	/* Default bootfs - but ignore failure, in case emu0 doesn't exist */
 	vfs_setbootfs("emu0");
@@ -40,17 +40,25 @@
 #include <vfs.h>
 #include <syscall.h>
 #include <test.h>
+#include <vm.h>
+#include <workqueue.h>
 
 /* BEGIN A3 SETUP */
 /* Needed to omit coremaptests when using dumbvm */
 #include "opt-dumbvm.h"
 /* Needed to include optional sfs code */
 #include "opt-sfs.h"
+#include "opt-kmallocprof.h"
+#include "opt-lockstat.h"
 
 #if OPT_SFS
 #include <sfs.h>
 #endif
 
+#if OPT_LOCKSTAT
+#include <lockstat.h>
+#endif
+
 /* Hacky semaphore solution to make menu thread wait for command
  * thread, in absence of thread_join solution.
  */
@@ -534,6 +542,109 @@ cmd_kheapstats(int nargs, char **args)
 	return 0;
 }
 
+static
+int
+cmd_threadstats(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	thread_printstats();
+
+	return 0;
+}
+
+/*
+ * Command for printing workqueue backlog and latency.
+ */
+static
+int
+cmd_wqstats(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	workqueue_printstats();
+
+	return 0;
+}
+
+#if OPT_LOCKSTAT
+/*
+ * Command for printing the most contended locks since the last time.
+ */
+static
+int
+cmd_lockstat(int nargs, char **args)
+{
+	unsigned n = 10;
+
+	if (nargs > 2) {
+		kprintf("Usage: ls [count]\n");
+		return EINVAL;
+	}
+	if (nargs == 2) {
+		n = atoi(args[1]);
+	}
+
+	lockstat_printtop(n);
+
+	return 0;
+}
+#endif
+
+#if OPT_KMALLOCPROF
+static
+int
+cmd_kheapsites(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	kheap_printsites();
+
+	return 0;
+}
+
+static
+int
+cmd_kheapmark(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	kheap_setmark();
+
+	return 0;
+}
+
+static
+int
+cmd_kheapsincemark(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	kheap_dumpsincemark();
+
+	return 0;
+}
+#endif
+
+#if !OPT_DUMBVM
+static
+int
+cmd_vmstats(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	vm_printstats();
+
+	return 0;
+}
+#endif
+
 ////////////////////////////////////////
 //
 // Menus.
@@ -595,17 +706,23 @@ static const char *testmenu[] = {
 	"[bt]  Bitmap test                   ",
 	"[km1] Kernel malloc test            ",
 	"[km2] kmalloc stress test           ",
+	"[km3] kmalloc throughput test       ",
 	"[tt1] Thread test 1                 ",
 	"[tt2] Thread test 2                 ",
 	"[tt3] Thread test 3                 ",
+	"[tt4] Scheduler latency test        ",
 #if OPT_NET
 	"[net] Network test                  ",
 #endif
 	"[sy1] Semaphore test                ",
 	"[sy2] Lock test             (1)     ",
 	"[sy3] CV test               (1)     ",
+	"[sy4] Reader-writer lock test       ",
+	"[sy5] Spinlock scaling benchmark    ",
+	"[wq1] Workqueue test                ",
 	"[cm] Coremap test           (3)     ",
 	"[cm2] Coremap stress test   (3)     ",
+	"[cm3] vmalloc test          (3)     ",
 	"[fs1] Filesystem test               ",
 	"[fs2] FS read stress        (4)     ",
 	"[fs3] FS write stress       (4)     ",
@@ -635,6 +752,19 @@ static const char *mainmenu[] = {
 	"[?o] Operations menu                ",
 	"[?t] Tests menu                     ",
 	"[kh] Kernel heap stats              ",
+#if OPT_KMALLOCPROF
+	"[khs] kmalloc call sites            ",
+	"[khm] Mark kmalloc allocations      ",
+	"[khd] kmalloc allocations since mark",
+#endif
+#if !OPT_DUMBVM
+	"[vs] VM system stats                ",
+#endif
+	"[ts] Scheduler stats                ",
+	"[wq] Workqueue stats                ",
+#if OPT_LOCKSTAT
+	"[ls] Lock contention stats [count]  ",
+#endif
 	"[q] Quit and shut down              ",
 	NULL
 };
@@ -683,23 +813,41 @@ static struct {
 
 	/* stats */
 	{ "kh",         cmd_kheapstats },
+#if OPT_KMALLOCPROF
+	{ "khs",        cmd_kheapsites },
+	{ "khm",        cmd_kheapmark },
+	{ "khd",        cmd_kheapsincemark },
+#endif
+#if !OPT_DUMBVM
+	{ "vs",         cmd_vmstats },
+#endif
+	{ "ts",         cmd_threadstats },
+	{ "wq",         cmd_wqstats },
+#if OPT_LOCKSTAT
+	{ "ls",         cmd_lockstat },
+#endif
 
 	/* base system tests */
 	{ "at",		arraytest },
 	{ "bt",		bitmaptest },
 	{ "km1",	malloctest },
 	{ "km2",	mallocstress },
+	{ "km3",	mallocbench },
 #if OPT_NET
 	{ "net",	nettest },
 #endif
 	{ "tt1",	threadtest },
 	{ "tt2",	threadtest2 },
 	{ "tt3",	threadtest3 },
+	{ "tt4",	schedlattest },
 	{ "sy1",	semtest },
 
 	/* synchronization assignment tests */
 	{ "sy2",	locktest },
 	{ "sy3",	cvtest },
+	{ "sy4",	rwtest },
+	{ "sy5",	spinbench },
+	{ "wq1",	workqueuetest },
 
 	/* ASST2 tests */
 	/* For testing the wait implementation. */
@@ -711,6 +859,7 @@ static struct {
 	/* ASST2 tests */
 	{ "cm",		coremaptest },
 	{ "cm2",	coremapstress },
+	{ "cm3",	vmalloctest },
 #endif
 /* END A3 SETUP */
 
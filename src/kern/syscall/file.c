@@ -20,9 +20,26 @@
 #include <kern/fcntl.h>
 #include <current.h>
 #include <lib.h>
+#include <kmem_cache.h>
 
 /*** openfile functions ***/
 
+/* File descriptor objects come from their own object cache. */
+static struct kmem_cache fdescript_cache =
+	KMEM_CACHE_INITIALIZER("fdescript", sizeof(struct fdescript), 0, NULL);
+
+struct fdescript *
+fdescript_alloc(void)
+{
+	return kmem_cache_alloc(&fdescript_cache);
+}
+
+void
+fdescript_free(struct fdescript *file)
+{
+	kmem_cache_free(&fdescript_cache, file);
+}
+
 /*
  * file_open
  * opens a file, places it in the filetable, sets RETFD to the file
@@ -53,14 +70,14 @@ file_open(char *filename, int flags, int mode, int *retfd)
 		return status;
 	
 	/* create a filetable entry, return out of memory if can't */
-	if(!(file = kmalloc(sizeof(struct fdescript))))
+	if(!(file = fdescript_alloc()))
 		vfs_close(v);
 		return ENOMEM;
 	
 	/* Lock the fdescript, return EUNIMP */
 	if (!(file->lock = lock_create("Fdiscriptor lock")))
 		vfs_close(v);
-		kfree(file); //clear the allocation of memory
+		fdescript_free(file); //clear the allocation of memory
 		return EUNIMP;
 		
 	/* attach values to the file fields */
@@ -74,7 +91,7 @@ file_open(char *filename, int flags, int mode, int *retfd)
 	if((status = filetable_inject(file, retfd)))
 		lock_destroy(file->lock);
 		vfs_close(v);
-		kfree(file);
+		fdescript_free(file);
 		return status;
 	
 	return 0;
@@ -110,7 +127,7 @@ file_close(int fd)
 		/* release and destroy the lock */
 		lock_release(file->lock);
 		lock_destroy(file->lock);
-		kfree(file); //free memory
+		fdescript_free(file); //free memory
 	else
 		lock_release(file->lock);
 	
@@ -150,7 +167,7 @@ filetable_init(struct filetable *ft)
 	ft->lock = lock_create("filetable");
 	for(int i = 0; i < 3; i++)
 		/* allocate memory for node and descriptor */
-		fdep[i] = (struct fdescript *)kmalloc(sizeof(struct fdescript));
+		fdep[i] = fdescript_alloc();
 		v = (struct vnode *)kmalloc(sizeof(struct vnode));
 		
 		/* if NULL destroy filetable */
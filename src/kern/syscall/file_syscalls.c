@@ -135,7 +135,7 @@ sys_dup2(int oldfd, int newfd, int *retval)
 	struct fdescript *old;
 	struct fdescript *new;
 	
-	old = (struct fdescript *)kmalloc(sizeof(struct fdescript));
+	old = fdescript_alloc();
 	if (old == NULL)
 		return ENOMEM;
 	
@@ -154,7 +154,7 @@ sys_dup2(int oldfd, int newfd, int *retval)
 	if (new != NULL)
 		file_close(newfd);
 	
-	new = (struct fdescript *)kmalloc(sizeof(struct fdescript));
+	new = fdescript_alloc();
 	if (new == NULL)
 		return ENOMEM;
 	
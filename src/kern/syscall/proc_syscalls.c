@@ -5,10 +5,14 @@
 
 #include <types.h>
 #include <kern/errno.h>
+#include <kern/time.h>
+#include <kern/resource.h>
 #include <lib.h>
 #include <thread.h>
 #include <current.h>
 #include <pid.h>
+#include <synch.h>
+#include <addrspace.h>
 #include <machine/trapframe.h>
 #include <syscall.h>
 
@@ -47,6 +51,106 @@ sys_fork(struct trapframe *tf, pid_t *retval)
 	return 0;
 }
 
+/*
+ * sys_vfork
+ *
+ * Like fork, but instead of copying the address space the child
+ * borrows ours, and we sleep until the child gives it back. There is
+ * no execv yet, so for now that means exiting. The child must not
+ * return from the function that called vfork, or it'll wreck our
+ * stack.
+ */
+int
+sys_vfork(struct trapframe *tf, pid_t *retval)
+{
+	struct trapframe *ntf;
+	struct semaphore *sem;
+	int result;
+
+	sem = sem_create("vfork", 0);
+	if (sem == NULL) {
+		return ENOMEM;
+	}
+
+	ntf = kmalloc(sizeof(struct trapframe));
+	if (ntf==NULL) {
+		sem_destroy(sem);
+		return ENOMEM;
+	}
+	*ntf = *tf;
+
+	/*
+	 * Flush our TLB entries first. The coremap only tracks one TLB
+	 * mapping per page, so the child mustn't find our mappings
+	 * live on this CPU if it ends up running on another one.
+	 */
+	as_activate(NULL);
+
+	result = thread_vfork(curthread->t_name, enter_forked_process,
+			      ntf, 0, sem, retval);
+	if (result) {
+		kfree(ntf);
+		sem_destroy(sem);
+		as_activate(curthread->t_addrspace);
+		return result;
+	}
+
+	/* wait for the address space to come back */
+	P(sem);
+	sem_destroy(sem);
+	as_activate(curthread->t_addrspace);
+
+	return 0;
+}
+
+/*
+ * sys_getpriority / sys_setpriority
+ *
+ * Get or set the nice value that weights the process's share of the
+ * CPU. Only PRIO_PROCESS is supported, and only for the calling
+ * process (WHO of 0 or our own pid): there are no process groups or
+ * users, and no way to find another process's thread from its pid.
+ * setpriority clamps PRIO to PRIO_MIN..PRIO_MAX, as in BSD.
+ */
+static
+int
+prio_checkwho(int which, pid_t who)
+{
+	if (which != PRIO_PROCESS) {
+		return EINVAL;
+	}
+	if (who != 0 && who != curthread->t_pid) {
+		return ESRCH;
+	}
+	return 0;
+}
+
+int
+sys_getpriority(int which, pid_t who, int *retval)
+{
+	int result;
+
+	result = prio_checkwho(which, who);
+	if (result) {
+		return result;
+	}
+	*retval = thread_getnice();
+	return 0;
+}
+
+int
+sys_setpriority(int which, pid_t who, int prio)
+{
+	int result;
+
+	result = prio_checkwho(which, who);
+	if (result) {
+		return result;
+	}
+	thread_setnice(prio);
+	return 0;
+}
+
 /*
  * sys_getpid
  * Placeholder to remind you to implement this.
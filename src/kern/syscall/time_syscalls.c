@@ -28,8 +28,11 @@
  */
 
 #include <types.h>
+#include <kern/errno.h>
+#include <kern/time.h>
 #include <clock.h>
 #include <copyinout.h>
+#include <thread.h>
 #include <syscall.h>
 
 /*
@@ -56,3 +59,34 @@ sys___time(userptr_t user_seconds_ptr, userptr_t user_nanoseconds_ptr)
 
 	return 0;
 }
+
+/*
+ * Sleep for the time in *USER_REQ. We can't be interrupted, so the
+ * remaining time, if asked for, is always zero.
+ */
+int
+sys_nanosleep(userptr_t user_req, userptr_t user_rem)
+{
+	struct timespec ts;
+	int result;
+
+	result = copyin(user_req, &ts, sizeof(ts));
+	if (result) {
+		return result;
+	}
+	if (ts.tv_sec < 0 || ts.tv_nsec < 0 || ts.tv_nsec >= 1000000000) {
+		return EINVAL;
+	}
+
+	thread_sleep_ns((uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec);
+
+	if (user_rem != NULL) {
+		ts.tv_sec = 0;
+		ts.tv_nsec = 0;
+		result = copyout(&ts, user_rem, sizeof(ts));
+		if (result) {
+			return result;
+		}
+	}
+	return 0;
+}
@@ -0,0 +1,124 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <thread.h>
+#include <current.h>
+#include <addrspace.h>
+#include <syscall.h>
+
+/*
+ * Virtual memory system calls.
+ */
+
+/*
+ * sbrk: move the heap break by AMOUNT bytes; returns the old break.
+ */
+int
+sys_sbrk(int amount, int *retval)
+{
+	vaddr_t oldbreak;
+	int result;
+
+	if (curthread->t_addrspace == NULL) {
+		return ENOMEM;
+	}
+	result = as_sbrk(curthread->t_addrspace, amount, &oldbreak);
+	if (result) {
+		return result;
+	}
+	*retval = (int)oldbreak;
+	return 0;
+}
+
+/*
+ * madvise: advice about how the pages from ADDR to ADDR+LEN will be
+ * used.
+ */
+int
+sys_madvise(userptr_t addr, size_t len, int advice)
+{
+	vaddr_t va = (vaddr_t)addr;
+
+	if (curthread->t_addrspace == NULL) {
+		return ENOMEM;
+	}
+	if (va + len < va || va + len > USERSPACETOP) {
+		return ENOMEM;
+	}
+	return as_madvise(curthread->t_addrspace, va, len, advice);
+}
+
+/*
+ * mlock: lock the pages covering ADDR to ADDR+LEN into memory.
+ */
+int
+sys_mlock(userptr_t addr, size_t len)
+{
+	vaddr_t va = (vaddr_t)addr;
+
+	if (curthread->t_addrspace == NULL) {
+		return EFAULT;
+	}
+	if (va + len < va || va + len > USERSPACETOP) {
+		return EFAULT;
+	}
+	return as_mlock(curthread->t_addrspace, va, len);
+}
+
+/*
+ * munlock: unlock the pages covering ADDR to ADDR+LEN.
+ */
+int
+sys_munlock(userptr_t addr, size_t len)
+{
+	vaddr_t va = (vaddr_t)addr;
+
+	if (curthread->t_addrspace == NULL) {
+		return EFAULT;
+	}
+	if (va + len < va || va + len > USERSPACETOP) {
+		return EFAULT;
+	}
+	return as_munlock(curthread->t_addrspace, va, len);
+}
+
+/*
+ * munlockall: unlock every page of the process.
+ */
+int
+sys_munlockall(void)
+{
+	if (curthread->t_addrspace != NULL) {
+		as_munlockall(curthread->t_addrspace);
+	}
+	return 0;
+}
@@ -138,3 +138,67 @@ coremapstress(int nargs, char **args)
 
 	return 0;
 }
+
+/*
+ * Test vmalloc: allocate and free blocks of varying size, enough in
+ * total to go through the kseg2 window several times so stale pages
+ * have to be purged. Fill each block with a pattern and check it
+ * before freeing.
+ */
+
+#define VM_NTRIES	400
+#define VM_NLIVE	3
+#define VM_MAXPAGES	13
+
+int
+vmalloctest(int nargs, char **args)
+{
+	uint32_t *blocks[VM_NLIVE];
+	size_t sizes[VM_NLIVE];
+	unsigned i, j, slot, nwords;
+	int ret = 0;
+
+	(void)nargs;
+	(void)args;
+
+	kprintf("Starting vmalloc test...\n");
+
+	for (i=0; i<VM_NLIVE; i++) {
+		blocks[i] = NULL;
+	}
+
+	for (i=0; i<VM_NTRIES; i++) {
+		slot = i % VM_NLIVE;
+		if (blocks[slot] != NULL) {
+			nwords = sizes[slot] / sizeof(uint32_t);
+			for (j=0; j<nwords; j++) {
+				if (blocks[slot][j] != (slot << 24) + j) {
+					kprintf("vmalloc block %p word %u "
+						"corrupted\n", blocks[slot], j);
+					ret = 1;
+					break;
+				}
+			}
+			vfree(blocks[slot]);
+		}
+
+		sizes[slot] = (1 + (i * 7) % VM_MAXPAGES) * PAGE_SIZE - 12;
+		blocks[slot] = vmalloc(sizes[slot]);
+		if (blocks[slot] == NULL) {
+			kprintf("vmalloc failed; test failed.\n");
+			ret = 1;
+			break;
+		}
+		nwords = sizes[slot] / sizeof(uint32_t);
+		for (j=0; j<nwords; j++) {
+			blocks[slot][j] = (slot << 24) + j;
+		}
+	}
+
+	for (i=0; i<VM_NLIVE; i++) {
+		vfree(blocks[i]);
+	}
+
+	kprintf("vmalloc test %s\n", ret ? "failed" : "done");
+	return 0;
+}
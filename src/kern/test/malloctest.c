@@ -31,9 +31,11 @@
  * Test code for kmalloc.
  */
 #include <types.h>
+#include <kern/errno.h>
 #include <lib.h>
 #include <thread.h>
 #include <synch.h>
+#include <clock.h>
 #include <test.h>
 
 /*
@@ -138,3 +140,109 @@ mallocstress(int nargs, char **args)
 
 	return 0;
 }
+
+/*
+ * mallocbench: kmalloc/kfree throughput. Each of N threads (default
+ * NTHREADS) does BENCHOPS allocations of assorted small sizes, keeping
+ * BENCHSLOTS of them live at a time so frees come back in a different
+ * order than allocations went out. Reports the overall rate, which is
+ * what the per-cpu magazines are for; compare with one thread and
+ * with several on a multiprocessor.
+ */
+
+#define BENCHOPS    20000
+#define BENCHSLOTS  16
+
+static const size_t benchsizes[] = { 24, 40, 64, 100, 200, 24, 48, 500 };
+#define NBENCHSIZES (sizeof(benchsizes)/sizeof(benchsizes[0]))
+
+static
+void
+mallocbenchthread(void *sm, unsigned long num)
+{
+	struct semaphore *sem = sm;
+	void *slots[BENCHSLOTS];
+	unsigned i, ix;
+
+	for (i=0; i<BENCHSLOTS; i++) {
+		slots[i] = NULL;
+	}
+
+	for (i=0; i<BENCHOPS; i++) {
+		ix = (i * 7 + num) % BENCHSLOTS;
+		kfree(slots[ix]);
+		slots[ix] = kmalloc(benchsizes[(i + num) % NBENCHSIZES]);
+		if (slots[ix] == NULL) {
+			kprintf("thread %lu: kmalloc returned NULL\n", num);
+			break;
+		}
+	}
+
+	for (i=0; i<BENCHSLOTS; i++) {
+		kfree(slots[i]);
+	}
+	V(sem);
+}
+
+int
+mallocbench(int nargs, char **args)
+{
+	struct semaphore *sem;
+	time_t secs1, secs2, rsecs;
+	uint32_t nsecs1, nsecs2, rnsecs;
+	uint64_t usecs;
+	unsigned i, nthreads;
+	int result;
+
+	nthreads = NTHREADS;
+	if (nargs > 1) {
+		nthreads = atoi(args[1]);
+	}
+	if (nargs > 2 || nthreads == 0) {
+		kprintf("Usage: km3 [nthreads]\n");
+		return EINVAL;
+	}
+
+	sem = sem_create("mallocbench", 0);
+	if (sem == NULL) {
+		panic("mallocbench: sem_create failed\n");
+	}
+
+	kprintf("Starting kmalloc throughput test with %u threads...\n",
+		nthreads);
+
+	gettime(&secs1, &nsecs1);
+
+	for (i=0; i<nthreads; i++) {
+		result = thread_fork("mallocbench",
+				     mallocbenchthread, sem, i,
+				     NULL);
+		if (result) {
+			panic("mallocbench: thread_fork failed: %s\n",
+			      strerror(result));
+		}
+	}
+
+	for (i=0; i<nthreads; i++) {
+		P(sem);
+	}
+
+	gettime(&secs2, &nsecs2);
+	getinterval(secs1, nsecs1, secs2, nsecs2, &rsecs, &rnsecs);
+
+	sem_destroy(sem);
+
+	usecs = (uint64_t)rsecs * 1000000 + rnsecs / 1000;
+	kprintf("%u kmalloc/kfree pairs in %lu.%09lu seconds",
+		nthreads * BENCHOPS, (unsigned long)rsecs,
+		(unsigned long)rnsecs);
+	if (usecs > 0) {
+		kprintf(" (%lu per second)",
+			(unsigned long)((uint64_t)nthreads * BENCHOPS
+					* 1000000 / usecs));
+	}
+	kprintf("\n");
+	kprintf("kmalloc throughput test done\n");
+
+	return 0;
+}
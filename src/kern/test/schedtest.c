@@ -0,0 +1,227 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Scheduler latency benchmark.
+ *
+ * A pair of "interactive" threads ping-pong through two semaphores,
+ * doing a little work each time they wake, while NHOGS compute-bound
+ * threads spin on the same cpus. Each side stamps the time just before
+ * waking the other, and the other measures how long it took to
+ * actually get the cpu. Under plain round-robin that is roughly one
+ * tick per hog; a scheduler that favours threads that block should
+ * keep it near zero without starving the hogs.
+ */
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <thread.h>
+#include <synch.h>
+#include <clock.h>
+#include <test.h>
+
+#define NHOGS		4	/* default number of hog threads */
+#define NROUNDS		200	/* ping-pong round trips measured */
+#define NWARMUP		20	/* round trips before measuring */
+#define THINKLOOPS	200	/* work done per wakeup */
+
+static struct semaphore *pingsem;
+static struct semaphore *pongsem;
+static struct semaphore *donesem;
+static volatile bool hogs_done;
+
+/* Wakeup timestamp; handed from waker to wakee by the semaphores. */
+static time_t stamp_secs;
+static uint32_t stamp_nsecs;
+
+/* Results. */
+static uint64_t lat_total;
+static uint32_t lat_max;
+static unsigned lat_count;
+static volatile unsigned long hog_iters;
+
+static
+void
+think(void)
+{
+	volatile unsigned i, x;
+
+	x = 0;
+	for (i=0; i<THINKLOOPS; i++) {
+		x += i;
+	}
+}
+
+static
+void
+stamp(void)
+{
+	gettime(&stamp_secs, &stamp_nsecs);
+}
+
+static
+void
+measure(bool counting)
+{
+	time_t secs, rsecs;
+	uint32_t nsecs, rnsecs, lat;
+
+	gettime(&secs, &nsecs);
+	if (!counting) {
+		return;
+	}
+	getinterval(stamp_secs, stamp_nsecs, secs, nsecs, &rsecs, &rnsecs);
+	lat = rsecs > 0 ? 0xffffffff : rnsecs;
+	lat_total += lat;
+	if (lat > lat_max) {
+		lat_max = lat;
+	}
+	lat_count++;
+}
+
+static
+void
+hogthread(void *junk, unsigned long num)
+{
+	unsigned long n;
+
+	(void)junk;
+	(void)num;
+
+	n = 0;
+	while (!hogs_done) {
+		n++;
+	}
+	/* Not atomic, but the hogs are only counted at the end. */
+	hog_iters += n;
+	V(donesem);
+}
+
+static
+void
+pingthread(void *junk, unsigned long num)
+{
+	unsigned i;
+
+	(void)junk;
+	(void)num;
+
+	for (i=0; i<NWARMUP + NROUNDS; i++) {
+		think();
+		stamp();
+		V(pingsem);
+		P(pongsem);
+		measure(i >= NWARMUP);
+	}
+	hogs_done = true;
+	V(donesem);
+}
+
+static
+void
+pongthread(void *junk, unsigned long num)
+{
+	unsigned i;
+
+	(void)junk;
+	(void)num;
+
+	for (i=0; i<NWARMUP + NROUNDS; i++) {
+		P(pingsem);
+		measure(i >= NWARMUP);
+		think();
+		stamp();
+		V(pongsem);
+	}
+	V(donesem);
+}
+
+int
+schedlattest(int nargs, char **args)
+{
+	unsigned i, nhogs;
+	int result;
+
+	nhogs = NHOGS;
+	if (nargs > 1) {
+		nhogs = atoi(args[1]);
+	}
+	if (nargs > 2) {
+		kprintf("Usage: tt4 [nhogs]\n");
+		return EINVAL;
+	}
+
+	pingsem = sem_create("ping", 0);
+	pongsem = sem_create("pong", 0);
+	donesem = sem_create("schedlat", 0);
+	if (pingsem == NULL || pongsem == NULL || donesem == NULL) {
+		panic("schedlattest: sem_create failed\n");
+	}
+	hogs_done = false;
+	lat_total = 0;
+	lat_max = 0;
+	lat_count = 0;
+	hog_iters = 0;
+
+	kprintf("Starting scheduler latency test with %u hogs...\n", nhogs);
+
+	for (i=0; i<nhogs; i++) {
+		result = thread_fork("schedhog", hogthread, NULL, i, NULL);
+		if (result) {
+			panic("schedlattest: thread_fork failed: %s\n",
+			      strerror(result));
+		}
+	}
+	result = thread_fork("schedping", pingthread, NULL, 0, NULL);
+	if (result) {
+		panic("schedlattest: thread_fork failed: %s\n",
+		      strerror(result));
+	}
+	result = thread_fork("schedpong", pongthread, NULL, 0, NULL);
+	if (result) {
+		panic("schedlattest: thread_fork failed: %s\n",
+		      strerror(result));
+	}
+
+	for (i=0; i<nhogs + 2; i++) {
+		P(donesem);
+	}
+
+	sem_destroy(pingsem);
+	sem_destroy(pongsem);
+	sem_destroy(donesem);
+
+	kprintf("%u wakeups: average latency %lu us, max %lu us\n",
+		lat_count,
+		(unsigned long)(lat_total / lat_count / 1000),
+		(unsigned long)(lat_max / 1000));
+	kprintf("Hogs made %lu iterations\n", hog_iters);
+	kprintf("Scheduler latency test done\n");
+	return 0;
+}
@@ -35,6 +35,7 @@
 #include <lib.h>
 #include <clock.h>
 #include <thread.h>
+#include <spinlock.h>
 #include <synch.h>
 #include <test.h>
 #include <kern/sysexits.h>
@@ -43,6 +44,8 @@
 #define NSEMLOOPS     63
 #define NLOCKLOOPS    120
 #define NCVLOOPS      5
+#define NRWLOOPS      200
+#define RWWRITERS     4		/* one thread in RWWRITERS writes */
 #define NTHREADS      32
 
 static volatile unsigned long testval1;
@@ -51,8 +54,15 @@ static volatile unsigned long testval3;
 static struct semaphore *testsem;
 static struct lock *testlock;
 static struct cv *testcv;
+static struct rwlock *testrwlock;
+static struct rwspinlock testrwspinlock = RWSPINLOCK_INITIALIZER;
 static struct semaphore *donesem;
 
+/* Who's inside the rwlock under test; protected by rwcount_lock. */
+static struct spinlock rwcount_lock = SPINLOCK_INITIALIZER;
+static unsigned rwreaders, rwwriters, rwmaxreaders;
+static bool rwfailed;
+
 static
 void
 inititems(void)
@@ -75,6 +85,12 @@ inititems(void)
 			panic("synchtest: cv_create failed\n");
 		}
 	}
+	if (testrwlock==NULL) {
+		testrwlock = rwlock_create("testrwlock");
+		if (testrwlock == NULL) {
+			panic("synchtest: rwlock_create failed\n");
+		}
+	}
 	if (donesem==NULL) {
 		donesem = sem_create("donesem", 0);
 		if (donesem == NULL) {
@@ -304,3 +320,304 @@ cvtest(int nargs, char **args)
 
 	return 0;
 }
+
+/*
+ * Reader-writer lock tests. Writers store a consistent set of values;
+ * readers check they see a consistent set that doesn't change under
+ * them. Both check who else is inside, so a writer overlapping anyone
+ * is caught directly. The sleeping lock's holders yield to give the
+ * others every chance to get in; the spinning lock's can't sleep, so
+ * they just hang around a while.
+ */
+
+static
+void
+rwfail(unsigned long num, const char *msg)
+{
+	kprintf("thread %lu: %s\n", num, msg);
+	rwfailed = true;
+}
+
+static
+void
+rwenter(unsigned long num, bool writer)
+{
+	spinlock_acquire(&rwcount_lock);
+	if (rwwriters > 0 || (writer && rwreaders > 0)) {
+		rwfail(num, writer ? "writer got in with others inside" :
+		       "reader got in with a writer inside");
+	}
+	if (writer) {
+		rwwriters++;
+	}
+	else {
+		rwreaders++;
+		if (rwreaders > rwmaxreaders) {
+			rwmaxreaders = rwreaders;
+		}
+	}
+	spinlock_release(&rwcount_lock);
+}
+
+static
+void
+rwleave(bool writer)
+{
+	spinlock_acquire(&rwcount_lock);
+	if (writer) {
+		rwwriters--;
+	}
+	else {
+		rwreaders--;
+	}
+	spinlock_release(&rwcount_lock);
+}
+
+static
+void
+rwwrite(unsigned long num)
+{
+	testval1 = num;
+	testval2 = num*num;
+	testval3 = num%3;
+}
+
+static
+void
+rwcheck(unsigned long num, unsigned long val1)
+{
+	if (testval1 != val1) {
+		rwfail(num, "values changed under a reader");
+	}
+	if (testval2 != testval1*testval1) {
+		rwfail(num, "Mismatch on testval2/testval1");
+	}
+	if (testval3 != testval1%3) {
+		rwfail(num, "Mismatch on testval3/testval1");
+	}
+}
+
+static
+void
+rwtestthread(void *junk, unsigned long num)
+{
+	bool writer = (num % RWWRITERS) == 0;
+	unsigned long val1;
+	int i;
+
+	(void)junk;
+
+	for (i=0; i<NRWLOOPS; i++) {
+		if (writer) {
+			rwlock_acquire_write(testrwlock);
+		}
+		else {
+			rwlock_acquire_read(testrwlock);
+		}
+		rwenter(num, writer);
+
+		if (writer) {
+			rwwrite(num);
+		}
+		val1 = testval1;
+		rwcheck(num, val1);
+		thread_yield();
+		rwcheck(num, val1);
+
+		rwleave(writer);
+		if (writer) {
+			rwlock_release_write(testrwlock);
+		}
+		else {
+			rwlock_release_read(testrwlock);
+		}
+	}
+	V(donesem);
+}
+
+static
+void
+rwspintestthread(void *junk, unsigned long num)
+{
+	bool writer = (num % RWWRITERS) == 0;
+	unsigned long val1;
+	volatile int j;
+	int i;
+
+	(void)junk;
+
+	for (i=0; i<NRWLOOPS; i++) {
+		if (writer) {
+			rwspinlock_acquire_write(&testrwspinlock);
+		}
+		else {
+			rwspinlock_acquire_read(&testrwspinlock);
+		}
+		rwenter(num, writer);
+
+		if (writer) {
+			rwwrite(num);
+		}
+		val1 = testval1;
+		rwcheck(num, val1);
+		for (j=0; j<500; j++);
+		rwcheck(num, val1);
+
+		rwleave(writer);
+		if (writer) {
+			rwspinlock_release_write(&testrwspinlock);
+		}
+		else {
+			rwspinlock_release_read(&testrwspinlock);
+		}
+
+		/* give the other threads on this cpu a turn */
+		thread_yield();
+	}
+	V(donesem);
+}
+
+static
+void
+rwrun(const char *name, void (*func)(void *, unsigned long))
+{
+	int i, result;
+
+	rwreaders = rwwriters = rwmaxreaders = 0;
+	rwwrite(0);
+
+	for (i=0; i<NTHREADS; i++) {
+		result = thread_fork("synchtest", func, NULL, i, NULL);
+		if (result) {
+			panic("rwtest: thread_fork failed: %s\n",
+			      strerror(result));
+		}
+	}
+	for (i=0; i<NTHREADS; i++) {
+		P(donesem);
+	}
+
+	kprintf("%s: up to %u readers at once\n", name, rwmaxreaders);
+}
+
+int
+rwtest(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	inititems();
+	kprintf("Starting reader-writer lock test...\n");
+
+	rwfailed = false;
+	rwrun("rwlock", rwtestthread);
+	rwrun("rwspinlock", rwspintestthread);
+
+	if (rwfailed) {
+		kprintf("Test failed\n");
+	}
+	kprintf("Reader-writer lock test done.\n");
+
+	return 0;
+}
+
+/*
+ * Spinlock scaling benchmark. For 1 to SPINBENCH_MAXTHREADS threads,
+ * hammer one spinlock with a tiny critical section for a second and
+ * count acquires. The total shows how throughput holds up as more
+ * cpus fight over the lock; the spread between the threads' counts
+ * shows how fair it is. Run it with as many cpus configured in
+ * sys161.conf as you want to measure; past that, the extra threads
+ * just take turns.
+ */
+
+#define SPINBENCH_MAXTHREADS	8
+
+static struct spinlock benchlock = SPINLOCK_INITIALIZER;
+static volatile bool benchstop;
+static volatile unsigned long benchshared;
+static volatile unsigned long benchcount[SPINBENCH_MAXTHREADS];
+
+static
+void
+spinbenchthread(void *junk, unsigned long num)
+{
+	(void)junk;
+
+	while (!benchstop) {
+		spinlock_acquire(&benchlock);
+		benchshared++;
+		spinlock_release(&benchlock);
+		benchcount[num]++;
+	}
+	V(donesem);
+}
+
+int
+spinbench(int nargs, char **args)
+{
+	unsigned long total, min, max;
+	int i, n, result;
+#if OPT_SPINSTATS
+	unsigned ncontended, maxspin;
+#endif
+
+	(void)nargs;
+	(void)args;
+
+	inititems();
+	kprintf("Starting spinlock scaling benchmark...\n");
+
+	for (n=1; n<=SPINBENCH_MAXTHREADS; n++) {
+		benchstop = false;
+		benchshared = 0;
+		for (i=0; i<n; i++) {
+			benchcount[i] = 0;
+		}
+#if OPT_SPINSTATS
+		spinlock_resetstats(&benchlock);
+#endif
+
+		for (i=0; i<n; i++) {
+			result = thread_fork("spinbench", spinbenchthread,
+					     NULL, i, NULL);
+			if (result) {
+				panic("spinbench: thread_fork failed: %s\n",
+				      strerror(result));
+			}
+		}
+		clocksleep(1);
+		benchstop = true;
+		for (i=0; i<n; i++) {
+			P(donesem);
+		}
+
+		total = 0;
+		min = max = benchcount[0];
+		for (i=0; i<n; i++) {
+			total += benchcount[i];
+			if (benchcount[i] < min) {
+				min = benchcount[i];
+			}
+			if (benchcount[i] > max) {
+				max = benchcount[i];
+			}
+		}
+		if (total != benchshared) {
+			kprintf("spinbench: lost updates: %lu counted, "
+				"%lu under the lock\n", total, benchshared);
+			kprintf("Test failed\n");
+			return 0;
+		}
+		kprintf("%d threads: %lu acquires/sec, per thread %lu-%lu",
+			n, total, min, max);
+#if OPT_SPINSTATS
+		spinlock_getstats(&benchlock, &ncontended, &maxspin);
+		kprintf(", %u waited, longest %u polls", ncontended, maxspin);
+#endif
+		kprintf("\n");
+	}
+
+	kprintf("Spinlock scaling benchmark done.\n");
+	return 0;
+}
@@ -0,0 +1,204 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Workqueue test.
+ *
+ * Runs a batch of work through a private workqueue and checks that
+ * every item ran exactly once, on the cpu that queued it, and that
+ * double queueing, cancellation, and delays behave as documented in
+ * <workqueue.h>. Queueing is done at splhigh where the test needs the
+ * work not to have started yet; the workers are bound to this cpu, so
+ * they can't get to it until we let go.
+ */
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <spl.h>
+#include <clock.h>
+#include <cpu.h>
+#include <current.h>
+#include <spinlock.h>
+#include <thread.h>
+#include <workqueue.h>
+#include <test.h>
+
+#define NWQWORK		32	/* work items in the batch */
+#define NWQWORKERS	2	/* workers per cpu */
+#define WQDELAY		5	/* ticks, for the delayed tests */
+
+struct wqtestitem {
+	struct work wi_work;
+	unsigned wi_runs;		/* times it's run */
+	unsigned wi_cpu;		/* cpu it was queued on */
+	bool wi_wrongcpu;		/* ran somewhere else */
+};
+
+static struct spinlock wqtest_lock = SPINLOCK_INITIALIZER;
+static struct wqtestitem wqitems[NWQWORK];
+static bool wqfailed;
+
+static
+void
+wqtestfunc(void *data)
+{
+	struct wqtestitem *wi = data;
+
+	spinlock_acquire(&wqtest_lock);
+	wi->wi_runs++;
+	if (curcpu->c_number != wi->wi_cpu) {
+		wi->wi_wrongcpu = true;
+	}
+	spinlock_release(&wqtest_lock);
+}
+
+static
+void
+wqcheck(const char *what, bool ok)
+{
+	if (!ok) {
+		kprintf("wq1: %s: wrong\n", what);
+		wqfailed = true;
+	}
+}
+
+/*
+ * Check that item I ran EXPECTED times and reset its count.
+ */
+static
+void
+wqcheckruns(const char *what, unsigned i, unsigned expected)
+{
+	struct wqtestitem *wi = &wqitems[i];
+
+	if (wi->wi_runs != expected) {
+		kprintf("wq1: %s: item %u ran %u times, expected %u\n",
+			what, i, wi->wi_runs, expected);
+		wqfailed = true;
+	}
+	if (wi->wi_wrongcpu) {
+		kprintf("wq1: %s: item %u ran on the wrong cpu\n", what, i);
+		wqfailed = true;
+	}
+	wi->wi_runs = 0;
+	wi->wi_wrongcpu = false;
+}
+
+/*
+ * Queue item I, noting the cpu. Returns workqueue_add's result.
+ */
+static
+bool
+wqqueue(struct workqueue *wq, unsigned i, unsigned ticks)
+{
+	struct wqtestitem *wi = &wqitems[i];
+	bool ret;
+	int spl;
+
+	/* Stay on one cpu between looking and queueing */
+	spl = splhigh();
+	wi->wi_cpu = curcpu->c_number;
+	ret = workqueue_add_delayed(wq, &wi->wi_work, ticks);
+	splx(spl);
+	return ret;
+}
+
+int
+workqueuetest(int nargs, char **args)
+{
+	struct workqueue *wq;
+	unsigned i;
+	int spl;
+
+	(void)nargs;
+	(void)args;
+
+	kprintf("Starting workqueue test...\n");
+	wqfailed = false;
+
+	wq = workqueue_create("wqtest", NWQWORKERS);
+	if (wq == NULL) {
+		kprintf("wq1: workqueue_create failed\n");
+		return ENOMEM;
+	}
+	for (i=0; i<NWQWORK; i++) {
+		work_init(&wqitems[i].wi_work, wqtestfunc, &wqitems[i]);
+		wqitems[i].wi_runs = 0;
+		wqitems[i].wi_wrongcpu = false;
+	}
+
+	/* A batch, yielding now and then so it may land on other cpus */
+	for (i=0; i<NWQWORK; i++) {
+		wqcheck("add", wqqueue(wq, i, 0));
+		if (i % 4 == 0) {
+			thread_yield();
+		}
+	}
+	workqueue_flush(wq);
+	for (i=0; i<NWQWORK; i++) {
+		wqcheckruns("batch", i, 1);
+	}
+
+	/* Adding what's already pending does nothing */
+	spl = splhigh();
+	wqcheck("first add", wqqueue(wq, 0, 0));
+	wqcheck("second add", !wqqueue(wq, 0, 0));
+	splx(spl);
+	workqueue_flush(wq);
+	wqcheckruns("double add", 0, 1);
+
+	/* Cancelling queued work */
+	spl = splhigh();
+	wqcheck("add before cancel", wqqueue(wq, 1, 0));
+	wqcheck("cancel queued", workqueue_cancel(&wqitems[1].wi_work));
+	wqcheck("cancel again", !workqueue_cancel(&wqitems[1].wi_work));
+	splx(spl);
+	workqueue_flush(wq);
+	wqcheckruns("cancel queued", 1, 0);
+
+	/* Cancelling delayed work, then delaying it again */
+	wqcheck("add delayed", wqqueue(wq, 2, WQDELAY));
+	wqcheck("add delayed again", !wqqueue(wq, 2, WQDELAY));
+	wqcheck("cancel delayed", workqueue_cancel(&wqitems[2].wi_work));
+	wqcheck("re-add delayed", wqqueue(wq, 2, WQDELAY));
+	wqcheck("add other delayed", wqqueue(wq, 3, WQDELAY));
+	clocksleep(1);
+	workqueue_flush(wq);
+	wqcheckruns("delayed", 2, 1);
+	wqcheckruns("delayed", 3, 1);
+
+	workqueue_destroy(wq);
+
+	if (wqfailed) {
+		kprintf("Test failed\n");
+	}
+	kprintf("Workqueue test done.\n");
+
+	return 0;
+}
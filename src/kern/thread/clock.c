@@ -30,17 +30,18 @@
 #include <types.h>
 #include <lib.h>
 #include <cpu.h>
-#include <wchan.h>
 #include <clock.h>
 #include <thread.h>
+#include <timer.h>
 #include <current.h>
+#include <mainbus.h>
 
 /*
  * Time handling.
  *
- * This is pretty primitive. A real kernel will typically have some
- * kind of support for scheduling callbacks to happen at specific
- * points in the future, usually with more resolution that one second.
+ * hardclock() drives the scheduler and each cpu's timer wheel (see
+ * thread/timer.c), which is how callbacks are scheduled for specific
+ * points in the future, at a resolution of one hardclock.
  *
  * A real kernel also has to maintain the time of day; in OS/161 we
  * skimp on that because we have a known-good hardware clock.
@@ -49,41 +50,48 @@
 /*
  * Timing constants. These should be tuned along with any work done on
  * the scheduler.
+ *
+ * An idle cpu only looks for threads to steal when it wakes up, so
+ * IDLE_MAXHARDCLOCKS is kept to STEAL_HOLDOFF (in thread.c): a busy
+ * cpu never waits much longer for help than a thread has to wait
+ * before it may be moved again anyway.
  */
 #define SCHEDULE_HARDCLOCKS	4	/* Reschedule every 4 hardclocks. */
 #define MIGRATE_HARDCLOCKS	16	/* Migrate every 16 hardclocks. */
+#define IDLE_MAXHARDCLOCKS	8	/* Longest tickless idle stretch. */
 
 /*
- * Once a second, everything waiting on lbolt is awakened by CPU 0.
- */
-static struct wchan *lbolt;
-
-/*
- * Setup.
+ * This is called once per second, on one processor, by the timer
+ * code.
  */
 void
-hardclock_bootstrap(void)
+timerclock(void)
 {
-	lbolt = wchan_create("lbolt");
-	if (lbolt == NULL) {
-		panic("Couldn't create lbolt\n");
-	}
+	/* Nothing needs this at the moment; timeouts run off hardclock. */
 }
 
 /*
- * This is called once per second, on one processor, by the timer
- * code.
+ * Account for NUM hardclocks that went by while the cpu was idle
+ * without taking them. The timer wheel still has to see every tick,
+ * but nothing was running, so the scheduler has nothing to charge.
  */
+static
 void
-timerclock(void)
+hardclock_catchup(unsigned num)
 {
-	/* Just broadcast on lbolt */
-	wchan_wakeall(lbolt);
+	unsigned i;
+
+	for (i=0; i<num; i++) {
+		curcpu->c_hardclocks++;
+		curcpu->c_skippedclocks++;
+		timerwheel_tick();
+		thread_tick();
+	}
 }
 
 /*
  * This is called HZ times a second (on each processor) by the timer
- * code.
+ * code, or less often while the processor is idle.
  */
 void
 hardclock(void)
@@ -92,14 +100,54 @@ hardclock(void)
 	 * Collect statistics here as desired.
 	 */
 
+	if (curcpu->c_tickless > 0) {
+		/* This is the end of a tickless idle stretch. */
+		hardclock_catchup(curcpu->c_tickless - 1);
+		curcpu->c_tickless = 0;
+	}
+
 	curcpu->c_hardclocks++;
+	timerwheel_tick();
 	if ((curcpu->c_hardclocks % SCHEDULE_HARDCLOCKS) == 0) {
 		schedule();
 	}
 	if ((curcpu->c_hardclocks % MIGRATE_HARDCLOCKS) == 0) {
 		thread_consider_migration();
 	}
-	thread_yield();
+	thread_tick();
+}
+
+/*
+ * Go idle with the timer stretched out to the next tick the timer
+ * wheel cares about, so an idle cpu isn't woken HZ times a second for
+ * nothing. If that tick comes, hardclock() catches up; if something
+ * else wakes us first (usually IPI_UNIDLE from a wakeup on another
+ * cpu), put the timer back and catch up here so the wheel and the
+ * scheduler see a normal run of ticks again. If the tick came anyway
+ * before we got the timer back, leave it to hardclock().
+ */
+void
+hardclock_idle(void)
+{
+	unsigned ticks;
+
+	ticks = timerwheel_nextevent(IDLE_MAXHARDCLOCKS);
+	if (ticks <= 1) {
+		cpu_idle();
+		return;
+	}
+
+	if (!mainbus_timer_stretch(ticks)) {
+		/* a tick is due already; take it */
+		cpu_idle();
+		return;
+	}
+	curcpu->c_tickless = ticks;
+	cpu_idle();
+	if (curcpu->c_tickless > 0 && mainbus_timer_restore(&ticks)) {
+		curcpu->c_tickless = 0;
+		hardclock_catchup(ticks);
+	}
 }
 
 /*
@@ -108,9 +156,7 @@ hardclock(void)
 void
 clocksleep(int num_secs)
 {
-	while (num_secs > 0) {
-		wchan_lock(lbolt);
-		wchan_sleep(lbolt);
-		num_secs--;
+	if (num_secs > 0) {
+		thread_sleep_ns((uint64_t)num_secs * 1000000000);
 	}
 }
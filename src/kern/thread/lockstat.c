@@ -0,0 +1,481 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Lock contention profiling. See <lockstat.h>.
+ *
+ * Each cpu has a small open-addressed hash table of records, which
+ * only that cpu writes, with interrupts off. That means no locking
+ * here at all, which matters, since every spinlock in the system
+ * comes through. It also means the reports read other cpus' tables
+ * while they're being updated, so the numbers are only as exact as a
+ * snapshot of a moving system can be.
+ *
+ * Records are keyed by kind and name, so all the locks made under one
+ * name (every vnode's lock, say) share a record, and the table stays
+ * small however many lock instances come and go. Spinlocks have no
+ * names; they're keyed by the code address that acquired them
+ * instead. A lookup only probes LOCKSTAT_MAXPROBE slots, so a crowded
+ * table costs lost records, not long scans at splhigh inside
+ * spinlock_acquire.
+ *
+ * Names are compared only as far as the copy kept in the record
+ * (LOCKSTAT_NAMELEN-1 bytes), so longer names with a common prefix
+ * share a record.
+ *
+ * Resetting bumps a generation number; each table clears itself the
+ * next time its cpu records something and sees the number has moved.
+ */
+
+#include <types.h>
+#include <lib.h>
+#include <spl.h>
+#include <clock.h>
+#include <cpu.h>
+#include <current.h>
+#include <lockstat.h>
+#include <platform/maxcpus.h>
+
+#define LOCKSTAT_NSLOTS		128	/* Records per cpu; power of 2 */
+#define LOCKSTAT_MAXPROBE	8	/* Slots looked at per lookup */
+#define LOCKSTAT_NAMELEN	16	/* Name bytes kept per record */
+#define LOCKSTAT_MAXTOP		32	/* Most lines lockstat_printtop prints */
+
+struct lockstat_rec {
+	bool lr_used;			/* False if slot free */
+	unsigned lr_kind;		/* LOCKSTAT_* */
+	const void *lr_caller;		/* Key if unnamed, else NULL */
+	char lr_name[LOCKSTAT_NAMELEN];	/* Key; copied, as it may be freed */
+	unsigned lr_nacquire;		/* Acquires */
+	unsigned lr_ncontended;		/* Acquires that had to wait */
+	unsigned lr_nhold;		/* Holds timed */
+	uint64_t lr_waittotal;		/* Total wait, ns */
+	uint64_t lr_holdtotal;		/* Total hold, ns */
+	uint32_t lr_waitmax;		/* Longest wait, ns */
+	uint32_t lr_holdmax;		/* Longest hold, ns */
+};
+
+struct lockstat_table {
+	unsigned lt_gen;		/* lockstat_gen when last cleared */
+	unsigned lt_dropped;		/* Records lost to crowding */
+	struct lockstat_rec lt_recs[LOCKSTAT_NSLOTS];
+};
+
+static struct lockstat_table *lockstat_tables[MAXCPUS];
+static volatile bool lockstat_on;
+static volatile unsigned lockstat_gen;
+
+/*
+ * Set up the table for cpu C. Nothing's recorded yet, so kmalloc's
+ * spinlocks don't come back here.
+ */
+void
+lockstat_cpu_init(struct cpu *c)
+{
+	struct lockstat_table *lt;
+
+	KASSERT(c->c_number < MAXCPUS);
+	lt = kmalloc(sizeof(*lt));
+	if (lt == NULL) {
+		panic("lockstat: Out of memory\n");
+	}
+	bzero(lt, sizeof(*lt));
+	lt->lt_gen = lockstat_gen;
+	lockstat_tables[c->c_number] = lt;
+}
+
+void
+lockstat_bootstrap(void)
+{
+	lockstat_on = true;
+}
+
+/*
+ * Current time in nanoseconds, or 0 if not recording.
+ */
+uint64_t
+lockstat_now(void)
+{
+	time_t secs;
+	uint32_t nsecs;
+
+	if (!lockstat_on || !CURCPU_EXISTS()) {
+		return 0;
+	}
+	gettime(&secs, &nsecs);
+	return (uint64_t)secs * 1000000000 + nsecs;
+}
+
+/*
+ * Get the current cpu's table, clearing it first if there's been a
+ * reset since it was last used. Interrupts must be off.
+ */
+static
+struct lockstat_table *
+lockstat_mytable(void)
+{
+	struct lockstat_table *lt;
+
+	lt = lockstat_tables[curcpu->c_number];
+	if (lt != NULL && lt->lt_gen != lockstat_gen) {
+		bzero(lt->lt_recs, sizeof(lt->lt_recs));
+		lt->lt_dropped = 0;
+		lt->lt_gen = lockstat_gen;
+	}
+	return lt;
+}
+
+/*
+ * True if NAME matches the copy kept in LR.
+ */
+static
+bool
+lockstat_samename(const struct lockstat_rec *lr, const char *name)
+{
+	unsigned i;
+
+	for (i=0; i<LOCKSTAT_NAMELEN-1; i++) {
+		if (lr->lr_name[i] != name[i]) {
+			return false;
+		}
+		if (name[i] == 0) {
+			break;
+		}
+	}
+	return true;
+}
+
+/*
+ * Hash for the record keyed by NAME, or by CALLER if NAME is NULL.
+ */
+static
+unsigned
+lockstat_hash(unsigned kind, const char *name, const void *caller)
+{
+	unsigned hash, i;
+
+	if (name == NULL) {
+		hash = (uintptr_t)caller >> 2;
+	}
+	else {
+		hash = 0;
+		for (i=0; name[i] != 0 && i < LOCKSTAT_NAMELEN-1; i++) {
+			hash = hash * 31 + (unsigned char)name[i];
+		}
+	}
+	return hash + kind;
+}
+
+/*
+ * Find the record in LT for locks of type KIND called NAME, or for
+ * the unnamed ones known by CALLER if NAME is NULL or empty. If
+ * there isn't one and CREATE is set, make one. Returns NULL if there
+ * isn't one and it wasn't or couldn't be made.
+ */
+static
+struct lockstat_rec *
+lockstat_find(struct lockstat_table *lt, unsigned kind, const char *name,
+	      const void *caller, bool create)
+{
+	struct lockstat_rec *lr;
+	unsigned hash, i, j;
+
+	if (name != NULL && name[0] == 0) {
+		name = NULL;
+	}
+	if (name != NULL) {
+		caller = NULL;
+	}
+
+	hash = lockstat_hash(kind, name, caller);
+	for (i=0; i<LOCKSTAT_MAXPROBE; i++) {
+		lr = &lt->lt_recs[(hash + i) & (LOCKSTAT_NSLOTS - 1)];
+		if (!lr->lr_used) {
+			break;
+		}
+		if (lr->lr_kind == kind && lr->lr_caller == caller &&
+		    (name == NULL || lockstat_samename(lr, name))) {
+			return lr;
+		}
+	}
+	if (!create) {
+		return NULL;
+	}
+	if (i == LOCKSTAT_MAXPROBE) {
+		lt->lt_dropped++;
+		return NULL;
+	}
+
+	lr->lr_kind = kind;
+	lr->lr_caller = caller;
+	for (j=0; name != NULL && name[j] != 0 && j < LOCKSTAT_NAMELEN-1; j++) {
+		lr->lr_name[j] = name[j];
+	}
+	lr->lr_name[j] = 0;
+	/* set last, for readers on other cpus */
+	lr->lr_used = true;
+	return lr;
+}
+
+/*
+ * Find LR's counterpart in LT.
+ */
+static
+struct lockstat_rec *
+lockstat_findrec(struct lockstat_table *lt, const struct lockstat_rec *lr)
+{
+	return lockstat_find(lt, lr->lr_kind,
+			     lr->lr_caller == NULL ? lr->lr_name : NULL,
+			     lr->lr_caller, false);
+}
+
+uint64_t
+lockstat_acquired(unsigned kind, const char *name, const void *caller,
+		  uint64_t waitstart)
+{
+	struct lockstat_table *lt;
+	struct lockstat_rec *lr;
+	uint64_t now, wait;
+	int spl;
+
+	now = lockstat_now();
+	if (now == 0) {
+		return 0;
+	}
+
+	spl = splhigh();
+	lt = lockstat_mytable();
+	lr = lt == NULL ? NULL : lockstat_find(lt, kind, name, caller, true);
+	if (lr != NULL) {
+		lr->lr_nacquire++;
+		if (waitstart != 0) {
+			wait = now - waitstart;
+			lr->lr_ncontended++;
+			lr->lr_waittotal += wait;
+			if (wait > lr->lr_waitmax) {
+				lr->lr_waitmax = wait > 0xffffffff ?
+					0xffffffff : wait;
+			}
+		}
+	}
+	splx(spl);
+
+	return now;
+}
+
+void
+lockstat_released(unsigned kind, const char *name, const void *caller,
+		  uint64_t acqtime)
+{
+	struct lockstat_table *lt;
+	struct lockstat_rec *lr;
+	uint64_t now, hold;
+	int spl;
+
+	if (acqtime == 0) {
+		/* acquired before we started, or not timed */
+		return;
+	}
+	now = lockstat_now();
+	if (now == 0) {
+		return;
+	}
+
+	spl = splhigh();
+	lt = lockstat_mytable();
+	/*
+	 * A sleep lock may be released on a different cpu than it was
+	 * acquired on, so this may make a record with no acquires;
+	 * lockstat_sum merges it with the others.
+	 */
+	lr = lt == NULL ? NULL : lockstat_find(lt, kind, name, caller, true);
+	if (lr != NULL) {
+		hold = now - acqtime;
+		lr->lr_nhold++;
+		lr->lr_holdtotal += hold;
+		if (hold > lr->lr_holdmax) {
+			lr->lr_holdmax = hold > 0xffffffff ? 0xffffffff : hold;
+		}
+	}
+	splx(spl);
+}
+
+/*
+ * Add up the records for LR's key from every cpu into SUM.
+ */
+static
+void
+lockstat_sum(const struct lockstat_rec *lr, struct lockstat_rec *sum)
+{
+	struct lockstat_table *lt;
+	struct lockstat_rec *other;
+	unsigned i;
+
+	*sum = *lr;
+	sum->lr_nacquire = sum->lr_ncontended = sum->lr_nhold = 0;
+	sum->lr_waittotal = sum->lr_holdtotal = 0;
+	sum->lr_waitmax = sum->lr_holdmax = 0;
+
+	for (i=0; i<MAXCPUS; i++) {
+		lt = lockstat_tables[i];
+		if (lt == NULL || lt->lt_gen != lockstat_gen) {
+			continue;
+		}
+		other = lockstat_findrec(lt, lr);
+		if (other == NULL) {
+			continue;
+		}
+		sum->lr_nacquire += other->lr_nacquire;
+		sum->lr_ncontended += other->lr_ncontended;
+		sum->lr_nhold += other->lr_nhold;
+		sum->lr_waittotal += other->lr_waittotal;
+		sum->lr_holdtotal += other->lr_holdtotal;
+		if (other->lr_waitmax > sum->lr_waitmax) {
+			sum->lr_waitmax = other->lr_waitmax;
+		}
+		if (other->lr_holdmax > sum->lr_holdmax) {
+			sum->lr_holdmax = other->lr_holdmax;
+		}
+	}
+}
+
+/*
+ * True if LR's key has a record in a table before number CPU, in
+ * which case it has already been counted.
+ */
+static
+bool
+lockstat_seen(const struct lockstat_rec *lr, unsigned cpu)
+{
+	struct lockstat_table *lt;
+	unsigned i;
+
+	for (i=0; i<cpu; i++) {
+		lt = lockstat_tables[i];
+		if (lt != NULL && lt->lt_gen == lockstat_gen &&
+		    lockstat_findrec(lt, lr) != NULL) {
+			return true;
+		}
+	}
+	return false;
+}
+
+static
+const char *
+lockstat_kindname(unsigned kind)
+{
+	switch (kind) {
+	    case LOCKSTAT_SPIN: return "spin";
+	    case LOCKSTAT_LOCK: return "lock";
+	    case LOCKSTAT_SEM: return "sem";
+	    case LOCKSTAT_CV: return "cv";
+	}
+	return "?";
+}
+
+void
+lockstat_printtop(unsigned n)
+{
+	struct lockstat_rec *top, sum, tmp;
+	struct lockstat_table *lt;
+	unsigned i, j, k, ntop, nlocks, ndropped;
+	const char *name;
+	char namebuf[LOCKSTAT_NAMELEN];
+
+	if (!lockstat_on) {
+		kprintf("lockstat: not started yet\n");
+		return;
+	}
+	if (n > LOCKSTAT_MAXTOP) {
+		n = LOCKSTAT_MAXTOP;
+	}
+	top = kmalloc(n * sizeof(*top));
+	if (top == NULL) {
+		kprintf("lockstat: Out of memory\n");
+		return;
+	}
+
+	/* Keep the N with the most contended acquires, most first. */
+	ntop = nlocks = ndropped = 0;
+	for (i=0; i<MAXCPUS; i++) {
+		lt = lockstat_tables[i];
+		if (lt == NULL || lt->lt_gen != lockstat_gen) {
+			continue;
+		}
+		ndropped += lt->lt_dropped;
+		for (j=0; j<LOCKSTAT_NSLOTS; j++) {
+			if (!lt->lt_recs[j].lr_used ||
+			    lockstat_seen(&lt->lt_recs[j], i)) {
+				continue;
+			}
+			nlocks++;
+			lockstat_sum(&lt->lt_recs[j], &sum);
+			if (ntop == n && (n == 0 || sum.lr_ncontended <=
+					  top[n-1].lr_ncontended)) {
+				continue;
+			}
+			if (ntop < n) {
+				ntop++;
+			}
+			/* insert, pushing the last one off the end */
+			for (k=ntop-1; k>0 && top[k-1].lr_ncontended <
+				     sum.lr_ncontended; k--) {
+				top[k] = top[k-1];
+			}
+			top[k] = sum;
+		}
+	}
+
+	/* Start over; each cpu clears its own table when it next looks. */
+	lockstat_gen++;
+
+	kprintf("lockstat: %u lock names seen, %u records dropped\n",
+		nlocks, ndropped);
+	kprintf("%-16s %-4s %9s %9s %15s %15s\n", "lock", "kind",
+		"acquires", "contended", "wait avg/max us", "hold avg/max us");
+	for (i=0; i<ntop; i++) {
+		tmp = top[i];
+		name = tmp.lr_name;
+		if (name[0] == 0) {
+			snprintf(namebuf, sizeof(namebuf), "%p",
+				 tmp.lr_caller);
+			name = namebuf;
+		}
+		kprintf("%-16s %-4s %9u %9u %7llu/%-7u %7llu/%-7u\n",
+			name, lockstat_kindname(tmp.lr_kind),
+			tmp.lr_nacquire, tmp.lr_ncontended,
+			tmp.lr_ncontended ?
+			tmp.lr_waittotal / tmp.lr_ncontended / 1000 : 0,
+			tmp.lr_waitmax / 1000,
+			tmp.lr_nhold ?
+			tmp.lr_holdtotal / tmp.lr_nhold / 1000 : 0,
+			tmp.lr_holdmax / 1000);
+	}
+	kfree(top);
+}
@@ -42,6 +42,7 @@
 #include <current.h>
 #include <synch.h>
 #include <pid.h>
+#include <kmem_cache.h>
 
 /*
  * Structure for holding PID and return data for a thread.
@@ -66,16 +67,35 @@ struct pidinfo {
  * (pid % PROCS_MAX), and only allows one process per slot. If a
  * new pid allocation would cause a hash collision, we just don't
  * use that pid.
+ *
+ * The table itself (and nextpid and nprocs) is read much more often
+ * than it changes, so it has a read-mostly spinlock of its own:
+ * lookups take only that, for reading, so lookups on different cpus
+ * don't get in each other's way, and fork doesn't have to wait for
+ * pidlock. Nothing may sleep holding it. pidlock protects the exit
+ * data in the pidinfos, and taking an entry out also requires it, so
+ * a pidinfo looked up while holding pidlock stays put after the table
+ * lock is dropped. Only a process and its parent ever take its entry
+ * out, so a process can also rely on its own entry, and on those of
+ * its children that haven't been waited for.
+ * Lock order: pidlock, then pidtable_lock.
  */
 static struct lock *pidlock;		// lock for global exit data
+static struct rwspinlock pidtable_lock = RWSPINLOCK_INITIALIZER;
 static struct pidinfo *pidinfo[PROCS_MAX]; // actual pid info
 static pid_t nextpid;			// next candidate pid
 static int nprocs;			// number of allocated pids
 
 
 
+/* Object cache for pidinfo structures. */
+static struct kmem_cache pidinfo_cache =
+	KMEM_CACHE_INITIALIZER("pidinfo", sizeof(struct pidinfo), 0, NULL);
+
 /*
- * Create a pidinfo structure for the specified pid.
+ * Create a pidinfo structure for the specified pid. The pid may be
+ * INVALID_PID for now, for when it isn't known until the structure
+ * goes into the table (see pid_alloc).
  */
 static
 struct pidinfo *
@@ -83,16 +103,14 @@ pidinfo_create(pid_t pid, pid_t ppid)
 {
 	struct pidinfo *pi;
 
-	KASSERT(pid != INVALID_PID);
-
-	pi = kmalloc(sizeof(struct pidinfo));
+	pi = kmem_cache_alloc(&pidinfo_cache);
 	if (pi==NULL) {
 		return NULL;
 	}
 
 	pi->pi_cv = cv_create("pidinfo cv");
 	if (pi->pi_cv == NULL) {
-		kfree(pi);
+		kmem_cache_free(&pidinfo_cache, pi);
 		return NULL;
 	}
 
@@ -114,7 +132,7 @@ pidinfo_destroy(struct pidinfo *pi)
 	KASSERT(pi->pi_exited == true);
 	KASSERT(pi->pi_ppid == INVALID_PID);
 	cv_destroy(pi->pi_cv);
-	kfree(pi);
+	kmem_cache_free(&pidinfo_cache, pi);
 }
 
 ////////////////////////////////////////////////////////////
@@ -137,6 +155,7 @@ pid_bootstrap(void)
 		pidinfo[i] = NULL;
 	}
 
+	/* no other threads yet; no need for pidtable_lock */
 	pidinfo[BOOTUP_PID] = pidinfo_create(BOOTUP_PID, INVALID_PID);
 	if (pidinfo[BOOTUP_PID]==NULL) {
 		panic("Out of memory creating bootup pid data\n");
@@ -147,7 +166,10 @@ pid_bootstrap(void)
 }
 
 /*
- * pi_get: look up a pidinfo in the process table.
+ * pi_get: look up a pidinfo in the process table. The caller must
+ * make sure the result can't be dropped out from under it, as
+ * described above: by holding pidlock, or because the pid is its own
+ * or its child's.
  */
 static
 struct pidinfo *
@@ -157,28 +179,25 @@ pi_get(pid_t pid)
 
 	KASSERT(pid>=0);
 	KASSERT(pid != INVALID_PID);
-	KASSERT(lock_do_i_hold(pidlock));
 
+	rwspinlock_acquire_read(&pidtable_lock);
 	pi = pidinfo[pid % PROCS_MAX];
-	if (pi==NULL) {
-		return NULL;
-	}
-	if (pi->pi_pid != pid) {
-		return NULL;
+	if (pi != NULL && pi->pi_pid != pid) {
+		pi = NULL;
 	}
+	rwspinlock_release_read(&pidtable_lock);
+
 	return pi;
 }
 
 /*
  * pi_put: insert a new pidinfo in the process table. The right slot
- * must be empty.
+ * must be empty. Call with pidtable_lock held for writing.
  */
 static
 void
 pi_put(pid_t pid, struct pidinfo *pi)
 {
-	KASSERT(lock_do_i_hold(pidlock));
-
 	KASSERT(pid != INVALID_PID);
 
 	KASSERT(pidinfo[pid % PROCS_MAX] == NULL);
@@ -199,26 +218,27 @@ pi_drop(pid_t pid)
 
 	KASSERT(lock_do_i_hold(pidlock));
 
+	rwspinlock_acquire_write(&pidtable_lock);
 	pi = pidinfo[pid % PROCS_MAX];
 	KASSERT(pi != NULL);
 	KASSERT(pi->pi_pid == pid);
-
-	pidinfo_destroy(pi);
 	pidinfo[pid % PROCS_MAX] = NULL;
 	nprocs--;
+	rwspinlock_release_write(&pidtable_lock);
+
+	pidinfo_destroy(pi);
 }
 
 ////////////////////////////////////////////////////////////
 
 /*
- * Helper function for pid_alloc.
+ * Helper function for pid_alloc. Call with pidtable_lock held for
+ * writing.
  */
 static
 void
 inc_nextpid(void)
 {
-	KASSERT(lock_do_i_hold(pidlock));
-
 	nextpid++;
 	if (nextpid > PID_MAX) {
 		nextpid = PID_MIN;
@@ -237,11 +257,20 @@ pid_alloc(pid_t *retval)
 
 	KASSERT(curthread->t_pid != INVALID_PID);
 
+	/* Allocate first; we can't sleep holding the table lock. */
+	pi = pidinfo_create(INVALID_PID, curthread->t_pid);
+	if (pi==NULL) {
+		return ENOMEM;
+	}
+
 	/* lock the table */
-	lock_acquire(pidlock);
+	rwspinlock_acquire_write(&pidtable_lock);
 
 	if (nprocs == PROCS_MAX) {
-		lock_release(pidlock);
+		rwspinlock_release_write(&pidtable_lock);
+		pi->pi_exited = true;
+		pi->pi_ppid = INVALID_PID;
+		pidinfo_destroy(pi);
 		return EAGAIN;
 	}
 
@@ -261,18 +290,13 @@ pid_alloc(pid_t *retval)
 	}
 
 	pid = nextpid;
-
-	pi = pidinfo_create(pid, curthread->t_pid);
-	if (pi==NULL) {
-		lock_release(pidlock);
-		return ENOMEM;
-	}
+	pi->pi_pid = pid;
 
 	pi_put(pid, pi);
 
 	inc_nextpid();
 
-	lock_release(pidlock);
+	rwspinlock_release_write(&pidtable_lock);
 
 	*retval = pid;
 	return 0;
@@ -289,10 +313,11 @@ pid_unalloc(pid_t theirpid)
 
 	KASSERT(theirpid >= PID_MIN && theirpid <= PID_MAX);
 
-	lock_acquire(pidlock);
-
+	/* our child, so nobody else can take it out */
 	them = pi_get(theirpid);
 	KASSERT(them != NULL);
+
+	lock_acquire(pidlock);
 	KASSERT(them->pi_exited == false);
 	KASSERT(them->pi_ppid == curthread->t_pid);
 
@@ -338,10 +363,10 @@ pid_exit(int status, bool dodetach)
 	(void)dodetach; /* for compiler - delete when dodetach has real use */
 
 	// Implement me. Existing code simply sets the exit status.
-	lock_acquire(pidlock);
-
 	my_pi = pi_get(curthread->t_pid);
 	KASSERT(my_pi != NULL);
+
+	lock_acquire(pidlock);
 	my_pi->pi_exitstatus = status;
 
 	lock_release(pidlock);
@@ -36,6 +36,7 @@
 #include <spl.h>
 #include <spinlock.h>
 #include <current.h>	/* for curcpu */
+#include <lockstat.h>
 
 /*
  * Spinlocks.
@@ -48,8 +49,17 @@
 void
 spinlock_init(struct spinlock *splk)
 {
-	spinlock_data_set(&splk->splk_lock, 0);
+	spinlock_data_set(&splk->splk_next, 0);
+	spinlock_data_set(&splk->splk_serving, 0);
 	splk->splk_holder = NULL;
+#if OPT_SPINSTATS
+	splk->splk_ncontended = 0;
+	splk->splk_maxspin = 0;
+#endif
+#if OPT_LOCKSTAT
+	splk->splk_acqtime = 0;
+	splk->splk_acqsite = NULL;
+#endif
 }
 
 /*
@@ -59,7 +69,8 @@ void
 spinlock_cleanup(struct spinlock *splk)
 {
 	KASSERT(splk->splk_holder == NULL);
-	KASSERT(spinlock_data_get(&splk->splk_lock) == 0);
+	KASSERT(spinlock_data_get(&splk->splk_next) ==
+		spinlock_data_get(&splk->splk_serving));
 }
 
 /*
@@ -67,12 +78,19 @@ spinlock_cleanup(struct spinlock *splk)
  *
  * First disable interrupts (otherwise, if we get a timer interrupt we
  * might come back to this lock and deadlock), then use a machine-level
- * atomic operation to wait for the lock to be free.
+ * atomic operation to take a ticket, and wait for our turn.
  */
 void
 spinlock_acquire(struct spinlock *splk)
 {
 	struct cpu *mycpu;
+	spinlock_data_t ticket;
+#if OPT_SPINSTATS
+	unsigned spins = 0;
+#endif
+#if OPT_LOCKSTAT
+	uint64_t waitstart = 0;
+#endif
 
 	splraise(IPL_NONE, IPL_HIGH);
 
@@ -87,27 +105,38 @@ spinlock_acquire(struct spinlock *splk)
 		mycpu = NULL;
 	}
 
-	while (1) {
-		/*
-		 * Do test-test-and-set, that is, read first before
-		 * doing test-and-set, to reduce bus contention.
-		 *
-		 * Test-and-set is a machine-level atomic operation
-		 * that writes 1 into the lock word and returns the
-		 * previous value. If that value was 0, the lock was
-		 * previously unheld and we now own it. If it was 1,
-		 * we don't.
-		 */
-		if (spinlock_data_get(&splk->splk_lock) != 0) {
-			continue;
-		}
-		if (spinlock_data_testandset(&splk->splk_lock) != 0) {
-			continue;
-		}
-		break;
+	/*
+	 * Fetch-and-increment is a machine-level atomic operation, so
+	 * every CPU gets a different ticket. The holder moves
+	 * splk_serving on by one when it lets go; nobody else writes
+	 * it, so waiting is just reading.
+	 */
+	ticket = spinlock_data_fetchinc(&splk->splk_next);
+#if OPT_LOCKSTAT
+	if (spinlock_data_get(&splk->splk_serving) != ticket) {
+		waitstart = lockstat_now();
+	}
+#endif
+	while (spinlock_data_get(&splk->splk_serving) != ticket) {
+#if OPT_SPINSTATS
+		spins++;
+#endif
 	}
 
 	splk->splk_holder = mycpu;
+#if OPT_SPINSTATS
+	if (spins > 0) {
+		splk->splk_ncontended++;
+		if (spins > splk->splk_maxspin) {
+			splk->splk_maxspin = spins;
+		}
+	}
+#endif
+#if OPT_LOCKSTAT
+	splk->splk_acqsite = __builtin_return_address(0);
+	splk->splk_acqtime = lockstat_acquired(LOCKSTAT_SPIN, NULL,
+					       splk->splk_acqsite, waitstart);
+#endif
 }
 
 /*
@@ -121,8 +150,14 @@ spinlock_release(struct spinlock *splk)
 		KASSERT(splk->splk_holder == curcpu->c_self);
 	}
 
+#if OPT_LOCKSTAT
+	/* still holding it, so nobody else can change splk_acq* */
+	lockstat_released(LOCKSTAT_SPIN, NULL, splk->splk_acqsite,
+			  splk->splk_acqtime);
+#endif
 	splk->splk_holder = NULL;
-	spinlock_data_set(&splk->splk_lock, 0);
+	spinlock_data_set(&splk->splk_serving,
+			  spinlock_data_get(&splk->splk_serving) + 1);
 	spllower(IPL_HIGH, IPL_NONE);
 }
 
@@ -139,3 +174,118 @@ spinlock_do_i_hold(struct spinlock *splk)
 	/* Assume we can read splk_holder atomically enough for this to work */
 	return (splk->splk_holder == curcpu->c_self);
 }
+
+#if OPT_SPINSTATS
+/*
+ * Read the wait counters. They're updated by the holder, so take the
+ * lock to get a consistent pair.
+ */
+void
+spinlock_getstats(struct spinlock *splk,
+		  unsigned *ncontended, unsigned *maxspin)
+{
+	spinlock_acquire(splk);
+	*ncontended = splk->splk_ncontended;
+	*maxspin = splk->splk_maxspin;
+	spinlock_release(splk);
+}
+
+void
+spinlock_resetstats(struct spinlock *splk)
+{
+	spinlock_acquire(splk);
+	splk->splk_ncontended = 0;
+	splk->splk_maxspin = 0;
+	spinlock_release(splk);
+}
+#endif
+
+////////////////////////////////////////////////////////////
+
+/*
+ * Read-mostly spinlocks.
+ *
+ * Interrupts are kept off for as long as the lock is held, not just
+ * while rwsplk_lock is, so an interrupt handler can't come along and
+ * spin on a lock its own CPU is holding.
+ */
+
+void
+rwspinlock_init(struct rwspinlock *lk)
+{
+	spinlock_init(&lk->rwsplk_lock);
+	lk->rwsplk_readers = 0;
+	lk->rwsplk_wwaiting = 0;
+	lk->rwsplk_writing = false;
+}
+
+void
+rwspinlock_cleanup(struct rwspinlock *lk)
+{
+	KASSERT(lk->rwsplk_readers == 0);
+	KASSERT(lk->rwsplk_wwaiting == 0);
+	KASSERT(lk->rwsplk_writing == false);
+	spinlock_cleanup(&lk->rwsplk_lock);
+}
+
+void
+rwspinlock_acquire_read(struct rwspinlock *lk)
+{
+	splraise(IPL_NONE, IPL_HIGH);
+
+	while (1) {
+		spinlock_acquire(&lk->rwsplk_lock);
+		if (!lk->rwsplk_writing && lk->rwsplk_wwaiting == 0) {
+			break;
+		}
+		spinlock_release(&lk->rwsplk_lock);
+
+		/* As in spinlock_acquire, look before trying again. */
+		while (lk->rwsplk_writing || lk->rwsplk_wwaiting > 0) {
+			/* spin */
+		}
+	}
+	lk->rwsplk_readers++;
+	spinlock_release(&lk->rwsplk_lock);
+}
+
+void
+rwspinlock_release_read(struct rwspinlock *lk)
+{
+	spinlock_acquire(&lk->rwsplk_lock);
+	KASSERT(lk->rwsplk_readers > 0);
+	lk->rwsplk_readers--;
+	spinlock_release(&lk->rwsplk_lock);
+
+	spllower(IPL_HIGH, IPL_NONE);
+}
+
+void
+rwspinlock_acquire_write(struct rwspinlock *lk)
+{
+	splraise(IPL_NONE, IPL_HIGH);
+
+	spinlock_acquire(&lk->rwsplk_lock);
+	lk->rwsplk_wwaiting++;
+	while (lk->rwsplk_writing || lk->rwsplk_readers > 0) {
+		spinlock_release(&lk->rwsplk_lock);
+		while (lk->rwsplk_writing || lk->rwsplk_readers > 0) {
+			/* spin */
+		}
+		spinlock_acquire(&lk->rwsplk_lock);
+	}
+	lk->rwsplk_wwaiting--;
+	lk->rwsplk_writing = true;
+	spinlock_release(&lk->rwsplk_lock);
+}
+
+void
+rwspinlock_release_write(struct rwspinlock *lk)
+{
+	spinlock_acquire(&lk->rwsplk_lock);
+	KASSERT(lk->rwsplk_writing);
+	lk->rwsplk_writing = false;
+	spinlock_release(&lk->rwsplk_lock);
+
+	spllower(IPL_HIGH, IPL_NONE);
+}
@@ -37,8 +37,30 @@
 #include <spinlock.h>
 #include <wchan.h>
 #include <thread.h>
+#include <cpu.h>
 #include <current.h>
 #include <synch.h>
+#include <kmem_cache.h>
+#include <lockstat.h>
+
+/*
+ * Semaphores, locks, and CVs are created and destroyed all the time;
+ * give each its own object cache so they're packed at their real size.
+ *
+ * None of them has a wait channel or spinlock of its own. Threads
+ * wait on the object's address in the hashed sleep queues (see
+ * <wchan.h>), and the queue's lock also protects the object's fields.
+ * Semaphores and CVs use SLEEPQ_WAIT; locks use SLEEPQ_LOCK, so that
+ * cv_wait can release the lock while holding the CV's queue.
+ */
+static struct kmem_cache sem_cache =
+	KMEM_CACHE_INITIALIZER("semaphore", sizeof(struct semaphore), 0, NULL);
+static struct kmem_cache lock_cache =
+	KMEM_CACHE_INITIALIZER("lock", sizeof(struct lock), 0, NULL);
+static struct kmem_cache cv_cache =
+	KMEM_CACHE_INITIALIZER("cv", sizeof(struct cv), 0, NULL);
+static struct kmem_cache rwlock_cache =
+	KMEM_CACHE_INITIALIZER("rwlock", sizeof(struct rwlock), 0, NULL);
 
 ////////////////////////////////////////////////////////////
 //
@@ -51,25 +73,12 @@ sem_create(const char *name, int initial_count)
 
         KASSERT(initial_count >= 0);
 
-        sem = kmalloc(sizeof(struct semaphore));
+        sem = kmem_cache_alloc(&sem_cache);
         if (sem == NULL) {
                 return NULL;
         }
 
-        sem->sem_name = kstrdup(name);
-        if (sem->sem_name == NULL) {
-                kfree(sem);
-                return NULL;
-        }
-
-	sem->sem_wchan = wchan_create(sem->sem_name);
-	if (sem->sem_wchan == NULL) {
-		kfree(sem->sem_name);
-		kfree(sem);
-		return NULL;
-	}
-
-	spinlock_init(&sem->sem_lock);
+        sem->sem_name = name;
         sem->sem_count = initial_count;
 
         return sem;
@@ -80,16 +89,17 @@ sem_destroy(struct semaphore *sem)
 {
         KASSERT(sem != NULL);
 
-	/* wchan_cleanup will assert if anyone's waiting on it */
-	spinlock_cleanup(&sem->sem_lock);
-	wchan_destroy(sem->sem_wchan);
-        kfree(sem->sem_name);
-        kfree(sem);
+	KASSERT(sleepq_isempty(SLEEPQ_WAIT, sem));
+        kmem_cache_free(&sem_cache, sem);
 }
 
 void 
 P(struct semaphore *sem)
 {
+#if OPT_LOCKSTAT
+	uint64_t waitstart = 0;
+#endif
+
         KASSERT(sem != NULL);
 
         /*
@@ -100,13 +110,12 @@ P(struct semaphore *sem)
          */
         KASSERT(curthread->t_in_interrupt == false);
 
-	spinlock_acquire(&sem->sem_lock);
+	sleepq_lock(SLEEPQ_WAIT, sem);
         while (sem->sem_count == 0) {
 		/*
-		 * Bridge to the wchan lock, so if someone else comes
-		 * along in V right this instant the wakeup can't go
-		 * through on the wchan until we've finished going to
-		 * sleep. Note that wchan_sleep unlocks the wchan.
+		 * The sleep queue lock protects the count, so nobody
+		 * can come along in V and miss us until we've finished
+		 * going to sleep. Note that sleepq_sleep unlocks it.
 		 *
 		 * Note that we don't maintain strict FIFO ordering of
 		 * threads going through the semaphore; that is, we
@@ -118,15 +127,22 @@ P(struct semaphore *sem)
 		 * Exercise: how would you implement strict FIFO
 		 * ordering?
 		 */
-		wchan_lock(sem->sem_wchan);
-		spinlock_release(&sem->sem_lock);
-                wchan_sleep(sem->sem_wchan);
-
-		spinlock_acquire(&sem->sem_lock);
+#if OPT_LOCKSTAT
+		if (waitstart == 0) {
+			waitstart = lockstat_now();
+		}
+#endif
+		sleepq_sleep(SLEEPQ_WAIT, sem, sem->sem_name);
+
+		sleepq_lock(SLEEPQ_WAIT, sem);
         }
         KASSERT(sem->sem_count > 0);
         sem->sem_count--;
-	spinlock_release(&sem->sem_lock);
+	sleepq_unlock(SLEEPQ_WAIT, sem);
+#if OPT_LOCKSTAT
+	/* no release to match, so no hold time */
+	lockstat_acquired(LOCKSTAT_SEM, sem->sem_name, sem, waitstart);
+#endif
 }
 
 void
@@ -134,13 +150,13 @@ V(struct semaphore *sem)
 {
         KASSERT(sem != NULL);
 
-	spinlock_acquire(&sem->sem_lock);
+	sleepq_lock(SLEEPQ_WAIT, sem);
 
         sem->sem_count++;
         KASSERT(sem->sem_count > 0);
-	wchan_wakeone(sem->sem_wchan);
+	sleepq_wakeone(SLEEPQ_WAIT, sem);
 
-	spinlock_release(&sem->sem_lock);
+	sleepq_unlock(SLEEPQ_WAIT, sem);
 }
 
 ////////////////////////////////////////////////////////////
@@ -152,25 +168,19 @@ lock_create(const char *name)
 {
         struct lock *lock;
 
-        lock = kmalloc(sizeof(struct lock));
+        lock = kmem_cache_alloc(&lock_cache);
         if (lock == NULL) {
                 return NULL;
         }
 
-        lock->lk_name = kstrdup(name);
-        if (lock->lk_name == NULL) {
-                kfree(lock);
-                return NULL;
-        }
-
-	lock->lk_wchan = wchan_create(lock->lk_name);
-	if (lock->lk_wchan == NULL) {
-		kfree(lock->lk_name);
-		kfree(lock);
-		return NULL;
-	}
-	spinlock_init(&lock->lk_lock);
+        lock->lk_name = name;
 	lock->lk_holder = NULL;
+	lock->lk_nacquire = 0;
+	lock->lk_nspin = 0;
+	lock->lk_nsleep = 0;
+#if OPT_LOCKSTAT
+	lock->lk_acqtime = 0;
+#endif
         
         return lock;
 }
@@ -181,31 +191,81 @@ lock_destroy(struct lock *lock)
         KASSERT(lock != NULL);
 
 	KASSERT(lock->lk_holder == NULL);
-	spinlock_cleanup(&lock->lk_lock);
-	wchan_destroy(lock->lk_wchan);
-        
-        kfree(lock->lk_name);
-        kfree(lock);
+	KASSERT(sleepq_isempty(SLEEPQ_LOCK, lock));
+
+        kmem_cache_free(&lock_cache, lock);
+}
+
+/*
+ * True if T is running on some other cpu right now. T is a lock
+ * holder looked at without its lock, so it might even have exited by
+ * the time we look; that only costs a wrong guess, since the caller
+ * goes back and checks lk_holder again.
+ */
+static
+bool
+lock_holder_running(const volatile struct thread *t)
+{
+	return t->t_state == S_RUN && t->t_cpu != curcpu->c_self;
 }
 
 void
 lock_acquire(struct lock *lock)
 {
+	struct thread *holder;
+	bool spun = false, slept = false;
+#if OPT_LOCKSTAT
+	uint64_t waitstart = 0;
+#endif
+
 	DEBUGASSERT(lock != NULL);
         KASSERT(curthread->t_in_interrupt == false);
 
-	spinlock_acquire(&lock->lk_lock);
-	while (lock->lk_holder != NULL) {
+	sleepq_lock(SLEEPQ_LOCK, lock);
+	while ((holder = lock->lk_holder) != NULL) {
+#if OPT_LOCKSTAT
+		if (waitstart == 0) {
+			waitstart = lockstat_now();
+		}
+#endif
+		if (lock_holder_running(holder)) {
+			/*
+			 * The holder is busy on another cpu and will
+			 * probably let go shortly. Waiting here is much
+			 * cheaper than two context switches. Stop as soon
+			 * as it lets go, or if it blocks or is preempted.
+			 */
+			sleepq_unlock(SLEEPQ_LOCK, lock);
+			while (lock->lk_holder == holder &&
+			       lock_holder_running(holder)) {
+				/* spin */
+			}
+			spun = true;
+			sleepq_lock(SLEEPQ_LOCK, lock);
+			continue;
+		}
+
 		/* As in the semaphore. */
-		wchan_lock(lock->lk_wchan);
-		spinlock_release(&lock->lk_lock);
-                wchan_sleep(lock->lk_wchan);
+		sleepq_sleep(SLEEPQ_LOCK, lock, lock->lk_name);
+		slept = true;
 
-		spinlock_acquire(&lock->lk_lock);
+		sleepq_lock(SLEEPQ_LOCK, lock);
 	}
 
 	lock->lk_holder = curthread;
-	spinlock_release(&lock->lk_lock);
+	lock->lk_nacquire++;
+	if (slept) {
+		lock->lk_nsleep++;
+	}
+	else if (spun) {
+		lock->lk_nspin++;
+	}
+	sleepq_unlock(SLEEPQ_LOCK, lock);
+#if OPT_LOCKSTAT
+	/* ours now, so nobody else touches lk_acqtime */
+	lock->lk_acqtime = lockstat_acquired(LOCKSTAT_LOCK, lock->lk_name,
+					     lock, waitstart);
+#endif
 }
 
 void
@@ -213,25 +273,42 @@ lock_release(struct lock *lock)
 {
 	DEBUGASSERT(lock != NULL);
 
-	spinlock_acquire(&lock->lk_lock);
+#if OPT_LOCKSTAT
+	lockstat_released(LOCKSTAT_LOCK, lock->lk_name, lock,
+			  lock->lk_acqtime);
+#endif
+	sleepq_lock(SLEEPQ_LOCK, lock);
 	KASSERT(lock->lk_holder == curthread);
 	lock->lk_holder = NULL;
-	wchan_wakeone(lock->lk_wchan);
-	spinlock_release(&lock->lk_lock);
+	sleepq_wakeone(SLEEPQ_LOCK, lock);
+	sleepq_unlock(SLEEPQ_LOCK, lock);
 }
 
 bool
 lock_do_i_hold(struct lock *lock)
 {
-	bool ret;
-
 	DEBUGASSERT(lock != NULL);
 
-	spinlock_acquire(&lock->lk_lock);
-	ret = (lock->lk_holder == curthread);
-	spinlock_release(&lock->lk_lock);
+	/*
+	 * No need to lock: only we can make lk_holder be curthread,
+	 * or stop it being curthread.
+	 */
+        return lock->lk_holder == curthread;
+}
 
-        return ret;
+void
+lock_printstats(struct lock *lock)
+{
+	unsigned nacquire, nspin, nsleep;
+
+	sleepq_lock(SLEEPQ_LOCK, lock);
+	nacquire = lock->lk_nacquire;
+	nspin = lock->lk_nspin;
+	nsleep = lock->lk_nsleep;
+	sleepq_unlock(SLEEPQ_LOCK, lock);
+
+	kprintf("%s: %u acquires, %u spun, %u slept\n",
+		lock->lk_name, nacquire, nspin, nsleep);
 }
 
 ////////////////////////////////////////////////////////////
@@ -244,23 +321,12 @@ cv_create(const char *name)
 {
         struct cv *cv;
 
-        cv = kmalloc(sizeof(struct cv));
+        cv = kmem_cache_alloc(&cv_cache);
         if (cv == NULL) {
                 return NULL;
         }
 
-        cv->cv_name = kstrdup(name);
-        if (cv->cv_name==NULL) {
-                kfree(cv);
-                return NULL;
-        }
-        
-	cv->cv_wchan = wchan_create(cv->cv_name);
-	if (cv->cv_wchan == NULL) {
-		kfree(cv->cv_name);
-		kfree(cv);
-		return NULL;
-	}
+        cv->cv_name = name;
         
         return cv;
 }
@@ -270,18 +336,26 @@ cv_destroy(struct cv *cv)
 {
         KASSERT(cv != NULL);
 
-	wchan_destroy(cv->cv_wchan);
-        
-        kfree(cv->cv_name);
-        kfree(cv);
+	KASSERT(sleepq_isempty(SLEEPQ_WAIT, cv));
+
+        kmem_cache_free(&cv_cache, cv);
 }
 
 void
 cv_wait(struct cv *cv, struct lock *lock)
 {
-	wchan_lock(cv->cv_wchan);
+#if OPT_LOCKSTAT
+	uint64_t waitstart = lockstat_now();
+#endif
+
+	/* Releasing the lock takes a SLEEPQ_LOCK queue; that's allowed. */
+	sleepq_lock(SLEEPQ_WAIT, cv);
 	lock_release(lock);
-	wchan_sleep(cv->cv_wchan);
+	sleepq_sleep(SLEEPQ_WAIT, cv, cv->cv_name);
+#if OPT_LOCKSTAT
+	/* every wait is a contended one; there's no hold time */
+	lockstat_acquired(LOCKSTAT_CV, cv->cv_name, cv, waitstart);
+#endif
 	lock_acquire(lock);
 }
 
@@ -289,12 +363,165 @@ void
 cv_signal(struct cv *cv, struct lock *lock)
 {
 	(void)lock;
-	wchan_wakeone(cv->cv_wchan);
+	sleepq_lock(SLEEPQ_WAIT, cv);
+	sleepq_wakeone(SLEEPQ_WAIT, cv);
+	sleepq_unlock(SLEEPQ_WAIT, cv);
 }
 
 void
 cv_broadcast(struct cv *cv, struct lock *lock)
 {
 	(void)lock;
-	wchan_wakeall(cv->cv_wchan);
+	sleepq_lock(SLEEPQ_WAIT, cv);
+	sleepq_wakeall(SLEEPQ_WAIT, cv);
+	sleepq_unlock(SLEEPQ_WAIT, cv);
+}
+
+////////////////////////////////////////////////////////////
+//
+// Reader-writer lock
+
+/*
+ * Readers and writers wait on different keys, so each kind can be
+ * woken without the other. rw_lock protects the state; the sleep
+ * queue lock is only taken to go to sleep or wake someone, always
+ * while holding rw_lock.
+ */
+#define RWLOCK_RKEY(rw)	((const void *)&(rw)->rw_readers)
+#define RWLOCK_WKEY(rw)	((const void *)&(rw)->rw_wwaiting)
+
+static
+void
+rwlock_wake(const void *key, bool all)
+{
+	sleepq_lock(SLEEPQ_WAIT, key);
+	if (all) {
+		sleepq_wakeall(SLEEPQ_WAIT, key);
+	}
+	else {
+		sleepq_wakeone(SLEEPQ_WAIT, key);
+	}
+	sleepq_unlock(SLEEPQ_WAIT, key);
+}
+
+struct rwlock *
+rwlock_create(const char *name)
+{
+	struct rwlock *rw;
+
+	rw = kmem_cache_alloc(&rwlock_cache);
+	if (rw == NULL) {
+		return NULL;
+	}
+
+	rw->rw_name = name;
+	spinlock_init(&rw->rw_lock);
+	rw->rw_readers = 0;
+	rw->rw_wwaiting = 0;
+	rw->rw_writer = NULL;
+
+	return rw;
+}
+
+void
+rwlock_destroy(struct rwlock *rw)
+{
+	KASSERT(rw != NULL);
+
+	KASSERT(rw->rw_readers == 0);
+	KASSERT(rw->rw_wwaiting == 0);
+	KASSERT(rw->rw_writer == NULL);
+	spinlock_cleanup(&rw->rw_lock);
+
+	kmem_cache_free(&rwlock_cache, rw);
+}
+
+void
+rwlock_acquire_read(struct rwlock *rw)
+{
+	DEBUGASSERT(rw != NULL);
+	KASSERT(curthread->t_in_interrupt == false);
+
+	spinlock_acquire(&rw->rw_lock);
+	KASSERT(rw->rw_writer != curthread);
+	/* Stay out of the way of waiting writers, too. */
+	while (rw->rw_writer != NULL || rw->rw_wwaiting > 0) {
+		sleepq_lock(SLEEPQ_WAIT, RWLOCK_RKEY(rw));
+		spinlock_release(&rw->rw_lock);
+		sleepq_sleep(SLEEPQ_WAIT, RWLOCK_RKEY(rw), rw->rw_name);
+
+		spinlock_acquire(&rw->rw_lock);
+	}
+	rw->rw_readers++;
+	spinlock_release(&rw->rw_lock);
+}
+
+void
+rwlock_release_read(struct rwlock *rw)
+{
+	DEBUGASSERT(rw != NULL);
+
+	spinlock_acquire(&rw->rw_lock);
+	KASSERT(rw->rw_readers > 0);
+	rw->rw_readers--;
+	if (rw->rw_readers == 0 && rw->rw_wwaiting > 0) {
+		rwlock_wake(RWLOCK_WKEY(rw), false);
+	}
+	spinlock_release(&rw->rw_lock);
+}
+
+void
+rwlock_acquire_write(struct rwlock *rw)
+{
+	DEBUGASSERT(rw != NULL);
+	KASSERT(curthread->t_in_interrupt == false);
+
+	spinlock_acquire(&rw->rw_lock);
+	KASSERT(rw->rw_writer != curthread);
+	rw->rw_wwaiting++;
+	while (rw->rw_writer != NULL || rw->rw_readers > 0) {
+		sleepq_lock(SLEEPQ_WAIT, RWLOCK_WKEY(rw));
+		spinlock_release(&rw->rw_lock);
+		sleepq_sleep(SLEEPQ_WAIT, RWLOCK_WKEY(rw), rw->rw_name);
+
+		spinlock_acquire(&rw->rw_lock);
+	}
+	rw->rw_wwaiting--;
+	rw->rw_writer = curthread;
+	spinlock_release(&rw->rw_lock);
+}
+
+void
+rwlock_release_write(struct rwlock *rw)
+{
+	DEBUGASSERT(rw != NULL);
+
+	spinlock_acquire(&rw->rw_lock);
+	KASSERT(rw->rw_writer == curthread);
+	rw->rw_writer = NULL;
+	/*
+	 * Hand off to the next writer if there is one; the readers
+	 * get their turn once the writers have all gone through.
+	 */
+	if (rw->rw_wwaiting > 0) {
+		rwlock_wake(RWLOCK_WKEY(rw), false);
+	}
+	else {
+		rwlock_wake(RWLOCK_RKEY(rw), true);
+	}
+	spinlock_release(&rw->rw_lock);
+}
+
+bool
+rwlock_do_i_hold(struct rwlock *rw)
+{
+	bool ret;
+
+	DEBUGASSERT(rw != NULL);
+
+	spinlock_acquire(&rw->rw_lock);
+	ret = (rw->rw_writer == curthread);
+	spinlock_release(&rw->rw_lock);
+
+	return ret;
 }
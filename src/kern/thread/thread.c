@@ -33,6 +33,8 @@
 
 #include <types.h>
 #include <kern/errno.h>
+#include <kern/time.h>
+#include <kern/resource.h>
 #include <lib.h>
 #include <array.h>
 #include <cpu.h>
@@ -44,12 +46,17 @@
 #include <threadprivate.h>
 #include <current.h>
 #include <synch.h>
+#include <kmem_cache.h>
 #include <addrspace.h>
+#include <vm.h>
 #include <mainbus.h>
 #include <vnode.h>
 #include <kern/sysexits.h>
 #include <kern/wait.h> /* New include of macros to make exit codes for ASST2 */
 #include <pid.h> /* New include of pid functions for ASST 2 */
+#include <clock.h>
+#include <timer.h>
+#include <lockstat.h>
 
 /* BEGIN A3 SETUP */
 #include <file.h>
@@ -67,6 +74,42 @@ extern int progthread_pid;
 /* Magic number used as a guard value on kernel thread stacks. */
 #define THREAD_STACK_MAGIC 0xbaadf00d
 
+/*
+ * Scheduler tuning. A thread that runs for a whole quantum at one
+ * level is demoted to the next; lower levels get longer quanta. All
+ * threads are raised back to level 0 every SCHED_BOOST_HARDCLOCKS so
+ * nothing starves. See schedule() and thread_tick().
+ */
+static const unsigned sched_quantum[SCHED_NLEVELS] = { 1, 2, 4, 8 };
+#define SCHED_BOOST_HARDCLOCKS	HZ	/* Boost everything once a second. */
+
+/*
+ * Fair-share weights, indexed by nice value - PRIO_MIN. Each step of
+ * nice is worth about 25% more or less CPU than its neighbour; nice 0
+ * is SCHED_WEIGHT0. A thread's t_vruntime goes up by SCHED_VSCALE /
+ * weight for each tick it runs.
+ */
+static const uint32_t sched_weight[PRIO_MAX - PRIO_MIN + 1] = {
+	/* -20 */ 88761, 71755, 56483, 46273, 36291,
+	/* -15 */ 29154, 23254, 18705, 14949, 11916,
+	/* -10 */  9548,  7620,  6100,  4904,  3906,
+	/*  -5 */  3121,  2501,  1991,  1586,  1277,
+	/*   0 */  1024,   820,   655,   526,   423,
+	/*   5 */   335,   272,   215,   172,   137,
+	/*  10 */   110,    87,    70,    56,    45,
+	/*  15 */    36,    29,    23,    18,    15,
+	/*  20 */    12,
+};
+#define SCHED_WEIGHT0	1024
+#define SCHED_VSCALE	((uint64_t)SCHED_WEIGHT0 * SCHED_WEIGHT0)
+
+/*
+ * Spare threads. Dead threads keep their stacks and go on a per-cpu
+ * list for thread_fork to reuse, instead of going back to kmalloc,
+ * up to this many per cpu. Past that they're freed as usual.
+ */
+#define THREAD_CACHE_MAX	8
+
 /* Wait channel. */
 struct wchan {
 	const char *wc_name;		/* name for this channel */
@@ -82,6 +125,10 @@ static struct cpuarray allcpus;
 /* Used to wait for secondary CPUs to come online. */
 static struct semaphore *cpu_startup_sem;
 
+static struct cpu *thread_placecpu(struct thread *t);
+static bool thread_steal(void);
+static void sleepq_bootstrap(void);
+
 ////////////////////////////////////////////////////////////
 
 /*
@@ -121,6 +168,13 @@ thread_checkstack(struct thread *thread)
 	}
 }
 
+/* Object cache for thread structures. */
+static struct kmem_cache thread_cache =
+	KMEM_CACHE_INITIALIZER("thread", sizeof(struct thread), 0, NULL);
+
+static void thread_initfields(struct thread *thread);
+static void thread_free(struct thread *thread);
+
 /*
  * Create a thread. This is used both to create a first thread
  * for each CPU and to create subsequent forked threads.
@@ -133,26 +187,53 @@ thread_create(const char *name)
 
 	DEBUGASSERT(name != NULL);
 
-	thread = kmalloc(sizeof(*thread));
+	thread = kmem_cache_alloc(&thread_cache);
 	if (thread == NULL) {
 		return NULL;
 	}
 
 	thread->t_name = kstrdup(name);
 	if (thread->t_name == NULL) {
-		kfree(thread);
+		kmem_cache_free(&thread_cache, thread);
 		return NULL;
 	}
-	thread->t_wchan_name = "NEW";
-	thread->t_state = S_READY;
 
-	/* Thread subsystem fields */
+	/* Thread subsystem fields that survive in the spare thread cache */
 	thread_machdep_init(&thread->t_machdep);
 	threadlistnode_init(&thread->t_listnode, thread);
 	thread->t_stack = NULL;
+
+	thread_initfields(thread);
+
+	return thread;
+}
+
+/*
+ * Initialize the fields of a new or reused thread that start over
+ * each time.
+ */
+static
+void
+thread_initfields(struct thread *thread)
+{
+	thread->t_wchan_name = "NEW";
+	thread->t_state = S_READY;
+
+	/* Thread subsystem fields */
+	thread->t_sleepkey = NULL;
 	thread->t_context = NULL;
 	thread->t_cpu = NULL;
 
+	/* Scheduler fields; new threads start at the top level */
+	thread->t_priority = 0;
+	thread->t_ticks = 0;
+	thread->t_nice = 0;
+	thread->t_vruntime = 0;
+	thread->t_cputicks = 0;
+	thread->t_migrated = 0;
+	thread->t_lastrun = 0;
+	thread->t_bound = false;
+
 	/* Interrupt state fields */
 	thread->t_in_interrupt = false;
 	thread->t_curspl = IPL_HIGH;
@@ -163,6 +244,7 @@ thread_create(const char *name)
 
 	/* VM fields */
 	thread->t_addrspace = NULL;
+	thread->t_vforksem = NULL;
 
 	/* VFS fields */
 	thread->t_cwd = NULL;
@@ -172,6 +254,51 @@ thread_create(const char *name)
 	/* BEGIN A3 SETUP */
 	thread->t_filetable = NULL;
 	/* END A3 SETUP */
+}
+
+/*
+ * Get a thread with a stack, for thread_fork. Take one from this
+ * cpu's spare thread cache if there is one; otherwise make a new one.
+ */
+static
+struct thread *
+thread_get(const char *name)
+{
+	struct thread *thread;
+	int spl;
+
+	spl = splhigh();
+	thread = threadlist_remhead(&curcpu->c_threadcache);
+	if (thread != NULL) {
+		curcpu->c_threadcache_hits++;
+	}
+	else {
+		curcpu->c_threadcache_misses++;
+	}
+	splx(spl);
+
+	if (thread != NULL) {
+		thread->t_name = kstrdup(name);
+		if (thread->t_name == NULL) {
+			thread_free(thread);
+			return NULL;
+		}
+		thread_initfields(thread);
+	}
+	else {
+		thread = thread_create(name);
+		if (thread == NULL) {
+			return NULL;
+		}
+
+		/* Allocate a stack */
+		thread->t_stack = kmalloc(STACK_SIZE);
+		if (thread->t_stack == NULL) {
+			thread_free(thread);
+			return NULL;
+		}
+	}
+	thread_checkstack_init(thread);
 
 	return thread;
 }
@@ -189,6 +316,7 @@ cpu_create(unsigned hardware_number)
 {
 	struct cpu *c;
 	int result;
+	unsigned i;
 	char namebuf[16];
 
 	c = kmalloc(sizeof(*c));
@@ -201,7 +329,14 @@ cpu_create(unsigned hardware_number)
 
 	c->c_curthread = NULL;
 	threadlist_init(&c->c_zombies);
+	threadlist_init(&c->c_threadcache);
+	c->c_threadcache_hits = 0;
+	c->c_threadcache_misses = 0;
 	c->c_hardclocks = 0;
+	c->c_lastboost = 0;
+	c->c_tickless = 0;
+	c->c_skippedclocks = 0;
+	timerwheel_init(&c->c_timers);
 
         /* BEGIN A3 SETUP */
 #if !OPT_DUMBVM
@@ -210,7 +345,15 @@ cpu_create(unsigned hardware_number)
         /* END A3 SETUP */
 
 	c->c_isidle = false;
-	threadlist_init(&c->c_runqueue);
+	for (i=0; i<SCHED_NLEVELS; i++) {
+		threadlist_init(&c->c_runqueue[i]);
+	}
+	c->c_runcount = 0;
+	c->c_minvruntime = 0;
+	c->c_nmigrate = 0;
+	for (i=0; i<SCHED_RQHIST; i++) {
+		c->c_rqhist[i] = 0;
+	}
 	spinlock_init(&c->c_runqueue_lock);
 
 	c->c_ipi_pending = 0;
@@ -221,6 +364,9 @@ cpu_create(unsigned hardware_number)
 	if (result != 0) {
 		panic("cpu_create: array_add: %s\n", strerror(result));
 	}
+#if OPT_LOCKSTAT
+	lockstat_cpu_init(c);
+#endif
 
 	snprintf(namebuf, sizeof(namebuf), "<boot #%d>", c->c_number);
 	c->c_curthread = thread_create(namebuf);
@@ -273,6 +419,8 @@ static
 void
 thread_destroy(struct thread *thread)
 {
+	int spl;
+
 	KASSERT(thread != curthread);
 	KASSERT(thread->t_state != S_RUN);
 
@@ -286,7 +434,39 @@ thread_destroy(struct thread *thread)
 
 	/* VM fields, cleaned up in thread_exit */
 	KASSERT(thread->t_addrspace == NULL);
+	KASSERT(thread->t_vforksem == NULL);
+
+	/* sheer paranoia */
+	thread->t_wchan_name = "DESTROYED";
 
+	kfree(thread->t_name);
+	thread->t_name = NULL;
+
+	/*
+	 * Keep it for reuse if it has a stack and the cache has room.
+	 * The rest of its fields get reset by thread_get.
+	 */
+	spl = splhigh();
+	if (thread->t_stack != NULL &&
+	    curcpu->c_threadcache.tl_count < THREAD_CACHE_MAX) {
+		threadlist_addhead(&curcpu->c_threadcache, thread);
+		thread = NULL;
+	}
+	splx(spl);
+
+	if (thread != NULL) {
+		thread_free(thread);
+	}
+}
+
+/*
+ * Free a thread and its stack for good. The name, and everything
+ * thread_destroy checks, should already be gone.
+ */
+static
+void
+thread_free(struct thread *thread)
+{
 	/* Thread subsystem fields */
 	if (thread->t_stack != NULL) {
 		kfree(thread->t_stack);
@@ -294,11 +474,8 @@ thread_destroy(struct thread *thread)
 	threadlistnode_cleanup(&thread->t_listnode);
 	thread_machdep_cleanup(&thread->t_machdep);
 
-	/* sheer paranoia */
-	thread->t_wchan_name = "DESTROYED";
-
 	kfree(thread->t_name);
-	kfree(thread);
+	kmem_cache_free(&thread_cache, thread);
 }
 
 /*
@@ -320,6 +497,77 @@ exorcise(void)
 	}
 }
 
+/*
+ * Shrinker callback: under memory pressure, free this cpu's spare
+ * threads. Each one gives back its kernel stack.
+ *
+ * Like the zombie list, the cache is per-cpu and only touched with
+ * interrupts off, so take everything off it at splhigh and free it
+ * afterwards. Other cpus' spares are theirs to deal with.
+ */
+static
+unsigned
+thread_shrink_cache(void *data, unsigned npages)
+{
+	struct threadlist victims;
+	struct thread *t;
+	unsigned count;
+	int spl;
+
+	(void)data;
+	(void)npages;
+
+	threadlist_init(&victims);
+
+	spl = splhigh();
+	while ((t = threadlist_remhead(&curcpu->c_threadcache)) != NULL) {
+		threadlist_addtail(&victims, t);
+	}
+	splx(spl);
+
+	count = 0;
+	while ((t = threadlist_remhead(&victims)) != NULL) {
+		thread_free(t);
+		count++;
+	}
+	threadlist_cleanup(&victims);
+
+	return count * DIVROUNDUP(STACK_SIZE, PAGE_SIZE);
+}
+
+/*
+ * Shrinker callback: under memory pressure, reap this cpu's zombies
+ * now instead of waiting for the next context switch, and then free
+ * them along with the other spare threads.
+ */
+static
+unsigned
+thread_shrink_zombies(void *data, unsigned npages)
+{
+	struct threadlist victims;
+	struct thread *z;
+	int spl;
+
+	(void)data;
+
+	threadlist_init(&victims);
+
+	spl = splhigh();
+	while ((z = threadlist_remhead(&curcpu->c_zombies)) != NULL) {
+		threadlist_addtail(&victims, z);
+	}
+	splx(spl);
+
+	while ((z = threadlist_remhead(&victims)) != NULL) {
+		KASSERT(z != curthread);
+		KASSERT(z->t_state == S_ZOMBIE);
+		thread_destroy(z);
+	}
+	threadlist_cleanup(&victims);
+
+	return thread_shrink_cache(NULL, npages);
+}
+
 /*
  * On panic, stop the thread system (as much as is reasonably
  * possible) to make sure we don't end up letting any other threads
@@ -328,6 +576,8 @@ exorcise(void)
 void
 thread_panic(void)
 {
+	unsigned i;
+
 	/*
 	 * Kill off other CPUs.
 	 *
@@ -342,9 +592,12 @@ thread_panic(void)
 	 * to.  Instead, blat the list structure by hand, and take the
 	 * risk that it might not be quite atomic.
 	 */
-	curcpu->c_runqueue.tl_count = 0;
-	curcpu->c_runqueue.tl_head.tln_next = NULL;
-	curcpu->c_runqueue.tl_tail.tln_prev = NULL;
+	for (i=0; i<SCHED_NLEVELS; i++) {
+		curcpu->c_runqueue[i].tl_count = 0;
+		curcpu->c_runqueue[i].tl_head.tln_next = NULL;
+		curcpu->c_runqueue[i].tl_tail.tln_prev = NULL;
+	}
+	curcpu->c_runcount = 0;
 
 	/*
 	 * Ideally, we want to make sure sleeping threads don't wake
@@ -416,6 +669,14 @@ thread_bootstrap(void)
 	curthread->t_cpu = curcpu;
 	curcpu->c_curthread = curthread;
 
+	sleepq_bootstrap();
+
+	/* Let the VM system reap zombies when memory gets tight. */
+	shrinker_register("threadcache", SHRINKER_PRI_CACHE,
+			  thread_shrink_cache, NULL);
+	shrinker_register("zombies", SHRINKER_PRI_RECLAIM,
+			  thread_shrink_zombies, NULL);
+
 	/* Done */
 }
 
@@ -462,10 +723,109 @@ thread_start_cpus(void)
 	cpu_startup_sem = NULL;
 }
 
+/*
+ * Run queue helpers. The caller must hold the cpu's runqueue lock.
+ *
+ * A thread goes on the queue for its current priority level, kept
+ * sorted by t_vruntime (ties go in FIFO order); the next thread to run
+ * is the head of the highest-priority nonempty queue, and victims for
+ * stealing come off the tail of the lowest.
+ */
+static
+void
+runqueue_insert(struct threadlist *tl, struct thread *t)
+{
+	struct thread *t2;
+
+	THREADLIST_FORALL(t2, *tl) {
+		if (t2->t_vruntime > t->t_vruntime) {
+			threadlist_insertbefore(tl, t, t2);
+			return;
+		}
+	}
+	threadlist_addtail(tl, t);
+}
+
+static
+void
+runqueue_add(struct cpu *c, struct thread *t)
+{
+	KASSERT(t->t_priority < SCHED_NLEVELS);
+	runqueue_insert(&c->c_runqueue[t->t_priority], t);
+	c->c_runcount++;
+}
+
+/*
+ * Advance the cpu's c_minvruntime after picking NEXT to run. The
+ * queues are sorted, so the smallest t_vruntime of anything runnable
+ * is either NEXT's or at the head of some level.
+ */
+static
+void
+runqueue_updatemin(struct cpu *c, struct thread *next)
+{
+	struct threadlistnode *tln;
+	uint64_t min;
+	unsigned i;
+
+	min = next->t_vruntime;
+	for (i=0; i<SCHED_NLEVELS; i++) {
+		tln = c->c_runqueue[i].tl_head.tln_next;
+		if (tln->tln_self != NULL && tln->tln_self->t_vruntime < min) {
+			min = tln->tln_self->t_vruntime;
+		}
+	}
+	if (min > c->c_minvruntime) {
+		c->c_minvruntime = min;
+	}
+}
+
+static
+struct thread *
+runqueue_remhead(struct cpu *c)
+{
+	struct thread *t;
+	unsigned i;
+
+	if (c->c_runcount == 0) {
+		return NULL;
+	}
+	for (i=0; i<SCHED_NLEVELS; i++) {
+		t = threadlist_remhead(&c->c_runqueue[i]);
+		if (t != NULL) {
+			c->c_runcount--;
+			return t;
+		}
+	}
+	panic("runqueue_remhead: c_runcount is %u but queues are empty\n",
+	      c->c_runcount);
+	return NULL;
+}
+
+/*
+ * True if a thread with a higher priority than LEVEL is waiting.
+ */
+static
+bool
+runqueue_hasbetter(struct cpu *c, unsigned level)
+{
+	unsigned i;
+
+	for (i=0; i<level; i++) {
+		if (!threadlist_isempty(&c->c_runqueue[i])) {
+			return true;
+		}
+	}
+	return false;
+}
+
 /*
  * Make a thread runnable.
  *
- * targetcpu might be curcpu; it might not be, too. 
+ * targetcpu might be curcpu; it might not be, too. If we don't
+ * already have the target's run queue locked, the target is being
+ * woken up or is new, and thread_placecpu picks a cpu for it (and
+ * locks it).
  */
 static
 void
@@ -474,19 +834,27 @@ thread_make_runnable(struct thread *target, bool already_have_lock)
 	struct cpu *targetcpu;
 	bool isidle;
 
-	/* Lock the run queue of the target thread's cpu. */
-	targetcpu = target->t_cpu;
-
 	if (already_have_lock) {
 		/* The target thread's cpu should be already locked. */
+		targetcpu = target->t_cpu;
 		KASSERT(spinlock_do_i_hold(&targetcpu->c_runqueue_lock));
 	}
 	else {
-		spinlock_acquire(&targetcpu->c_runqueue_lock);
+		targetcpu = thread_placecpu(target);
+	}
+
+	/*
+	 * A thread that was asleep (or is new) hasn't been keeping up
+	 * with everyone else's t_vruntime; don't let it come back with
+	 * a huge credit and hog the cpu to catch up.
+	 */
+	if (target->t_state != S_RUN &&
+	    target->t_vruntime < targetcpu->c_minvruntime) {
+		target->t_vruntime = targetcpu->c_minvruntime;
 	}
 
 	isidle = targetcpu->c_isidle;
-	threadlist_addtail(&targetcpu->c_runqueue, target);
+	runqueue_add(targetcpu, target);
 	if (isidle) {
 		/*
 		 * Other processor is idle; send interrupt to make
@@ -515,29 +883,30 @@ thread_make_runnable(struct thread *target, bool already_have_lock)
  * thread, rather than a pointer to its thread struct. For simplicity,
  * we are giving the new thread a copy of its parent's address space, if
  * it has one, contrary to the comment above.
+ *
+ * If VFORKSEM is not NULL, the new thread borrows the caller's address
+ * space instead of copying it, and does V(VFORKSEM) when it gives it
+ * back (see thread_vfork_release).
+ *
+ * If BINDCPU is not NULL, the new thread starts on it instead and
+ * stays there for good.
  */
+static
 int
-thread_fork(const char *name,
-	    void (*entrypoint)(void *data1, unsigned long data2),
-	    void *data1, unsigned long data2,
-	    pid_t *ret)
+thread_fork_common(const char *name,
+		   void (*entrypoint)(void *data1, unsigned long data2),
+		   void *data1, unsigned long data2,
+		   struct semaphore *vforksem, struct cpu *bindcpu,
+		   pid_t *ret)
 {
 	struct thread *newthread;
 	int result;
 
-	newthread = thread_create(name);
+	newthread = thread_get(name);
 	if (newthread == NULL) {
 		return ENOMEM;
 	}
 
-	/* Allocate a stack */
-	newthread->t_stack = kmalloc(STACK_SIZE);
-	if (newthread->t_stack == NULL) {
-		thread_destroy(newthread);
-		return ENOMEM;
-	}
-	thread_checkstack_init(newthread);
-
 	/* Get a process ID - new for ASST2 */
 	result = pid_alloc(&newthread->t_pid);
 	if (result) {
@@ -546,7 +915,11 @@ thread_fork(const char *name,
 	}
 
 	/* Copy address space if there is one - new for ASST2, sys_fork */
-	if (curthread->t_addrspace != NULL) {
+	if (vforksem != NULL) {
+		newthread->t_addrspace = curthread->t_addrspace;
+		newthread->t_vforksem = vforksem;
+	}
+	else if (curthread->t_addrspace != NULL) {
 		result = as_copy(curthread->t_addrspace, &newthread->t_addrspace);
 		if (result) {
  			pid_unalloc(newthread->t_pid); 
@@ -560,7 +933,16 @@ thread_fork(const char *name,
 	 */
 
 	/* Thread subsystem fields */
-	newthread->t_cpu = curthread->t_cpu;
+	if (bindcpu != NULL) {
+		newthread->t_cpu = bindcpu;
+		newthread->t_bound = true;
+	}
+	else {
+		newthread->t_cpu = curthread->t_cpu;
+	}
+
+	/* Scheduler fields; the nice value is per-process and inherited */
+	newthread->t_nice = curthread->t_nice;
 
 	/* VFS fields */
 	if (curthread->t_cwd != NULL) {
@@ -582,7 +964,7 @@ thread_fork(const char *name,
 		newthread->t_filetable->lock = lock_create("filetable lock");
 		for (int i = 0; i < __OPEN_MAX; i++) {
 			if (newthread->t_filetable->fdt[i] == NULL)
-				newthread->t_filetable->fdt[i] = kmalloc(sizeof(struct fdescript));
+				newthread->t_filetable->fdt[i] = fdescript_alloc();
 			newthread->t_filetable->fdt[i]->ref_count++;
 			newthread->t_filetable->fdt[i] = curthread->t_filetable->fdt[i];
 		}
@@ -613,6 +995,80 @@ thread_fork(const char *name,
 	return 0;
 }
 
+int
+thread_fork(const char *name,
+	    void (*entrypoint)(void *data1, unsigned long data2),
+	    void *data1, unsigned long data2,
+	    pid_t *ret)
+{
+	return thread_fork_common(name, entrypoint, data1, data2, NULL, NULL,
+				  ret);
+}
+
+/*
+ * Like thread_fork, but the new thread shares the caller's address
+ * space until it calls thread_vfork_release (for now, only from
+ * thread_exit), at which point it does V(VFORKSEM). The caller
+ * should wait on VFORKSEM before touching the address space again.
+ */
+int
+thread_vfork(const char *name,
+	     void (*entrypoint)(void *data1, unsigned long data2),
+	     void *data1, unsigned long data2,
+	     struct semaphore *vforksem,
+	     pid_t *ret)
+{
+	KASSERT(vforksem != NULL);
+	return thread_fork_common(name, entrypoint, data1, data2, vforksem,
+				  NULL, ret);
+}
+
+int
+thread_fork_bound(const char *name, unsigned cpunum,
+		  void (*entrypoint)(void *data1, unsigned long data2),
+		  void *data1, unsigned long data2,
+		  pid_t *ret)
+{
+	KASSERT(cpunum < cpuarray_num(&allcpus));
+	return thread_fork_common(name, entrypoint, data1, data2, NULL,
+				  cpuarray_get(&allcpus, cpunum), ret);
+}
+
+unsigned
+thread_numcpus(void)
+{
+	return cpuarray_num(&allcpus);
+}
+
+/*
+ * If the current thread is a vfork child, hand the borrowed address
+ * space back to the parent and wake it up. Afterwards the current
+ * thread has no address space. Returns true if the address space was
+ * borrowed, in which case the caller must not destroy it.
+ */
+bool
+thread_vfork_release(void)
+{
+	struct semaphore *sem;
+
+	sem = curthread->t_vforksem;
+	if (sem == NULL) {
+		return false;
+	}
+
+	/*
+	 * Drop our TLB entries for the parent's address space, so no
+	 * stale translations are left behind on this CPU when the
+	 * parent runs somewhere else.
+	 */
+	curthread->t_addrspace = NULL;
+	as_activate(NULL);
+
+	curthread->t_vforksem = NULL;
+	V(sem);
+	return true;
+}
+
 /*
  * High level, machine-independent context switch code.
  *
@@ -652,8 +1108,11 @@ thread_switch(threadstate_t newstate, struct wchan *wc)
 	/* Lock the run queue. */
 	spinlock_acquire(&curcpu->c_runqueue_lock);
 
+	/* Remember when we last ran here, for cache affinity. */
+	cur->t_lastrun = curcpu->c_hardclocks;
+
 	/* Micro-optimization: if nothing to do, just return */
-	if (newstate == S_READY && threadlist_isempty(&curcpu->c_runqueue)) {
+	if (newstate == S_READY && curcpu->c_runcount == 0) {
 		spinlock_release(&curcpu->c_runqueue_lock);
 		splx(spl);
 		return;
@@ -667,7 +1126,19 @@ thread_switch(threadstate_t newstate, struct wchan *wc)
 		thread_make_runnable(cur, true /*have lock*/);
 		break;
 	    case S_SLEEP:
-		cur->t_wchan_name = wc->wc_name;
+		/* sleep queues have no name; sleepq_sleep sets it */
+		if (wc->wc_name != NULL) {
+			cur->t_wchan_name = wc->wc_name;
+		}
+		/*
+		 * Blocking before the quantum runs out is what
+		 * interactive threads do; move up a level so we get
+		 * the cpu back quickly once woken.
+		 */
+		if (cur->t_priority > 0) {
+			cur->t_priority--;
+		}
+		cur->t_ticks = 0;
 		/*
 		 * Add the thread to the list in the wait channel, and
 		 * unlock same. To avoid a race with someone else
@@ -711,14 +1182,18 @@ thread_switch(threadstate_t newstate, struct wchan *wc)
 	/* The current cpu is now idle. */
 	curcpu->c_isidle = true;
 	do {
-		next = threadlist_remhead(&curcpu->c_runqueue);
+		next = runqueue_remhead(curcpu);
 		if (next == NULL) {
 			spinlock_release(&curcpu->c_runqueue_lock);
-			cpu_idle();
+			/* Look for work elsewhere before going to sleep. */
+			if (!thread_steal()) {
+				hardclock_idle();
+			}
 			spinlock_acquire(&curcpu->c_runqueue_lock);
 		}
 	} while (next == NULL);
 	curcpu->c_isidle = false;
+	runqueue_updatemin(curcpu, next);
 
 	/*
 	 * Note that curcpu->c_curthread may be the same variable as
@@ -886,6 +1361,10 @@ thread_exit(int exitcode)
 	}
 
 	/* VM fields */
+	if (thread_vfork_release()) {
+		/* the address space went back to our vfork parent */
+		KASSERT(cur->t_addrspace == NULL);
+	}
 	if (cur->t_addrspace) {
 		/*
 		 * Clear t_addrspace before calling as_destroy. Otherwise
@@ -899,6 +1378,9 @@ thread_exit(int exitcode)
 		as_destroy(as);
 	}
 
+	DEBUG(DB_THREADS, "Thread %s exiting after %u ticks of cpu\n",
+	      cur->t_name, cur->t_cputicks);
+
 	/* Check the stack guard band. */
 	thread_checkstack(cur);
 
@@ -922,139 +1404,419 @@ thread_yield(void)
 /*
  * Scheduler.
  *
- * This is called periodically from hardclock(). It should reshuffle
- * the current CPU's run queue by job priority.
+ * This is a multi-level feedback queue. Each cpu has SCHED_NLEVELS
+ * run queues and always runs the head of the highest-priority
+ * nonempty one, round-robin within a level. A thread that uses up its
+ * whole quantum is assumed to be compute-bound and is moved down a
+ * level (thread_tick); a thread that blocks is moved up one
+ * (thread_switch). Lower levels get longer quanta, so batch jobs
+ * switch less often, but only run when nothing interactive is ready.
+ *
+ * Within a level the cpu is shared in proportion to weight rather
+ * than strictly round-robin: each thread's t_vruntime advances by
+ * its ticks divided by the weight for its nice value, and the queue
+ * is kept sorted so the thread that is furthest behind runs next.
+ *
+ * schedule() is called periodically from hardclock(). To keep a steady
+ * stream of interactive work from starving the batch jobs forever, it
+ * puts every thread on this cpu back at level 0 once each
+ * SCHED_BOOST_HARDCLOCKS. Sleeping threads aren't boosted here, but
+ * they gain levels by sleeping anyway.
  */
 
 void
 schedule(void)
 {
-	/*
-	 * You can write this. If we do nothing, threads will run in
-	 * round-robin fashion.
-	 */
+	struct thread *t;
+	unsigned i;
+
+	if (curcpu->c_hardclocks - curcpu->c_lastboost <
+	    SCHED_BOOST_HARDCLOCKS) {
+		return;
+	}
+	curcpu->c_lastboost = curcpu->c_hardclocks;
+
+	spinlock_acquire(&curcpu->c_runqueue_lock);
+	for (i=1; i<SCHED_NLEVELS; i++) {
+		while ((t = threadlist_remhead(&curcpu->c_runqueue[i]))
+		       != NULL) {
+			t->t_priority = 0;
+			t->t_ticks = 0;
+			runqueue_insert(&curcpu->c_runqueue[0], t);
+		}
+	}
+	if (!curcpu->c_isidle) {
+		curthread->t_priority = 0;
+		curthread->t_ticks = 0;
+	}
+	spinlock_release(&curcpu->c_runqueue_lock);
+}
+
+/*
+ * Clock tick accounting. This is called from hardclock() on every
+ * tick, in place of the unconditional thread_yield() that plain
+ * round-robin would do.
+ *
+ * Charge the tick to the current thread. If that finishes its
+ * quantum, demote it and yield; otherwise yield only if something of
+ * higher priority is waiting (e.g. a thread that was woken since the
+ * last switch).
+ */
+void
+thread_tick(void)
+{
+	struct thread *cur;
+	bool preempt;
+
+	cur = curthread;
+
+	spinlock_acquire(&curcpu->c_runqueue_lock);
+	curcpu->c_rqhist[curcpu->c_runcount < SCHED_RQHIST ?
+			 curcpu->c_runcount : SCHED_RQHIST - 1]++;
+	if (curcpu->c_isidle) {
+		/* Nothing is running; don't charge the idle loop. */
+		spinlock_release(&curcpu->c_runqueue_lock);
+		return;
+	}
+	cur->t_cputicks++;
+	cur->t_vruntime += SCHED_VSCALE / sched_weight[cur->t_nice - PRIO_MIN];
+	cur->t_ticks++;
+	if (cur->t_ticks >= sched_quantum[cur->t_priority]) {
+		if (cur->t_priority < SCHED_NLEVELS - 1) {
+			cur->t_priority++;
+		}
+		cur->t_ticks = 0;
+		preempt = true;
+	}
+	else {
+		preempt = runqueue_hasbetter(curcpu, cur->t_priority);
+	}
+	spinlock_release(&curcpu->c_runqueue_lock);
+
+	if (preempt) {
+		thread_yield();
+	}
+}
+
+/*
+ * Nice value of the current thread (setpriority/getpriority).
+ *
+ * Only the thread itself and thread_tick on its own cpu look at
+ * t_nice, so no locking is needed.
+ */
+int
+thread_getnice(void)
+{
+	return curthread->t_nice;
+}
+
+void
+thread_setnice(int nice)
+{
+	if (nice < PRIO_MIN) {
+		nice = PRIO_MIN;
+	}
+	if (nice > PRIO_MAX) {
+		nice = PRIO_MAX;
+	}
+	curthread->t_nice = nice;
 }
 
 /*
  * Thread migration.
  *
- * This is also called periodically from hardclock(). If the current
- * CPU is busy and other CPUs are idle, or less busy, it should move
- * threads across to those other other CPUs.
+ * CPUs pull work rather than having it pushed at them. A cpu with
+ * nothing to run steals from the busiest cpu as soon as it goes idle
+ * (from thread_switch), and again each time it wakes from idle, which
+ * is at least every IDLE_MAXHARDCLOCKS (see clock.c). Every
+ * MIGRATE_HARDCLOCKS a busy cpu also checks whether some other cpu
+ * has a lot more to do than it has.
  *
  * Migrating threads isn't free because of cache affinity; a thread's
  * working cache set will end up having to be moved to the other CPU,
- * which is fairly slow. The tradeoff between this performance loss
- * and the performance loss due to underutilization of some CPUs is
- * something that needs to be tuned and probably is workload-specific.
+ * which is fairly slow. System/161 does not (yet) model such cache
+ * effects, but ping-ponging threads between CPUs still costs lock
+ * traffic, so there is some hysteresis: we only steal when the other
+ * cpu's load (ready threads plus the running one) is at least
+ * STEAL_IMBALANCE more than ours, we take half the difference, and a
+ * thread that has just been moved can't be moved again for
+ * STEAL_HOLDOFF hardclocks. Threads are taken from the low-priority
+ * end of the victim's queues, so batch jobs move and interactive
+ * ones stay put.
  *
- * For here and now, because we know we're running on System/161 and
- * System/161 does not (yet) model such cache effects, we'll be very
- * aggressive.
+ * A thread that ran less than MIGRATE_COST hardclocks ago is taken to
+ * still have a warm cache where it was, and is never stolen. When a
+ * thread wakes up (thread_placecpu) it goes back to its previous cpu
+ * if that is idle or has at most AFFINITY_LIGHTLOAD load, or if the
+ * thread is cache-hot and the cpu's load is under AFFINITY_HOTLOAD;
+ * otherwise it goes to an idle cpu if there is one.
+ */
+#define STEAL_IMBALANCE	2	/* Minimum load difference to steal. */
+#define STEAL_HOLDOFF	8	/* Hardclocks before moving a thread again. */
+#define MIGRATE_COST	2	/* Hardclocks a thread's cache stays warm. */
+#define AFFINITY_LIGHTLOAD 1	/* Always wake on a cpu this lightly loaded */
+#define AFFINITY_HOTLOAD 3	/* ...or this, if the thread's cache is warm */
+
+/*
+ * Load on a cpu: threads ready to run, plus the running one if any.
+ * Racy unless the cpu's runqueue lock is held, which is fine for
+ * picking a victim.
+ */
+static
+unsigned
+cpu_load(struct cpu *c)
+{
+	return c->c_runcount + (c->c_isidle ? 0 : 1);
+}
+
+/*
+ * Check if a thread on VICTIM's run queue may be moved.
+ *
+ * Ordinarily, a cpu's c_curthread will not appear on its run queue.
+ * However, it can under the following circumstances:
+ *   - it went to sleep;
+ *   - the processor became idle, so it remained curthread;
+ *   - it was reawakened, so it was put on the run queue;
+ *   - and the processor hasn't fully unidled yet, so all these
+ *     things are still true.
+ *
+ * Migrating such a thread would let it run here while its stack is
+ * still in use over there, so it must be left alone. (Exercise: is
+ * there a cheaper way to tell?)
+ */
+static
+bool
+thread_can_steal(struct cpu *victim, struct thread *t)
+{
+	if (t == victim->c_curthread || t->t_bound) {
+		return false;
+	}
+	if (victim->c_hardclocks - t->t_migrated < STEAL_HOLDOFF) {
+		return false;
+	}
+	if (victim->c_hardclocks - t->t_lastrun < MIGRATE_COST) {
+		return false;
+	}
+	return true;
+}
+
+/*
+ * Move T, which is on no run queue, to cpu C, whose run queue lock we
+ * hold. Its t_vruntime must already be relative (see thread_steal).
  */
+static
 void
-thread_consider_migration(void)
+thread_migrate(struct thread *t, struct cpu *c)
 {
-	unsigned my_count, total_count, one_share, to_send;
-	unsigned i, numcpus;
-	struct cpu *c;
-	struct threadlist victims;
-	struct thread *t;
+	KASSERT(spinlock_do_i_hold(&c->c_runqueue_lock));
+
+	t->t_vruntime += c->c_minvruntime;
+	t->t_cpu = c;
+	t->t_migrated = c->c_hardclocks;
+	/* Whatever it had in the cache is on the other cpu. */
+	t->t_lastrun = c->c_hardclocks - MIGRATE_COST;
+	c->c_nmigrate++;
+}
+
+/*
+ * Choose a cpu for thread T, which is waking up or new, and return it
+ * with its run queue locked.
+ */
+static
+struct cpu *
+thread_placecpu(struct thread *t)
+{
+	struct cpu *prev, *c;
+	unsigned i, numcpus, load;
+	bool hot;
+
+	prev = t->t_cpu;
+	spinlock_acquire(&prev->c_runqueue_lock);
 
-	my_count = total_count = 0;
+	/*
+	 * If T was the last thread to run on PREV and PREV is still
+	 * idle, PREV is still on T's stack; see thread_can_steal. It
+	 * has to go back there. Bound threads always go back, too.
+	 */
+	if (prev->c_curthread == t || t->t_bound) {
+		return prev;
+	}
+
+	load = cpu_load(prev);
+	hot = prev->c_hardclocks - t->t_lastrun < MIGRATE_COST;
+	if (load <= AFFINITY_LIGHTLOAD || (hot && load < AFFINITY_HOTLOAD)) {
+		return prev;
+	}
+
+	/* Look for an idle cpu. Unlocked; it's a hint. */
 	numcpus = cpuarray_num(&allcpus);
+	c = NULL;
 	for (i=0; i<numcpus; i++) {
 		c = cpuarray_get(&allcpus, i);
-		spinlock_acquire(&c->c_runqueue_lock);
-		total_count += c->c_runqueue.tl_count;
-		if (c == curcpu->c_self) {
-			my_count = c->c_runqueue.tl_count;
+		if (c != prev && c->c_isidle) {
+			break;
 		}
-		spinlock_release(&c->c_runqueue_lock);
 	}
-
-	one_share = DIVROUNDUP(total_count, numcpus);
-	if (my_count < one_share) {
-		return;
+	if (i == numcpus) {
+		return prev;
 	}
 
-	to_send = my_count - one_share;
-	threadlist_init(&victims);
-	spinlock_acquire(&curcpu->c_runqueue_lock);
-	for (i=0; i<to_send; i++) {
-		t = threadlist_remtail(&curcpu->c_runqueue);
-		threadlist_addhead(&victims, t);
+	if (t->t_vruntime > prev->c_minvruntime) {
+		t->t_vruntime -= prev->c_minvruntime;
 	}
-	spinlock_release(&curcpu->c_runqueue_lock);
+	else {
+		t->t_vruntime = 0;
+	}
+	spinlock_release(&prev->c_runqueue_lock);
 
-	for (i=0; i < numcpus && to_send > 0; i++) {
+	spinlock_acquire(&c->c_runqueue_lock);
+	DEBUG(DB_THREADS, "Placed thread %s: cpu %u -> %u",
+	      t->t_name, prev->c_number, c->c_number);
+	thread_migrate(t, c);
+	return c;
+}
+
+/*
+ * Try to pull threads from the busiest other cpu onto this one.
+ * Returns true if we got any.
+ *
+ * Call with interrupts off and without holding any runqueue lock; we
+ * never hold two at once.
+ */
+static
+bool
+thread_steal(void)
+{
+	struct cpu *c, *victim;
+	struct thread *t, *prev;
+	struct threadlist stolen;
+	unsigned i, numcpus, load, maxload, myload, to_steal;
+
+	myload = cpu_load(curcpu->c_self);
+
+	/* Find the busiest cpu. Don't bother locking; it's a hint. */
+	victim = NULL;
+	maxload = 0;
+	numcpus = cpuarray_num(&allcpus);
+	for (i=0; i<numcpus; i++) {
 		c = cpuarray_get(&allcpus, i);
 		if (c == curcpu->c_self) {
 			continue;
 		}
-		spinlock_acquire(&c->c_runqueue_lock);
-		while (c->c_runqueue.tl_count < one_share && to_send > 0) {
-			t = threadlist_remhead(&victims);
-			/*
-			 * Ordinarily, curthread will not appear on
-			 * the run queue. However, it can under the
-			 * following circumstances:
-			 *   - it went to sleep;
-			 *   - the processor became idle, so it
-			 *     remained curthread;
-			 *   - it was reawakened, so it was put on the
-			 *     run queue;
-			 *   - and the processor hasn't fully unidled
-			 *     yet, so all these things are still true.
-			 *
-			 * If the timer interrupt happens at (almost)
-			 * exactly the proper moment, we can come here
-			 * while things are in this state and see
-			 * curthread. However, *migrating* curthread
-			 * can cause bad things to happen (Exercise:
-			 * Why? And what?) so shuffle it to the end of
-			 * the list and decrement to_send in order to
-			 * skip it. Then it goes back on our own run
-			 * queue below.
-			 */
-			if (t == curthread) {
-				threadlist_addtail(&victims, t);
-				to_send--;
-				continue;
-			}
+		load = cpu_load(c);
+		if (load > maxload) {
+			maxload = load;
+			victim = c;
+		}
+	}
+	if (victim == NULL || maxload < myload + STEAL_IMBALANCE) {
+		return false;
+	}
 
-			t->t_cpu = c;
-			threadlist_addtail(&c->c_runqueue, t);
-			DEBUG(DB_THREADS,
-			      "Migrated thread %s: cpu %u -> %u",
-			      t->t_name, curcpu->c_number, c->c_number);
-			to_send--;
-			if (c->c_isidle) {
-				/*
-				 * Other processor is idle; send
-				 * interrupt to make sure it unidles.
-				 */
-				ipi_send(c, IPI_UNIDLE);
+	threadlist_init(&stolen);
+	spinlock_acquire(&victim->c_runqueue_lock);
+
+	/* Recheck now that it's locked. */
+	load = cpu_load(victim);
+	to_steal = load < myload + STEAL_IMBALANCE ? 0 : (load - myload) / 2;
+
+	for (i=SCHED_NLEVELS; i-- > 0 && to_steal > 0; ) {
+		t = victim->c_runqueue[i].tl_tail.tln_prev->tln_self;
+		while (t != NULL && to_steal > 0) {
+			prev = t->t_listnode.tln_prev->tln_self;
+			if (thread_can_steal(victim, t)) {
+				threadlist_remove(&victim->c_runqueue[i], t);
+				victim->c_runcount--;
+				/* Keep its fair-share lag, not its clock. */
+				if (t->t_vruntime > victim->c_minvruntime) {
+					t->t_vruntime -= victim->c_minvruntime;
+				}
+				else {
+					t->t_vruntime = 0;
+				}
+				threadlist_addtail(&stolen, t);
+				to_steal--;
 			}
+			t = prev;
 		}
-		spinlock_release(&c->c_runqueue_lock);
 	}
+	spinlock_release(&victim->c_runqueue_lock);
 
-	/*
-	 * Because the code above isn't atomic, the thread counts may have
-	 * changed while we were working and we may end up with leftovers.
-	 * Don't panic; just put them back on our own run queue.
-	 */
-	if (!threadlist_isempty(&victims)) {
-		spinlock_acquire(&curcpu->c_runqueue_lock);
-		while ((t = threadlist_remhead(&victims)) != NULL) {
-			threadlist_addtail(&curcpu->c_runqueue, t);
-		}
-		spinlock_release(&curcpu->c_runqueue_lock);
+	if (threadlist_isempty(&stolen)) {
+		threadlist_cleanup(&stolen);
+		return false;
 	}
 
-	KASSERT(threadlist_isempty(&victims));
-	threadlist_cleanup(&victims);
+	spinlock_acquire(&curcpu->c_runqueue_lock);
+	while ((t = threadlist_remhead(&stolen)) != NULL) {
+		DEBUG(DB_THREADS, "Stole thread %s: cpu %u -> %u",
+		      t->t_name, victim->c_number, curcpu->c_number);
+		thread_migrate(t, curcpu->c_self);
+		runqueue_add(curcpu->c_self, t);
+	}
+	spinlock_release(&curcpu->c_runqueue_lock);
+
+	threadlist_cleanup(&stolen);
+	return true;
+}
+
+/*
+ * Periodic load balancing, called from hardclock(). Idle cpus steal
+ * on their own; this catches the case where every cpu is busy but
+ * some are much busier than others.
+ */
+void
+thread_consider_migration(void)
+{
+	/* Interrupts are already off in hardclock(). */
+	thread_steal();
+}
+
+/*
+ * Print the scheduler statistics for each cpu: how many threads were
+ * moved onto it, and how long its run queue was (sampled once per
+ * hardclock, as a percentage; the last bucket includes anything
+ * longer).
+ */
+void
+thread_printstats(void)
+{
+	struct cpu *c;
+	unsigned i, j, numcpus, nmigrate, total, hardclocks, skipped;
+	unsigned spares, hits, misses;
+	unsigned hist[SCHED_RQHIST];
+
+	numcpus = cpuarray_num(&allcpus);
+	for (i=0; i<numcpus; i++) {
+		c = cpuarray_get(&allcpus, i);
+
+		/* Copy the numbers out so we don't print holding the lock */
+		total = 0;
+		spinlock_acquire(&c->c_runqueue_lock);
+		nmigrate = c->c_nmigrate;
+		for (j=0; j<SCHED_RQHIST; j++) {
+			hist[j] = c->c_rqhist[j];
+			total += hist[j];
+		}
+		spinlock_release(&c->c_runqueue_lock);
+		hardclocks = c->c_hardclocks;
+		skipped = c->c_skippedclocks;
+		spares = c->c_threadcache.tl_count;
+		hits = c->c_threadcache_hits;
+		misses = c->c_threadcache_misses;
+
+		kprintf("cpu%u: %u hardclocks, %u skipped while idle\n",
+			c->c_number, hardclocks, skipped);
+		kprintf("cpu%u: %u spare threads; %u forks reused one, "
+			"%u allocated\n", c->c_number, spares, hits, misses);
+		kprintf("cpu%u: %u threads migrated in; run queue length:",
+			c->c_number, nmigrate);
+		for (j=0; j<SCHED_RQHIST; j++) {
+			kprintf(" %u%s:%u%%", j, j == SCHED_RQHIST-1 ? "+" : "",
+				total ? hist[j] * 100 / total : 0);
+		}
+		kprintf("\n");
+	}
 }
 
 ////////////////////////////////////////////////////////////
@@ -1190,6 +1952,51 @@ wchan_wakeall(struct wchan *wc)
 	threadlist_cleanup(&list);
 }
 
+/*
+ * Timed sleep.
+ *
+ * The sleeping thread waits on a private wait channel on its own
+ * stack, and a timeout on this cpu's timer wheel wakes it, so nobody
+ * else is disturbed. The channel stays locked (so interrupts stay off
+ * on this cpu) from before the timeout is armed until we're on the
+ * channel's list, so the wakeup can't be lost.
+ */
+static
+void
+thread_sleep_wake(void *data)
+{
+	wchan_wakeone(data);
+}
+
+void
+thread_sleep_ns(uint64_t nsecs)
+{
+	struct wchan wc;
+	struct timeout to;
+	uint64_t ticks;
+	unsigned chunk;
+
+	KASSERT(!curthread->t_in_interrupt);
+
+	spinlock_init(&wc.wc_lock);
+	threadlist_init(&wc.wc_threads);
+	wc.wc_name = "sleep";
+	timeout_init(&to, thread_sleep_wake, &wc);
+
+	ticks = DIVROUNDUP(nsecs, 1000000000 / HZ);
+	while (ticks > 0) {
+		chunk = ticks > 0x7fffffff ? 0x7fffffff : ticks;
+		ticks -= chunk;
+
+		wchan_lock(&wc);
+		timeout_add(&to, chunk);
+		wchan_sleep(&wc);
+	}
+
+	threadlist_cleanup(&wc.wc_threads);
+	spinlock_cleanup(&wc.wc_lock);
+}
+
 /*
  * Return nonzero if there are no threads sleeping on the channel.
  * This is meant to be used only for diagnostic purposes.
@@ -1208,6 +2015,140 @@ wchan_isempty(struct wchan *wc)
 
 ////////////////////////////////////////////////////////////
 
+/*
+ * Hashed sleep queues. See <wchan.h>.
+ *
+ * Each queue is an ordinary wait channel whose list is shared by all
+ * the keys that hash to it. Threads on it remember their key in
+ * t_sleepkey, and wakeups only take the ones with the right key, so
+ * waking one object's sleepers doesn't disturb anyone else's.
+ *
+ * Unlike wchan_wake*, the wakeups make threads runnable with the queue
+ * still locked. That's the same order thread_switch takes the queue
+ * and run queue locks in, so it's safe.
+ */
+
+#define SLEEPQ_NTABLES		2
+#define SLEEPQ_NBUCKETS		64	/* Queues per table; power of 2 */
+
+static struct wchan sleepq_table[SLEEPQ_NTABLES][SLEEPQ_NBUCKETS];
+
+static
+void
+sleepq_bootstrap(void)
+{
+	unsigned i, j;
+
+	for (i=0; i<SLEEPQ_NTABLES; i++) {
+		for (j=0; j<SLEEPQ_NBUCKETS; j++) {
+			spinlock_init(&sleepq_table[i][j].wc_lock);
+			threadlist_init(&sleepq_table[i][j].wc_threads);
+			sleepq_table[i][j].wc_name = NULL;
+		}
+	}
+}
+
+/*
+ * Find the queue for KEY. Objects are small and allocated close
+ * together, so mix in some higher bits as well as the low ones.
+ */
+static
+struct wchan *
+sleepq_get(unsigned table, const void *key)
+{
+	uintptr_t k = (uintptr_t)key;
+
+	KASSERT(table < SLEEPQ_NTABLES);
+	return &sleepq_table[table][((k >> 3) ^ (k >> 11)) &
+				    (SLEEPQ_NBUCKETS - 1)];
+}
+
+void
+sleepq_lock(unsigned table, const void *key)
+{
+	spinlock_acquire(&sleepq_get(table, key)->wc_lock);
+}
+
+void
+sleepq_unlock(unsigned table, const void *key)
+{
+	spinlock_release(&sleepq_get(table, key)->wc_lock);
+}
+
+void
+sleepq_sleep(unsigned table, const void *key, const char *name)
+{
+	struct wchan *wc = sleepq_get(table, key);
+
+	/* may not sleep in an interrupt handler */
+	KASSERT(!curthread->t_in_interrupt);
+	KASSERT(spinlock_do_i_hold(&wc->wc_lock));
+
+	/* nobody can look at these until we're on the list */
+	curthread->t_sleepkey = key;
+	curthread->t_wchan_name = name;
+	thread_switch(S_SLEEP, wc);
+}
+
+void
+sleepq_wakeone(unsigned table, const void *key)
+{
+	struct wchan *wc = sleepq_get(table, key);
+	struct thread *target;
+
+	KASSERT(spinlock_do_i_hold(&wc->wc_lock));
+
+	THREADLIST_FORALL(target, wc->wc_threads) {
+		if (target->t_sleepkey == key) {
+			threadlist_remove(&wc->wc_threads, target);
+			target->t_sleepkey = NULL;
+			thread_make_runnable(target, false);
+			return;
+		}
+	}
+}
+
+void
+sleepq_wakeall(unsigned table, const void *key)
+{
+	struct wchan *wc = sleepq_get(table, key);
+	struct thread *target, *next;
+
+	KASSERT(spinlock_do_i_hold(&wc->wc_lock));
+
+	/* Like THREADLIST_FORALL, but safe against removal. */
+	for (target = wc->wc_threads.tl_head.tln_next->tln_self;
+	     target != NULL; target = next) {
+		next = target->t_listnode.tln_next->tln_self;
+		if (target->t_sleepkey == key) {
+			threadlist_remove(&wc->wc_threads, target);
+			target->t_sleepkey = NULL;
+			thread_make_runnable(target, false);
+		}
+	}
+}
+
+bool
+sleepq_isempty(unsigned table, const void *key)
+{
+	struct wchan *wc = sleepq_get(table, key);
+	struct thread *t;
+	bool ret = true;
+
+	spinlock_acquire(&wc->wc_lock);
+	THREADLIST_FORALL(t, wc->wc_threads) {
+		if (t->t_sleepkey == key) {
+			ret = false;
+			break;
+		}
+	}
+	spinlock_release(&wc->wc_lock);
+
+	return ret;
+}
+
+////////////////////////////////////////////////////////////
+
 /*
  * Machine-independent IPI handling
  */
@@ -1265,6 +2206,28 @@ ipi_tlbshootdown(unsigned targetcpu, const struct tlbshootdown *mapping)
         spinlock_release(&target->c_ipi_lock);
 }
 
+/*
+ * Ask every other CPU to flush its whole TLB.
+ */
+void
+ipi_tlbshootdown_all(void)
+{
+	unsigned i;
+	struct cpu *c;
+
+	for (i=0; i < cpuarray_num(&allcpus); i++) {
+		c = cpuarray_get(&allcpus, i);
+		if (c == curcpu->c_self) {
+			continue;
+		}
+		spinlock_acquire(&c->c_ipi_lock);
+		c->c_numshootdown = TLBSHOOTDOWN_ALL;
+		c->c_ipi_pending |= (uint32_t)1 << IPI_TLBSHOOTDOWN;
+		mainbus_send_ipi(c);
+		spinlock_release(&c->c_ipi_lock);
+	}
+}
+
 void
 interprocessor_interrupt(void)
 {
@@ -0,0 +1,281 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Timeouts and the per-cpu timer wheel. See <timer.h>.
+ */
+
+#include <types.h>
+#include <lib.h>
+#include <spl.h>
+#include <cpu.h>
+#include <current.h>
+#include <timer.h>
+
+/* How far ahead the wheel can hold a timeout without re-sorting it. */
+#define TW_SPAN		((uint64_t)1 << (TW_BITS * TW_LEVELS))
+
+/*
+ * Set up a timeout.
+ */
+void
+timeout_init(struct timeout *to, void (*func)(void *), void *data)
+{
+	to->to_next = NULL;
+	to->to_prevp = NULL;
+	to->to_wheel = NULL;
+	to->to_expire = 0;
+	to->to_func = func;
+	to->to_data = data;
+}
+
+/*
+ * Set up a cpu's wheel. Called from cpu_create.
+ */
+void
+timerwheel_init(struct timerwheel *tw)
+{
+	unsigned i, j;
+
+	spinlock_init(&tw->tw_lock);
+	tw->tw_now = 0;
+	tw->tw_count = 0;
+	for (i=0; i<TW_LEVELS; i++) {
+		for (j=0; j<TW_SLOTS; j++) {
+			tw->tw_slots[i][j] = NULL;
+		}
+	}
+}
+
+/*
+ * Put TO in the slot for its expiry time. The wheel must be locked.
+ *
+ * A timeout due within TW_SLOTS ticks goes in level 0; otherwise in
+ * the lowest level whose span covers it. Anything further out than the
+ * whole wheel is parked at the far end of the top level and sorted
+ * again when that slot is cascaded.
+ */
+static
+void
+timerwheel_insert(struct timerwheel *tw, struct timeout *to)
+{
+	struct timeout **slot;
+	uint64_t when, delta;
+	unsigned level;
+
+	when = to->to_expire;
+	if (when < tw->tw_now) {
+		/* Overdue; fire on the next tick. */
+		when = tw->tw_now;
+	}
+	delta = when - tw->tw_now;
+	if (delta >= TW_SPAN) {
+		delta = TW_SPAN - 1;
+		when = tw->tw_now + delta;
+	}
+
+	for (level=0; level < TW_LEVELS - 1; level++) {
+		if (delta < ((uint64_t)1 << (TW_BITS * (level + 1)))) {
+			break;
+		}
+	}
+	slot = &tw->tw_slots[level][(when >> (TW_BITS * level)) & TW_MASK];
+
+	to->to_next = *slot;
+	if (to->to_next != NULL) {
+		to->to_next->to_prevp = &to->to_next;
+	}
+	to->to_prevp = slot;
+	*slot = to;
+}
+
+/*
+ * Take TO off its wheel, which must be locked.
+ */
+static
+void
+timerwheel_remove(struct timerwheel *tw, struct timeout *to)
+{
+	KASSERT(to->to_wheel == tw);
+
+	*to->to_prevp = to->to_next;
+	if (to->to_next != NULL) {
+		to->to_next->to_prevp = to->to_prevp;
+	}
+	to->to_next = NULL;
+	to->to_prevp = NULL;
+	to->to_wheel = NULL;
+	KASSERT(tw->tw_count > 0);
+	tw->tw_count--;
+}
+
+/*
+ * Move everything in a slot of an upper level down to where it now
+ * belongs.
+ */
+static
+void
+timerwheel_cascade(struct timerwheel *tw, struct timeout **slot)
+{
+	struct timeout *to, *next;
+
+	to = *slot;
+	*slot = NULL;
+	for (; to != NULL; to = next) {
+		next = to->to_next;
+		timerwheel_insert(tw, to);
+	}
+}
+
+/*
+ * Arm a timeout on the current cpu's wheel.
+ */
+void
+timeout_add(struct timeout *to, unsigned ticks)
+{
+	struct timerwheel *tw;
+	int spl;
+
+	KASSERT(to->to_wheel == NULL);
+
+	/* Stay on this cpu while we pick its wheel. */
+	spl = splhigh();
+	tw = &curcpu->c_timers;
+	spinlock_acquire(&tw->tw_lock);
+	to->to_expire = tw->tw_now + ticks;
+	to->to_wheel = tw;
+	tw->tw_count++;
+	timerwheel_insert(tw, to);
+	spinlock_release(&tw->tw_lock);
+	splx(spl);
+}
+
+/*
+ * Disarm a timeout.
+ */
+bool
+timeout_cancel(struct timeout *to)
+{
+	struct timerwheel *tw;
+
+	tw = to->to_wheel;
+	if (tw == NULL) {
+		return false;
+	}
+	spinlock_acquire(&tw->tw_lock);
+	if (to->to_wheel != tw) {
+		/* It fired while we were getting the lock. */
+		spinlock_release(&tw->tw_lock);
+		return false;
+	}
+	timerwheel_remove(tw, to);
+	spinlock_release(&tw->tw_lock);
+	return true;
+}
+
+/*
+ * How many hardclocks from now until the current cpu's wheel next has
+ * something to do, at most MAX: the tick that runs the first nonempty
+ * level-0 slot, or the next cascade, whichever is sooner. 1 means the
+ * very next hardclock. Used to decide how long an idle cpu can go
+ * without ticks.
+ */
+unsigned
+timerwheel_nextevent(unsigned max)
+{
+	struct timerwheel *tw;
+	unsigned i, index;
+
+	tw = &curcpu->c_timers;
+	spinlock_acquire(&tw->tw_lock);
+	if (tw->tw_count == 0) {
+		spinlock_release(&tw->tw_lock);
+		return max;
+	}
+	for (i=0; i<max; i++) {
+		index = (tw->tw_now + i) & TW_MASK;
+		if (tw->tw_slots[0][index] != NULL) {
+			break;
+		}
+		if (index == 0) {
+			/* Level 0 wraps; upper levels cascade into it here. */
+			break;
+		}
+	}
+	spinlock_release(&tw->tw_lock);
+	return i < max ? i + 1 : max;
+}
+
+/*
+ * Advance the current cpu's wheel by one tick and run whatever is
+ * due. Called from hardclock().
+ *
+ * Every TW_SLOTS ticks level 0 comes back around to slot 0, and the
+ * next slot of level 1 is cascaded down; likewise level 1 wrapping
+ * cascades level 2, and so on. The functions are called with the
+ * wheel unlocked so they can add timeouts or wake threads.
+ */
+void
+timerwheel_tick(void)
+{
+	struct timerwheel *tw;
+	struct timeout **slot, *to, *due;
+	unsigned level, index;
+
+	tw = &curcpu->c_timers;
+	spinlock_acquire(&tw->tw_lock);
+
+	index = tw->tw_now & TW_MASK;
+	for (level=1; index == 0 && level < TW_LEVELS; level++) {
+		index = (tw->tw_now >> (TW_BITS * level)) & TW_MASK;
+		timerwheel_cascade(tw, &tw->tw_slots[level][index]);
+	}
+
+	/*
+	 * Take the due timeouts off onto a private list first: one
+	 * re-armed from its own function for TW_SLOTS-1 ticks would
+	 * otherwise land back in this very slot. They still count as on
+	 * the wheel until they run, so timeout_cancel works on them.
+	 */
+	slot = &tw->tw_slots[0][tw->tw_now & TW_MASK];
+	due = *slot;
+	*slot = NULL;
+	if (due != NULL) {
+		due->to_prevp = &due;
+	}
+	tw->tw_now++;
+	while ((to = due) != NULL) {
+		timerwheel_remove(tw, to);
+		spinlock_release(&tw->tw_lock);
+		to->to_func(to->to_data);
+		spinlock_acquire(&tw->tw_lock);
+	}
+
+	spinlock_release(&tw->tw_lock);
+}
@@ -0,0 +1,546 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Workqueues. See <workqueue.h>.
+ *
+ * Each cpu's pending list is only touched on that cpu, with
+ * interrupts off: work is always put on the current cpu's list, and
+ * the workers that take it off are bound to that cpu. So the lists
+ * need no locks of their own. A work's flags, on the other hand, can
+ * be looked at from anywhere; they're protected by the hashed sleep
+ * queue lock for the work's address (see <wchan.h>).
+ *
+ * Cancelling doesn't take work off the list it's on, since that list
+ * may belong to another cpu; it just clears w_pending, and the worker
+ * that finds it there drops it. Queueing it again meanwhile leaves it
+ * where it is and sets w_pending again.
+ *
+ * Workers sleep on their wq_cpu's address, and workqueue_flush sleeps
+ * on the workqueue's.
+ */
+
+#include <types.h>
+#include <lib.h>
+#include <spl.h>
+#include <clock.h>
+#include <cpu.h>
+#include <current.h>
+#include <synch.h>
+#include <thread.h>
+#include <wchan.h>
+#include <workqueue.h>
+
+struct wq_cpu {
+	/* Only touched on this cpu, with interrupts off */
+	struct work *wqc_head;		/* Pending list */
+	struct work **wqc_tailp;	/* Link to add the next one at */
+	unsigned wqc_nqueued;		/* Number on the list */
+	unsigned wqc_nrunning;		/* Workers not idle */
+	/* Statistics; same rules */
+	unsigned wqc_maxqueued;		/* Longest the list has been */
+	unsigned wqc_ndone;		/* Work run */
+	uint64_t wqc_waittotal;		/* Total time on the list, ns */
+	uint32_t wqc_waitmax;		/* Longest time on the list, ns */
+};
+
+struct workqueue {
+	const char *wq_name;
+	unsigned wq_ncpus;		/* Size of wq_cpus */
+	unsigned wq_nworkers;		/* Workers per cpu */
+	volatile bool wq_dying;		/* Set to make the workers exit */
+	struct semaphore *wq_exitsem;	/* Workers V it as they exit */
+	struct workqueue *wq_next;	/* On the list of all workqueues */
+	struct wq_cpu *wq_cpus;		/* One per cpu */
+};
+
+/* All workqueues, for workqueue_printstats. */
+static struct lock *workqueues_lock;
+static struct workqueue *workqueues;
+
+struct workqueue *system_wq;
+
+static
+uint64_t
+workqueue_now(void)
+{
+	time_t secs;
+	uint32_t nsecs;
+
+	gettime(&secs, &nsecs);
+	return (uint64_t)secs * 1000000000 + nsecs;
+}
+
+static
+void
+work_lock(struct work *w)
+{
+	sleepq_lock(SLEEPQ_WAIT, w);
+}
+
+static
+void
+work_unlock(struct work *w)
+{
+	sleepq_unlock(SLEEPQ_WAIT, w);
+}
+
+static void workqueue_timeout(void *data);
+
+void
+work_init(struct work *w, void (*func)(void *), void *data)
+{
+	w->w_next = NULL;
+	w->w_func = func;
+	w->w_data = data;
+	w->w_wq = NULL;
+	timeout_init(&w->w_timeout, workqueue_timeout, w);
+	w->w_queuedat = 0;
+	w->w_pending = false;
+	w->w_delayed = false;
+	w->w_onlist = false;
+}
+
+////////////////////////////////////////////////////////////
+//
+// Queueing
+
+/*
+ * Put W on the current cpu's list for its workqueue, unless it's on a
+ * list already, and return that cpu's wq_cpu. W must be locked (so
+ * interrupts are off).
+ */
+static
+struct wq_cpu *
+work_push(struct work *w)
+{
+	struct wq_cpu *wqc;
+
+	KASSERT(curcpu->c_number < w->w_wq->wq_ncpus);
+	wqc = &w->w_wq->wq_cpus[curcpu->c_number];
+
+	w->w_queuedat = workqueue_now();
+	if (!w->w_onlist) {
+		w->w_next = NULL;
+		*wqc->wqc_tailp = w;
+		wqc->wqc_tailp = &w->w_next;
+		w->w_onlist = true;
+		wqc->wqc_nqueued++;
+		if (wqc->wqc_nqueued > wqc->wqc_maxqueued) {
+			wqc->wqc_maxqueued = wqc->wqc_nqueued;
+		}
+	}
+	return wqc;
+}
+
+/*
+ * Wake a worker for WQC. Not with a work locked; that's also a
+ * SLEEPQ_WAIT queue.
+ */
+static
+void
+workqueue_kick(struct wq_cpu *wqc)
+{
+	sleepq_lock(SLEEPQ_WAIT, wqc);
+	sleepq_wakeone(SLEEPQ_WAIT, wqc);
+	sleepq_unlock(SLEEPQ_WAIT, wqc);
+}
+
+bool
+workqueue_add(struct workqueue *wq, struct work *w)
+{
+	struct wq_cpu *wqc;
+
+	KASSERT(!wq->wq_dying);
+
+	work_lock(w);
+	if (w->w_pending) {
+		work_unlock(w);
+		return false;
+	}
+	w->w_pending = true;
+	w->w_wq = wq;
+	wqc = work_push(w);
+	work_unlock(w);
+
+	workqueue_kick(wqc);
+	return true;
+}
+
+bool
+workqueue_add_delayed(struct workqueue *wq, struct work *w, unsigned ticks)
+{
+	if (ticks == 0) {
+		return workqueue_add(wq, w);
+	}
+
+	KASSERT(!wq->wq_dying);
+
+	work_lock(w);
+	if (w->w_pending) {
+		work_unlock(w);
+		return false;
+	}
+	w->w_pending = true;
+	w->w_delayed = true;
+	w->w_wq = wq;
+	timeout_add(&w->w_timeout, ticks);
+	work_unlock(w);
+
+	return true;
+}
+
+/*
+ * Timeout function for delayed work. Runs from hardclock on the cpu
+ * that armed the timeout, so the work goes on that cpu's list.
+ */
+static
+void
+workqueue_timeout(void *data)
+{
+	struct work *w = data;
+	struct wq_cpu *wqc;
+
+	work_lock(w);
+	/*
+	 * If it was cancelled after the timeout went off, w_delayed is
+	 * clear. If it was then queued with a delay again, the timeout
+	 * is back on a wheel, and it's that one that counts.
+	 */
+	if (!w->w_delayed || w->w_timeout.to_wheel != NULL) {
+		work_unlock(w);
+		return;
+	}
+	w->w_delayed = false;
+	wqc = work_push(w);
+	work_unlock(w);
+
+	workqueue_kick(wqc);
+}
+
+bool
+workqueue_cancel(struct work *w)
+{
+	bool ret;
+
+	work_lock(w);
+	ret = w->w_pending;
+	if (w->w_delayed) {
+		/* If it's just gone off, workqueue_timeout does nothing */
+		timeout_cancel(&w->w_timeout);
+		w->w_delayed = false;
+	}
+	/* If it's on a list, the worker will drop it. */
+	w->w_pending = false;
+	work_unlock(w);
+
+	return ret;
+}
+
+////////////////////////////////////////////////////////////
+//
+// Workers
+
+/*
+ * True if WQ has anything queued or running on any cpu. Looks at the
+ * other cpus' counts without locking, so the caller must be prepared
+ * to check again when a worker goes idle; see workqueue_worker.
+ */
+static
+bool
+workqueue_busy(struct workqueue *wq)
+{
+	struct wq_cpu *wqc;
+	unsigned i;
+
+	for (i=0; i<wq->wq_ncpus; i++) {
+		wqc = &wq->wq_cpus[i];
+		/* in this order; workers count themselves before popping */
+		if (wqc->wqc_head != NULL || wqc->wqc_nrunning > 0) {
+			return true;
+		}
+	}
+	return false;
+}
+
+static
+void
+workqueue_worker(void *data1, unsigned long cpunum)
+{
+	struct workqueue *wq = data1;
+	struct wq_cpu *wqc;
+	struct work *w;
+	void (*func)(void *);
+	void *arg;
+	uint64_t queuedat, wait;
+	bool run, idle;
+	int spl;
+
+	KASSERT(curcpu->c_number == cpunum);
+	wqc = &wq->wq_cpus[cpunum];
+
+	while (1) {
+		/* Holding the sleep queue, interrupts are off. */
+		sleepq_lock(SLEEPQ_WAIT, wqc);
+		while (wqc->wqc_head == NULL && !wq->wq_dying) {
+			sleepq_sleep(SLEEPQ_WAIT, wqc, wq->wq_name);
+			sleepq_lock(SLEEPQ_WAIT, wqc);
+		}
+		w = wqc->wqc_head;
+		if (w == NULL) {
+			/* dying, and nothing left to do */
+			sleepq_unlock(SLEEPQ_WAIT, wqc);
+			break;
+		}
+		wqc->wqc_nrunning++;
+		wqc->wqc_head = w->w_next;
+		if (wqc->wqc_head == NULL) {
+			wqc->wqc_tailp = &wqc->wqc_head;
+		}
+		wqc->wqc_nqueued--;
+		sleepq_unlock(SLEEPQ_WAIT, wqc);
+
+		/*
+		 * Until w_onlist is cleared, anyone queueing it again
+		 * will think it's still on the list and only set
+		 * w_pending, which we're about to look at.
+		 */
+		work_lock(w);
+		w->w_onlist = false;
+		run = w->w_pending && !w->w_delayed;
+		if (run) {
+			w->w_pending = false;
+			func = w->w_func;
+			arg = w->w_data;
+			queuedat = w->w_queuedat;
+		}
+		work_unlock(w);
+
+		/* W may be queued again, or freed, from here on. */
+		if (run) {
+			wait = workqueue_now() - queuedat;
+			spl = splhigh();
+			wqc->wqc_ndone++;
+			wqc->wqc_waittotal += wait;
+			if (wait > wqc->wqc_waitmax) {
+				wqc->wqc_waitmax = wait > 0xffffffff ?
+					0xffffffff : wait;
+			}
+			splx(spl);
+
+			func(arg);
+		}
+
+		spl = splhigh();
+		wqc->wqc_nrunning--;
+		idle = wqc->wqc_head == NULL && wqc->wqc_nrunning == 0;
+		splx(spl);
+
+		if (idle) {
+			/* for workqueue_flush */
+			sleepq_lock(SLEEPQ_WAIT, wq);
+			sleepq_wakeall(SLEEPQ_WAIT, wq);
+			sleepq_unlock(SLEEPQ_WAIT, wq);
+		}
+	}
+
+	V(wq->wq_exitsem);
+}
+
+void
+workqueue_flush(struct workqueue *wq)
+{
+	KASSERT(curthread->t_in_interrupt == false);
+
+	sleepq_lock(SLEEPQ_WAIT, wq);
+	while (workqueue_busy(wq)) {
+		sleepq_sleep(SLEEPQ_WAIT, wq, "wqflush");
+		sleepq_lock(SLEEPQ_WAIT, wq);
+	}
+	sleepq_unlock(SLEEPQ_WAIT, wq);
+}
+
+////////////////////////////////////////////////////////////
+//
+// Setup and teardown
+
+/*
+ * Tell the workers to exit once their lists are empty, and wait for
+ * the first NSTARTED of them to do so.
+ */
+static
+void
+workqueue_stop(struct workqueue *wq, unsigned nstarted)
+{
+	unsigned i;
+
+	wq->wq_dying = true;
+	for (i=0; i<wq->wq_ncpus; i++) {
+		sleepq_lock(SLEEPQ_WAIT, &wq->wq_cpus[i]);
+		sleepq_wakeall(SLEEPQ_WAIT, &wq->wq_cpus[i]);
+		sleepq_unlock(SLEEPQ_WAIT, &wq->wq_cpus[i]);
+	}
+	for (i=0; i<nstarted; i++) {
+		P(wq->wq_exitsem);
+	}
+}
+
+struct workqueue *
+workqueue_create(const char *name, unsigned nworkers)
+{
+	struct workqueue *wq;
+	struct wq_cpu *wqc;
+	unsigned i, j, nstarted;
+	int result;
+
+	KASSERT(workqueues_lock != NULL);
+	KASSERT(nworkers > 0 && nworkers <= WQ_MAXWORKERS);
+
+	wq = kmalloc(sizeof(*wq));
+	if (wq == NULL) {
+		return NULL;
+	}
+	wq->wq_name = name;
+	wq->wq_ncpus = thread_numcpus();
+	wq->wq_nworkers = nworkers;
+	wq->wq_dying = false;
+	wq->wq_cpus = kmalloc(wq->wq_ncpus * sizeof(*wq->wq_cpus));
+	if (wq->wq_cpus == NULL) {
+		kfree(wq);
+		return NULL;
+	}
+	wq->wq_exitsem = sem_create("wqexit", 0);
+	if (wq->wq_exitsem == NULL) {
+		kfree(wq->wq_cpus);
+		kfree(wq);
+		return NULL;
+	}
+
+	for (i=0; i<wq->wq_ncpus; i++) {
+		wqc = &wq->wq_cpus[i];
+		wqc->wqc_head = NULL;
+		wqc->wqc_tailp = &wqc->wqc_head;
+		wqc->wqc_nqueued = 0;
+		wqc->wqc_nrunning = 0;
+		wqc->wqc_maxqueued = 0;
+		wqc->wqc_ndone = 0;
+		wqc->wqc_waittotal = 0;
+		wqc->wqc_waitmax = 0;
+	}
+
+	nstarted = 0;
+	for (i=0; i<wq->wq_ncpus; i++) {
+		for (j=0; j<nworkers; j++) {
+			result = thread_fork_bound(name, i, workqueue_worker,
+						   wq, i, NULL);
+			if (result) {
+				kprintf("workqueue %s: thread_fork_bound: "
+					"%s\n", name, strerror(result));
+				workqueue_stop(wq, nstarted);
+				sem_destroy(wq->wq_exitsem);
+				kfree(wq->wq_cpus);
+				kfree(wq);
+				return NULL;
+			}
+			nstarted++;
+		}
+	}
+
+	lock_acquire(workqueues_lock);
+	wq->wq_next = workqueues;
+	workqueues = wq;
+	lock_release(workqueues_lock);
+
+	return wq;
+}
+
+void
+workqueue_destroy(struct workqueue *wq)
+{
+	struct workqueue **wqp;
+
+	workqueue_flush(wq);
+	workqueue_stop(wq, wq->wq_ncpus * wq->wq_nworkers);
+
+	lock_acquire(workqueues_lock);
+	for (wqp = &workqueues; *wqp != wq; wqp = &(*wqp)->wq_next) {
+		KASSERT(*wqp != NULL);
+	}
+	*wqp = wq->wq_next;
+	lock_release(workqueues_lock);
+
+	sem_destroy(wq->wq_exitsem);
+	kfree(wq->wq_cpus);
+	kfree(wq);
+}
+
+/*
+ * Start the workqueue system. Call once all the cpus are running.
+ */
+void
+workqueue_bootstrap(void)
+{
+	workqueues_lock = lock_create("workqueues");
+	if (workqueues_lock == NULL) {
+		panic("workqueue_bootstrap: Out of memory\n");
+	}
+	system_wq = workqueue_create("events", 1);
+	if (system_wq == NULL) {
+		panic("workqueue_bootstrap: Cannot create system_wq\n");
+	}
+}
+
+////////////////////////////////////////////////////////////
+//
+// Statistics
+
+void
+workqueue_printstats(void)
+{
+	struct workqueue *wq;
+	struct wq_cpu *wqc;
+	unsigned i;
+
+	lock_acquire(workqueues_lock);
+	for (wq = workqueues; wq != NULL; wq = wq->wq_next) {
+		kprintf("workqueue %s: %u workers per cpu\n",
+			wq->wq_name, wq->wq_nworkers);
+		for (i=0; i<wq->wq_ncpus; i++) {
+			wqc = &wq->wq_cpus[i];
+			kprintf("  cpu%u: %u queued (max %u), %u run, "
+				"wait avg %llu us, max %u us\n",
+				i, wqc->wqc_nqueued, wqc->wqc_maxqueued,
+				wqc->wqc_ndone,
+				wqc->wqc_ndone ?
+				wqc->wqc_waittotal / wqc->wqc_ndone / 1000 : 0,
+				wqc->wqc_waitmax / 1000);
+		}
+	}
+	lock_release(workqueues_lock);
+}
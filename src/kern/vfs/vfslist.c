@@ -87,6 +87,14 @@ DEFARRAY(knowndev, /*no inline*/);
 
 static struct knowndevarray *knowndevs;
 
+/*
+ * Lock for knowndevs. The list (and each entry's kd_fs) only changes
+ * with both this held for writing and the big lock held, so looking
+ * at it needs either one. Name lookups, which are most of the traffic,
+ * take this for reading. Lock order: vfs_biglock, then knowndevs_lock.
+ */
+static struct rwlock *knowndevs_lock;
+
 /* The big lock for all FS ops. Remove for filesystem assignment. */
 static struct lock *vfs_biglock;
 static unsigned vfs_biglock_depth;
@@ -103,6 +111,11 @@ vfs_bootstrap(void)
 		panic("vfs: Could not create knowndevs array\n");
 	}
 
+	knowndevs_lock = rwlock_create("knowndevs");
+	if (knowndevs_lock==NULL) {
+		panic("vfs: Could not create knowndevs lock\n");
+	}
+
 	vfs_biglock = lock_create("vfs_biglock");
 	if (vfs_biglock==NULL) {
 		panic("vfs: Could not create vfs big lock\n");
@@ -172,6 +185,9 @@ vfs_sync(void)
 /*
  * Given a device name (lhd0, emu0, somevolname, null, etc.), hand
  * back an appropriate vnode.
+ *
+ * This needs the big lock for the FSOP calls anyway, and that keeps
+ * knowndevs still, so it doesn't bother with knowndevs_lock.
  */
 int
 vfs_getroot(const char *devname, struct vnode **result)
@@ -261,13 +277,13 @@ vfs_getdevname(struct fs *fs)
 
 	KASSERT(fs != NULL);
 
-	KASSERT(vfs_biglock_do_i_hold());
-
+	rwlock_acquire_read(knowndevs_lock);
 	num = knowndevarray_num(knowndevs);
 	for (i=0; i<num; i++) {
 		kd = knowndevarray_get(knowndevs, i);
 
 		if (kd->kd_fs == fs) {
+			rwlock_release_read(knowndevs_lock);
 			/*
 			 * This is not a race condition: as long as the
 			 * guy calling us holds a reference to the fs,
@@ -277,6 +293,7 @@ vfs_getdevname(struct fs *fs)
 			return kd->kd_name;
 		}
 	}
+	rwlock_release_read(knowndevs_lock);
 
 	return NULL;
 }
@@ -416,7 +433,9 @@ vfs_doadd(const char *dname, int mountable, struct device *dev, struct fs *fs)
 		return EEXIST;
 	}
 
+	rwlock_acquire_write(knowndevs_lock);
 	result = knowndevarray_add(knowndevs, kd, &index);
+	rwlock_release_write(knowndevs_lock);
 
 	if (result == 0 && dev != NULL) {
 		/* use index+1 as the device number, so 0 is reserved */
@@ -470,7 +489,7 @@ vfs_addfs(const char *devname, struct fs *fs)
 
 /*
  * Look for a mountable device named DEVNAME.
- * Should already hold knowndevs_lock.
+ * Should already hold the big lock, which keeps knowndevs still.
  */
 static
 int
@@ -537,7 +556,9 @@ vfs_mount(const char *devname, void *data,
 
 	KASSERT(fs != NULL);
 
+	rwlock_acquire_write(knowndevs_lock);
 	kd->kd_fs = fs;
+	rwlock_release_write(knowndevs_lock);
 
 	volname = FSOP_GETVOLNAME(fs);
 	kprintf("vfs: Mounted %s: on %s\n",
@@ -584,7 +605,9 @@ vfs_unmount(const char *devname)
 	kprintf("vfs: Unmounted %s:\n", kd->kd_name);
 
 	/* now drop the filesystem */
+	rwlock_acquire_write(knowndevs_lock);
 	kd->kd_fs = NULL;
+	rwlock_release_write(knowndevs_lock);
 
 	KASSERT(result==0);
 
@@ -647,7 +670,9 @@ vfs_unmountall(void)
 		}
 
 		/* now drop the filesystem */
+		rwlock_acquire_write(knowndevs_lock);
 		dev->kd_fs = NULL;
+		rwlock_release_write(knowndevs_lock);
 	}
 
 	vfs_biglock_release();
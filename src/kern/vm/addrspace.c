@@ -30,12 +30,14 @@
 #include <types.h>
 #include <kern/errno.h>
 #include <kern/unistd.h>
+#include <kern/mman.h>
 #include <limits.h>
 #include <lib.h>
 #include <array.h>
 #include <uio.h>
 #include <thread.h>
 #include <current.h>
+#include <synch.h>
 #include <addrspace.h>
 #include <vm.h>
 #include <vmprivate.h>
@@ -74,6 +76,15 @@ as_create(void)
 		kfree(as);
 		return NULL;
 	}
+	as->as_rwlock = rwlock_create("as");
+	if (as->as_rwlock == NULL) {
+		vm_object_array_destroy(as->as_objects);
+		kfree(as);
+		return NULL;
+	}
+	as->as_nlocked = 0;
+	as->as_heap = NULL;
+	as->as_heapend = 0;
 
 	return as;
 }
@@ -83,7 +94,7 @@ as_create(void)
  * copies each vm_object in the source address space into the new one.
  * Implements the VM system part of fork().
  *
- * Synchronization: none.
+ * Synchronization: holds the source's region list for reading.
  */
 int
 as_copy(struct addrspace *as, struct addrspace **ret)
@@ -111,6 +122,7 @@ as_copy(struct addrspace *as, struct addrspace **ret)
 
 
 	/* copy the vmos */
+	rwlock_acquire_read(as->as_rwlock);
 	for (i = 0; i < vm_object_array_num(as->as_objects); i++) {
 		vmo = vm_object_array_get(as->as_objects, i);
 
@@ -124,32 +136,44 @@ as_copy(struct addrspace *as, struct addrspace **ret)
 			vm_object_destroy(newas, newvmo);
 			goto fail;
 		}
+		if (vmo == as->as_heap) {
+			newas->as_heap = newvmo;
+		}
 	}
+	newas->as_heapend = as->as_heapend;
+	rwlock_release_read(as->as_rwlock);
 	
 	*ret = newas;
 	return 0;
 
 fail:
+	rwlock_release_read(as->as_rwlock);
 	as_destroy(newas);
 	return result;
 }
 
 /*
- * as_fault: fault handling. Handle a fault on an address space, of
- * specified type, at specified address.
+ * as_lookup: find the lpage for virtual address VA. Fails with
+ * EFAULT if VA isn't in any vm_object. If the page hasn't been
+ * touched yet and CREATE is set, materialize it as a zero-filled
+ * page; otherwise hand back NULL for it.
  *
- * Synchronization: none. We assume the address space is not shared,
- * so we don't lock it.
+ * Synchronization: the region list must be locked; for writing if
+ * CREATE is set, since that changes the vm_object.
  */
+static
 int
-as_fault(struct addrspace *as, int faulttype, vaddr_t va)
+as_lookup(struct addrspace *as, vaddr_t va, bool create,
+	  struct lpage **lpret)
 {
-	struct vm_object *faultobj = NULL;
+	struct vm_object *foundobj = NULL;
 	struct lpage *lp;
 	vaddr_t bot=0, top;
 	unsigned i, index;
 	int result;
 
+	KASSERT(!create || rwlock_do_i_hold(as->as_rwlock));
+
 	/* Find the vm_object concerned */
 	for (i=0; i<vm_object_array_num(as->as_objects); i++) {
 		struct vm_object *vmo;
@@ -158,33 +182,488 @@ as_fault(struct addrspace *as, int faulttype, vaddr_t va)
 		bot = vmo->vmo_base;
 		top = bot + PAGE_SIZE * lpage_array_num(vmo->vmo_lpages);
 		if (va >= bot && va < top) {
-			faultobj = vmo;
+			foundobj = vmo;
 			break;
 		}
 	}
 
-	if (faultobj == NULL) {
-		DEBUG(DB_VM, "vm_fault: EFAULT: va=0x%x\n", va);
+	if (foundobj == NULL) {
 		return EFAULT;
 	}
 
 	/* Now get the logical page */
 	index = (va - bot) / PAGE_SIZE;
-	lp = lpage_array_get(faultobj->vmo_lpages, index);
+	lp = lpage_array_get(foundobj->vmo_lpages, index);
 
-	if (lp == NULL) {
+	if (lp == NULL && create) {
 		/* zerofill page */
 		result = lpage_zerofill(&lp);
 		if (result) {
 			kprintf("vm: zerofill fault at 0x%x failed\n", va);
 			return result;
 		}
-		lpage_array_set(faultobj->vmo_lpages, index, lp);
+		lpage_array_set(foundobj->vmo_lpages, index, lp);
+	}
+
+	*lpret = lp;
+	return 0;
+}
+
+/*
+ * as_getlpage: as_lookup, taking the region lock.
+ *
+ * Synchronization: looks with the region list held for reading, and
+ * only if a page has to be made retakes it for writing (and looks
+ * again, since it may have changed in between). We assume the
+ * address space is not shared, so nobody else is after the page.
+ */
+static
+int
+as_getlpage(struct addrspace *as, vaddr_t va, bool create,
+	    struct lpage **lpret)
+{
+	struct lpage *lp;
+	int result;
+
+	rwlock_acquire_read(as->as_rwlock);
+	result = as_lookup(as, va, false, &lp);
+	rwlock_release_read(as->as_rwlock);
+	if (result) {
+		return result;
+	}
+
+	if (lp == NULL && create) {
+		rwlock_acquire_write(as->as_rwlock);
+		result = as_lookup(as, va, true, &lp);
+		rwlock_release_write(as->as_rwlock);
+		if (result) {
+			return result;
+		}
+	}
+
+	*lpret = lp;
+	return 0;
+}
+
+/*
+ * as_fault: fault handling. Handle a fault on an address space, of
+ * specified type, at specified address.
+ *
+ * Synchronization: as_getlpage does the lookup under the region lock.
+ * We assume the address space is not shared, so we don't lock the
+ * page beyond what lpage_fault does.
+ */
+int
+as_fault(struct addrspace *as, int faulttype, vaddr_t va)
+{
+	struct lpage *lp;
+	int result;
+
+	result = as_getlpage(as, va, true, &lp);
+	if (result == EFAULT) {
+		DEBUG(DB_VM, "vm_fault: EFAULT: va=0x%x\n", va);
+	}
+	if (result) {
+		return result;
 	}
 	
 	return lpage_fault(lp, as, faulttype, va);
 }
 
+/*
+ * as_mlock: lock the pages from VA to VA+LEN into memory. Pages that
+ * are already locked are left alone. Fails with EFAULT if part of the
+ * range isn't mapped, ENOMEM if the process would have more than
+ * AS_MAXLOCKED pages locked, and EAGAIN if the system is short of
+ * memory that can be wired down. On failure, pages locked by this
+ * call stay locked, as POSIX allows.
+ *
+ * Synchronization: holds the region list for writing, which also
+ * protects as_nlocked and the pages' LPF_LOCKED bits.
+ */
+int
+as_mlock(struct addrspace *as, vaddr_t va, size_t len)
+{
+	struct lpage *lp;
+	vaddr_t end;
+	int result;
+
+	end = ROUNDUP(va + len, PAGE_SIZE);
+	if (end < va) {
+		return EINVAL;
+	}
+
+	result = 0;
+	rwlock_acquire_write(as->as_rwlock);
+	for (va &= PAGE_FRAME; va < end; va += PAGE_SIZE) {
+		result = as_lookup(as, va, true, &lp);
+		if (result) {
+			break;
+		}
+		if (LP_ISLOCKED(lp)) {
+			continue;
+		}
+		if (as->as_nlocked >= AS_MAXLOCKED) {
+			result = ENOMEM;
+			break;
+		}
+
+		result = lpage_wire(lp);
+		if (result) {
+			break;
+		}
+		lpage_lock(lp);
+		LP_SET(lp, LPF_LOCKED);
+		lpage_unlock(lp);
+		as->as_nlocked++;
+	}
+	rwlock_release_write(as->as_rwlock);
+	return result;
+}
+
+/*
+ * as_munlock: undo as_mlock for the pages from VA to VA+LEN. Pages
+ * that aren't locked are ignored.
+ *
+ * Synchronization: as for as_mlock.
+ */
+int
+as_munlock(struct addrspace *as, vaddr_t va, size_t len)
+{
+	struct lpage *lp;
+	vaddr_t end;
+	int result;
+
+	end = ROUNDUP(va + len, PAGE_SIZE);
+	if (end < va) {
+		return EINVAL;
+	}
+
+	result = 0;
+	rwlock_acquire_write(as->as_rwlock);
+	for (va &= PAGE_FRAME; va < end; va += PAGE_SIZE) {
+		result = as_lookup(as, va, false, &lp);
+		if (result) {
+			break;
+		}
+		if (lp == NULL || !LP_ISLOCKED(lp)) {
+			continue;
+		}
+
+		lpage_lock(lp);
+		LP_CLEAR(lp, LPF_LOCKED);
+		lpage_unlock(lp);
+		lpage_unwire(lp);
+		KASSERT(as->as_nlocked > 0);
+		as->as_nlocked--;
+	}
+	rwlock_release_write(as->as_rwlock);
+	return result;
+}
+
+/*
+ * as_munlockall: unlock every locked page in the address space.
+ *
+ * Synchronization: as for as_mlock.
+ */
+void
+as_munlockall(struct addrspace *as)
+{
+	struct vm_object *vmo;
+	struct lpage *lp;
+	unsigned i, j;
+
+	rwlock_acquire_write(as->as_rwlock);
+	for (i=0; i<vm_object_array_num(as->as_objects); i++) {
+		if (as->as_nlocked == 0) {
+			break;
+		}
+		vmo = vm_object_array_get(as->as_objects, i);
+		for (j=0; j<lpage_array_num(vmo->vmo_lpages); j++) {
+			lp = lpage_array_get(vmo->vmo_lpages, j);
+			if (lp == NULL || !LP_ISLOCKED(lp)) {
+				continue;
+			}
+			lpage_lock(lp);
+			LP_CLEAR(lp, LPF_LOCKED);
+			lpage_unlock(lp);
+			lpage_unwire(lp);
+			as->as_nlocked--;
+		}
+	}
+	KASSERT(as->as_nlocked == 0);
+	rwlock_release_write(as->as_rwlock);
+}
+
+/*
+ * The guts of as_sbrk. Call with the region list locked.
+ */
+static
+int
+as_dosbrk(struct addrspace *as, int amount, vaddr_t *oldbreak)
+{
+	struct vm_object *vmo, *heap = as->as_heap;
+	vaddr_t base, newend, newtop, bot, top;
+	unsigned i;
+	int result;
+
+	if (heap == NULL) {
+		return ENOMEM;
+	}
+	base = heap->vmo_base;
+
+	if (amount < 0 && (vaddr_t)-amount > as->as_heapend - base) {
+		return EINVAL;
+	}
+	newend = as->as_heapend + amount;
+	if (amount > 0 && newend < as->as_heapend) {
+		return ENOMEM;
+	}
+	newtop = ROUNDUP(newend, PAGE_SIZE);
+	if (newtop < newend) {
+		return ENOMEM;
+	}
+
+	if (amount > 0) {
+		for (i = 0; i < vm_object_array_num(as->as_objects); i++) {
+			vmo = vm_object_array_get(as->as_objects, i);
+			if (vmo == heap) {
+				continue;
+			}
+			bot = vmo->vmo_base - vmo->vmo_lower_redzone;
+			top = vmo->vmo_base +
+				PAGE_SIZE * lpage_array_num(vmo->vmo_lpages);
+			if (newtop > bot && base < top) {
+				return ENOMEM;
+			}
+		}
+	}
+
+	result = vm_object_setsize(as, heap, (newtop - base) / PAGE_SIZE);
+	if (result) {
+		return result;
+	}
+
+	*oldbreak = as->as_heapend;
+	as->as_heapend = newend;
+	return 0;
+}
+
+/*
+ * as_sbrk: move the heap break by AMOUNT bytes and return the old
+ * break. The heap may not shrink below its base or grow into another
+ * region (or the guard band under the stack). Shrinking frees the
+ * pages that are no longer covered, and their swap, right away.
+ *
+ * Synchronization: holds the region list for writing.
+ */
+int
+as_sbrk(struct addrspace *as, int amount, vaddr_t *oldbreak)
+{
+	int result;
+
+	rwlock_acquire_write(as->as_rwlock);
+	result = as_dosbrk(as, amount, oldbreak);
+	rwlock_release_write(as->as_rwlock);
+
+	return result;
+}
+
+/*
+ * as_madvise: take advice about the pages from VA to VA+LEN. VA must
+ * be page-aligned and the whole range mapped. MADV_DONTNEED discards
+ * the pages (except mlocked ones); the other advice is ignored.
+ *
+ * Synchronization: holds the region list for writing, since
+ * discarding changes the vm_objects' pages.
+ */
+int
+as_madvise(struct addrspace *as, vaddr_t va, size_t len, int advice)
+{
+	struct vm_object *vmo;
+	vaddr_t end, bot, top;
+	unsigned i, first, npages;
+
+	switch (advice) {
+	    case MADV_NORMAL:
+	    case MADV_RANDOM:
+	    case MADV_SEQUENTIAL:
+	    case MADV_WILLNEED:
+	    case MADV_DONTNEED:
+		break;
+	    default:
+		return EINVAL;
+	}
+
+	if (va % PAGE_SIZE != 0) {
+		return EINVAL;
+	}
+	end = ROUNDUP(va + len, PAGE_SIZE);
+	if (end < va) {
+		return EINVAL;
+	}
+
+	rwlock_acquire_write(as->as_rwlock);
+	while (va < end) {
+		/* Find the vm_object holding va */
+		vmo = NULL;
+		bot = top = 0;
+		for (i = 0; i < vm_object_array_num(as->as_objects); i++) {
+			vmo = vm_object_array_get(as->as_objects, i);
+			bot = vmo->vmo_base;
+			top = bot + PAGE_SIZE * lpage_array_num(vmo->vmo_lpages);
+			if (va >= bot && va < top) {
+				break;
+			}
+			vmo = NULL;
+		}
+		if (vmo == NULL) {
+			rwlock_release_write(as->as_rwlock);
+			return ENOMEM;
+		}
+
+		if (end < top) {
+			top = end;
+		}
+		first = (va - bot) / PAGE_SIZE;
+		npages = (top - va) / PAGE_SIZE;
+		if (advice == MADV_DONTNEED) {
+			vm_object_discard(as, vmo, first, npages);
+		}
+		va = top;
+	}
+	rwlock_release_write(as->as_rwlock);
+	return 0;
+}
+
+/*
+ * as_pin_range: wire down the user pages from VA to VA+LEN so the
+ * kernel can do I/O straight into them (see as_pinned_uiomove)
+ * without any chance of faulting. Unlike mlock, pins nest and don't
+ * count against the process's locked-page limit; they are expected
+ * to be short-lived. Every successful call needs a matching
+ * as_unpin_range.
+ */
+int
+as_pin_range(struct addrspace *as, vaddr_t va, size_t len)
+{
+	struct lpage *lp;
+	vaddr_t start, end;
+	int result;
+
+	end = ROUNDUP(va + len, PAGE_SIZE);
+	if (end < va) {
+		return EFAULT;
+	}
+
+	start = va & PAGE_FRAME;
+	for (va = start; va < end; va += PAGE_SIZE) {
+		result = as_getlpage(as, va, true, &lp);
+		if (result == 0) {
+			result = lpage_wire(lp);
+		}
+		if (result) {
+			/* unwind */
+			if (va > start) {
+				as_unpin_range(as, start, va - start);
+			}
+			return result;
+		}
+	}
+	return 0;
+}
+
+/*
+ * as_unpin_range: drop the pins made by as_pin_range.
+ */
+void
+as_unpin_range(struct addrspace *as, vaddr_t va, size_t len)
+{
+	struct lpage *lp;
+	vaddr_t end;
+	int result;
+
+	end = ROUNDUP(va + len, PAGE_SIZE);
+	for (va &= PAGE_FRAME; va < end; va += PAGE_SIZE) {
+		result = as_getlpage(as, va, false, &lp);
+		KASSERT(result == 0);
+		KASSERT(lp != NULL);
+		lpage_unwire(lp);
+	}
+}
+
+/*
+ * as_pinned_uiomove: like uiomove, but for a user-space uio whose
+ * buffers have been pinned with as_pin_range. Copies through the
+ * kernel's direct mapping of the physical pages instead of through
+ * the user mapping, so it never faults and is safe to call while
+ * holding locks that paging might need (e.g. a disk's).
+ */
+int
+as_pinned_uiomove(void *ptr, size_t n, struct uio *uio)
+{
+	struct iovec *iov;
+	struct lpage *lp;
+	paddr_t pa;
+	vaddr_t uva, kva;
+	size_t size;
+	int result;
+
+	KASSERT(uio->uio_segflg != UIO_SYSSPACE);
+	KASSERT(uio->uio_space == curthread->t_addrspace);
+	KASSERT(uio->uio_rw == UIO_READ || uio->uio_rw == UIO_WRITE);
+
+	while (n > 0 && uio->uio_resid > 0) {
+		iov = uio->uio_iov;
+		size = iov->iov_len;
+		if (size == 0) {
+			uio->uio_iov++;
+			uio->uio_iovcnt--;
+			KASSERT(uio->uio_iovcnt > 0);
+			continue;
+		}
+
+		/* one page at a time */
+		uva = (vaddr_t)iov->iov_ubase;
+		if (size > PAGE_SIZE - (uva & ~PAGE_FRAME)) {
+			size = PAGE_SIZE - (uva & ~PAGE_FRAME);
+		}
+		if (size > n) {
+			size = n;
+		}
+
+		result = as_getlpage(uio->uio_space, uva, false, &lp);
+		if (result) {
+			return result;
+		}
+		KASSERT(lp != NULL);
+		pa = lp->lp_paddr & PAGE_FRAME;
+		KASSERT(pa != INVALID_PADDR);
+		KASSERT(coremap_pageiswired(pa));
+
+		kva = PADDR_TO_KVADDR(pa) + (uva & ~PAGE_FRAME);
+		if (uio->uio_rw == UIO_READ) {
+			/* reading into user memory; writing the page */
+			lpage_lock(lp);
+			LP_SET(lp, LPF_DIRTY);
+			lpage_unlock(lp);
+			memmove((void *)kva, ptr, size);
+		}
+		else {
+			memmove(ptr, (void *)kva, size);
+		}
+
+		iov->iov_ubase += size;
+		iov->iov_len -= size;
+		uio->uio_resid -= size;
+		uio->uio_offset += size;
+		ptr = ((char *)ptr + size);
+		n -= size;
+	}
+
+	return 0;
+}
+
 /*
  * as_destroy: wipe out an address space by destroying its components.
  * Synchronization: none.
@@ -199,9 +678,12 @@ as_destroy(struct addrspace *as)
 		vmo = vm_object_array_get(as->as_objects, i);
 		vm_object_destroy(as, vmo);
 	}
+	/* destroying the lpages dropped any mlock wirings */
+	KASSERT(as->as_nlocked == 0);
 
 	vm_object_array_setsize(as->as_objects, 0);
 	vm_object_array_destroy(as->as_objects);
+	rwlock_destroy(as->as_rwlock);
 	kfree(as);
 }
 
@@ -229,6 +711,8 @@ as_activate(struct addrspace *as)
  * moment, these are ignored.
  *
  * Does not allow overlapping regions.
+ *
+ * Synchronization: holds the region list for writing.
  */
 int
 as_define_region(struct addrspace *as, vaddr_t vaddr, size_t sz,
@@ -257,6 +741,8 @@ as_define_region(struct addrspace *as, vaddr_t vaddr, size_t sz,
 	/* size may not be */
 	sz = ROUNDUP(sz, PAGE_SIZE);
 
+	rwlock_acquire_write(as->as_rwlock);
+
 	/*
 	 * Check for overlaps.
 	 */
@@ -274,6 +760,7 @@ as_define_region(struct addrspace *as, vaddr_t vaddr, size_t sz,
 
 		if (check_vaddr+sz > bot && check_vaddr < top) {
 			/* overlap */
+			rwlock_release_write(as->as_rwlock);
 			return EINVAL;
 		}
 	}
@@ -282,6 +769,7 @@ as_define_region(struct addrspace *as, vaddr_t vaddr, size_t sz,
 	/* Create a new vmo. All pages are marked zerofilled. */
 	vmo = vm_object_create(sz/PAGE_SIZE);
 	if (vmo == NULL) {
+		rwlock_release_write(as->as_rwlock);
 		return ENOMEM;
 	}
 	vmo->vmo_base = vaddr;
@@ -290,11 +778,13 @@ as_define_region(struct addrspace *as, vaddr_t vaddr, size_t sz,
 	/* Add it to the parent address space. */
 	result = vm_object_array_add(as->as_objects, vmo, NULL);
 	if (result) {
+		rwlock_release_write(as->as_rwlock);
 		vm_object_destroy(as, vmo);
 		return result;
 	}
 
 	/* Done */
+	rwlock_release_write(as->as_rwlock);
 	return 0;
 }
 
@@ -313,16 +803,40 @@ as_prepare_load(struct addrspace *as)
 }
 
 /*
- * as_complete_load: called after loading executable segments.
+ * as_complete_load: called after loading executable segments. Sets
+ * up an empty heap object just above the highest segment.
  */
 int
 as_complete_load(struct addrspace *as)
 {
-	/*
-	 * Do nothing.
-	 */
+	struct vm_object *vmo;
+	vaddr_t top, heapbase;
+	unsigned i;
+	int result;
+
+	KASSERT(as->as_heap == NULL);
+
+	heapbase = 0;
+	rwlock_acquire_read(as->as_rwlock);
+	for (i = 0; i < vm_object_array_num(as->as_objects); i++) {
+		vmo = vm_object_array_get(as->as_objects, i);
+		top = vmo->vmo_base + PAGE_SIZE * lpage_array_num(vmo->vmo_lpages);
+		if (top > heapbase) {
+			heapbase = top;
+		}
+	}
+	rwlock_release_read(as->as_rwlock);
+
+	result = as_define_region(as, heapbase, 0, 0, 1, 1, 0);
+	if (result) {
+		return result;
+	}
+	rwlock_acquire_write(as->as_rwlock);
+	i = vm_object_array_num(as->as_objects) - 1;
+	as->as_heap = vm_object_array_get(as->as_objects, i);
+	as->as_heapend = heapbase;
+	rwlock_release_write(as->as_rwlock);
 
-	(void)as;
 	return 0;
 }
 
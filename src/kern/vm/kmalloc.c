@@ -29,8 +29,15 @@
 
 #include <types.h>
 #include <lib.h>
+#include <spl.h>
 #include <spinlock.h>
+#include <cpu.h>
+#include <current.h>
+#include <mainbus.h>
 #include <vm.h>
+#include <kmem_cache.h>
+#include <platform/maxcpus.h>
+#include "opt-kmallocprof.h"
 
 /*
  * Kernel malloc.
@@ -70,10 +77,10 @@ fill_deadbeef(void *vptr, size_t len)
 //    more blocks would fit on a page than with the existing block
 //    sizes, and large numbers of items of the new size are allocated.
 //
-//    The free counts and addresses of the pages are maintained in
-//    another list.  Maintaining this table is a nuisance, because it
-//    cannot recursively use the subpage allocator. (We could probably
-//    make that work, but it would be painful.)
+//    The free counts and addresses of the pages are kept in pageref
+//    structures, on lists by block size and fullness. The pagerefs
+//    can't recursively come from the subpage allocator, so they come
+//    from an object cache (see kmem_cache.c) instead.
 //
 
 #undef  SLOW	/* consistency checks */
@@ -102,8 +109,10 @@ struct freelist {
 };
 
 struct pageref {
-	struct pageref *next_samesize;
-	struct pageref *next_all;
+	struct pageref *next_samesize;	/* on one of the sizebases lists */
+	struct pageref *prev_samesize;
+	struct pageref *next_all;	/* on allbase */
+	struct pageref *prev_all;
 	vaddr_t pageaddr_and_blocktype;
 	uint16_t freelist_offset;
 	uint16_t nfree;
@@ -115,87 +124,129 @@ struct pageref {
 #define PR_BLOCKTYPE(pr) ((pr)->pageaddr_and_blocktype & ~PAGE_FRAME)
 #define MKPAB(pa, blk)   (((pa)&PAGE_FRAME) | ((blk) & ~PAGE_FRAME))
 
+#define PR_NBLOCKS(blk)  (PAGE_SIZE / sizes[blk])
+
+////////////////////////////////////////
+
+/*
+ * Pagerefs come from an object cache, which gets its pages straight
+ * from alloc_kpages, so there's no limit on how many we can have
+ * besides memory itself. (It used to be a single static page of
+ * them, which capped the kernel heap at 1M.)
+ *
+ * Since the object cache has its own lock, allocate and free pagerefs
+ * without holding kmalloc_spinlock.
+ */
+static struct kmem_cache pageref_cache =
+	KMEM_CACHE_INITIALIZER("kmalloc pageref", sizeof(struct pageref),
+			       0, NULL);
+
 ////////////////////////////////////////
 
 /*
- * This is cheesy. 
+ * The pages of each block size are kept on lists by how full they
+ * are, so finding a page to allocate from takes constant time:
+ *
+ *    sizebases[k][0 .. PRL_NPARTIAL-1]  pages with some blocks in use,
+ *                                       bucketed by fraction in use
+ *    sizebases[k][PRL_EMPTY]            pages with no blocks in use
  *
- * The problem is not that it's wasteful - we can only allocate whole
- * pages of pageref structures at a time anyway. The problem is that
- * we really ought to be able to have more than one of these pages.
+ * Pages with no free blocks aren't on any of these. Allocation takes
+ * from the fullest bucket that has anything in it, so that lightly
+ * used pages get a chance to drain and be released.
  *
- * However, for the time being, one page worth of pagerefs gives us
- * 256 pagerefs; this lets us manage 256 * 4k = 1M of kernel heap.
- * That would be twice as much memory as we get for *everything*.
- * Thus, we will cheat and not allow any mechanism for having a second
- * page of pageref structs.
+ * When a page becomes completely free, we keep one such page per
+ * block size on the empty list instead of handing it straight back,
+ * so a workload that allocates and frees across a page boundary
+ * doesn't bounce pages in and out of the coremap. The shrinker
+ * releases whatever is on the empty lists under memory pressure.
  *
- * Then, since the size is fixed at one page, we'll simplify a bit
- * further by allocating the page in the kernel BSS instead of calling
- * alloc_kpages to get it.
+ * All pages are also on allbase, for kheap_printstats.
  */
+#define PRL_NPARTIAL	4
+#define PRL_EMPTY	PRL_NPARTIAL
+#define PRL_NLISTS	(PRL_NPARTIAL + 1)
+#define PRL_NONE	(-1)		/* full; on no size list */
 
-#define NPAGEREFS (PAGE_SIZE / sizeof(struct pageref))
-static struct pageref pagerefs[NPAGEREFS];
-
-#define INUSE_WORDS (NPAGEREFS/32)
-static uint32_t pagerefs_inuse[INUSE_WORDS];
+static struct pageref *sizebases[NSIZES][PRL_NLISTS];
+static struct pageref *allbase;
 
+/*
+ * Which size list a page belongs on, given its free count.
+ */
 static
-struct pageref *
-allocpageref(void)
+int
+pr_listindex(struct pageref *pr)
 {
-	unsigned i,j;
-	uint32_t k;
+	unsigned nblocks;
 
-	for (i=0; i<INUSE_WORDS; i++) {
-		if (pagerefs_inuse[i]==0xffffffff) {
-			/* full */
-			continue;
-		}
-		for (k=1,j=0; k!=0; k<<=1,j++) {
-			if ((pagerefs_inuse[i] & k)==0) {
-				pagerefs_inuse[i] |= k;
-				return &pagerefs[i*32 + j];
-			}
-		}
-		KASSERT(0);
+	nblocks = PR_NBLOCKS(PR_BLOCKTYPE(pr));
+	if (pr->nfree == 0) {
+		return PRL_NONE;
 	}
-
-	/* ran out */
-	return NULL;
+	if (pr->nfree == nblocks) {
+		return PRL_EMPTY;
+	}
+	return ((nblocks - pr->nfree) * PRL_NPARTIAL) / nblocks;
 }
 
-static
-void
-freepageref(struct pageref *p)
-{
-	size_t i, j;
-	uint32_t k;
-
-	j = p-pagerefs;
-	KASSERT(j < NPAGEREFS);  /* note: j is unsigned, don't test < 0 */
-	i = j/32;
-	k = ((uint32_t)1) << (j%32);
-	KASSERT((pagerefs_inuse[i] & k) != 0);
-	pagerefs_inuse[i] &= ~k;
-}
+/*
+ * Map from physical page number to the pageref for that page, or
+ * NULL if the page isn't a subpage allocator page. This lets kfree
+ * find the block size of a pointer without searching allbase (and
+ * without holding kmalloc_spinlock, which the magazine layer below
+ * depends on). Entries only change under kmalloc_spinlock, and the
+ * entry for a page can't change while someone holds a block on it,
+ * so reading the entry for a block you're freeing is safe unlocked.
+ *
+ * The map is allocated by kmalloc_bootstrap; before that, lookups
+ * fall back to searching allbase.
+ */
+static struct pageref **pagerefmap;
+static unsigned pagerefmap_size;
 
 ////////////////////////////////////////
 
-static struct pageref *sizebases[NSIZES];
-static struct pageref *allbase;
+/*
+ * One spinlock protects the pages, lists, and map. The common case
+ * doesn't take it, though: see the per-cpu magazines below.
+ */
 
-////////////////////////////////////////
+static struct spinlock kmalloc_spinlock = SPINLOCK_INITIALIZER;
 
 /*
- * Use one spinlock for the whole thing. Making parts of the kmalloc
- * logic per-cpu is worthwhile for scalability; however, for the time
- * being at least we won't, because it adds a lot of complexity and in
- * OS/161 performance and scalability aren't super-critical.
+ * Per-cpu magazines.
+ *
+ * Each cpu keeps, for each block size, a small stack ("magazine") of
+ * free blocks. kmalloc pops from it and kfree pushes onto it with
+ * interrupts off and no lock at all: nothing else touches a cpu's
+ * magazines except that cpu, and with interrupts off we can't be
+ * preempted or migrated. Only when a magazine is empty (or full) do
+ * we take kmalloc_spinlock and move half a magazine's worth of blocks
+ * from (or to) the shared pages in one go.
+ *
+ * Blocks sitting in magazines look allocated as far as the pages are
+ * concerned, so a page can't be released while any of its blocks are
+ * in a magazine. The magazines are kept small to limit this, and the
+ * shrinker asks every cpu to empty its magazines.
  */
+#define MAG_MAXROUNDS	16
 
-static struct spinlock kmalloc_spinlock = SPINLOCK_INITIALIZER;
+struct magazine {
+	unsigned m_rounds;		/* number of blocks held */
+	void *m_objs[MAG_MAXROUNDS];
+};
+
+struct kmalloc_cpu {
+	struct magazine kc_mags[NSIZES];
+	volatile bool kc_drain;		/* shrinker wants magazines emptied */
+	unsigned kc_hits;		/* alloc/free done in the magazine */
+	unsigned kc_misses;		/* alloc that had to go to the pages */
+	unsigned kc_exchanges;		/* batch moves to/from the pages */
+};
+
+static struct kmalloc_cpu kmalloc_cpus[MAXCPUS];
+static bool magazines_enabled;
 
 ////////////////////////////////////////
 
@@ -252,26 +303,37 @@ void
 checksubpages(void)
 {
 	struct pageref *pr;
-	int i;
-	unsigned sc=0, ac=0;
+	int i, j;
+	unsigned sc=0, ac=0, fc=0, max;
 
 	KASSERT(spinlock_do_i_hold(&kmalloc_spinlock));
 
+	/* can't have more pages than there is memory */
+	max = mainbus_ramsize() / PAGE_SIZE;
+
 	for (i=0; i<NSIZES; i++) {
-		for (pr = sizebases[i]; pr != NULL; pr = pr->next_samesize) {
-			checksubpage(pr);
-			KASSERT(sc < NPAGEREFS);
-			sc++;
+		for (j=0; j<PRL_NLISTS; j++) {
+			for (pr = sizebases[i][j]; pr != NULL;
+			     pr = pr->next_samesize) {
+				checksubpage(pr);
+				KASSERT(PR_BLOCKTYPE(pr) == (unsigned)i);
+				KASSERT(pr_listindex(pr) == j);
+				KASSERT(sc < max);
+				sc++;
+			}
 		}
 	}
 
 	for (pr = allbase; pr != NULL; pr = pr->next_all) {
 		checksubpage(pr);
-		KASSERT(ac < NPAGEREFS);
+		KASSERT(ac < max);
 		ac++;
+		if (pr->nfree == 0) {
+			fc++;
+		}
 	}
 
-	KASSERT(sc==ac);
+	KASSERT(sc+fc==ac);
 }
 #else
 #define checksubpages() 
@@ -279,21 +341,26 @@ checksubpages(void)
 
 ////////////////////////////////////////
 
+#define FREEMAP_WORDS (PAGE_SIZE / (SMALLEST_SUBPAGE_SIZE*32))
+
+/*
+ * Fill in a bitmap of which blocks on a page are on its freelist.
+ * Returns the number of blocks on the page.
+ */
 static
-void
-dumpsubpage(struct pageref *pr)
+unsigned
+subpage_freemap(struct pageref *pr, uint32_t *freemap)
 {
 	vaddr_t prpage, fla;
 	struct freelist *fl;
 	int blktype;
 	unsigned i, n, index;
-	uint32_t freemap[PAGE_SIZE / (SMALLEST_SUBPAGE_SIZE*32)];
 
 	checksubpage(pr);
 	KASSERT(spinlock_do_i_hold(&kmalloc_spinlock));
 
 	/* clear freemap[] */
-	for (i=0; i<sizeof(freemap)/sizeof(freemap[0]); i++) {
+	for (i=0; i<FREEMAP_WORDS; i++) {
 		freemap[i] = 0;
 	}
 
@@ -302,7 +369,7 @@ dumpsubpage(struct pageref *pr)
 
 	/* compute how many bits we need in freemap and assert we fit */
 	n = PAGE_SIZE / sizes[blktype];
-	KASSERT(n <= 32*sizeof(freemap)/sizeof(freemap[0]));
+	KASSERT(n <= 32*FREEMAP_WORDS);
 
 	if (pr->freelist_offset != INVALID_OFFSET) {
 		fla = prpage + pr->freelist_offset;
@@ -316,6 +383,22 @@ dumpsubpage(struct pageref *pr)
 		}
 	}
 
+	return n;
+}
+
+static
+void
+dumpsubpage(struct pageref *pr)
+{
+	vaddr_t prpage;
+	int blktype;
+	unsigned i, n;
+	uint32_t freemap[FREEMAP_WORDS];
+
+	n = subpage_freemap(pr, freemap);
+	prpage = PR_PAGEADDR(pr);
+	blktype = PR_BLOCKTYPE(pr);
+
 	kprintf("at 0x%08lx: size %-4lu  %u/%u free\n", 
 		(unsigned long)prpage, (unsigned long) sizes[blktype],
 		(unsigned) pr->nfree, n);
@@ -334,6 +417,8 @@ void
 kheap_printstats(void)
 {
 	struct pageref *pr;
+	struct kmalloc_cpu *kc;
+	unsigned i, j;
 
 	/* print the whole thing with interrupts off */
 	spinlock_acquire(&kmalloc_spinlock);
@@ -344,34 +429,220 @@ kheap_printstats(void)
 		dumpsubpage(pr);
 	}
 
+	if (magazines_enabled) {
+		kprintf("Magazines (blocks held per size):\n");
+		for (i=0; i<MAXCPUS; i++) {
+			kc = &kmalloc_cpus[i];
+			if (kc->kc_hits + kc->kc_misses == 0) {
+				continue;
+			}
+			kprintf("   cpu%u:", i);
+			for (j=0; j<NSIZES; j++) {
+				kprintf(" %u", kc->kc_mags[j].m_rounds);
+			}
+			kprintf("  %u hits, %u misses, %u exchanges\n",
+				kc->kc_hits, kc->kc_misses,
+				kc->kc_exchanges);
+		}
+	}
+
 	spinlock_release(&kmalloc_spinlock);
+
+	kmem_cache_printstats();
 }
 
 ////////////////////////////////////////
 
+/*
+ * Record (or with pr NULL, clear) the pageref for a page in the
+ * pageref map, if we have one yet.
+ */
 static
 void
-remove_lists(struct pageref *pr, int blktype)
+pagerefmap_set(vaddr_t prpage, struct pageref *pr)
 {
-	struct pageref **guy;
+	unsigned ix;
 
-	KASSERT(blktype>=0 && blktype<NSIZES);
+	KASSERT(spinlock_do_i_hold(&kmalloc_spinlock));
 
-	for (guy = &sizebases[blktype]; *guy; guy = &(*guy)->next_samesize) {
-		checksubpage(*guy);
-		if (*guy == pr) {
-			*guy = pr->next_samesize;
-			break;
+	if (pagerefmap == NULL) {
+		return;
+	}
+	ix = KVADDR_TO_PADDR(prpage) / PAGE_SIZE;
+	KASSERT(ix < pagerefmap_size);
+	pagerefmap[ix] = pr;
+}
+
+/*
+ * Look up the pageref for the page holding ptraddr. Returns NULL if
+ * the address isn't on a subpage allocator page.
+ *
+ * With the map this does not need the lock (see above); without it
+ * we search allbase, which does.
+ */
+static
+struct pageref *
+pagerefmap_get(vaddr_t ptraddr)
+{
+	struct pageref *pr;
+	vaddr_t prpage;
+	unsigned ix;
+
+	if (pagerefmap != NULL) {
+		if (ptraddr < MIPS_KSEG0 || ptraddr >= MIPS_KSEG1) {
+			return NULL;
 		}
+		ix = KVADDR_TO_PADDR(ptraddr) / PAGE_SIZE;
+		if (ix >= pagerefmap_size) {
+			return NULL;
+		}
+		return pagerefmap[ix];
 	}
 
-	for (guy = &allbase; *guy; guy = &(*guy)->next_all) {
-		checksubpage(*guy);
-		if (*guy == pr) {
-			*guy = pr->next_all;
-			break;
+	KASSERT(spinlock_do_i_hold(&kmalloc_spinlock));
+
+	for (pr = allbase; pr; pr = pr->next_all) {
+		prpage = PR_PAGEADDR(pr);
+
+		/* check for corruption */
+		KASSERT(PR_BLOCKTYPE(pr) < NSIZES);
+		checksubpage(pr);
+
+		if (ptraddr >= prpage && ptraddr < prpage + PAGE_SIZE) {
+			return pr;
+		}
+	}
+	return NULL;
+}
+
+////////////////////////////////////////
+
+/*
+ * Size list handling. The lists are doubly linked so that moving a
+ * page between them is constant-time.
+ */
+static
+void
+sizelist_add(struct pageref *pr, int ix)
+{
+	struct pageref **head;
+
+	KASSERT(ix >= 0 && ix < PRL_NLISTS);
+	head = &sizebases[PR_BLOCKTYPE(pr)][ix];
+
+	pr->prev_samesize = NULL;
+	pr->next_samesize = *head;
+	if (*head != NULL) {
+		(*head)->prev_samesize = pr;
+	}
+	*head = pr;
+}
+
+static
+void
+sizelist_remove(struct pageref *pr, int ix)
+{
+	KASSERT(ix >= 0 && ix < PRL_NLISTS);
+
+	if (pr->prev_samesize != NULL) {
+		pr->prev_samesize->next_samesize = pr->next_samesize;
+	}
+	else {
+		KASSERT(sizebases[PR_BLOCKTYPE(pr)][ix] == pr);
+		sizebases[PR_BLOCKTYPE(pr)][ix] = pr->next_samesize;
+	}
+	if (pr->next_samesize != NULL) {
+		pr->next_samesize->prev_samesize = pr->prev_samesize;
+	}
+	pr->next_samesize = pr->prev_samesize = NULL;
+}
+
+/*
+ * Move a page to the right size list after its free count changed.
+ * OLDIX is the list it was on before.
+ */
+static
+void
+sizelist_update(struct pageref *pr, int oldix)
+{
+	int newix;
+
+	newix = pr_listindex(pr);
+	if (newix == oldix) {
+		return;
+	}
+	if (oldix != PRL_NONE) {
+		sizelist_remove(pr, oldix);
+	}
+	if (newix != PRL_NONE) {
+		sizelist_add(pr, newix);
+	}
+}
+
+/*
+ * Hook a new page into all the lists and the map.
+ */
+static
+void
+add_lists(struct pageref *pr)
+{
+	sizelist_add(pr, pr_listindex(pr));
+
+	pr->prev_all = NULL;
+	pr->next_all = allbase;
+	if (allbase != NULL) {
+		allbase->prev_all = pr;
+	}
+	allbase = pr;
+
+	pagerefmap_set(PR_PAGEADDR(pr), pr);
+}
+
+/*
+ * Unhook a page from all the lists and the map.
+ */
+static
+void
+remove_lists(struct pageref *pr)
+{
+	int ix;
+
+	ix = pr_listindex(pr);
+	if (ix != PRL_NONE) {
+		sizelist_remove(pr, ix);
+	}
+
+	if (pr->prev_all != NULL) {
+		pr->prev_all->next_all = pr->next_all;
+	}
+	else {
+		KASSERT(allbase == pr);
+		allbase = pr->next_all;
+	}
+	if (pr->next_all != NULL) {
+		pr->next_all->prev_all = pr->prev_all;
+	}
+	pr->next_all = pr->prev_all = NULL;
+
+	pagerefmap_set(PR_PAGEADDR(pr), NULL);
+}
+
+/*
+ * Find a page of the given block size with a free block, fullest
+ * first. Returns NULL if there isn't one.
+ */
+static
+struct pageref *
+sizelist_find(unsigned blktype)
+{
+	int ix;
+
+	for (ix = PRL_NPARTIAL-1; ix >= 0; ix--) {
+		if (sizebases[blktype][ix] != NULL) {
+			return sizebases[blktype][ix];
 		}
 	}
+	return sizebases[blktype][PRL_EMPTY];
 }
 
 static
@@ -392,198 +663,476 @@ int blocktype(size_t sz)
 	return 0;
 }
 
+/*
+ * Take one block off a page's freelist. The page must have one.
+ * Must hold kmalloc_spinlock.
+ */
 static
 void *
-subpage_kmalloc(size_t sz)
+subpage_takeblock(struct pageref *pr)
 {
-	unsigned blktype;	// index into sizes[] that we're using
-	struct pageref *pr;	// pageref for page we're allocating from
-	vaddr_t prpage;		// PR_PAGEADDR(pr)
-	vaddr_t fla;		// free list entry address
-	struct freelist *volatile fl;	// free list entry
-	void *retptr;		// our result
-
-	volatile int i;
-
-
-	blktype = blocktype(sz);
-	sz = sizes[blktype];
-
-	spinlock_acquire(&kmalloc_spinlock);
-
-	checksubpages();
+	vaddr_t prpage, fla;
+	struct freelist *fl;
+	void *retptr;
+	int oldix;
 
-	for (pr = sizebases[blktype]; pr != NULL; pr = pr->next_samesize) {
+	KASSERT(spinlock_do_i_hold(&kmalloc_spinlock));
+	KASSERT(pr->nfree > 0);
+	KASSERT(pr->freelist_offset < PAGE_SIZE);
 
-		/* check for corruption */
-		KASSERT(PR_BLOCKTYPE(pr) == blktype);
-		checksubpage(pr);
+	oldix = pr_listindex(pr);
+	prpage = PR_PAGEADDR(pr);
+	fla = prpage + pr->freelist_offset;
+	fl = (struct freelist *)fla;
 
-		if (pr->nfree > 0) {
+	retptr = fl;
+	fl = fl->next;
+	pr->nfree--;
 
-		doalloc: /* comes here after getting a whole fresh page */
+	if (fl != NULL) {
+		KASSERT(pr->nfree > 0);
+		fla = (vaddr_t)fl;
+		KASSERT(fla - prpage < PAGE_SIZE);
+		pr->freelist_offset = fla - prpage;
+	}
+	else {
+		KASSERT(pr->nfree == 0);
+		pr->freelist_offset = INVALID_OFFSET;
+	}
 
-			KASSERT(pr->freelist_offset < PAGE_SIZE);
-			prpage = PR_PAGEADDR(pr);
-			fla = prpage + pr->freelist_offset;
-			fl = (struct freelist *)fla;
+	sizelist_update(pr, oldix);
 
-			retptr = fl;
-			fl = fl->next;
-			pr->nfree--;
+	return retptr;
+}
 
-			if (fl != NULL) {
-				KASSERT(pr->nfree > 0);
-				fla = (vaddr_t)fl;
-				KASSERT(fla - prpage < PAGE_SIZE);
-				pr->freelist_offset = fla - prpage;
-			}
-			else {
-				KASSERT(pr->nfree == 0);
-				pr->freelist_offset = INVALID_OFFSET;
-			}
+/*
+ * Put a block back on its page's freelist. Returns true if this left
+ * the whole page free. Must hold kmalloc_spinlock.
+ */
+static
+bool
+subpage_putblock(struct pageref *pr, vaddr_t ptraddr)
+{
+	unsigned blktype;
+	vaddr_t prpage, offset;
+	struct freelist *fl;
+	int oldix;
 
-			checksubpages();
+	KASSERT(spinlock_do_i_hold(&kmalloc_spinlock));
 
-			spinlock_release(&kmalloc_spinlock);
-			return retptr;
-		}
-	}
+	oldix = pr_listindex(pr);
+	blktype = PR_BLOCKTYPE(pr);
+	prpage = PR_PAGEADDR(pr);
+	offset = ptraddr - prpage;
 
 	/*
-	 * No page of the right size available.
-	 * Make a new one.
-	 *
-	 * We release the spinlock while calling alloc_kpages. This
-	 * avoids deadlock if alloc_kpages needs to come back here.
-	 * Note that this means things can change behind our back...
+	 * We probably ought to check for free twice by seeing if the block
+	 * is already on the free list. But that's expensive, so we don't.
 	 */
 
-	spinlock_release(&kmalloc_spinlock);
-	prpage = alloc_kpages(1);
-	if (prpage==0) {
-		/* Out of memory. */
-		kprintf("kmalloc: Subpage allocator couldn't get a page\n"); 
-		return NULL;
+	fl = (struct freelist *)ptraddr;
+	if (pr->freelist_offset == INVALID_OFFSET) {
+		fl->next = NULL;
+	} else {
+		fl->next = (struct freelist *)(prpage + pr->freelist_offset);
 	}
-	spinlock_acquire(&kmalloc_spinlock);
+	pr->freelist_offset = offset;
+	pr->nfree++;
 
-	pr = allocpageref();
-	if (pr==NULL) {
-		/* Couldn't allocate accounting space for the new page. */
-		spinlock_release(&kmalloc_spinlock);
-		free_kpages(prpage);
-		kprintf("kmalloc: Subpage allocator couldn't get pageref\n"); 
+	KASSERT(pr->nfree <= PR_NBLOCKS(blktype));
+	sizelist_update(pr, oldix);
+
+	return pr->nfree == PR_NBLOCKS(blktype);
+}
+
+/*
+ * Dispose of a page that has become completely free: keep it if it's
+ * the only empty page of its size, otherwise unhook it. Returns the
+ * pageref to pass to subpage_freepage (after dropping the lock), or
+ * NULL if the page was kept.
+ */
+static
+struct pageref *
+subpage_release(struct pageref *pr)
+{
+	KASSERT(spinlock_do_i_hold(&kmalloc_spinlock));
+	KASSERT(pr_listindex(pr) == PRL_EMPTY);
+
+	if (sizebases[PR_BLOCKTYPE(pr)][PRL_EMPTY] == pr &&
+	    pr->next_samesize == NULL) {
+		/* Whole page is free; keep it as the spare. */
 		return NULL;
 	}
 
-	pr->pageaddr_and_blocktype = MKPAB(prpage, blktype);
-	pr->nfree = PAGE_SIZE / sizes[blktype];
+	remove_lists(pr);
+	return pr;
+}
 
-	/*
-	 * Note: fl is volatile because the MIPS toolchain we were
-	 * using in spring 2001 attempted to optimize this loop and
-	 * blew it. Making fl volatile inhibits the optimization.
+/*
+ * Give back a page that's been unhooked with remove_lists, and its
+ * pageref. Call without kmalloc_spinlock.
+ */
+static
+void
+subpage_freepage(struct pageref *pr)
+{
+	vaddr_t prpage;
+
+	prpage = PR_PAGEADDR(pr);
+	kmem_cache_free(&pageref_cache, pr);
+	free_kpages(prpage);
+}
+
+/*
+ * Check that ptr is a proper block of its page, and scribble on it.
+ */
+static
+void
+subpage_checkfree(struct pageref *pr, void *ptr)
+{
+	vaddr_t offset;
+	unsigned blktype;
+
+	blktype = PR_BLOCKTYPE(pr);
+	KASSERT(blktype < NSIZES);
+	offset = (vaddr_t)ptr - PR_PAGEADDR(pr);
+
+	/* Check for proper positioning and alignment */
+	if (offset >= PAGE_SIZE || offset % sizes[blktype] != 0) {
+		panic("kfree: subpage free of invalid addr %p\n", ptr);
+	}
+
+	/*
+	 * Clear the block to 0xdeadbeef to make it easier to detect
+	 * uses of dangling pointers.
 	 */
+	fill_deadbeef(ptr, sizes[blktype]);
+}
 
-	fla = prpage;
-	fl = (struct freelist *)fla;
-	fl->next = NULL;
-	for (i=1; i<pr->nfree; i++) {
-		fl = (struct freelist *)(fla + i*sizes[blktype]);
-		fl->next = (struct freelist *)(fla + (i-1)*sizes[blktype]);
-		KASSERT(fl != fl->next);
+////////////////////////////////////////
+
+/*
+ * Number of blocks a magazine holds for a given size. Keep it to at
+ * most half a page's worth so magazines can't pin down too much.
+ */
+static
+unsigned
+magazine_capacity(unsigned blktype)
+{
+	unsigned cap;
+
+	cap = PAGE_SIZE / sizes[blktype] / 2;
+	return cap > MAG_MAXROUNDS ? MAG_MAXROUNDS : cap;
+}
+
+/* Number of blocks moved per exchange with the shared pages. */
+#define MAG_BATCH(blktype) ((magazine_capacity(blktype) + 1) / 2)
+
+/*
+ * Move blocks from the magazine back to their pages: all of them if
+ * drain is set, otherwise the oldest batch. Pages this leaves free are
+ * released, except when draining, where they're left for the shrinker
+ * to collect (there could be a lot of them, and the shrinker is the
+ * one that wants them anyway).
+ *
+ * Call with interrupts off.
+ */
+static
+void
+magazine_flush(struct magazine *mag, unsigned blktype, bool drain)
+{
+	struct pageref *freepages[MAG_MAXROUNDS];
+	unsigned i, n, nfreepages;
+	struct pageref *pr;
+
+	n = drain ? mag->m_rounds : MAG_BATCH(blktype);
+	KASSERT(n <= mag->m_rounds);
+	nfreepages = 0;
+
+	spinlock_acquire(&kmalloc_spinlock);
+	for (i=0; i<n; i++) {
+		pr = pagerefmap_get((vaddr_t)mag->m_objs[i]);
+		KASSERT(pr != NULL);
+		KASSERT(PR_BLOCKTYPE(pr) == blktype);
+		if (subpage_putblock(pr, (vaddr_t)mag->m_objs[i]) && !drain) {
+			pr = subpage_release(pr);
+			if (pr != NULL) {
+				freepages[nfreepages++] = pr;
+			}
+		}
 	}
-	fla = (vaddr_t) fl;
-	pr->freelist_offset = fla - prpage;
-	KASSERT(pr->freelist_offset == (pr->nfree-1)*sizes[blktype]);
+	checksubpages();
+	spinlock_release(&kmalloc_spinlock);
+
+	/* slide the rest down */
+	for (i=n; i<mag->m_rounds; i++) {
+		mag->m_objs[i-n] = mag->m_objs[i];
+	}
+	mag->m_rounds -= n;
 
-	pr->next_samesize = sizebases[blktype];
-	sizebases[blktype] = pr;
+	for (i=0; i<nfreepages; i++) {
+		subpage_freepage(freepages[i]);
+	}
+}
 
-	pr->next_all = allbase;
-	allbase = pr;
+/*
+ * Get this cpu's magazine state, emptying it first if the shrinker
+ * asked. Call with interrupts off.
+ */
+static
+struct kmalloc_cpu *
+magazine_curcpu(void)
+{
+	struct kmalloc_cpu *kc;
+	unsigned i;
 
-	/* This is kind of cheesy, but avoids duplicating the alloc code. */
-	goto doalloc;
+	KASSERT(curcpu->c_number < MAXCPUS);
+	kc = &kmalloc_cpus[curcpu->c_number];
+
+	if (kc->kc_drain) {
+		kc->kc_drain = false;
+		for (i=0; i<NSIZES; i++) {
+			if (kc->kc_mags[i].m_rounds > 0) {
+				magazine_flush(&kc->kc_mags[i], i, true);
+			}
+		}
+	}
+	return kc;
 }
 
+/*
+ * Allocate from this cpu's magazine, refilling it from the shared
+ * pages if it's empty. Returns NULL if there's nothing to be had
+ * without allocating a new page, in which case the caller goes the
+ * slow way.
+ */
 static
-int
-subpage_kfree(void *ptr)
+void *
+magazine_get(unsigned blktype)
 {
-	int blktype;		// index into sizes[] that we're using
-	vaddr_t ptraddr;	// same as ptr
-	struct pageref *pr;	// pageref for page we're freeing in
+	struct kmalloc_cpu *kc;
+	struct magazine *mag;
+	struct pageref *pr;
+	unsigned want;
+	void *ret;
+	int spl;
+
+	if (!magazines_enabled || !CURCPU_EXISTS()) {
+		return NULL;
+	}
+
+	spl = splhigh();
+	kc = magazine_curcpu();
+	mag = &kc->kc_mags[blktype];
+
+	if (mag->m_rounds == 0) {
+		want = MAG_BATCH(blktype);
+		spinlock_acquire(&kmalloc_spinlock);
+		while (mag->m_rounds < want) {
+			pr = sizelist_find(blktype);
+			if (pr == NULL) {
+				break;
+			}
+			KASSERT(PR_BLOCKTYPE(pr) == blktype);
+			checksubpage(pr);
+			mag->m_objs[mag->m_rounds++] = subpage_takeblock(pr);
+		}
+		checksubpages();
+		spinlock_release(&kmalloc_spinlock);
+		kc->kc_exchanges++;
+	}
+
+	if (mag->m_rounds > 0) {
+		ret = mag->m_objs[--mag->m_rounds];
+		kc->kc_hits++;
+	}
+	else {
+		ret = NULL;
+		kc->kc_misses++;
+	}
+
+	splx(spl);
+	return ret;
+}
+
+/*
+ * Free into this cpu's magazine, first sending a batch back to the
+ * pages if it's full. Returns false if magazines aren't available
+ * and the caller should free the slow way.
+ */
+static
+bool
+magazine_put(void *ptr, unsigned blktype)
+{
+	struct kmalloc_cpu *kc;
+	struct magazine *mag;
+	int spl;
+
+	if (!magazines_enabled || !CURCPU_EXISTS()) {
+		return false;
+	}
+
+	spl = splhigh();
+	kc = magazine_curcpu();
+	mag = &kc->kc_mags[blktype];
+
+	if (mag->m_rounds >= magazine_capacity(blktype)) {
+		magazine_flush(mag, blktype, false);
+		kc->kc_exchanges++;
+	}
+	KASSERT(mag->m_rounds < magazine_capacity(blktype));
+	mag->m_objs[mag->m_rounds++] = ptr;
+	kc->kc_hits++;
+
+	splx(spl);
+	return true;
+}
+
+////////////////////////////////////////
+
+static
+void *
+subpage_kmalloc(size_t sz)
+{
+	unsigned blktype;	// index into sizes[] that we're using
+	struct pageref *pr;	// pageref for page we're allocating from
 	vaddr_t prpage;		// PR_PAGEADDR(pr)
 	vaddr_t fla;		// free list entry address
-	struct freelist *fl;	// free list entry
-	vaddr_t offset;		// offset into page
+	struct freelist *volatile fl;	// free list entry
+	void *retptr;		// our result
+
+	volatile int i;
 
-	ptraddr = (vaddr_t)ptr;
+
+	blktype = blocktype(sz);
+	sz = sizes[blktype];
+
+	retptr = magazine_get(blktype);
+	if (retptr != NULL) {
+		return retptr;
+	}
 
 	spinlock_acquire(&kmalloc_spinlock);
 
 	checksubpages();
 
-	for (pr = allbase; pr; pr = pr->next_all) {
-		prpage = PR_PAGEADDR(pr);
-		blktype = PR_BLOCKTYPE(pr);
+	pr = sizelist_find(blktype);
+	if (pr != NULL) {
 
 		/* check for corruption */
-		KASSERT(blktype>=0 && blktype<NSIZES);
+		KASSERT(PR_BLOCKTYPE(pr) == blktype);
 		checksubpage(pr);
 
-		if (ptraddr >= prpage && ptraddr < prpage + PAGE_SIZE) {
-			break;
-		}
-	}
+	doalloc: /* comes here after getting a whole fresh page */
 
-	if (pr==NULL) {
-		/* Not on any of our pages - not a subpage allocation */
-		spinlock_release(&kmalloc_spinlock);
-		return -1;
-	}
+		retptr = subpage_takeblock(pr);
 
-	offset = ptraddr - prpage;
+		checksubpages();
 
-	/* Check for proper positioning and alignment */
-	if (offset >= PAGE_SIZE || offset % sizes[blktype] != 0) {
-		panic("kfree: subpage free of invalid addr %p\n", ptr);
+		spinlock_release(&kmalloc_spinlock);
+		return retptr;
 	}
 
 	/*
-	 * Clear the block to 0xdeadbeef to make it easier to detect
-	 * uses of dangling pointers.
+	 * No page of the right size available.
+	 * Make a new one.
+	 *
+	 * We release the spinlock while calling alloc_kpages. This
+	 * avoids deadlock if alloc_kpages needs to come back here.
+	 * Note that this means things can change behind our back...
 	 */
-	fill_deadbeef(ptr, sizes[blktype]);
+
+	spinlock_release(&kmalloc_spinlock);
+	prpage = alloc_kpages(1);
+	if (prpage==0) {
+		/* Out of memory. */
+		kprintf("kmalloc: Subpage allocator couldn't get a page\n"); 
+		return NULL;
+	}
+
+	pr = kmem_cache_alloc(&pageref_cache);
+	if (pr==NULL) {
+		/* Couldn't allocate accounting space for the new page. */
+		free_kpages(prpage);
+		kprintf("kmalloc: Subpage allocator couldn't get pageref\n"); 
+		return NULL;
+	}
+
+	pr->pageaddr_and_blocktype = MKPAB(prpage, blktype);
+	pr->nfree = PR_NBLOCKS(blktype);
 
 	/*
-	 * We probably ought to check for free twice by seeing if the block
-	 * is already on the free list. But that's expensive, so we don't.
+	 * Note: fl is volatile because the MIPS toolchain we were
+	 * using in spring 2001 attempted to optimize this loop and
+	 * blew it. Making fl volatile inhibits the optimization.
+	 *
+	 * Nobody else can see the page yet, so we don't need the
+	 * lock for this part.
 	 */
 
-	fla = prpage + offset;
+	fla = prpage;
 	fl = (struct freelist *)fla;
-	if (pr->freelist_offset == INVALID_OFFSET) {
-		fl->next = NULL;
-	} else {
-		fl->next = (struct freelist *)(prpage + pr->freelist_offset);
+	fl->next = NULL;
+	for (i=1; i<pr->nfree; i++) {
+		fl = (struct freelist *)(fla + i*sizes[blktype]);
+		fl->next = (struct freelist *)(fla + (i-1)*sizes[blktype]);
+		KASSERT(fl != fl->next);
 	}
-	pr->freelist_offset = offset;
-	pr->nfree++;
+	fla = (vaddr_t) fl;
+	pr->freelist_offset = fla - prpage;
+	KASSERT(pr->freelist_offset == (pr->nfree-1)*sizes[blktype]);
 
-	KASSERT(pr->nfree <= PAGE_SIZE / sizes[blktype]);
-	if (pr->nfree == PAGE_SIZE / sizes[blktype]) {
-		/* Whole page is free. */
-		remove_lists(pr, blktype);
-		freepageref(pr);
-		/* Call free_kpages without kmalloc_spinlock. */
-		spinlock_release(&kmalloc_spinlock);
-		free_kpages(prpage);
+	spinlock_acquire(&kmalloc_spinlock);
+	add_lists(pr);
+
+	/* This is kind of cheesy, but avoids duplicating the alloc code. */
+	goto doalloc;
+}
+
+static
+int
+subpage_kfree(void *ptr)
+{
+	vaddr_t ptraddr;	// same as ptr
+	struct pageref *pr;	// pageref for page we're freeing in
+
+	ptraddr = (vaddr_t)ptr;
+
+	if (pagerefmap != NULL) {
+		/* Fast path: no lock needed to find the page. */
+		pr = pagerefmap_get(ptraddr);
+		if (pr == NULL) {
+			/* Not on any of our pages - not a subpage allocation */
+			return -1;
+		}
+		subpage_checkfree(pr, ptr);
+		if (magazine_put(ptr, PR_BLOCKTYPE(pr))) {
+			return 0;
+		}
+		spinlock_acquire(&kmalloc_spinlock);
 	}
 	else {
-		spinlock_release(&kmalloc_spinlock);
+		spinlock_acquire(&kmalloc_spinlock);
+		checksubpages();
+		pr = pagerefmap_get(ptraddr);
+		if (pr==NULL) {
+			/* Not on any of our pages - not a subpage allocation */
+			spinlock_release(&kmalloc_spinlock);
+			return -1;
+		}
+		subpage_checkfree(pr, ptr);
+	}
+
+	if (subpage_putblock(pr, ptraddr)) {
+		pr = subpage_release(pr);
+	}
+	else {
+		pr = NULL;
+	}
+	spinlock_release(&kmalloc_spinlock);
+
+	if (pr != NULL) {
+		subpage_freepage(pr);
 	}
 
 #ifdef SLOWER /* Don't get the lock unless checksubpages does something. */
@@ -595,11 +1144,99 @@ subpage_kfree(void *ptr)
 	return 0;
 }
 
+/*
+ * Shrinker callback: empty the magazines and give back the pages on
+ * the empty lists, spares included.
+ *
+ * We can only empty this cpu's magazines directly; the other cpus are
+ * flagged and empty theirs the next time they kmalloc or kfree, so
+ * what that frees up is picked up on the next call.
+ */
+static
+unsigned
+subpage_shrink(void *data, unsigned npages)
+{
+	struct pageref *pr;
+	unsigned i, count;
+	int spl;
+
+	(void)data;
+
+	if (magazines_enabled) {
+		for (i=0; i<MAXCPUS; i++) {
+			kmalloc_cpus[i].kc_drain = true;
+		}
+		spl = splhigh();
+		magazine_curcpu();
+		splx(spl);
+	}
+
+	count = 0;
+	for (i=0; i<NSIZES && count < npages; i++) {
+		while (count < npages) {
+			spinlock_acquire(&kmalloc_spinlock);
+			pr = sizebases[i][PRL_EMPTY];
+			if (pr != NULL) {
+				remove_lists(pr);
+			}
+			spinlock_release(&kmalloc_spinlock);
+			if (pr == NULL) {
+				break;
+			}
+			subpage_freepage(pr);
+			count++;
+		}
+	}
+
+	return count;
+}
+
 //
 ////////////////////////////////////////////////////////////
 
+/*
+ * Set up the pageref map and magazines, and hook kmalloc up to the VM
+ * system's memory-pressure callbacks. Called once at boot after
+ * vm_bootstrap, before the other cpus start.
+ */
+void
+kmalloc_bootstrap(void)
+{
+	struct pageref **map;
+	struct pageref *pr;
+	unsigned i, size;
+	int result;
+
+	size = mainbus_ramsize() / PAGE_SIZE;
+	map = kmalloc(size * sizeof(map[0]));
+	if (map == NULL) {
+		panic("kmalloc: Out of memory allocating pageref map\n");
+	}
+	for (i=0; i<size; i++) {
+		map[i] = NULL;
+	}
+
+	spinlock_acquire(&kmalloc_spinlock);
+	for (pr = allbase; pr != NULL; pr = pr->next_all) {
+		i = KVADDR_TO_PADDR(PR_PAGEADDR(pr)) / PAGE_SIZE;
+		KASSERT(i < size);
+		map[i] = pr;
+	}
+	pagerefmap_size = size;
+	pagerefmap = map;
+	magazines_enabled = true;
+	spinlock_release(&kmalloc_spinlock);
+
+	result = shrinker_register("kmalloc", SHRINKER_PRI_CACHE,
+				   subpage_shrink, NULL);
+	if (result) {
+		panic("kmalloc: shrinker_register: %s\n", strerror(result));
+	}
+}
+
+static
 void *
-kmalloc(size_t sz)
+kmalloc_raw(size_t sz)
 {
 	if (sz>=LARGEST_SUBPAGE_SIZE) {
 		unsigned long npages;
@@ -618,8 +1255,9 @@ kmalloc(size_t sz)
 	return subpage_kmalloc(sz);
 }
 
+static
 void
-kfree(void *ptr)
+kfree_raw(void *ptr)
 {
 	/*
 	 * Try subpage first; if that fails, assume it's a big allocation.
@@ -632,3 +1270,365 @@ kfree(void *ptr)
 	}
 }
 
+#if OPT_KMALLOCPROF
+
+////////////////////////////////////////////////////////////
+//
+// Allocation-site profiling (options kmallocprof).
+//
+// Every kmalloc records its caller's return address. Per call site
+// we keep the number of allocations, what's still live, and the
+// high-water mark of live bytes; use os161-addr2line on the kernel
+// to turn the addresses into source lines. Allocations made via
+// kstrdup all show up as kstrdup's call to kmalloc.
+//
+// Only kmalloc is covered. kmem_cache objects live on pages the caches
+// get straight from alloc_kpages, so neither the objects nor those
+// pages pass through here; kheap_printstats shows the per-cache counts.
+//
+// Each allocation also gets a sequence number, so we can list just
+// the allocations made since some point (kheap_setmark) - run a
+// program, and anything it left behind shows up.
+//
+// Subpage allocations get a small header in front of the block with
+// the site, size, and sequence number. Page-sized ones can't (people
+// rely on them being page-aligned), so they're tracked in a small
+// table instead; if that fills up, the overflow goes uncounted.
+//
+
+#define KPROF_NSITES	256		/* site 0 is "everything else" */
+#define KPROF_NBIG	64
+#define KPROF_MAGIC	0x6b70726f	/* "kpro" */
+
+struct kprof_hdr {
+	uint32_t kh_gen;	/* sequence number (clobbered on free) */
+	uint32_t kh_magic;	/* KPROF_MAGIC while allocated */
+	uint16_t kh_site;	/* index into kprof_sites */
+	uint16_t kh_size;	/* size the caller asked for */
+	uint32_t kh_unused;	/* keep what follows 8-aligned */
+};
+
+struct kprof_site {
+	vaddr_t ks_caller;	/* return address of the kmalloc call */
+	unsigned ks_allocs;	/* allocations ever */
+	unsigned ks_live;	/* allocations not yet freed */
+	size_t ks_livebytes;	/* bytes in those */
+	size_t ks_peakbytes;	/* high-water mark of ks_livebytes */
+};
+
+struct kprof_big {
+	vaddr_t kb_addr;	/* 0 if slot unused */
+	size_t kb_size;
+	uint32_t kb_gen;
+	unsigned kb_site;
+};
+
+static struct kprof_site kprof_sites[KPROF_NSITES];
+static struct kprof_big kprof_big[KPROF_NBIG];
+static uint32_t kprof_gen;		/* last sequence number handed out */
+static uint32_t kprof_mark;		/* sequence number at last mark */
+static size_t kprof_livebytes, kprof_peakbytes;
+static unsigned kprof_untracked;	/* big allocations we lost track of */
+
+/* Lock order: kmalloc_spinlock before this. */
+static struct spinlock kprof_spinlock = SPINLOCK_INITIALIZER;
+
+/*
+ * Find (or make) the site table entry for a caller.
+ */
+static
+unsigned
+kprof_getsite(vaddr_t caller)
+{
+	unsigned i, ix;
+
+	KASSERT(spinlock_do_i_hold(&kprof_spinlock));
+
+	ix = (caller >> 2) % (KPROF_NSITES - 1);
+	for (i=0; i<KPROF_NSITES-1; i++) {
+		if (kprof_sites[ix + 1].ks_caller == caller) {
+			return ix + 1;
+		}
+		if (kprof_sites[ix + 1].ks_caller == 0) {
+			kprof_sites[ix + 1].ks_caller = caller;
+			return ix + 1;
+		}
+		ix = (ix + 1) % (KPROF_NSITES - 1);
+	}
+
+	/* table full */
+	return 0;
+}
+
+static
+void
+kprof_count(unsigned site, size_t size, bool alloc)
+{
+	struct kprof_site *ks = &kprof_sites[site];
+
+	KASSERT(spinlock_do_i_hold(&kprof_spinlock));
+
+	if (alloc) {
+		ks->ks_allocs++;
+		ks->ks_live++;
+		ks->ks_livebytes += size;
+		if (ks->ks_livebytes > ks->ks_peakbytes) {
+			ks->ks_peakbytes = ks->ks_livebytes;
+		}
+		kprof_livebytes += size;
+		if (kprof_livebytes > kprof_peakbytes) {
+			kprof_peakbytes = kprof_livebytes;
+		}
+	}
+	else {
+		KASSERT(ks->ks_live > 0);
+		KASSERT(ks->ks_livebytes >= size);
+		ks->ks_live--;
+		ks->ks_livebytes -= size;
+		kprof_livebytes -= size;
+	}
+}
+
+static
+void *
+kprof_kmalloc(size_t sz, vaddr_t caller)
+{
+	struct kprof_hdr *kh;
+	void *ptr;
+	unsigned i;
+
+	if (sz + sizeof(struct kprof_hdr) < LARGEST_SUBPAGE_SIZE) {
+		kh = kmalloc_raw(sz + sizeof(struct kprof_hdr));
+		if (kh == NULL) {
+			return NULL;
+		}
+		spinlock_acquire(&kprof_spinlock);
+		kh->kh_gen = ++kprof_gen;
+		kh->kh_magic = KPROF_MAGIC;
+		kh->kh_site = kprof_getsite(caller);
+		kh->kh_size = sz;
+		kprof_count(kh->kh_site, sz, true);
+		spinlock_release(&kprof_spinlock);
+		return kh + 1;
+	}
+
+	/*
+	 * Sizes just under LARGEST_SUBPAGE_SIZE don't leave room for the
+	 * header, but kmalloc_raw would still put them in a subpage block,
+	 * which needn't be page-aligned. Ask for whole pages.
+	 */
+	ptr = kmalloc_raw(sz < LARGEST_SUBPAGE_SIZE ? LARGEST_SUBPAGE_SIZE : sz);
+	if (ptr == NULL) {
+		return NULL;
+	}
+	KASSERT((vaddr_t)ptr % PAGE_SIZE == 0);
+
+	spinlock_acquire(&kprof_spinlock);
+	for (i=0; i<KPROF_NBIG; i++) {
+		if (kprof_big[i].kb_addr == 0) {
+			break;
+		}
+	}
+	if (i < KPROF_NBIG) {
+		kprof_big[i].kb_addr = (vaddr_t)ptr;
+		kprof_big[i].kb_size = sz;
+		kprof_big[i].kb_gen = ++kprof_gen;
+		kprof_big[i].kb_site = kprof_getsite(caller);
+		kprof_count(kprof_big[i].kb_site, sz, true);
+	}
+	else {
+		kprof_untracked++;
+	}
+	spinlock_release(&kprof_spinlock);
+
+	return ptr;
+}
+
+static
+void
+kprof_kfree(void *ptr)
+{
+	struct kprof_hdr *kh;
+	unsigned i;
+
+	if (ptr == NULL) {
+		return;
+	}
+
+	if ((vaddr_t)ptr % PAGE_SIZE == 0) {
+		/* Big allocation; subpage ones are never page-aligned. */
+		spinlock_acquire(&kprof_spinlock);
+		for (i=0; i<KPROF_NBIG; i++) {
+			if (kprof_big[i].kb_addr == (vaddr_t)ptr) {
+				kprof_count(kprof_big[i].kb_site,
+					    kprof_big[i].kb_size, false);
+				kprof_big[i].kb_addr = 0;
+				break;
+			}
+		}
+		spinlock_release(&kprof_spinlock);
+		kfree_raw(ptr);
+		return;
+	}
+
+	kh = (struct kprof_hdr *)ptr - 1;
+	spinlock_acquire(&kprof_spinlock);
+	if (kh->kh_magic != KPROF_MAGIC) {
+		panic("kfree: %p was not allocated, or was freed twice\n",
+		      ptr);
+	}
+	kprof_count(kh->kh_site, kh->kh_size, false);
+	kh->kh_magic = 0;
+	spinlock_release(&kprof_spinlock);
+
+	kfree_raw(kh);
+}
+
+/*
+ * Print the call site table.
+ */
+void
+kheap_printsites(void)
+{
+	struct kprof_site *ks;
+	unsigned i;
+
+	spinlock_acquire(&kprof_spinlock);
+
+	kprintf("kmalloc call sites:\n");
+	kprintf("   %-10s %8s %10s %10s %8s\n",
+		"caller", "live", "livebytes", "peakbytes", "allocs");
+	for (i=0; i<KPROF_NSITES; i++) {
+		ks = &kprof_sites[i];
+		if (ks->ks_allocs == 0) {
+			continue;
+		}
+		if (i == 0) {
+			kprintf("   %-10s", "(other)");
+		}
+		else {
+			kprintf("   0x%08lx", (unsigned long)ks->ks_caller);
+		}
+		kprintf(" %8u %10lu %10lu %8u\n",
+			ks->ks_live, (unsigned long)ks->ks_livebytes,
+			(unsigned long)ks->ks_peakbytes, ks->ks_allocs);
+	}
+	kprintf("%lu bytes live, high-water mark %lu bytes; "
+		"%u allocations so far\n",
+		(unsigned long)kprof_livebytes,
+		(unsigned long)kprof_peakbytes, (unsigned)kprof_gen);
+	if (kprof_untracked > 0) {
+		kprintf("(%u large allocations not tracked)\n",
+			kprof_untracked);
+	}
+
+	spinlock_release(&kprof_spinlock);
+}
+
+/*
+ * Remember the current point in the allocation sequence.
+ */
+void
+kheap_setmark(void)
+{
+	spinlock_acquire(&kprof_spinlock);
+	kprof_mark = kprof_gen;
+	spinlock_release(&kprof_spinlock);
+
+	kprintf("kmalloc: mark set at allocation %u\n", (unsigned)kprof_mark);
+}
+
+/*
+ * List the allocations made since the mark that are still live.
+ */
+void
+kheap_dumpsincemark(void)
+{
+	struct pageref *pr;
+	struct kprof_hdr *kh;
+	uint32_t freemap[FREEMAP_WORDS];
+	vaddr_t prpage;
+	unsigned i, n, count;
+	size_t bytes;
+
+	count = 0;
+	bytes = 0;
+
+	spinlock_acquire(&kmalloc_spinlock);
+	spinlock_acquire(&kprof_spinlock);
+
+	kprintf("Allocations since mark (allocation %u):\n",
+		(unsigned)kprof_mark);
+
+	for (pr = allbase; pr != NULL; pr = pr->next_all) {
+		n = subpage_freemap(pr, freemap);
+		prpage = PR_PAGEADDR(pr);
+		for (i=0; i<n; i++) {
+			if (freemap[i/32] & (1<<(i%32))) {
+				continue;
+			}
+			/*
+			 * Blocks sitting in magazines have been
+			 * scribbled on by kfree, so the magic number
+			 * sorts them out.
+			 */
+			kh = (struct kprof_hdr *)
+				(prpage + i*sizes[PR_BLOCKTYPE(pr)]);
+			if (kh->kh_magic != KPROF_MAGIC ||
+			    kh->kh_gen <= kprof_mark) {
+				continue;
+			}
+			kprintf("   %p: %5u bytes from 0x%08lx (#%u)\n",
+				kh + 1, kh->kh_size,
+				(unsigned long)kprof_sites[kh->kh_site].ks_caller,
+				(unsigned)kh->kh_gen);
+			count++;
+			bytes += kh->kh_size;
+		}
+	}
+
+	for (i=0; i<KPROF_NBIG; i++) {
+		if (kprof_big[i].kb_addr == 0 ||
+		    kprof_big[i].kb_gen <= kprof_mark) {
+			continue;
+		}
+		kprintf("   0x%08lx: %5lu bytes from 0x%08lx (#%u)\n",
+			(unsigned long)kprof_big[i].kb_addr,
+			(unsigned long)kprof_big[i].kb_size,
+			(unsigned long)
+			kprof_sites[kprof_big[i].kb_site].ks_caller,
+			(unsigned)kprof_big[i].kb_gen);
+		count++;
+		bytes += kprof_big[i].kb_size;
+	}
+
+	kprintf("%u allocations, %lu bytes\n", count, (unsigned long)bytes);
+
+	spinlock_release(&kprof_spinlock);
+	spinlock_release(&kmalloc_spinlock);
+}
+
+//
+////////////////////////////////////////////////////////////
+
+#endif /* OPT_KMALLOCPROF */
+
+void *
+kmalloc(size_t sz)
+{
+#if OPT_KMALLOCPROF
+	return kprof_kmalloc(sz, (vaddr_t)__builtin_return_address(0));
+#else
+	return kmalloc_raw(sz);
+#endif
+}
+
+void
+kfree(void *ptr)
+{
+#if OPT_KMALLOCPROF
+	kprof_kfree(ptr);
+#else
+	kfree_raw(ptr);
+#endif
+}
@@ -0,0 +1,484 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Object caches. See kmem_cache.h.
+ *
+ * Each cache gets whole pages ("slabs") from alloc_kpages. A slab
+ * looks like this:
+ *
+ *    +--------------+----------+-----+-----+-----+-----+------+
+ *    | kmem_slab    | next-free| obj | obj | obj | ... |unused|
+ *    | header       | indexes  |  0  |  1  |  2  |     |      |
+ *    +--------------+----------+-----+-----+-----+-----+------+
+ *
+ * The free list is kept as an array of object indexes in the header
+ * rather than threaded through the free objects themselves, so that
+ * free objects keep their constructed contents. Since the header is
+ * at the start of the page, kmem_cache_free finds it by masking the
+ * object address.
+ *
+ * Each cache keeps its slabs on three lists: partly used, full, and
+ * empty. Allocation prefers partly used slabs so empty ones stay
+ * empty; when a slab empties we hang onto one of them per cache, and
+ * give the rest back to the coremap. The shrinker gives back the
+ * ones we hung onto.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <spinlock.h>
+#include <vm.h>
+#include <kmem_cache.h>
+
+#define KS_NOFREE	0xffff		/* end of slab free list */
+#define KMEM_MINPERSLAB	4		/* fewer than this: use kmalloc */
+
+struct kmem_slab {
+	struct kmem_slab *ks_next;	/* on one of the cache's lists */
+	struct kmem_slab *ks_prev;
+	struct kmem_cache *ks_cache;	/* cache we belong to */
+	uint16_t ks_nfree;		/* free objects in this slab */
+	uint16_t ks_freehead;		/* first free object, or KS_NOFREE */
+};
+
+/* The array of next-free indexes follows the header. */
+#define KS_NEXTFREE(ks) ((uint16_t *)((ks) + 1))
+
+#define KS_OBJ(kc, ks, ix) \
+	((void *)((vaddr_t)(ks) + (kc)->kc_objoffset + (ix) * (kc)->kc_stride))
+
+/*
+ * List of all caches that have been set up, for printstats and the
+ * shrinker. Lock order: this before the per-cache locks.
+ */
+static struct kmem_cache *allcaches;
+static struct spinlock allcaches_spinlock = SPINLOCK_INITIALIZER;
+
+////////////////////////////////////////////////////////////
+// slab lists
+
+static
+void
+slablist_add(struct kmem_slab **head, struct kmem_slab *ks)
+{
+	ks->ks_prev = NULL;
+	ks->ks_next = *head;
+	if (*head != NULL) {
+		(*head)->ks_prev = ks;
+	}
+	*head = ks;
+}
+
+static
+void
+slablist_remove(struct kmem_slab **head, struct kmem_slab *ks)
+{
+	if (ks->ks_prev != NULL) {
+		ks->ks_prev->ks_next = ks->ks_next;
+	}
+	else {
+		KASSERT(*head == ks);
+		*head = ks->ks_next;
+	}
+	if (ks->ks_next != NULL) {
+		ks->ks_next->ks_prev = ks->ks_prev;
+	}
+	ks->ks_next = ks->ks_prev = NULL;
+}
+
+////////////////////////////////////////////////////////////
+// setup
+
+/*
+ * Work out how to lay out objects on a slab, and put the cache on the
+ * list of all caches. Done the first time the cache is used so that
+ * static caches need no explicit setup.
+ */
+static
+void
+kmem_cache_setup(struct kmem_cache *kc)
+{
+	size_t align, hdrsize;
+	unsigned n;
+
+	spinlock_acquire(&allcaches_spinlock);
+	spinlock_acquire(&kc->kc_lock);
+	if (kc->kc_ready) {
+		/* someone else got here first */
+		spinlock_release(&kc->kc_lock);
+		spinlock_release(&allcaches_spinlock);
+		return;
+	}
+
+	align = kc->kc_align;
+	if (align == 0) {
+		align = sizeof(void *);
+	}
+	/* alignment must be a power of two */
+	KASSERT((align & (align - 1)) == 0);
+	KASSERT(kc->kc_size > 0);
+
+	kc->kc_stride = ROUNDUP(kc->kc_size, align);
+	n = (PAGE_SIZE - sizeof(struct kmem_slab)) /
+		(kc->kc_stride + sizeof(uint16_t));
+	while (n > 0) {
+		hdrsize = sizeof(struct kmem_slab) + n * sizeof(uint16_t);
+		if (ROUNDUP(hdrsize, align) + n * kc->kc_stride <= PAGE_SIZE) {
+			break;
+		}
+		n--;
+	}
+	if (n < KMEM_MINPERSLAB) {
+		panic("kmem_cache %s: objects of size %lu are too large\n",
+		      kc->kc_name, (unsigned long)kc->kc_size);
+	}
+	kc->kc_perslab = n;
+	kc->kc_objoffset =
+		ROUNDUP(sizeof(struct kmem_slab) + n * sizeof(uint16_t),
+			align);
+
+	kc->kc_next = allcaches;
+	allcaches = kc;
+	kc->kc_ready = true;
+
+	spinlock_release(&kc->kc_lock);
+	spinlock_release(&allcaches_spinlock);
+}
+
+struct kmem_cache *
+kmem_cache_create(const char *name, size_t size, size_t align,
+		  void (*ctor)(void *obj))
+{
+	struct kmem_cache *kc;
+
+	kc = kmalloc(sizeof(*kc));
+	if (kc == NULL) {
+		return NULL;
+	}
+
+	kc->kc_name = name;
+	kc->kc_size = size;
+	kc->kc_align = align;
+	kc->kc_ctor = ctor;
+	spinlock_init(&kc->kc_lock);
+	kc->kc_ready = false;
+	kc->kc_stride = 0;
+	kc->kc_perslab = 0;
+	kc->kc_objoffset = 0;
+	kc->kc_partial = NULL;
+	kc->kc_full = NULL;
+	kc->kc_empty = NULL;
+	kc->kc_next = NULL;
+	kc->kc_nslabs = 0;
+	kc->kc_inuse = 0;
+	kc->kc_allocs = 0;
+	kc->kc_ctors = 0;
+	kc->kc_reaped = 0;
+
+	return kc;
+}
+
+void
+kmem_cache_destroy(struct kmem_cache *kc)
+{
+	struct kmem_cache **p;
+	struct kmem_slab *ks;
+
+	KASSERT(kc->kc_inuse == 0);
+	KASSERT(kc->kc_partial == NULL);
+	KASSERT(kc->kc_full == NULL);
+
+	if (kc->kc_ready) {
+		spinlock_acquire(&allcaches_spinlock);
+		for (p = &allcaches; *p != kc; p = &(*p)->kc_next) {
+			KASSERT(*p != NULL);
+		}
+		*p = kc->kc_next;
+		spinlock_release(&allcaches_spinlock);
+	}
+
+	while (kc->kc_empty != NULL) {
+		ks = kc->kc_empty;
+		slablist_remove(&kc->kc_empty, ks);
+		free_kpages((vaddr_t)ks);
+	}
+
+	spinlock_cleanup(&kc->kc_lock);
+	kfree(kc);
+}
+
+////////////////////////////////////////////////////////////
+// allocation
+
+/*
+ * Get a fresh page and set it up as a slab, running the constructor
+ * on each object. Called without the cache lock; the new slab isn't
+ * visible to anyone else yet.
+ */
+static
+struct kmem_slab *
+kmem_slab_create(struct kmem_cache *kc)
+{
+	struct kmem_slab *ks;
+	uint16_t *nextfree;
+	vaddr_t page;
+	unsigned i;
+
+	page = alloc_kpages(1);
+	if (page == 0) {
+		return NULL;
+	}
+
+	ks = (struct kmem_slab *)page;
+	ks->ks_next = ks->ks_prev = NULL;
+	ks->ks_cache = kc;
+	ks->ks_nfree = kc->kc_perslab;
+	ks->ks_freehead = 0;
+
+	nextfree = KS_NEXTFREE(ks);
+	for (i=0; i<kc->kc_perslab; i++) {
+		nextfree[i] = (i + 1 < kc->kc_perslab) ? i + 1 : KS_NOFREE;
+		if (kc->kc_ctor != NULL) {
+			kc->kc_ctor(KS_OBJ(kc, ks, i));
+		}
+	}
+
+	return ks;
+}
+
+void *
+kmem_cache_alloc(struct kmem_cache *kc)
+{
+	struct kmem_slab *ks;
+	unsigned ix;
+
+	if (!kc->kc_ready) {
+		kmem_cache_setup(kc);
+	}
+
+	spinlock_acquire(&kc->kc_lock);
+
+	ks = kc->kc_partial;
+	if (ks == NULL) {
+		ks = kc->kc_empty;
+	}
+	if (ks == NULL) {
+		/*
+		 * Make a new slab. Drop the lock while calling
+		 * alloc_kpages (and the constructors) - things may
+		 * change behind our back, but we're adding a slab, so
+		 * that's fine.
+		 */
+		spinlock_release(&kc->kc_lock);
+		ks = kmem_slab_create(kc);
+		if (ks == NULL) {
+			return NULL;
+		}
+		spinlock_acquire(&kc->kc_lock);
+		kc->kc_nslabs++;
+		if (kc->kc_ctor != NULL) {
+			kc->kc_ctors += kc->kc_perslab;
+		}
+		slablist_add(&kc->kc_empty, ks);
+	}
+
+	KASSERT(ks->ks_nfree > 0);
+	KASSERT(ks->ks_freehead < kc->kc_perslab);
+
+	if (ks->ks_nfree == kc->kc_perslab) {
+		slablist_remove(&kc->kc_empty, ks);
+		slablist_add(&kc->kc_partial, ks);
+	}
+
+	ix = ks->ks_freehead;
+	ks->ks_freehead = KS_NEXTFREE(ks)[ix];
+	ks->ks_nfree--;
+
+	if (ks->ks_nfree == 0) {
+		KASSERT(ks->ks_freehead == KS_NOFREE);
+		slablist_remove(&kc->kc_partial, ks);
+		slablist_add(&kc->kc_full, ks);
+	}
+
+	kc->kc_inuse++;
+	kc->kc_allocs++;
+
+	spinlock_release(&kc->kc_lock);
+
+	return KS_OBJ(kc, ks, ix);
+}
+
+void
+kmem_cache_free(struct kmem_cache *kc, void *obj)
+{
+	struct kmem_slab *ks;
+	vaddr_t offset, freepage;
+	uint32_t *p;
+	unsigned ix, i;
+
+	if (obj == NULL) {
+		return;
+	}
+
+	ks = (struct kmem_slab *)((vaddr_t)obj & PAGE_FRAME);
+	if (ks->ks_cache != kc) {
+		panic("kmem_cache_free: %p is not from cache %s\n",
+		      obj, kc->kc_name);
+	}
+
+	offset = (vaddr_t)obj - (vaddr_t)ks;
+	if (offset < kc->kc_objoffset ||
+	    (offset - kc->kc_objoffset) % kc->kc_stride != 0) {
+		panic("kmem_cache_free: invalid address %p for cache %s\n",
+		      obj, kc->kc_name);
+	}
+	ix = (offset - kc->kc_objoffset) / kc->kc_stride;
+	KASSERT(ix < kc->kc_perslab);
+
+	if (kc->kc_ctor == NULL) {
+		/* no constructed state to keep; catch dangling pointers */
+		p = obj;
+		for (i=0; i<kc->kc_size/sizeof(uint32_t); i++) {
+			p[i] = 0xdeadbeef;
+		}
+	}
+
+	spinlock_acquire(&kc->kc_lock);
+
+	KASSERT(ks->ks_nfree < kc->kc_perslab);
+	if (ks->ks_nfree == 0) {
+		slablist_remove(&kc->kc_full, ks);
+		slablist_add(&kc->kc_partial, ks);
+	}
+
+	KS_NEXTFREE(ks)[ix] = ks->ks_freehead;
+	ks->ks_freehead = ix;
+	ks->ks_nfree++;
+	kc->kc_inuse--;
+
+	freepage = 0;
+	if (ks->ks_nfree == kc->kc_perslab) {
+		slablist_remove(&kc->kc_partial, ks);
+		if (kc->kc_empty == NULL) {
+			/* keep one empty slab around */
+			slablist_add(&kc->kc_empty, ks);
+		}
+		else {
+			kc->kc_nslabs--;
+			kc->kc_reaped++;
+			freepage = (vaddr_t)ks;
+		}
+	}
+
+	spinlock_release(&kc->kc_lock);
+
+	if (freepage != 0) {
+		/* Call free_kpages without the cache lock. */
+		free_kpages(freepage);
+	}
+}
+
+////////////////////////////////////////////////////////////
+// memory pressure and stats
+
+/*
+ * Shrinker callback: give back empty slabs.
+ */
+static
+unsigned
+kmem_cache_shrink(void *data, unsigned npages)
+{
+	struct kmem_cache *kc;
+	struct kmem_slab *ks;
+	unsigned count;
+
+	(void)data;
+
+	count = 0;
+	spinlock_acquire(&allcaches_spinlock);
+	for (kc = allcaches; kc != NULL && count < npages; kc = kc->kc_next) {
+		while (count < npages) {
+			spinlock_acquire(&kc->kc_lock);
+			ks = kc->kc_empty;
+			if (ks != NULL) {
+				slablist_remove(&kc->kc_empty, ks);
+				kc->kc_nslabs--;
+				kc->kc_reaped++;
+			}
+			spinlock_release(&kc->kc_lock);
+			if (ks == NULL) {
+				break;
+			}
+			free_kpages((vaddr_t)ks);
+			count++;
+		}
+	}
+	spinlock_release(&allcaches_spinlock);
+
+	return count;
+}
+
+void
+kmem_cache_bootstrap(void)
+{
+	int result;
+
+	result = shrinker_register("kmem_cache", SHRINKER_PRI_CACHE,
+				   kmem_cache_shrink, NULL);
+	if (result) {
+		panic("kmem_cache: shrinker_register: %s\n",
+		      strerror(result));
+	}
+}
+
+void
+kmem_cache_printstats(void)
+{
+	struct kmem_cache *kc;
+
+	spinlock_acquire(&allcaches_spinlock);
+
+	kprintf("Object caches:\n");
+	kprintf("   %-16s %5s %5s %4s %5s %6s %8s %8s %6s\n",
+		"name", "size", "slot", "per", "pages", "inuse",
+		"allocs", "ctors", "reaped");
+	for (kc = allcaches; kc != NULL; kc = kc->kc_next) {
+		spinlock_acquire(&kc->kc_lock);
+		kprintf("   %-16s %5lu %5lu %4u %5u %6u %8u %8u %6u\n",
+			kc->kc_name, (unsigned long)kc->kc_size,
+			(unsigned long)kc->kc_stride, kc->kc_perslab,
+			kc->kc_nslabs, kc->kc_inuse, kc->kc_allocs,
+			kc->kc_ctors, kc->kc_reaped);
+		spinlock_release(&kc->kc_lock);
+	}
+
+	spinlock_release(&allcaches_spinlock);
+}
@@ -31,6 +31,7 @@
 #include <kern/errno.h>
 #include <lib.h>
 #include <spinlock.h>
+#include <kmem_cache.h>
 #include <synch.h>
 #include <thread.h>
 #include <addrspace.h>
@@ -46,6 +47,7 @@
 static volatile uint32_t ct_zerofills;
 static volatile uint32_t ct_minfaults;
 static volatile uint32_t ct_majfaults;
+static volatile uint32_t ct_dirtyfaults;
 static volatile uint32_t ct_discard_evictions;
 static volatile uint32_t ct_write_evictions;
 static struct spinlock stats_spinlock = SPINLOCK_INITIALIZER;
@@ -53,12 +55,13 @@ static struct spinlock stats_spinlock = SPINLOCK_INITIALIZER;
 void
 vm_printstats(void)
 {
-	uint32_t zf, mn, mj, de, we, te;
+	uint32_t zf, mn, mj, df, de, we, te;
 
 	spinlock_acquire(&stats_spinlock);
 	zf = ct_zerofills;
 	mn = ct_minfaults;
 	mj = ct_majfaults;
+	df = ct_dirtyfaults;
 	de = ct_discard_evictions;
 	we = ct_write_evictions;
 	spinlock_release(&stats_spinlock);
@@ -67,11 +70,36 @@ vm_printstats(void)
 
 	kprintf("vm: %lu zerofills %lu minorfaults %lu majorfaults\n",
 		(unsigned long) zf, (unsigned long) mn, (unsigned long) mj);
-	kprintf("vm: %lu evictions (%lu discarding, %lu writes)\n",
-		(unsigned long) te, (unsigned long) de, (unsigned long) we);
+	kprintf("vm: %lu dirtying faults (first write to a clean page)\n",
+		(unsigned long) df);
+	kprintf("vm: %lu evictions (%lu writes, %lu discarding: "
+		"pageouts avoided)\n",
+		(unsigned long) te, (unsigned long) we, (unsigned long) de);
+	shrinker_printstats();
+	vmalloc_printstats();
+	kprintf("vm: ");
+	lock_printstats(global_paging_lock);
 	vm_printmdstats();
 }
 
+/*
+ * Cache for lpages. There are a lot of them and they're small, so
+ * this saves a fair amount over kmalloc. The spinlock is set up once
+ * by the constructor and stays set up while the lpage sits free in
+ * the cache.
+ */
+static
+void
+lpage_ctor(void *obj)
+{
+	struct lpage *lp = obj;
+
+	spinlock_init(&lp->lp_spinlock);
+}
+
+static struct kmem_cache lpage_cache =
+	KMEM_CACHE_INITIALIZER("lpage", sizeof(struct lpage), 0, lpage_ctor);
+
 /*
  * Create a logical page object.
  * Synchronization: none.
@@ -81,14 +109,13 @@ lpage_create(void)
 {
 	struct lpage *lp;
 
-	lp = kmalloc(sizeof(struct lpage));
+	lp = kmem_cache_alloc(&lpage_cache);
 	if (lp==NULL) {
 		return NULL;
 	}
 
 	lp->lp_swapaddr = INVALID_SWAPADDR;
 	lp->lp_paddr = INVALID_PADDR;
-	spinlock_init(&lp->lp_spinlock);
 
 	return lp;
 }
@@ -97,6 +124,9 @@ lpage_create(void)
  * lpage_destroy: deallocates a logical page. Releases any RAM or swap
  * pages involved.
  *
+ * lpage_discard: the same, for a page whose virtual page goes back to
+ * zero-fill (madvise). The swap page stays reserved for it.
+ *
  * Synchronization: Someone might be in the process of evicting the
  * page if it's resident, so it might be pinned. So lock and pin
  * together.
@@ -104,8 +134,9 @@ lpage_create(void)
  * We assume that lpages are not shared between address spaces and
  * address spaces are not shared between threads.
  */
-void 					
-lpage_destroy(struct lpage *lp)
+static
+void
+lpage_release(struct lpage *lp, bool keepreserved)
 {
 	paddr_t pa;
 
@@ -128,11 +159,31 @@ lpage_destroy(struct lpage *lp)
 	if (lp->lp_swapaddr != INVALID_SWAPADDR) {
 		DEBUG(DB_VM, "lpage_destroy: freeing swap addr 0x%llx\n", 
 		      lp->lp_swapaddr);
-		swap_free(lp->lp_swapaddr);
+		if (keepreserved) {
+			swap_free_reserved(lp->lp_swapaddr);
+		}
+		else {
+			swap_free(lp->lp_swapaddr);
+		}
 	}
 
+	/* the spinlock stays initialized for the next user */
 	spinlock_cleanup(&lp->lp_spinlock);
-	kfree(lp);
+	kmem_cache_free(&lpage_cache, lp);
+}
+
+void
+lpage_destroy(struct lpage *lp)
+{
+	lpage_release(lp, false);
+}
+
+void
+lpage_discard(struct lpage *lp)
+{
+	/* a materialized page always has swap */
+	KASSERT(lp->lp_swapaddr != INVALID_SWAPADDR);
+	lpage_release(lp, true);
 }
 
 
@@ -399,12 +450,73 @@ lpage_zerofill(struct lpage **lpret)
 	return 0;
 }
 
+/*
+ * lpage_pagein: make sure an lpage is resident, reading it in from
+ * swap if necessary. Returns with the lpage locked and the physical
+ * page pinned, and the physical address in PARET.
+ *
+ * Synchronization: as described for lpage_fault. The lpage is
+ * unlocked while the page is allocated and read in; this only works
+ * because lpages are not currently sharable.
+ */
+static
+int
+lpage_pagein(struct lpage *lp, paddr_t *paret)
+{
+	paddr_t pa;
+	off_t swa;
+
+	lpage_lock_and_pin(lp);
+
+	pa = lp->lp_paddr & PAGE_FRAME;
+	if (pa != INVALID_PADDR) {
+		KASSERT(coremap_pageispinned(pa));
+
+		spinlock_acquire(&stats_spinlock);
+		ct_minfaults++;
+		spinlock_release(&stats_spinlock);
+
+		*paret = pa;
+		return 0;
+	}
+
+	swa = lp->lp_swapaddr;
+	KASSERT(swa != INVALID_SWAPADDR);
+	lpage_unlock(lp);
+
+	pa = coremap_allocuser(lp);
+	if (pa == INVALID_PADDR) {
+		return ENOMEM;
+	}
+	KASSERT(coremap_pageispinned(pa));
+
+	lock_acquire(global_paging_lock);
+	swap_pagein(pa, swa);
+	lpage_lock(lp);
+	lock_release(global_paging_lock);
+
+	/* Assert nobody else did the pagein. */
+	KASSERT((lp->lp_paddr & PAGE_FRAME) == INVALID_PADDR);
+	lp->lp_paddr = pa;
+
+	spinlock_acquire(&stats_spinlock);
+	ct_majfaults++;
+	spinlock_release(&stats_spinlock);
+
+	*paret = pa;
+	return 0;
+}
+
 /*
  * lpage_fault - handle a fault on a specific lpage. If the page is
  * not resident, get a physical page from coremap and swap it in.
- * 
- * You do not yet need to distinguish a readonly fault from a write
- * fault. When we implement sharing, there will be a difference.
+ *
+ * Dirty tracking: a clean page (one whose swap copy is current) is
+ * mapped read-only, so the first write to it comes back here as
+ * VM_FAULT_READONLY. Then we mark it dirty and map it writable. This
+ * lets lpage_evict drop clean pages without writing them out. (All
+ * regions are currently writable, so a readonly fault always means
+ * this.)
  *
  * Synchronization: Lock the lpage while checking if it's in memory. 
  * If it's not, unlock the page while allocting space and loading the
@@ -419,11 +531,38 @@ lpage_zerofill(struct lpage **lpret)
 int
 lpage_fault(struct lpage *lp, struct addrspace *as, int faulttype, vaddr_t va)
 {
-	(void)lp;	// suppress compiler warning until code gets written
-	(void)as;	// suppress compiler warning until code gets written
-	(void)faulttype;// suppress compiler warning until code gets written
-	(void)va;	// suppress compiler warning until code gets written
-	return EUNIMP;	// suppress compiler warning until code gets written
+	paddr_t pa;
+	int writable;
+	int result;
+
+	result = lpage_pagein(lp, &pa);
+	if (result) {
+		return result;
+	}
+
+	switch (faulttype) {
+	    case VM_FAULT_READ:
+		/* map read-only unless it's already dirty */
+		writable = LP_ISDIRTY(lp) != 0;
+		break;
+	    case VM_FAULT_READONLY:
+		spinlock_acquire(&stats_spinlock);
+		ct_dirtyfaults++;
+		spinlock_release(&stats_spinlock);
+		/* FALLTHROUGH */
+	    case VM_FAULT_WRITE:
+		LP_SET(lp, LPF_DIRTY);
+		writable = 1;
+		break;
+	    default:
+		panic("vm: bad fault type %d\n", faulttype);
+	}
+
+	/* mmu_map unpins the page, so unlock the lpage first */
+	lpage_unlock(lp);
+	mmu_map(as, va, pa, writable);
+
+	return 0;
 }
 
 /*
@@ -437,5 +576,88 @@ lpage_fault(struct lpage *lp, struct addrspace *as, int faulttype, vaddr_t va)
 void
 lpage_evict(struct lpage *lp)
 {
-	(void)lp;	// suppress compiler warning until code gets written
+	paddr_t pa;
+	off_t swa;
+
+	KASSERT(lp != NULL);
+	lpage_lock(lp);
+
+	pa = lp->lp_paddr & PAGE_FRAME;
+	swa = lp->lp_swapaddr;
+
+	KASSERT(pa != INVALID_PADDR);
+	KASSERT(swa != INVALID_SWAPADDR);
+	KASSERT(coremap_pageispinned(pa));
+	KASSERT(!LP_ISLOCKED(lp));
+
+	/*
+	 * The swap slot stays allocated for the life of the lpage, so if
+	 * the page hasn't been written since it was last paged in, the
+	 * copy in swap is still good and we can just drop the page.
+	 */
+	if (LP_ISDIRTY(lp)) {
+		lpage_unlock(lp);
+		swap_pageout(pa, swa);
+		lpage_lock(lp);
+		KASSERT((lp->lp_paddr & PAGE_FRAME) == pa);
+
+		spinlock_acquire(&stats_spinlock);
+		ct_write_evictions++;
+		spinlock_release(&stats_spinlock);
+	}
+	else {
+		spinlock_acquire(&stats_spinlock);
+		ct_discard_evictions++;
+		spinlock_release(&stats_spinlock);
+	}
+
+	lp->lp_paddr = INVALID_PADDR;
+	lpage_unlock(lp);
+}
+
+/*
+ * lpage_wire: page in an lpage (if needed) and wire its physical page
+ * in the coremap, so it stays resident at the same physical address
+ * until lpage_unwire. Used for mlock and for pinning user buffers
+ * for I/O. Wirings nest.
+ *
+ * Synchronization: the lpage is locked and its page pinned while the
+ * wiring is set; neither is held on return.
+ */
+int
+lpage_wire(struct lpage *lp)
+{
+	paddr_t pa;
+	int result;
+
+	result = lpage_pagein(lp, &pa);
+	if (result) {
+		return result;
+	}
+	lpage_unlock(lp);
+
+	result = coremap_wire(pa);
+	coremap_unpin(pa);
+	return result;
+}
+
+/*
+ * lpage_unwire: drop a wiring made with lpage_wire.
+ *
+ * Synchronization: the page is wired, so it's resident and can't
+ * move; pin it anyway so the check below is honest.
+ */
+void
+lpage_unwire(struct lpage *lp)
+{
+	paddr_t pa;
+
+	lpage_lock_and_pin(lp);
+	pa = lp->lp_paddr & PAGE_FRAME;
+	KASSERT(pa != INVALID_PADDR);
+	KASSERT(coremap_pageiswired(pa));
+	lpage_unlock(lp);
+
+	coremap_unwire(pa);
+	coremap_unpin(pa);
 }
@@ -0,0 +1,235 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <spinlock.h>
+#include <synch.h>
+#include <thread.h>
+#include <current.h>
+#include <vm.h>
+#include <vmprivate.h>
+
+/*
+ * Shrinkers: memory-pressure callbacks.
+ *
+ * Kernel subsystems that hold memory they could give back on demand
+ * (idle caches, objects awaiting deferred cleanup) register a callback
+ * here. When the coremap is about to fail a kernel allocation, or is
+ * about to start evicting user pages, it calls shrinker_run(), which
+ * asks each registered shrinker in priority order (lowest number
+ * first) to release memory until enough pages have come back.
+ *
+ * Shrink passes only happen in thread context, with global_paging_lock
+ * held; that serializes them. Callbacks may block, but must not
+ * allocate memory: the coremap is already in the middle of an
+ * allocation and holds global_paging_lock.
+ */
+
+#define MAX_SHRINKERS	16
+
+struct shrinker {
+	const char *sh_name;		/* for stats */
+	unsigned sh_priority;		/* lower runs first */
+	unsigned (*sh_func)(void *data, unsigned npages);
+	void *sh_data;			/* passed to sh_func */
+	unsigned sh_calls;		/* times called */
+	unsigned sh_freed;		/* total pages it reported freeing */
+};
+
+/*
+ * The table is kept sorted by priority. The spinlock protects the
+ * table itself; it is not held across callbacks.
+ */
+static struct shrinker shrinkers[MAX_SHRINKERS];
+static unsigned num_shrinkers;
+static struct spinlock shrinker_spinlock = SPINLOCK_INITIALIZER;
+
+/* Stats counters */
+static unsigned ct_shrink_passes;	/* calls to shrinker_run */
+static unsigned ct_shrink_pages;	/* pages freed by all shrinkers */
+
+/*
+ * shrinker_register: add a shrinker. FUNC is called with DATA and the
+ * number of pages wanted, and should return the number of pages it
+ * actually released (which may be more or less than asked for).
+ *
+ * NAME should be a string constant.
+ *
+ * Synchronization: takes shrinker_spinlock. Does not block, so it can
+ * be called early in boot.
+ */
+int
+shrinker_register(const char *name, unsigned priority,
+		  unsigned (*func)(void *data, unsigned npages), void *data)
+{
+	unsigned i, pos;
+
+	KASSERT(func != NULL);
+
+	spinlock_acquire(&shrinker_spinlock);
+
+	if (num_shrinkers == MAX_SHRINKERS) {
+		spinlock_release(&shrinker_spinlock);
+		return ENOSPC;
+	}
+
+	/* Insert after any existing shrinkers of the same priority. */
+	for (pos = 0; pos < num_shrinkers; pos++) {
+		if (shrinkers[pos].sh_priority > priority) {
+			break;
+		}
+	}
+	for (i = num_shrinkers; i > pos; i--) {
+		shrinkers[i] = shrinkers[i-1];
+	}
+
+	shrinkers[pos].sh_name = name;
+	shrinkers[pos].sh_priority = priority;
+	shrinkers[pos].sh_func = func;
+	shrinkers[pos].sh_data = data;
+	shrinkers[pos].sh_calls = 0;
+	shrinkers[pos].sh_freed = 0;
+	num_shrinkers++;
+
+	spinlock_release(&shrinker_spinlock);
+	return 0;
+}
+
+/*
+ * shrinker_unregister: remove a shrinker previously registered with
+ * the same FUNC and DATA.
+ *
+ * Synchronization: holds global_paging_lock so that a shrink pass
+ * cannot be running the callback (or about to) when we return, after
+ * which the caller may free DATA.
+ */
+void
+shrinker_unregister(unsigned (*func)(void *data, unsigned npages), void *data)
+{
+	unsigned i;
+	bool found = false;
+
+#if !OPT_DUMBVM
+	lock_acquire(global_paging_lock);
+#endif
+	spinlock_acquire(&shrinker_spinlock);
+
+	for (i = 0; i < num_shrinkers; i++) {
+		if (found) {
+			shrinkers[i-1] = shrinkers[i];
+		}
+		else if (shrinkers[i].sh_func == func &&
+			 shrinkers[i].sh_data == data) {
+			found = true;
+		}
+	}
+	KASSERT(found);
+	num_shrinkers--;
+
+	spinlock_release(&shrinker_spinlock);
+#if !OPT_DUMBVM
+	lock_release(global_paging_lock);
+#endif
+}
+
+/*
+ * shrinker_run: ask the shrinkers, in priority order, to release
+ * NPAGES pages. Stops as soon as enough have been released. Returns
+ * the number of pages released.
+ *
+ * Synchronization: must be in thread context. The caller (the
+ * coremap) must hold global_paging_lock and must not hold any
+ * spinlocks, as the callbacks may block.
+ */
+unsigned
+shrinker_run(unsigned npages)
+{
+	unsigned (*func)(void *, unsigned);
+	void *data;
+	unsigned i, got, total;
+
+	KASSERT(curthread != NULL && !curthread->t_in_interrupt);
+#if !OPT_DUMBVM
+	KASSERT(lock_do_i_hold(global_paging_lock));
+#endif
+
+	total = 0;
+
+	spinlock_acquire(&shrinker_spinlock);
+	ct_shrink_passes++;
+	for (i = 0; i < num_shrinkers && total < npages; i++) {
+		func = shrinkers[i].sh_func;
+		data = shrinkers[i].sh_data;
+
+		spinlock_release(&shrinker_spinlock);
+		got = func(data, npages - total);
+		spinlock_acquire(&shrinker_spinlock);
+
+		/*
+		 * Registration may have shifted the table while we
+		 * were out; that can only make us skip or repeat an
+		 * entry this pass, which is harmless. Only charge the
+		 * stats if the entry is still the one we called.
+		 */
+		if (i < num_shrinkers && shrinkers[i].sh_func == func &&
+		    shrinkers[i].sh_data == data) {
+			shrinkers[i].sh_calls++;
+			shrinkers[i].sh_freed += got;
+		}
+		total += got;
+	}
+	ct_shrink_pages += total;
+	spinlock_release(&shrinker_spinlock);
+
+	DEBUG(DB_VM, "shrinker: wanted %u pages, got %u\n", npages, total);
+
+	return total;
+}
+
+/*
+ * shrinker_printstats: print shrinker counters.
+ */
+void
+shrinker_printstats(void)
+{
+	unsigned i;
+
+	spinlock_acquire(&shrinker_spinlock);
+	kprintf("vm: %u shrink passes, %u pages reclaimed\n",
+		ct_shrink_passes, ct_shrink_pages);
+	for (i = 0; i < num_shrinkers; i++) {
+		kprintf("vm:    shrinker %-12s pri %-3u %u calls, "
+			"%u pages\n",
+			shrinkers[i].sh_name, shrinkers[i].sh_priority,
+			shrinkers[i].sh_calls, shrinkers[i].sh_freed);
+	}
+	spinlock_release(&shrinker_spinlock);
+}
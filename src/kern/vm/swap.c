@@ -198,11 +198,14 @@ swap_alloc(void)
 
 /*
  * swap_free: marks a page in the swapfile as unused.
+ * swap_free_reserved: same, but the page stays reserved, for a page
+ * that goes back to zero-fill and may be materialized again.
  *
  * Synchronization: uses swaplock.
  */
+static
 void
-swap_free(off_t swapaddr)
+swap_dofree(off_t swapaddr, bool keepreserved)
 {
 	uint32_t index;
 
@@ -219,10 +222,25 @@ swap_free(off_t swapaddr)
 	KASSERT(bitmap_isset(swapmap, index));
 	bitmap_unmark(swapmap, index);
 	swap_free_pages++;
+	if (keepreserved) {
+		swap_reserved_pages++;
+	}
 
 	lock_release(swaplock);
 }
 
+void
+swap_free(off_t swapaddr)
+{
+	swap_dofree(swapaddr, false);
+}
+
+void
+swap_free_reserved(off_t swapaddr)
+{
+	swap_dofree(swapaddr, true);
+}
+
 /*
  * swap_reserve/unreserve: reserve some pages for future allocation, or
  * release such pages.
@@ -0,0 +1,375 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <spinlock.h>
+#include <synch.h>
+#include <thread.h>
+#include <current.h>
+#include <vm.h>
+#include <vmprivate.h>
+#include <machine/coremap.h>
+
+/*
+ * vmalloc: virtually contiguous kernel memory.
+ *
+ * alloc_kpages(npages) hands out kseg0 memory, so a multipage block
+ * has to be physically contiguous, and after the system has been up
+ * a while that gets hard to find. vmalloc instead takes single pages
+ * from wherever the coremap has them and maps them one after another
+ * into a window of kseg2 (VMALLOC_START to VMALLOC_END).
+ *
+ * The mappings live in a kernel page table, vmalloc_pt, with one
+ * entry per page of the window. Nothing is put in the TLB up front;
+ * a kseg2 access that misses comes through vm_fault to
+ * vmalloc_fault, which loads the entry with mmu_kmap.
+ *
+ * Freeing is lazy. vfree gives the physical pages back at once, but
+ * some CPU may still have the old translations in its TLB, so the
+ * virtual pages are only marked stale. When vmalloc runs out of
+ * window it flushes the kernel translations from every CPU
+ * (mmu_kflush) and then reuses all the stale pages in one go. That
+ * costs one round of IPIs per window's worth of frees instead of one
+ * per vfree.
+ *
+ * The page table itself is in kseg0, since the fault handler reads
+ * it. The fault handler takes vmalloc_spinlock and then
+ * coremap_spinlock, so neither may be held while touching vmalloc'd
+ * memory. Nor can it hold a kernel stack, which the exception handler
+ * has to be able to use without taking a TLB miss. That's why kmalloc
+ * never hands it out; callers that can live with it call vmalloc
+ * themselves.
+ */
+
+/* Page table entry bits. The physical page number is in the top. */
+#define VPTE_VALID	0x1	/* mapped */
+#define VPTE_LAST	0x2	/* last page of its allocation */
+#define VPTE_BUSY	0x4	/* reserved by an allocation in progress */
+#define VPTE_STALE	0x8	/* freed, may still be in a TLB */
+#define VPTE_PURGE	0x10	/* stale, and a flush is under way */
+#define VPTE_FRAME	PAGE_FRAME
+
+static uint32_t *vmalloc_pt;
+static struct spinlock vmalloc_spinlock = SPINLOCK_INITIALIZER;
+
+/* Serializes purges of stale pages. */
+static struct lock *vmalloc_purgelock;
+
+static unsigned vmalloc_nmapped;	/* pages VALID */
+static unsigned vmalloc_nstale;		/* pages STALE (with or w/o PURGE) */
+
+/* Stats counters */
+static unsigned ct_vallocs;
+static unsigned ct_vfaults;
+static unsigned ct_vpurges;
+
+/*
+ * vmalloc_bootstrap: set up the page table. Called from vm_bootstrap
+ * once the coremap is up.
+ */
+void
+vmalloc_bootstrap(void)
+{
+	unsigned npages;
+	vaddr_t pt;
+
+	npages = DIVROUNDUP(VMALLOC_PAGES * sizeof(uint32_t), PAGE_SIZE);
+	pt = alloc_kpages(npages);
+	if (pt == 0) {
+		panic("vmalloc: no memory for page table\n");
+	}
+	bzero((void *)pt, npages * PAGE_SIZE);
+
+	vmalloc_purgelock = lock_create("vmalloc_purge");
+	if (vmalloc_purgelock == NULL) {
+		panic("vmalloc: lock_create failed\n");
+	}
+
+	spinlock_acquire(&vmalloc_spinlock);
+	vmalloc_pt = (uint32_t *)pt;
+	spinlock_release(&vmalloc_spinlock);
+}
+
+/*
+ * Find NPAGES free entries in a row, mark them busy, and return the
+ * index of the first. Returns -1 if there's no room.
+ *
+ * Synchronization: assumes we hold vmalloc_spinlock.
+ */
+static
+int
+vmalloc_reserve(unsigned npages)
+{
+	unsigned i, run;
+
+	KASSERT(spinlock_do_i_hold(&vmalloc_spinlock));
+
+	run = 0;
+	for (i=0; i<VMALLOC_PAGES; i++) {
+		if (vmalloc_pt[i] != 0) {
+			run = 0;
+			continue;
+		}
+		run++;
+		if (run == npages) {
+			i = i + 1 - npages;
+			for (run = 0; run < npages; run++) {
+				vmalloc_pt[i + run] = VPTE_BUSY;
+			}
+			return i;
+		}
+	}
+	return -1;
+}
+
+/*
+ * Make the stale pages reusable: flush all kernel translations
+ * everywhere, then free the entries that were stale before the flush
+ * started. Pages freed while we wait keep their stale mark for the
+ * next round.
+ *
+ * Synchronization: takes vmalloc_purgelock and vmalloc_spinlock.
+ * Blocks.
+ */
+static
+void
+vmalloc_purge(void)
+{
+	unsigned i;
+
+	lock_acquire(vmalloc_purgelock);
+
+	spinlock_acquire(&vmalloc_spinlock);
+	for (i=0; i<VMALLOC_PAGES; i++) {
+		if (vmalloc_pt[i] == VPTE_STALE) {
+			vmalloc_pt[i] |= VPTE_PURGE;
+		}
+	}
+	spinlock_release(&vmalloc_spinlock);
+
+	mmu_kflush();
+
+	spinlock_acquire(&vmalloc_spinlock);
+	for (i=0; i<VMALLOC_PAGES; i++) {
+		if (vmalloc_pt[i] == (VPTE_STALE | VPTE_PURGE)) {
+			vmalloc_pt[i] = 0;
+			KASSERT(vmalloc_nstale > 0);
+			vmalloc_nstale--;
+		}
+	}
+	ct_vpurges++;
+	spinlock_release(&vmalloc_spinlock);
+
+	lock_release(vmalloc_purgelock);
+}
+
+/*
+ * vmalloc: allocate SZ bytes of virtually contiguous kernel memory.
+ * Returns NULL if there's no memory or no room in the window.
+ *
+ * Synchronization: takes vmalloc_spinlock. May block (thread context
+ * only).
+ */
+void *
+vmalloc(size_t sz)
+{
+	unsigned npages, i;
+	int base;
+	vaddr_t kva;
+	uint32_t pte;
+
+	KASSERT(curthread != NULL && !curthread->t_in_interrupt);
+
+	if (vmalloc_pt == NULL || sz == 0) {
+		return NULL;
+	}
+	npages = DIVROUNDUP(sz, PAGE_SIZE);
+	if (npages > VMALLOC_PAGES) {
+		return NULL;
+	}
+
+	spinlock_acquire(&vmalloc_spinlock);
+	base = vmalloc_reserve(npages);
+	if (base < 0 && vmalloc_nstale > 0) {
+		spinlock_release(&vmalloc_spinlock);
+		vmalloc_purge();
+		spinlock_acquire(&vmalloc_spinlock);
+		base = vmalloc_reserve(npages);
+	}
+	spinlock_release(&vmalloc_spinlock);
+	if (base < 0) {
+		return NULL;
+	}
+
+	for (i=0; i<npages; i++) {
+		kva = alloc_kpages(1);
+		if (kva == 0) {
+			break;
+		}
+		pte = (KVADDR_TO_PADDR(kva) & VPTE_FRAME) | VPTE_VALID;
+		if (i == npages - 1) {
+			pte |= VPTE_LAST;
+		}
+		spinlock_acquire(&vmalloc_spinlock);
+		vmalloc_pt[base + i] = pte;
+		vmalloc_nmapped++;
+		spinlock_release(&vmalloc_spinlock);
+	}
+
+	if (i < npages) {
+		/*
+		 * Out of memory; undo. Nobody has seen these addresses,
+		 * so they can't be in any TLB and can be reused at once.
+		 */
+		spinlock_acquire(&vmalloc_spinlock);
+		while (i-- > 0) {
+			pte = vmalloc_pt[base + i];
+			free_kpages(PADDR_TO_KVADDR(pte & VPTE_FRAME));
+			vmalloc_pt[base + i] = 0;
+			vmalloc_nmapped--;
+		}
+		for (i=0; i<npages; i++) {
+			if (vmalloc_pt[base + i] == VPTE_BUSY) {
+				vmalloc_pt[base + i] = 0;
+			}
+		}
+		spinlock_release(&vmalloc_spinlock);
+		return NULL;
+	}
+
+	spinlock_acquire(&vmalloc_spinlock);
+	ct_vallocs++;
+	spinlock_release(&vmalloc_spinlock);
+
+	return (void *)(VMALLOC_START + base * PAGE_SIZE);
+}
+
+/*
+ * vfree: free memory from vmalloc. The physical pages go back to the
+ * coremap now; the virtual ones once the next purge has run.
+ *
+ * Synchronization: takes vmalloc_spinlock. Does not block.
+ */
+void
+vfree(void *ptr)
+{
+	vaddr_t va;
+	unsigned ix;
+	uint32_t pte;
+
+	if (ptr == NULL) {
+		return;
+	}
+
+	va = (vaddr_t)ptr;
+	KASSERT(va >= VMALLOC_START && va < VMALLOC_END);
+	KASSERT(va % PAGE_SIZE == 0);
+	ix = (va - VMALLOC_START) / PAGE_SIZE;
+
+	spinlock_acquire(&vmalloc_spinlock);
+
+	if (ix > 0 && (vmalloc_pt[ix-1] & VPTE_VALID) &&
+	    !(vmalloc_pt[ix-1] & VPTE_LAST)) {
+		panic("vfree: %p is not the start of a block\n", ptr);
+	}
+
+	do {
+		KASSERT(ix < VMALLOC_PAGES);
+		pte = vmalloc_pt[ix];
+		if (!(pte & VPTE_VALID)) {
+			panic("vfree: %p was not allocated, or was freed "
+			      "twice\n", ptr);
+		}
+		free_kpages(PADDR_TO_KVADDR(pte & VPTE_FRAME));
+		vmalloc_pt[ix] = VPTE_STALE;
+		vmalloc_nmapped--;
+		vmalloc_nstale++;
+		ix++;
+	} while (!(pte & VPTE_LAST));
+
+	spinlock_release(&vmalloc_spinlock);
+}
+
+/*
+ * vmalloc_fault: handle a TLB miss on a kseg2 address. Called by
+ * vm_fault; returns EFAULT if the address isn't mapped.
+ *
+ * Synchronization: takes vmalloc_spinlock. Does not block, so it's
+ * fine in interrupt handlers.
+ */
+int
+vmalloc_fault(vaddr_t va)
+{
+	unsigned ix;
+	uint32_t pte;
+
+	KASSERT(va >= MIPS_KSEG2);
+
+	if (va < VMALLOC_START || va >= VMALLOC_END) {
+		return EFAULT;
+	}
+	ix = (va - VMALLOC_START) / PAGE_SIZE;
+
+	spinlock_acquire(&vmalloc_spinlock);
+	if (vmalloc_pt == NULL || !(vmalloc_pt[ix] & VPTE_VALID)) {
+		spinlock_release(&vmalloc_spinlock);
+		return EFAULT;
+	}
+	pte = vmalloc_pt[ix];
+	/* Hold the spinlock so the page can't be freed under us. */
+	mmu_kmap(va & PAGE_FRAME, pte & VPTE_FRAME);
+	ct_vfaults++;
+	spinlock_release(&vmalloc_spinlock);
+
+	return 0;
+}
+
+/*
+ * Print the vmalloc counters.
+ */
+void
+vmalloc_printstats(void)
+{
+	unsigned nm, ns, va, vf, vp;
+
+	spinlock_acquire(&vmalloc_spinlock);
+	nm = vmalloc_nmapped;
+	ns = vmalloc_nstale;
+	va = ct_vallocs;
+	vf = ct_vfaults;
+	vp = ct_vpurges;
+	spinlock_release(&vmalloc_spinlock);
+
+	kprintf("vm: vmalloc: %u/%u pages mapped, %u stale\n",
+		nm, VMALLOC_PAGES, ns);
+	kprintf("vm: vmalloc: %u allocations, %u faults, %u purges\n",
+		va, vf, vp);
+}
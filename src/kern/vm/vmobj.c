@@ -142,30 +142,59 @@ vm_object_copy(struct vm_object *vmo, struct addrspace *newas,
 }
 
 /*
- * vm_object_setsize: change the size of a vm_object.
+ * vm_object_droppage: take page I out of a vm_object and get rid of
+ * it, releasing its RAM right away. If KEEPRESERVED is set the slot
+ * goes back to zero-fill and keeps its swap reservation; otherwise
+ * the swap space goes too. Leaves the slot NULL.
+ */
+static
+void
+vm_object_droppage(struct addrspace *as, struct vm_object *vmo, unsigned i,
+		   bool keepreserved)
+{
+	struct lpage *lp;
+
+	lp = lpage_array_get(vmo->vmo_lpages, i);
+	if (lp == NULL) {
+		if (!keepreserved) {
+			swap_unreserve(1);
+		}
+		return;
+	}
+
+	KASSERT(as != NULL);
+	/* remove any tlb entry for this mapping */
+	mmu_unmap(as, vmo->vmo_base+PAGE_SIZE*i);
+	/* freeing the page drops its mlock wiring */
+	if (LP_ISLOCKED(lp)) {
+		KASSERT(as->as_nlocked > 0);
+		as->as_nlocked--;
+	}
+	lpage_array_set(vmo->vmo_lpages, i, NULL);
+	if (keepreserved) {
+		lpage_discard(lp);
+	}
+	else {
+		lpage_destroy(lp);
+	}
+}
+
+/*
+ * vm_object_setsize: change the size of a vm_object. Pages cut off
+ * the end are released immediately, RAM and swap both.
  */
 int
 vm_object_setsize(struct addrspace *as, struct vm_object *vmo, unsigned npages)
 {
 	int result;
 	unsigned i;
-	struct lpage *lp;
 
 	KASSERT(vmo != NULL);
 	KASSERT(vmo->vmo_lpages != NULL);
 
 	if (npages < lpage_array_num(vmo->vmo_lpages)) {
 		for (i=npages; i<lpage_array_num(vmo->vmo_lpages); i++) {
-			lp = lpage_array_get(vmo->vmo_lpages, i);
-			if (lp != NULL) {
-				KASSERT(as != NULL);
-				/* remove any tlb entry for this mapping */
-				mmu_unmap(as, vmo->vmo_base+PAGE_SIZE*i);
-				lpage_destroy(lp);
-			}
-			else {
-				swap_unreserve(1);
-			}
+			vm_object_droppage(as, vmo, i, false);
 		}
 		result = lpage_array_setsize(vmo->vmo_lpages, npages);
 		/* shrinking an array shouldn't fail */
@@ -192,6 +221,30 @@ vm_object_setsize(struct addrspace *as, struct vm_object *vmo, unsigned npages)
 	return 0;
 }
 
+/*
+ * vm_object_discard: throw away the contents of NPAGES pages starting
+ * at page FIRST, returning them to zero-fill (madvise MADV_DONTNEED).
+ * Their RAM and swap pages are freed now, but the swap stays
+ * reserved. Pages locked with mlock are left alone.
+ */
+void
+vm_object_discard(struct addrspace *as, struct vm_object *vmo,
+		  unsigned first, unsigned npages)
+{
+	struct lpage *lp;
+	unsigned i;
+
+	KASSERT(first + npages <= lpage_array_num(vmo->vmo_lpages));
+
+	for (i=first; i<first+npages; i++) {
+		lp = lpage_array_get(vmo->vmo_lpages, i);
+		if (lp == NULL || LP_ISLOCKED(lp)) {
+			continue;
+		}
+		vm_object_droppage(as, vmo, i, true);
+	}
+}
+
 /*
  * vm_object_destroy: Deallocates a vm_object.
  *
@@ -39,9 +39,11 @@
  */
 #include <kern/fcntl.h>
 #include <kern/ioctl.h>
+#include <kern/mman.h>
 #include <kern/reboot.h>
 #include <kern/seek.h>
 #include <kern/time.h>
+#include <kern/resource.h>
 #include <kern/unistd.h>
 #include <kern/wait.h>
 
@@ -118,6 +120,7 @@
 __DEAD void _exit(int code);
 int execv(const char *prog, char *const *args);
 pid_t fork(void);
+pid_t vfork(void);
 int waitpid(pid_t pid, int *returncode, int flags);
 /* 
  * Open actually takes either two or three args: the optional third
@@ -148,12 +151,19 @@ int chdir(const char *path);
 
 /* Optional. */
 void *sbrk(int change);
+int madvise(void *addr, size_t len, int advice);
+int mlock(const void *addr, size_t len);
+int munlock(const void *addr, size_t len);
+int munlockall(void);
+int getpriority(int which, pid_t who);
+int setpriority(int which, pid_t who, int prio);
 int getdirentry(int filehandle, char *buf, size_t buflen);
 int symlink(const char *target, const char *linkname);
 int readlink(const char *path, char *buf, size_t buflen);
 int dup2(int filehandle, int newhandle);
 int pipe(int filehandles[2]);
 time_t __time(time_t *seconds, unsigned long *nanoseconds);
+int nanosleep(const struct timespec *req, struct timespec *rem);
 int __getcwd(char *buf, size_t buflen);
 /* stat - see sys/stat.h */
 /* lstat - see sys/stat.h */
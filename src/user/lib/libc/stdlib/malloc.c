@@ -30,10 +30,37 @@
 /*
  * User-level malloc and free implementation.
  *
- * This is a basic first-fit allocator. It's intended to be simple and
- * easy to follow. It performs abysmally if the heap becomes larger than
- * physical memory. To get (much) better out-of-core performance, port
- * the kernel's malloc. :-)
+ * Free blocks are kept on segregated free lists, one per size class,
+ * so malloc doesn't have to walk the heap. The small classes hold one
+ * exact size each (1 to NSMALLCLASSES blocks of data); above that
+ * each class covers a power-of-two range of sizes, and the last one
+ * holds everything bigger. A small request takes the head of the
+ * first nonempty list that fits; a larger one looks through its own
+ * class and then takes from the next nonempty class up. Requests of
+ * MLARGE bytes or more search their class best-fit instead of
+ * first-fit, to keep big holes from being chewed up.
+ *
+ * Every block has a header that records the offsets to both of its
+ * neighbours (a boundary tag), so free can coalesce with the blocks
+ * on either side in constant time. Adjacent free blocks are always
+ * merged, so the free lists never hold two blocks next to each other.
+ *
+ * When nothing fits, the heap is grown with sbrk in MGROWSIZE
+ * multiples. If the topmost block is free it is extended rather than
+ * left behind as a fragment.
+ *
+ * Memory goes back to the system two ways. When the free block at the
+ * top of the heap reaches MTRIMSIZE, free shrinks the heap with a
+ * negative sbrk, keeping MGROWSIZE or so in hand. When a page or more
+ * is freed in the middle of the heap and the free block it ends up
+ * in spans at least MRELEASESIZE of whole pages, those pages are
+ * handed back with madvise(MADV_DONTNEED); they stay part of the
+ * heap and come back zero-filled when next touched.
+ *
+ * Compile with MALLOCCHECK to have every call verify the whole heap
+ * and fill freed memory with 0xdeadbeef; MALLOCDEBUG also dumps the
+ * heap on every call. The magic numbers in the headers of the blocks
+ * being freed or merged are always checked.
  */
 
 #include <stdlib.h>
@@ -42,6 +69,11 @@
 #include <stdint.h>  // for uintptr_t on non-OS/161 platforms
 
 #undef MALLOCDEBUG
+#undef MALLOCCHECK
+
+#ifdef MALLOCDEBUG
+#define MALLOCCHECK
+#endif
 
 #if defined(__mips__) || defined(__i386__)
 #define MALLOC32
@@ -133,12 +165,47 @@ struct mheader {
 
 #define M_MKFIELD(off)	((off)>>MBLOCKSHIFT)
 
+/*
+ * Free list links. These live in the data area of free blocks; the
+ * smallest block has MBLOCKSIZE bytes of data, which is room for two
+ * pointers on both 32- and 64-bit platforms.
+ */
+struct mfreelinks {
+	struct mheader *mf_next;
+	struct mheader *mf_prev;
+};
+
+#define M_LINKS(mh)	((struct mfreelinks *)M_DATA(mh))
+
+/*
+ * Size classes.
+ *
+ * NSMALLCLASSES:	number of exact-size classes
+ * NCLASSES:		total number of classes (at most 32; see
+ *			__malloc_nonempty)
+ * MLARGE:		requests this big or bigger are placed best-fit
+ * MGROWSIZE:		granularity for growing the heap (a page)
+ * MTRIMSIZE:		trim the heap when this much is free at the top
+ * MRELEASESIZE:	madvise away free interior runs of pages this big
+ */
+#define NSMALLCLASSES	16
+#define NCLASSES	32
+#define MLARGE		16384
+#define MGROWSIZE	4096
+#define MTRIMSIZE	32768
+#define MRELEASESIZE	16384
+
 ////////////////////////////////////////////////////////////
 
 /*
- * Static variables - the bottom and top addresses of the heap.
+ * Static variables - the bottom and top addresses of the heap, the
+ * topmost block (NULL if the heap is empty), and the free lists.
+ * Bit N of __malloc_nonempty is set iff free list N is nonempty.
  */
 static uintptr_t __heapbase, __heaptop;
+static struct mheader *__malloc_last;
+static struct mheader *__malloc_freelists[NCLASSES];
+static uint32_t __malloc_nonempty;
 
 /*
  * Setup function.
@@ -161,6 +228,9 @@ __malloc_init(void)
 	if (1<<MBLOCKSHIFT != MBLOCKSIZE) {
 		errx(1, "malloc: Internal error - MBLOCKSHIFT wrong");
 	}
+	if (sizeof(struct mfreelinks) > MBLOCKSIZE) {
+		errx(1, "malloc: Internal error - free links too big");
+	}
 
 	/* init should only be called once. */
 	if (__heapbase!=0 || __heaptop!=0) {
@@ -204,23 +274,33 @@ __malloc_init(void)
 
 ////////////////////////////////////////////////////////////
 
-#ifdef MALLOCDEBUG
+#ifdef MALLOCCHECK
 
 /*
- * Debugging print function to iterate and dump the entire heap.
+ * Debugging function to iterate over the entire heap and check it,
+ * optionally printing it out.
  */
 static
 void
-__malloc_dump(void)
+__malloc_check(int dump)
 {
-	struct mheader *mh;
+	struct mheader *mh, *lastmh;
 	uintptr_t i;
 	size_t rightprevblock;
+	unsigned nfree;
+	struct mheader *fmh;
+	unsigned c, nlisted;
 
-	warnx("heap: ************************************************");
+	if (dump) {
+		warnx("heap: ************************************************");
+	}
 
 	rightprevblock = 0;
+	nfree = 0;
+	lastmh = NULL;
+	mh = NULL;
 	for (i=__heapbase; i<__heaptop; i += M_NEXTOFF(mh)) {
+		lastmh = mh;
 		mh = (struct mheader *) i;
 		if (!M_OK(mh)) {
 			errx(1, "malloc: Heap corrupt; header at 0x%lx"
@@ -237,20 +317,204 @@ __malloc_dump(void)
 		}
 		rightprevblock = mh->mh_nextblock;
 
-		warnx("heap: 0x%lx 0x%-6lx (next: 0x%lx) %s",
-		      (unsigned long) i + MBLOCKSIZE,
-		      (unsigned long) M_SIZE(mh),
-		      (unsigned long) (i+M_NEXTOFF(mh)),
-		      mh->mh_inuse ? "INUSE" : "FREE");
+		if (!mh->mh_inuse) {
+			nfree++;
+			if (lastmh != NULL && !lastmh->mh_inuse) {
+				errx(1, "malloc: Heap corrupt; free blocks at"
+				     " 0x%lx and 0x%lx not merged",
+				     (unsigned long) (uintptr_t) lastmh,
+				     (unsigned long) i);
+			}
+		}
+
+		if (dump) {
+			warnx("heap: 0x%lx 0x%-6lx (next: 0x%lx) %s",
+			      (unsigned long) i + MBLOCKSIZE,
+			      (unsigned long) M_SIZE(mh),
+			      (unsigned long) (i+M_NEXTOFF(mh)),
+			      mh->mh_inuse ? "INUSE" : "FREE");
+		}
 	}
 	if (i!=__heaptop) {
 		errx(1, "malloc: Heap corrupt; ran off end");
 	}
+	if (mh != __malloc_last) {
+		errx(1, "malloc: Internal error - wrong last block");
+	}
+
+	nlisted = 0;
+	for (c=0; c<NCLASSES; c++) {
+		if ((__malloc_freelists[c] != NULL) !=
+		    ((__malloc_nonempty & (1U << c)) != 0)) {
+			errx(1, "malloc: Internal error - free list %u has "
+			     "wrong nonempty bit", c);
+		}
+		for (fmh = __malloc_freelists[c]; fmh != NULL;
+		     fmh = M_LINKS(fmh)->mf_next) {
+			if (!M_OK(fmh) || fmh->mh_inuse) {
+				errx(1, "malloc: Heap corrupt; bad block %p "
+				     "on free list %u", fmh, c);
+			}
+			nlisted++;
+		}
+	}
+	if (nlisted != nfree) {
+		errx(1, "malloc: Heap corrupt; %u free blocks but %u on "
+		     "free lists", nfree, nlisted);
+	}
 
-	warnx("heap: ************************************************");
+	if (dump) {
+		warnx("heap: ************************************************");
+	}
 }
 
-#endif /* MALLOCDEBUG */
+#ifdef MALLOCDEBUG
+#define MALLOC_CHECK() __malloc_check(1)
+#else
+#define MALLOC_CHECK() __malloc_check(0)
+#endif
+
+#else
+#define MALLOC_CHECK() ((void)0)
+#endif /* MALLOCCHECK */
+
+////////////////////////////////////////////////////////////
+
+/*
+ * Clear a range of memory with 0xdeadbeef.
+ * ptr must be suitably aligned.
+ */
+static
+void
+__malloc_deadbeef(void *ptr, size_t size)
+{
+	uint32_t *x = ptr;
+	size_t i, n = size/sizeof(uint32_t);
+	for (i=0; i<n; i++) {
+		x[i] = 0xdeadbeef;
+	}
+}
+
+/*
+ * Return the size class for a data size (which must be a nonzero
+ * multiple of MBLOCKSIZE).
+ */
+static
+unsigned
+__malloc_class(size_t size)
+{
+	size_t nblocks, limit;
+	unsigned c;
+
+	nblocks = size >> MBLOCKSHIFT;
+	if (nblocks <= NSMALLCLASSES) {
+		return nblocks - 1;
+	}
+
+	c = NSMALLCLASSES;
+	limit = 2*NSMALLCLASSES;
+	while (nblocks > limit && c < NCLASSES-1) {
+		limit <<= 1;
+		c++;
+	}
+	return c;
+}
+
+/*
+ * Put a free block on its free list.
+ */
+static
+void
+__malloc_listadd(struct mheader *mh)
+{
+	struct mfreelinks *ml = M_LINKS(mh);
+	unsigned c = __malloc_class(M_SIZE(mh));
+
+	ml->mf_prev = NULL;
+	ml->mf_next = __malloc_freelists[c];
+	if (ml->mf_next != NULL) {
+		M_LINKS(ml->mf_next)->mf_prev = mh;
+	}
+	__malloc_freelists[c] = mh;
+	__malloc_nonempty |= 1U << c;
+}
+
+/*
+ * Take a free block off its free list.
+ */
+static
+void
+__malloc_listremove(struct mheader *mh)
+{
+	struct mfreelinks *ml = M_LINKS(mh);
+	unsigned c = __malloc_class(M_SIZE(mh));
+
+	if (ml->mf_prev != NULL) {
+		M_LINKS(ml->mf_prev)->mf_next = ml->mf_next;
+	}
+	else {
+		if (__malloc_freelists[c] != mh) {
+			errx(1, "malloc: Heap corrupt; free block %p not on "
+			     "its free list", mh);
+		}
+		__malloc_freelists[c] = ml->mf_next;
+	}
+	if (ml->mf_next != NULL) {
+		M_LINKS(ml->mf_next)->mf_prev = ml->mf_prev;
+	}
+	if (__malloc_freelists[c] == NULL) {
+		__malloc_nonempty &= ~(1U << c);
+	}
+}
+
+/*
+ * Find a free block with at least size bytes of data, and take it
+ * off its free list. Returns NULL if there isn't one.
+ */
+static
+struct mheader *
+__malloc_findfree(size_t size)
+{
+	struct mheader *mh, *best;
+	unsigned c;
+
+	c = __malloc_class(size);
+
+	if (c >= NSMALLCLASSES) {
+		/*
+		 * Blocks in this class may be too small, so look
+		 * through it. Large requests take the closest fit.
+		 */
+		best = NULL;
+		for (mh = __malloc_freelists[c]; mh != NULL;
+		     mh = M_LINKS(mh)->mf_next) {
+			if (M_SIZE(mh) < size) {
+				continue;
+			}
+			if (best == NULL || M_SIZE(mh) < M_SIZE(best)) {
+				best = mh;
+			}
+			if (size < MLARGE || M_SIZE(mh) == size) {
+				break;
+			}
+		}
+		if (best != NULL) {
+			__malloc_listremove(best);
+			return best;
+		}
+		c++;
+	}
+
+	/* Anything in a higher class is big enough. */
+	for (; c < NCLASSES; c++) {
+		if (__malloc_nonempty & (1U << c)) {
+			mh = __malloc_freelists[c];
+			__malloc_listremove(mh);
+			return mh;
+		}
+	}
+	return NULL;
+}
 
 ////////////////////////////////////////////////////////////
 
@@ -279,16 +543,66 @@ __malloc_sbrk(size_t size)
 	return x;
 }
 
+/*
+ * Grow the heap to make a free block with at least size bytes of
+ * data. If the top block is free it is extended; otherwise a new
+ * block is made. The block returned is not on any free list.
+ */
+static
+struct mheader *
+__malloc_grow(size_t size)
+{
+	struct mheader *mh;
+	size_t need;
+
+	need = size + MBLOCKSIZE;
+	mh = __malloc_last;
+	if (mh != NULL && !mh->mh_inuse) {
+		/* findfree would have used it if it were big enough */
+		need -= M_NEXTOFF(mh);
+	}
+	else {
+		mh = NULL;
+	}
+	need = (need + MGROWSIZE - 1) & ~(size_t)(MGROWSIZE-1);
+
+	if (__malloc_sbrk(need) == NULL) {
+		return NULL;
+	}
+
+	if (mh != NULL) {
+		__malloc_listremove(mh);
+		mh->mh_nextblock = M_MKFIELD(M_NEXTOFF(mh) + need);
+		return mh;
+	}
+
+	mh = (struct mheader *)(__heaptop - need);
+	if (__malloc_last != NULL) {
+		mh->mh_prevblock = M_MKFIELD((uintptr_t)mh -
+					     (uintptr_t)__malloc_last);
+	}
+	else {
+		mh->mh_prevblock = 0;
+	}
+	mh->mh_magic1 = MMAGIC;
+	mh->mh_magic2 = MMAGIC;
+	mh->mh_pad = 0;
+	mh->mh_inuse = 0;
+	mh->mh_nextblock = M_MKFIELD(need);
+	__malloc_last = mh;
+	return mh;
+}
+
 /*
  * Make a new (free) block from the block passed in, leaving size
  * bytes for data in the current block. size must be a multiple of
- * MBLOCKSIZE.
+ * MBLOCKSIZE. Returns the new block, or NULL if there was no split.
  *
  * Only split if the excess space is at least twice the blocksize -
  * one blocksize to hold a header and one for data.
  */
 static
-void
+struct mheader *
 __malloc_split(struct mheader *mh, size_t size)
 {
 	struct mheader *mhnext, *mhnew;
@@ -301,7 +615,7 @@ __malloc_split(struct mheader *mh, size_t size)
 
 	if (M_SIZE(mh) - size < 2*MBLOCKSIZE) {
 		/* no room */
-		return;
+		return NULL;
 	}
 
 	mhnext = M_NEXT(mh);
@@ -324,6 +638,10 @@ __malloc_split(struct mheader *mh, size_t size)
 	if (mhnext != (struct mheader *) __heaptop) {
 		mhnext->mh_prevblock = mhnew->mh_nextblock;
 	}
+	else {
+		__malloc_last = mhnew;
+	}
+	return mhnew;
 }
 
 /*
@@ -332,9 +650,7 @@ __malloc_split(struct mheader *mh, size_t size)
 void *
 malloc(size_t size)
 {
-	struct mheader *mh;
-	uintptr_t i;
-	size_t rightprevblock;
+	struct mheader *mh, *mhrest;
 
 	if (__heapbase==0) {
 		__malloc_init();
@@ -348,108 +664,53 @@ malloc(size_t size)
 #ifdef MALLOCDEBUG
 	warnx("malloc: about to allocate %lu (0x%lx) bytes", 
 	      (unsigned long) size, (unsigned long) size);
-	__malloc_dump();
 #endif
+	MALLOC_CHECK();
 
-	/* Round size up to an integral number of blocks. */
-	size = ((size + MBLOCKSIZE - 1) & ~(size_t)(MBLOCKSIZE-1));
-
-	/*
-	 * First-fit search algorithm for available blocks.
-	 * Check to make sure the next/previous sizes all agree.
-	 */
-	rightprevblock = 0;
-	for (i=__heapbase; i<__heaptop; i += M_NEXTOFF(mh)) {
-		mh = (struct mheader *) i;
-		if (!M_OK(mh)) {
-			errx(1, "malloc: Heap corrupt; header at 0x%lx"
-			     " has bad magic bits",
-			     (unsigned long) i);
-		}
-		if (mh->mh_prevblock != rightprevblock) {
-			errx(1, "malloc: Heap corrupt; header at 0x%lx"
-			     " has bad previous-block size %lu "
-			     "(should be %lu)",
-			     (unsigned long) i, 
-			     (unsigned long) mh->mh_prevblock << MBLOCKSHIFT,
-			     (unsigned long) rightprevblock << MBLOCKSHIFT);
-		}
-		rightprevblock = mh->mh_nextblock;
-
-		/* Can't allocate a block that's in use. */
-		if (mh->mh_inuse) {
-			continue;
-		}
-
-		/* Can't allocate a block that isn't big enough. */
-		if (M_SIZE(mh) < size) {
-			continue;
-		}
-
-		/* Try splitting block. */
-		__malloc_split(mh, size);
-
-		/*
-		 * Now, allocate.
-		 */
-		mh->mh_inuse = 1;
-
-#ifdef MALLOCDEBUG
-		warnx("malloc: allocating at %p", M_DATA(mh));
-		__malloc_dump();
-#endif
-		return M_DATA(mh);
-	}
-	if (i!=__heaptop) {
-		errx(1, "malloc: Heap corrupt; ran off end");
+	/* Don't let the rounding below wrap around. */
+	if (size > ((size_t)-1) / 2) {
+		return NULL;
 	}
 
 	/*
-	 * Didn't find anything. Expand the heap.
+	 * Round size up to an integral number of blocks, and to at
+	 * least one so there's room for the free list links.
 	 */
+	size = ((size + MBLOCKSIZE - 1) & ~(size_t)(MBLOCKSIZE-1));
+	if (size == 0) {
+		size = MBLOCKSIZE;
+	}
 
-	mh = __malloc_sbrk(size + MBLOCKSIZE);
+	mh = __malloc_findfree(size);
 	if (mh == NULL) {
-		return NULL;
+		mh = __malloc_grow(size);
+		if (mh == NULL) {
+			return NULL;
+		}
 	}
 
-	mh->mh_prevblock = rightprevblock;
-	mh->mh_magic1 = MMAGIC;
-	mh->mh_magic2 = MMAGIC;
-	mh->mh_pad = 0;
+	mhrest = __malloc_split(mh, size);
+	if (mhrest != NULL) {
+		__malloc_listadd(mhrest);
+	}
 	mh->mh_inuse = 1;
-	mh->mh_nextblock = M_MKFIELD(size + MBLOCKSIZE);
 
 #ifdef MALLOCDEBUG
 	warnx("malloc: allocating at %p", M_DATA(mh));
-	__malloc_dump();
 #endif
+	MALLOC_CHECK();
 	return M_DATA(mh);
 }
 
 ////////////////////////////////////////////////////////////
 
 /*
- * Clear a range of memory with 0xdeadbeef.
- * ptr must be suitably aligned.
- */
-static
-void
-__malloc_deadbeef(void *ptr, size_t size)
-{
-	uint32_t *x = ptr;
-	size_t i, n = size/sizeof(uint32_t);
-	for (i=0; i<n; i++) {
-		x[i] = 0xdeadbeef;
-	}
-}
-
-/*
- * Attempt to merge two adjacent blocks (mh below mhnext).
+ * Merge two adjacent free blocks (mh below mhnext). Neither should
+ * be on a free list.
  */
 static
 void
-__malloc_trymerge(struct mheader *mh, struct mheader *mhnext)
+__malloc_merge(struct mheader *mh, struct mheader *mhnext)
 {
 	struct mheader *mhnextnext;
 
@@ -457,10 +718,6 @@ __malloc_trymerge(struct mheader *mh, struct mheader *mhnext)
 		errx(1, "free: Heap corrupt (%p and %p inconsistent)",
 		     mh, mhnext);
 	}
-	if (mh->mh_inuse || mhnext->mh_inuse) {
-		/* can't merge */
-		return;
-	}
 
 	mhnextnext = M_NEXT(mhnext);
 
@@ -470,11 +727,62 @@ __malloc_trymerge(struct mheader *mh, struct mheader *mhnext)
 	if (mhnextnext != (struct mheader *)__heaptop) {
 		mhnextnext->mh_prevblock = mh->mh_nextblock;
 	}
+	else {
+		__malloc_last = mh;
+	}
 
 	/* Deadbeef out the memory used by the now-obsolete header */
 	__malloc_deadbeef(mhnext, sizeof(struct mheader));
 }
 
+/*
+ * If the free block at the top of the heap has gotten big, give most
+ * of it back to the system. The block must not be on a free list.
+ */
+static
+void
+__malloc_trim(struct mheader *mh)
+{
+	uintptr_t newtop;
+	size_t amount;
+
+	newtop = (uintptr_t)M_DATA(mh) + MGROWSIZE;
+	newtop = (newtop + MGROWSIZE - 1) & ~(uintptr_t)(MGROWSIZE-1);
+	if (newtop >= __heaptop || __heaptop - newtop < MTRIMSIZE) {
+		return;
+	}
+	amount = __heaptop - newtop;
+
+	if (sbrk(-(int)amount) == (void *)-1) {
+		/* oh well; keep it */
+		return;
+	}
+	__heaptop = newtop;
+	mh->mh_nextblock = M_MKFIELD(newtop - (uintptr_t)mh);
+}
+
+/*
+ * Give the whole pages inside a free block in the middle of the heap
+ * back to the system, if there are enough of them. The first page is
+ * kept because it has the header and free list links in it.
+ */
+static
+void
+__malloc_release(struct mheader *mh)
+{
+	uintptr_t start, end;
+
+	start = (uintptr_t)(M_LINKS(mh) + 1);
+	start = (start + MGROWSIZE - 1) & ~(uintptr_t)(MGROWSIZE-1);
+	end = (uintptr_t)M_NEXT(mh) & ~(uintptr_t)(MGROWSIZE-1);
+	if (end <= start || end - start < MRELEASESIZE) {
+		return;
+	}
+
+	/* This is only advice; if it fails, nothing is lost. */
+	(void)madvise((void *)start, end - start, MADV_DONTNEED);
+}
+
 /*
  * The actual free() implementation.
  */
@@ -482,6 +790,7 @@ void
 free(void *x)
 {
 	struct mheader *mh, *mhnext, *mhprev;
+	size_t freedsize;
 
 	if (x==NULL) {
 		/* safest practice */
@@ -502,8 +811,8 @@ free(void *x)
 
 #ifdef MALLOCDEBUG
 	warnx("free: about to free %p", x);
-	__malloc_dump();
 #endif
+	MALLOC_CHECK();
 
 	mh = ((struct mheader *)x)-1;
 	if (!M_OK(mh)) {
@@ -516,24 +825,51 @@ free(void *x)
 
 	/* mark it free */
 	mh->mh_inuse = 0;
+	freedsize = M_SIZE(mh);
 
+#ifdef MALLOCCHECK
 	/* wipe it */
 	__malloc_deadbeef(M_DATA(mh), M_SIZE(mh));
+#endif
 
 	/* Try merging with the block above (but not if we're at the top) */
-	mhnext = M_NEXT(mh);
-	if (mhnext != (struct mheader *)__heaptop) {
-		__malloc_trymerge(mh, mhnext);
+	if (mh != __malloc_last) {
+		mhnext = M_NEXT(mh);
+		if (!M_OK(mhnext)) {
+			errx(1, "free: Heap corrupt; header at %p has bad "
+			     "magic bits", mhnext);
+		}
+		if (!mhnext->mh_inuse) {
+			__malloc_listremove(mhnext);
+			__malloc_merge(mh, mhnext);
+		}
 	}
 
 	/* Try merging with the block below (but not if we're at the bottom) */
 	if (mh != (struct mheader *)__heapbase) {
 		mhprev = M_PREV(mh);
-		__malloc_trymerge(mhprev, mh);
+		if (!M_OK(mhprev)) {
+			errx(1, "free: Heap corrupt; header at %p has bad "
+			     "magic bits", mhprev);
+		}
+		if (!mhprev->mh_inuse) {
+			__malloc_listremove(mhprev);
+			__malloc_merge(mhprev, mh);
+			mh = mhprev;
+		}
 	}
 
+	if (mh == __malloc_last) {
+		__malloc_trim(mh);
+	}
+	else if (freedsize >= MGROWSIZE) {
+		__malloc_release(mh);
+	}
+
+	__malloc_listadd(mh);
+
 #ifdef MALLOCDEBUG
 	warnx("free: freed %p", x);
-	__malloc_dump();
 #endif
+	MALLOC_CHECK();
 }
@@ -0,0 +1,155 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * mlocktest.c
+ *
+ *	Tests mlock, munlock, and munlockall. Locks a buffer into
+ *	memory, then sweeps a large array to force paging and checks
+ *	that the locked buffer survived intact. Also checks the
+ *	per-process limit on locked pages and the error cases.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <err.h>
+
+#define PageSize	4096
+#define LockPages	16
+#define NumPages	512
+
+/* Must agree with AS_MAXLOCKED in the kernel. */
+#define MaxLocked	64
+
+static char locked[LockPages][PageSize];
+static int sparse[NumPages][PageSize/sizeof(int)];
+static char toomuch[MaxLocked+1][PageSize];
+
+static
+void
+fill(void)
+{
+	int i, j;
+
+	for (i=0; i<LockPages; i++) {
+		for (j=0; j<PageSize; j++) {
+			locked[i][j] = (char)(i*7 + j);
+		}
+	}
+}
+
+static
+void
+check(void)
+{
+	int i, j;
+
+	for (i=0; i<LockPages; i++) {
+		for (j=0; j<PageSize; j++) {
+			if (locked[i][j] != (char)(i*7 + j)) {
+				errx(1, "locked page %d corrupt at offset %d",
+				     i, j);
+			}
+		}
+	}
+}
+
+static
+void
+sweep(void)
+{
+	int i, j;
+
+	for (j=0; j<3; j++) {
+		for (i=0; i<NumPages; i++) {
+			sparse[i][0] += i;
+		}
+	}
+}
+
+int
+main(void)
+{
+	printf("mlocktest: locking %d pages\n", LockPages);
+	if (mlock(locked, sizeof(locked))) {
+		err(1, "mlock");
+	}
+	/* locking again is harmless */
+	if (mlock(locked, sizeof(locked))) {
+		err(1, "mlock (again)");
+	}
+	fill();
+
+	printf("mlocktest: sweeping %d pages\n", NumPages);
+	sweep();
+	check();
+
+	if (munlock(locked, sizeof(locked))) {
+		err(1, "munlock");
+	}
+	sweep();
+	check();
+
+	printf("mlocktest: checking limit of %d pages\n", MaxLocked);
+	if (mlock(locked, sizeof(locked))) {
+		err(1, "mlock (relock)");
+	}
+	if (mlock(toomuch, sizeof(toomuch)) == 0) {
+		errx(1, "mlock of %d more pages succeeded", MaxLocked+1);
+	}
+	if (errno != ENOMEM) {
+		err(1, "mlock over limit: expected ENOMEM, got");
+	}
+	if (munlockall()) {
+		err(1, "munlockall");
+	}
+	/*
+	 * Everything is unlocked now, so the limit is free again. The
+	 * array isn't page-aligned, so one page less than the limit
+	 * may touch MaxLocked pages.
+	 */
+	if (mlock(toomuch, (MaxLocked-1)*PageSize)) {
+		err(1, "mlock of %d pages", MaxLocked);
+	}
+	if (munlockall()) {
+		err(1, "munlockall");
+	}
+
+	if (mlock(NULL, PageSize) == 0) {
+		errx(1, "mlock of NULL succeeded");
+	}
+	if (errno != EFAULT) {
+		err(1, "mlock of NULL: expected EFAULT, got");
+	}
+
+	printf("mlocktest: passed\n");
+	return 0;
+}
@@ -0,0 +1,146 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * nicetest.c
+ *
+ *	Checks that nice values weight the CPU share. Forks several
+ *	children, each with a higher nice value than the last, which
+ *	spin for the same length of wall-clock time and report how far
+ *	they got. With fair-share scheduling the counts should fall off
+ *	by roughly 25% per step of nice.
+ *
+ *	There's no waitpid yet, so the parent just sleeps until the
+ *	children should be done.
+ *
+ * Usage: nicetest [nchildren [nicestep]]
+ */
+
+#include <sys/types.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <err.h>
+
+#define DEFAULT_NCHILD	3
+#define DEFAULT_STEP	5
+#define MAXCHILD	8
+#define RUNSECS		3
+
+static
+void
+checkargs(void)
+{
+	if (setpriority(PRIO_PGRP, 0, 0) != -1 || errno != EINVAL) {
+		errx(1, "setpriority PRIO_PGRP: expected EINVAL");
+	}
+	if (setpriority(PRIO_PROCESS, 0, PRIO_MAX + 100) < 0) {
+		err(1, "setpriority");
+	}
+	if (getpriority(PRIO_PROCESS, 0) != PRIO_MAX) {
+		errx(1, "setpriority did not clamp to PRIO_MAX");
+	}
+	if (setpriority(PRIO_PROCESS, 0, 0) < 0) {
+		err(1, "setpriority");
+	}
+}
+
+static
+void
+child(int nice)
+{
+	time_t start, now;
+	unsigned long nsecs, count;
+
+	if (setpriority(PRIO_PROCESS, 0, nice) < 0) {
+		err(1, "setpriority");
+	}
+	if (getpriority(PRIO_PROCESS, 0) != nice) {
+		errx(1, "getpriority: wrong value");
+	}
+
+	count = 0;
+	__time(&start, &nsecs);
+	now = start;
+	do {
+		count++;
+		if ((count & 1023) == 0) {
+			__time(&now, &nsecs);
+		}
+	} while (now - start < RUNSECS);
+
+	printf("nice %3d: %lu iterations\n", nice, count);
+	_exit(0);
+}
+
+int
+main(int argc, char *argv[])
+{
+	int nchild = DEFAULT_NCHILD, step = DEFAULT_STEP;
+	struct timespec ts;
+	pid_t pids[MAXCHILD];
+	int i;
+
+	if (argc > 1) {
+		nchild = atoi(argv[1]);
+	}
+	if (argc > 2) {
+		step = atoi(argv[2]);
+	}
+	if (argc > 3 || nchild < 1 || nchild > MAXCHILD) {
+		errx(1, "Usage: %s [nchildren [nicestep]]", argv[0]);
+	}
+
+	checkargs();
+
+	for (i=0; i<nchild; i++) {
+		pids[i] = fork();
+		if (pids[i] < 0) {
+			err(1, "fork");
+		}
+		if (pids[i] == 0) {
+			child(i * step);
+		}
+	}
+
+	/* We may only change our own priority, so a child's pid gets ESRCH */
+	if (setpriority(PRIO_PROCESS, pids[0], 0) != -1 || errno != ESRCH) {
+		errx(1, "setpriority on another pid: expected ESRCH");
+	}
+
+	/* Let the children finish and print before we say we're done */
+	ts.tv_sec = RUNSECS + 1;
+	ts.tv_nsec = 0;
+	if (nanosleep(&ts, NULL) < 0) {
+		err(1, "nanosleep");
+	}
+	printf("nicetest done\n");
+	return 0;
+}
@@ -0,0 +1,103 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * sleeptest.c
+ *
+ *	Checks nanosleep: sleeps for a range of times, from well under
+ *	a clock tick up to a second, and reports how long each one
+ *	really took. None may be short; each should be late by no more
+ *	than a tick or two.
+ */
+
+#include <sys/types.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <errno.h>
+#include <err.h>
+
+static const unsigned long sleeps_us[] = {
+	1, 100, 1000, 5000, 10000, 25000, 100000, 1000000,
+};
+#define NSLEEPS (sizeof(sleeps_us) / sizeof(sleeps_us[0]))
+
+static
+unsigned long
+elapsed_us(time_t s1, unsigned long ns1, time_t s2, unsigned long ns2)
+{
+	if (ns2 < ns1) {
+		ns2 += 1000000000;
+		s2--;
+	}
+	return (s2 - s1) * 1000000 + (ns2 - ns1) / 1000;
+}
+
+int
+main(void)
+{
+	struct timespec ts, rem;
+	time_t s1, s2;
+	unsigned long ns1, ns2, us;
+	unsigned i;
+	int bad = 0;
+
+	ts.tv_sec = 0;
+	ts.tv_nsec = 1000000000;
+	if (nanosleep(&ts, NULL) != -1 || errno != EINVAL) {
+		errx(1, "nanosleep with tv_nsec out of range: expected EINVAL");
+	}
+
+	for (i=0; i<NSLEEPS; i++) {
+		ts.tv_sec = sleeps_us[i] / 1000000;
+		ts.tv_nsec = (sleeps_us[i] % 1000000) * 1000;
+
+		__time(&s1, &ns1);
+		if (nanosleep(&ts, &rem) < 0) {
+			err(1, "nanosleep");
+		}
+		__time(&s2, &ns2);
+
+		us = elapsed_us(s1, ns1, s2, ns2);
+		printf("asked for %7lu us, slept %7lu us\n", sleeps_us[i], us);
+		if (us < sleeps_us[i]) {
+			printf("  ... too short!\n");
+			bad = 1;
+		}
+		if (rem.tv_sec != 0 || rem.tv_nsec != 0) {
+			printf("  ... nonzero remaining time\n");
+			bad = 1;
+		}
+	}
+
+	if (bad) {
+		errx(1, "FAILED");
+	}
+	printf("sleeptest done\n");
+	return 0;
+}
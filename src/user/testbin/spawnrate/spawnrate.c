@@ -0,0 +1,121 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * spawnrate.c
+ *
+ *	Measures how fast processes can be spawned, using fork and
+ *	then vfork. Each child either exits at once or, if a program
+ *	is named on the command line, execs it (try /bin/true), which
+ *	is what a shell does.
+ *
+ * Usage: spawnrate [-n count] [program [args...]]
+ */
+
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <err.h>
+
+#define DEFAULT_COUNT	200
+
+static
+void
+child(char **prog)
+{
+	if (prog[0] != NULL) {
+		execv(prog[0], prog);
+		warn("%s", prog[0]);
+		_exit(1);
+	}
+	_exit(0);
+}
+
+static
+void
+run(const char *name, int usevfork, int count, char **prog)
+{
+	time_t startsecs, endsecs;
+	unsigned long startnsecs, endnsecs;
+	unsigned long usecs;
+	int i, status;
+	pid_t pid;
+
+	__time(&startsecs, &startnsecs);
+	for (i=0; i<count; i++) {
+		pid = usevfork ? vfork() : fork();
+		if (pid < 0) {
+			err(1, "%s", name);
+		}
+		if (pid == 0) {
+			child(prog);
+		}
+		if (waitpid(pid, &status, 0) < 0) {
+			err(1, "waitpid");
+		}
+	}
+	__time(&endsecs, &endnsecs);
+
+	if (endnsecs < startnsecs) {
+		endnsecs += 1000000000;
+		endsecs--;
+	}
+	usecs = (endsecs - startsecs) * 1000000 +
+		(endnsecs - startnsecs) / 1000;
+	if (usecs == 0) {
+		usecs = 1;
+	}
+
+	printf("%s: %d spawns in %lu.%06lu seconds: %lu/sec, %lu us each\n",
+	       name, count, usecs / 1000000, usecs % 1000000,
+	       (unsigned long) count * 1000000 / usecs,
+	       usecs / count);
+}
+
+int
+main(int argc, char *argv[])
+{
+	int count = DEFAULT_COUNT;
+	int i = 1;
+
+	if (argc > 2 && !strcmp(argv[1], "-n")) {
+		count = atoi(argv[2]);
+		i = 3;
+	}
+	if (count <= 0) {
+		errx(1, "Usage: %s [-n count] [program [args...]]", argv[0]);
+	}
+
+	run("fork", 0, count, &argv[i]);
+	run("vfork", 1, count, &argv[i]);
+	return 0;
+}